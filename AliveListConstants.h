@@ -0,0 +1,16 @@
+#ifdef ALIVE_LIST_CONSTANTS_HEADER_GUARD
+#else
+#define ALIVE_LIST_CONSTANTS_HEADER_GUARD
+
+#define UPDATE_GROUP_SIZE 1000
+#define COMPACTION_GROUP_SIZE 1024  // Has to be a power of two for the scan
+
+// Layout of the dispatch argument buffer written by CSPrepareUpdate, in uints
+#define DISPATCH_ARGS_UPDATE 0
+#define DISPATCH_ARGS_COMPACTION 3
+#define DISPATCH_ARGS_TILE_RASTER 6     // Written by CSTileScan, one group per tile of the work list
+#define DISPATCH_ARGS_SIZE 9
+
+#define DRAW_ARGS_SIZE 4
+
+#endif
\ No newline at end of file
@@ -12,10 +12,14 @@
 #include "stdafx.h"
 #include <sstream>
 #include <string>
+#include <algorithm>
 #include <initguid.h>
 #include <dxgidebug.h>
 #include "DX12Particles.h"
+#include "ParticleSimulationCPU.h"
 #include "TileConstants.h"
+#include "AliveListConstants.h"
+#include "EmitterConstants.h"
 
 #define InterlockedGetValue(object) InterlockedCompareExchange(object, 0, 0)
 
@@ -26,7 +30,8 @@ DX12Particles::DX12Particles(UINT width, UINT height, std::wstring name) :
     m_scissorRect(0, 0, static_cast<LONG>(width), static_cast<LONG>(height)),
     m_frameCounter(0),
     m_fenceValue(0),
-    m_rtvDescriptorSize(0)
+    m_rtvDescriptorSize(0),
+    m_rangeAllocator(DefaultParticleBufferSize)
 {
     std::random_device r;
     m_randomNumberEngine.seed(std::seed_seq{ r(), r(), r(), r(), r() });
@@ -154,36 +159,43 @@ void DX12Particles::LoadPipeline()
         m_cbvSrvDescriptorSize = m_device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
     }
 
-    ThrowIfFailed(m_device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(&m_commandAllocator)));
-    ThrowIfFailed(m_device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_COMPUTE, IID_PPV_ARGS(&m_commandAllocatorCompute)));
+    // One pair per frame slot, a frame's lists stay in its allocators until the slot comes round again
+    for (UINT i = 0; i < FrameCount; i++)
+    {
+        ThrowIfFailed(m_device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(&m_commandAllocators[i])));
+        ThrowIfFailed(m_device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_COMPUTE, IID_PPV_ARGS(&m_commandAllocatorsCompute[i])));
 
-    NAME_D3D12_OBJECT(m_commandAllocator);
-    NAME_D3D12_OBJECT(m_commandAllocatorCompute);
+        NAME_D3D12_OBJECT_INDEXED(m_commandAllocators, i);
+        NAME_D3D12_OBJECT_INDEXED(m_commandAllocatorsCompute, i);
+    }
 
     ThrowIfFailed(m_commandQueueCompute->GetTimestampFrequency(&m_nComputeTimestampFreq));
 }
 
 std::vector<float> particleData[(int)DX12Particles::ParticleBufferTypes::Count];
 
-UINT DX12Particles::CreateParticleBuffers(ParticleBuffers& UploadBuffers)
+static const UINT particleBufferStrides[(int)DX12Particles::ParticleBufferTypes::Count] =
 {
-    std::array<UINT, (int)ParticleBufferTypes::Count> particleBufferSizes;
-    std::array<std::wstring, (int)ParticleBufferTypes::Count> particleBufferNames;
-
-    particleBufferSizes[(int)ParticleBufferTypes::Position] = sizeof(XMFLOAT2);
-    particleBufferSizes[(int)ParticleBufferTypes::Scale] = sizeof(XMFLOAT2);
-    particleBufferSizes[(int)ParticleBufferTypes::Velocity] = sizeof(XMFLOAT2);
-    particleBufferSizes[(int)ParticleBufferTypes::Rotation] = sizeof(float);
-    particleBufferSizes[(int)ParticleBufferTypes::Lifetime] = sizeof(float);
-    particleBufferSizes[(int)ParticleBufferTypes::Color] = sizeof(XMFLOAT4);
-
-    particleBufferNames[(int)ParticleBufferTypes::Position] = (L"Position");
-    particleBufferNames[(int)ParticleBufferTypes::Scale] = (L"Scale");
-    particleBufferNames[(int)ParticleBufferTypes::Velocity] = (L"Velocity");
-    particleBufferNames[(int)ParticleBufferTypes::Rotation] = (L"Rotation");
-    particleBufferNames[(int)ParticleBufferTypes::Lifetime] = (L"Lifetime");
-    particleBufferNames[(int)ParticleBufferTypes::Color] = (L"Color");
+    sizeof(XMFLOAT2),   // Position
+    sizeof(XMFLOAT2),   // Scale
+    sizeof(XMFLOAT2),   // Velocity
+    sizeof(float),      // Rotation
+    sizeof(float),      // Lifetime
+    sizeof(XMFLOAT4),   // Color
+};
+
+static const wchar_t* particleBufferNames[(int)DX12Particles::ParticleBufferTypes::Count] =
+{
+    L"Position",
+    L"Scale",
+    L"Velocity",
+    L"Rotation",
+    L"Lifetime",
+    L"Color",
+};
 
+UINT DX12Particles::CreateParticleBuffers(ParticleBuffers& UploadBuffers)
+{
 	auto fnGetRandomNumber = [&]() -> float
 	{
 		auto dist = std::uniform_real_distribution<float>{};
@@ -200,10 +212,10 @@ UINT DX12Particles::CreateParticleBuffers(ParticleBuffers& UploadBuffers)
     UINT PrecreatedParticleCount = 0;
     for(int iBuffer = 0; iBuffer < (int)ParticleBufferTypes::Count; iBuffer++)
     {
-        particleData[iBuffer].resize(ParticleBufferSize * particleBufferSizes[iBuffer]);
+        particleData[iBuffer].resize(m_nParticleBufferSize * particleBufferStrides[iBuffer]);
     }
 
-    UINT nParticlesPerRow = (UINT)ceil(sqrt((float)ParticleBufferSize));
+    UINT nParticlesPerRow = (UINT)ceil(sqrt((float)m_nParticleBufferSize));
     XMFLOAT4 colors[] = { XMFLOAT4(1, 0, 0, 1), XMFLOAT4(0, 1, 0, 1), XMFLOAT4(0, 0, 1, 1), XMFLOAT4(1, 0, 1, 1), XMFLOAT4(1, 1, 0, 1), XMFLOAT4(0, 1, 1, 1) };
 
     XMFLOAT2* particlePositions = reinterpret_cast<XMFLOAT2*>(particleData[(int)ParticleBufferTypes::Position].data());
@@ -213,7 +225,7 @@ UINT DX12Particles::CreateParticleBuffers(ParticleBuffers& UploadBuffers)
     float* particleLifetimes = particleData[(int)ParticleBufferTypes::Lifetime].data();
     XMFLOAT4* particleColors = reinterpret_cast<XMFLOAT4*>(particleData[(int)ParticleBufferTypes::Color].data());
 
-    for(UINT i = 0; i < ParticleBufferSize; i++)
+    for(UINT i = 0; i < m_nParticleBufferSize; i++)
     {
         particleLifetimes[i] = 9999999.0f;
 
@@ -239,10 +251,10 @@ UINT DX12Particles::CreateParticleBuffers(ParticleBuffers& UploadBuffers)
     }
 
     // One extra loop for the upload buffers
-    for (int i = 0; i < FrameCount + 1; i++)
+    for (int i = 0; i < ParticleBufferCount + 1; i++)
     {
         ParticleBuffers* currentParticleBuffers;
-        if(i < FrameCount)
+        if(i < ParticleBufferCount)
         {
             currentParticleBuffers = &m_particleBuffers[i];
         }
@@ -258,7 +270,7 @@ UINT DX12Particles::CreateParticleBuffers(ParticleBuffers& UploadBuffers)
         {
             startingState = D3D12_RESOURCE_STATE_UNORDERED_ACCESS;
         }
-        else if (i == FrameCount)
+        else if (i == ParticleBufferCount)
         {
             startingState = D3D12_RESOURCE_STATE_GENERIC_READ;
             heapType = D3D12_HEAP_TYPE_UPLOAD;
@@ -272,33 +284,38 @@ UINT DX12Particles::CreateParticleBuffers(ParticleBuffers& UploadBuffers)
         for (int iBuffer = 0; iBuffer < (int)ParticleBufferTypes::Count; iBuffer++)
         {
             auto&& buffer = currentParticleBuffers->Buffers[iBuffer];
-            auto bufferSize = particleBufferSizes[iBuffer];
-            auto& bufferName = particleBufferNames[iBuffer];
+            auto bufferSize = particleBufferStrides[iBuffer];
             ThrowIfFailed(m_device->CreateCommittedResource(
                 &CD3DX12_HEAP_PROPERTIES(heapType),
                 D3D12_HEAP_FLAG_NONE,
-                &CD3DX12_RESOURCE_DESC::Buffer(bufferSize * ParticleBufferSize, resourceFlags),
+                &CD3DX12_RESOURCE_DESC::Buffer(bufferSize * m_nParticleBufferSize, resourceFlags),
                 startingState,
                 nullptr,
                 IID_PPV_ARGS(&buffer)
             ));
-            SetNameIndexed(buffer.Get(), bufferName.c_str(), i);
+            SetNameIndexed(buffer.Get(), particleBufferNames[iBuffer], i);
         }
     }
     for (int iBuffer = 0; iBuffer < (int)ParticleBufferTypes::Count; iBuffer++)
     {
         auto&& buffer = m_particleBuffers[1].Buffers[iBuffer];
-        auto bufferSize = particleBufferSizes[iBuffer];
+        auto bufferSize = particleBufferStrides[iBuffer];
 
         D3D12_SUBRESOURCE_DATA particleSubresourceData;
         particleSubresourceData.pData = reinterpret_cast<void*>(particleData[iBuffer].data());
-        particleSubresourceData.SlicePitch = bufferSize * ParticleBufferSize;
+        particleSubresourceData.SlicePitch = bufferSize * m_nParticleBufferSize;
         particleSubresourceData.RowPitch = particleSubresourceData.SlicePitch;
         UpdateSubresources<1>(m_commandList.Get(), buffer.Get(), UploadBuffers.Buffers[iBuffer].Get(), 0, 0, 1, &particleSubresourceData);
     }
     
     // @TODO Set the deadlist's counter to the initialized particles
-    for (int i = 0; i < FrameCount; i++)
+    return PrecreatedParticleCount;
+}
+
+// Every view that depends on the size of the pools. Called again after they grow.
+void DX12Particles::CreateParticleBufferViews()
+{
+    for (int i = 0; i < ParticleBufferCount; i++)
     {
         int nEnumOffsetPerFrame = (int)DescOffset::ParticlePositionSRV1 - (int)DescOffset::ParticlePositionSRV0;
         int nEnumOffset = nEnumOffsetPerFrame * i;
@@ -309,20 +326,20 @@ UINT DX12Particles::CreateParticleBuffers(ParticleBuffers& UploadBuffers)
         srvDesc.Format = DXGI_FORMAT_UNKNOWN;
         srvDesc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
         srvDesc.Buffer.FirstElement = 0;
-        srvDesc.Buffer.NumElements = ParticleBufferSize;
+        srvDesc.Buffer.NumElements = m_nParticleBufferSize;
         srvDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_NONE;
 
         D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
         uavDesc.Format = DXGI_FORMAT_UNKNOWN;
         uavDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
         uavDesc.Buffer.FirstElement = 0;
-        uavDesc.Buffer.NumElements = ParticleBufferSize;
+        uavDesc.Buffer.NumElements = m_nParticleBufferSize;
         uavDesc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
 
         for (int iBuffer = 0; iBuffer < (int)ParticleBufferTypes::Count; iBuffer++)
         {
             auto&& buffer = m_particleBuffers[i].Buffers[iBuffer];
-            auto bufferSize = particleBufferSizes[iBuffer];
+            auto bufferSize = particleBufferStrides[iBuffer];
 
             srvDesc.Buffer.StructureByteStride = bufferSize;
             uavDesc.Buffer.StructureByteStride = bufferSize;
@@ -336,7 +353,208 @@ UINT DX12Particles::CreateParticleBuffers(ParticleBuffers& UploadBuffers)
         }
     }
 
-    return PrecreatedParticleCount;
+    {
+        D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+        uavDesc.Format = DXGI_FORMAT_UNKNOWN;
+        uavDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+        uavDesc.Buffer.FirstElement = 0;
+        uavDesc.Buffer.NumElements = m_nParticleBufferSize + 1;
+        uavDesc.Buffer.StructureByteStride = sizeof(UINT);
+        uavDesc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
+        uavDesc.Buffer.CounterOffsetInBytes = 0;
+
+        CD3DX12_CPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::DeadListUAV, m_cbvSrvDescriptorSize);
+        m_device->CreateUnorderedAccessView(m_deadListBuffer.Get(), m_deadListBuffer.Get(), &uavDesc, uavHandle);
+    }
+
+    {
+        UINT aliveListDescriptorCount = (UINT)DescOffset::AliveListInUAV1 - (UINT)DescOffset::AliveListInUAV0;
+
+        // Every alive list gets a set of views where it is the input, so the two can swap roles every frame like the particle buffers
+        D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+        uavDesc.Format = DXGI_FORMAT_UNKNOWN;
+        uavDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+        uavDesc.Buffer.FirstElement = 0;
+        uavDesc.Buffer.StructureByteStride = sizeof(UINT);
+        uavDesc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
+
+        for (int i = 0; i < ParticleBufferCount; i++)
+        {
+            int nEnumOffset = i * aliveListDescriptorCount;
+
+            struct AliveListView
+            {
+                DescOffset descOffset;
+                ID3D12Resource* pResource;
+                UINT nElementCount;
+            };
+
+            AliveListView views[] =
+            {
+                { DescOffset::AliveListInUAV0, m_aliveListBuffers[i].Get(), m_nParticleBufferSize + 1 },
+                { DescOffset::AliveListOutUAV0, m_aliveListBuffers[(i + 1) % ParticleBufferCount].Get(), m_nParticleBufferSize + 1 },
+                { DescOffset::DrawArgsOutUAV0, m_drawArgsBuffers[(i + 1) % ParticleBufferCount].Get(), DRAW_ARGS_SIZE },
+                { DescOffset::DispatchArgsUAV0, m_dispatchArgsBuffer.Get(), DISPATCH_ARGS_SIZE },
+            };
+
+            for (auto& view : views)
+            {
+                uavDesc.Buffer.NumElements = view.nElementCount;
+                CD3DX12_CPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)view.descOffset + nEnumOffset, m_cbvSrvDescriptorSize);
+                m_device->CreateUnorderedAccessView(view.pResource, nullptr, &uavDesc, uavHandle);
+            }
+        }
+    }
+}
+
+// The buffers only a frame uses, placed in one heap where GetParticleTransientLayout says, and their views.
+// They depend on the size of the pools and on the tile size, so they're created again when either changes.
+// Nothing in them is kept, the GPU has to be idle.
+void DX12Particles::CreateTransientResources()
+{
+    ParticleFrameDesc desc;
+    desc.nParticleBufferSize = m_nParticleBufferSize;
+    desc.nWidth = m_width;
+    desc.nHeight = m_height;
+    desc.nTileSize = m_nTileSize;
+    m_transientLayout = GetParticleTransientLayout(desc);
+
+    struct TransientBuffer
+    {
+        ParticleResource resource;
+        ComPtr<ID3D12Resource>& buffer;
+        LPCWSTR pName;
+    };
+
+    TransientBuffer buffers[] =
+    {
+        { ParticleResource::HashCellStarts, m_hashCellStartsBuffer, L"m_hashCellStartsBuffer" },
+        { ParticleResource::HashParticleCells, m_hashParticleCellsBuffer, L"m_hashParticleCellsBuffer" },
+        { ParticleResource::HashSortedParticles, m_hashSortedParticlesBuffer, L"m_hashSortedParticlesBuffer" },
+        { ParticleResource::CollisionImpulses, m_collisionImpulsesBuffer, L"m_collisionImpulsesBuffer" },
+        { ParticleResource::CompactionGroupOffsets, m_compactionGroupOffsetsBuffer, L"m_compactionGroupOffsetsBuffer" },
+#ifdef TILED_STUFF_CAN_HAPPEN
+        { ParticleResource::ParticleRasterSetups, m_particleRasterSetups, L"m_particleRasterSetups" },
+        { ParticleResource::TileIndices, m_ParticleIndicesForTiles, L"m_ParticleIndicesForTiles" },
+#endif
+    };
+
+    // The old buffers go before the heap they're placed in
+    for (auto& transient : buffers)
+    {
+        transient.buffer.Reset();
+    }
+    m_transientHeap.Reset();
+
+    ThrowIfFailed(m_device->CreateHeap(
+        &CD3DX12_HEAP_DESC(m_transientLayout.nHeapSize, D3D12_HEAP_TYPE_DEFAULT, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT, D3D12_HEAP_FLAG_ALLOW_ONLY_BUFFERS),
+        IID_PPV_ARGS(&m_transientHeap)
+    ));
+    NAME_D3D12_OBJECT(m_transientHeap);
+
+    for (auto& transient : buffers)
+    {
+        ThrowIfFailed(m_device->CreatePlacedResource(
+            m_transientHeap.Get(),
+            m_transientLayout.nOffsets[(int)transient.resource],
+            &CD3DX12_RESOURCE_DESC::Buffer(m_transientLayout.nSizes[(int)transient.resource], D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+            nullptr,
+            IID_PPV_ARGS(&transient.buffer)
+        ));
+        SetName(transient.buffer.Get(), transient.pName);
+    }
+
+    D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+    uavDesc.Format = DXGI_FORMAT_UNKNOWN;
+    uavDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+    uavDesc.Buffer.FirstElement = 0;
+    uavDesc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
+
+    {
+        struct TransientView
+        {
+            DescOffset descOffset;
+            ID3D12Resource* pResource;
+            UINT nStride;
+            UINT nElementCount;
+        };
+
+        TransientView views[] =
+        {
+            { DescOffset::HashCellStartsUAV, m_hashCellStartsBuffer.Get(), sizeof(UINT), HASH_START_COUNT },
+            { DescOffset::HashParticleCellsUAV, m_hashParticleCellsBuffer.Get(), sizeof(UINT) * 2, m_nParticleBufferSize },
+            { DescOffset::HashSortedParticlesUAV, m_hashSortedParticlesBuffer.Get(), sizeof(HashedParticle), m_nParticleBufferSize },
+            { DescOffset::CollisionImpulsesUAV, m_collisionImpulsesBuffer.Get(), sizeof(Float2), m_nParticleBufferSize },
+#ifdef TILED_STUFF_CAN_HAPPEN
+            { DescOffset::ParticleRasterSetupsUAV, m_particleRasterSetups.Get(), sizeof(float) * 6, m_nParticleBufferSize },
+#endif
+        };
+
+        for (auto& view : views)
+        {
+            uavDesc.Buffer.StructureByteStride = view.nStride;
+            uavDesc.Buffer.NumElements = view.nElementCount;
+            CD3DX12_CPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)view.descOffset, m_cbvSrvDescriptorSize);
+            m_device->CreateUnorderedAccessView(view.pResource, nullptr, &uavDesc, uavHandle);
+        }
+    }
+
+    // Every set of alive list views has the same group offsets
+    UINT aliveListDescriptorCount = (UINT)DescOffset::AliveListInUAV1 - (UINT)DescOffset::AliveListInUAV0;
+    uavDesc.Buffer.StructureByteStride = sizeof(UINT);
+    uavDesc.Buffer.NumElements = (m_nParticleBufferSize + COMPACTION_GROUP_SIZE - 1) / COMPACTION_GROUP_SIZE;
+    for (int i = 0; i < ParticleBufferCount; i++)
+    {
+        CD3DX12_CPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::CompactionGroupOffsetsUAV0 + i * aliveListDescriptorCount, m_cbvSrvDescriptorSize);
+        m_device->CreateUnorderedAccessView(m_compactionGroupOffsetsBuffer.Get(), nullptr, &uavDesc, uavHandle);
+    }
+
+#ifdef TILED_STUFF_CAN_HAPPEN
+    // The counters and the spilled tiles of CSTileScan come first in the tile indices, then the lists.
+    // The lists take MAX_PARTICLE_PER_TILE per tile, so the buffer changes with every tile size.
+    {
+        UINT tileCount = TILE_COUNT_FOR_SIZE(m_width, m_nTileSize) * TILE_COUNT_FOR_SIZE(m_height, m_nTileSize);
+        UINT tileListOffset = TILE_COUNTER_REGION_SIZE(tileCount);
+
+        uavDesc.Buffer.StructureByteStride = sizeof(UINT);
+        uavDesc.Buffer.NumElements = TILE_LIST_CAPACITY(tileCount);
+        uavDesc.Buffer.FirstElement = tileListOffset;
+        CD3DX12_CPU_DESCRIPTOR_HANDLE cpuHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticleIndicesForTilesUAV, m_cbvSrvDescriptorSize);
+        m_device->CreateUnorderedAccessView(m_ParticleIndicesForTiles.Get(), nullptr, &uavDesc, cpuHandle);
+
+        uavDesc.Buffer.NumElements = tileListOffset;
+        uavDesc.Buffer.FirstElement = 0;
+        CD3DX12_CPU_DESCRIPTOR_HANDLE cpuHandleCounter(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::OffsetCounterUAV, m_cbvSrvDescriptorSize);
+        m_device->CreateUnorderedAccessView(m_ParticleIndicesForTiles.Get(), nullptr, &uavDesc, cpuHandleCounter);
+    }
+#endif
+
+    // The frames compile against the new layout, and the new buffers start out where LoadAssets leaves them.
+    // LoadAssets passes the layout on itself, the pipeline doesn't exist yet the first time.
+    if (m_framePipeline)
+    {
+        m_framePipeline->SetTransientLayout(m_transientLayout);
+        for (auto& transient : buffers)
+        {
+            m_framePipeline->GetResourceTracker().SetState(transient.resource, ParticleResourceState::UnorderedAccess);
+        }
+    }
+}
+
+void DX12Particles::UploadStaticConstantBuffer(ID3D12Resource* pUploadBuffer)
+{
+    ConstantBufferData DataToUpload;
+    DataToUpload.m_AspectRatio = (float)m_width / m_height;
+    DataToUpload.m_ParticleCount = m_nParticleBufferSize;
+    DataToUpload.m_ResolutionX = m_width;
+    DataToUpload.m_ResolutionY = m_height;
+
+    D3D12_SUBRESOURCE_DATA constantBufferSubresourceData;
+    constantBufferSubresourceData.pData = reinterpret_cast<void*>(&DataToUpload);
+    constantBufferSubresourceData.SlicePitch = sizeof(ConstantBufferData);
+    constantBufferSubresourceData.RowPitch = sizeof(ConstantBufferData);
+    UpdateSubresources<1>(m_commandList.Get(), m_constantBufferGS.Get(), pUploadBuffer, 0, 0, 1, &constantBufferSubresourceData);
 }
 
 // Load the sample assets.
@@ -348,6 +566,7 @@ void DX12Particles::LoadAssets()
     // prematurely destroyed.
 
     UINT particleBufferCount = 6;
+    UINT aliveListDescriptorCount = (UINT)DescOffset::AliveListInUAV1 - (UINT)DescOffset::AliveListInUAV0;
 
     // Create the root signature.
     {
@@ -361,7 +580,7 @@ void DX12Particles::LoadAssets()
             featureData.HighestVersion = D3D_ROOT_SIGNATURE_VERSION_1_0;
         }
 
-        static const int maxRangeCount = 5;
+        static const int maxRangeCount = 9;
         UINT nRangeCount = 0;
         std::array<CD3DX12_DESCRIPTOR_RANGE1, maxRangeCount> ranges;
         ranges[nRangeCount++].Init(D3D12_DESCRIPTOR_RANGE_TYPE_CBV, 1, 0, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_STATIC);
@@ -369,6 +588,10 @@ void DX12Particles::LoadAssets()
         ranges[nRangeCount++].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 10, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);
         ranges[nRangeCount++].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, particleBufferCount, 0, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE);
         ranges[nRangeCount++].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, particleBufferCount, 0, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);
+        ranges[nRangeCount++].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, aliveListDescriptorCount, 14, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);
+        ranges[nRangeCount++].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 2, 6, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE);    // Emitter table and relocations
+        ranges[nRangeCount++].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 19, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);         // Emitter particle counts
+        ranges[nRangeCount++].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 5, 20, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);         // Spatial hash and collision impulses
 
         nRangeCount = 0;
         std::array<CD3DX12_ROOT_PARAMETER1, maxRangeCount> rootParameters;
@@ -549,6 +772,15 @@ void DX12Particles::LoadAssets()
         shaderFunctions[(int)ComputePass::Generate] = "CSGenerate";
         shaderFunctions[(int)ComputePass::Move] = "CSUpdate";
         shaderFunctions[(int)ComputePass::Destroy] = "CSDestroy";
+        shaderFunctions[(int)ComputePass::PrepareUpdate] = "CSPrepareUpdate";
+        shaderFunctions[(int)ComputePass::CompactCount] = "CSCompactCount";
+        shaderFunctions[(int)ComputePass::CompactScanGroups] = "CSCompactScanGroups";
+        shaderFunctions[(int)ComputePass::CompactScatter] = "CSCompactScatter";
+        shaderFunctions[(int)ComputePass::Relocate] = "CSRelocate";
+        shaderFunctions[(int)ComputePass::HashCount] = "CSHashCount";
+        shaderFunctions[(int)ComputePass::HashScan] = "CSHashScan";
+        shaderFunctions[(int)ComputePass::HashScatter] = "CSHashScatter";
+        shaderFunctions[(int)ComputePass::Collide] = "CSCollide";
 #if defined(_DEBUG)
         // Enable better shader debugging with the graphics debugging tools.
         UINT compileFlags = D3DCOMPILE_DEBUG | D3DCOMPILE_SKIP_OPTIMIZATION;
@@ -586,10 +818,10 @@ void DX12Particles::LoadAssets()
         }
     }
 
-    ThrowIfFailed(m_device->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_DIRECT, m_commandAllocator.Get(), nullptr, IID_PPV_ARGS(&m_commandList)));
+    ThrowIfFailed(m_device->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_DIRECT, m_commandAllocators[m_frameIndex].Get(), nullptr, IID_PPV_ARGS(&m_commandList)));
     NAME_D3D12_OBJECT(m_commandList);
 
-    ThrowIfFailed(m_device->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_COMPUTE, m_commandAllocatorCompute.Get(), nullptr, IID_PPV_ARGS(&m_commandListCompute)));
+    ThrowIfFailed(m_device->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_COMPUTE, m_commandAllocatorsCompute[m_frameIndex].Get(), nullptr, IID_PPV_ARGS(&m_commandListCompute)));
     NAME_D3D12_OBJECT(m_commandListCompute);
     m_commandListCompute->Close();
 
@@ -615,14 +847,6 @@ void DX12Particles::LoadAssets()
     // Create a static constant buffer for the geometry shader
     ComPtr<ID3D12Resource> constantBufferUpload;
     {
-        struct ConstantBufferData
-        {
-            float m_AspectRatio;
-            UINT m_ParticleCount;
-            UINT m_ResolutionX;
-            UINT m_ResolutionY;
-        };
-
         const UINT bufferSize = 256;
 
         ThrowIfFailed(m_device->CreateCommittedResource(
@@ -646,17 +870,7 @@ void DX12Particles::LoadAssets()
 
         NAME_D3D12_OBJECT(m_constantBufferGS);
         
-        ConstantBufferData DataToUpload;
-        DataToUpload.m_AspectRatio = (float)m_width / m_height;
-        DataToUpload.m_ParticleCount = ParticleBufferSize;
-        DataToUpload.m_ResolutionX = m_width;
-        DataToUpload.m_ResolutionY = m_height;
-
-        D3D12_SUBRESOURCE_DATA constantBufferSubresourceData;
-        constantBufferSubresourceData.pData = reinterpret_cast<void*>(&DataToUpload);
-        constantBufferSubresourceData.SlicePitch = sizeof(ConstantBufferData);
-        constantBufferSubresourceData.RowPitch = sizeof(ConstantBufferData);
-        UpdateSubresources<1>(m_commandList.Get(), m_constantBufferGS.Get(), constantBufferUpload.Get(), 0, 0, 1, &constantBufferSubresourceData);
+        UploadStaticConstantBuffer(constantBufferUpload.Get());
         m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_constantBufferGS.Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER));
 
         // Create a constant buffer view
@@ -669,7 +883,7 @@ void DX12Particles::LoadAssets()
 
     ComPtr<ID3D12Resource> deadListBufferUpload;
     {
-        UINT64 deadListBufferSize = sizeof(UINT) * (ParticleBufferSize + 1);
+        UINT64 deadListBufferSize = sizeof(UINT) * (m_nParticleBufferSize + 1);
         // Create the dead list append buffer
         ThrowIfFailed(m_device->CreateCommittedResource(
             &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
@@ -681,17 +895,31 @@ void DX12Particles::LoadAssets()
         ));
         NAME_D3D12_OBJECT(m_deadListBuffer);
 
+        // Every frame slot reads back into its own, the CPU only looks at them once the slot's frame is done
+        for (UINT i = 0; i < FrameCount; i++)
+        {
+            ThrowIfFailed(m_device->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(sizeof(UINT), D3D12_RESOURCE_FLAG_NONE),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                nullptr,
+                IID_PPV_ARGS(&m_particleCountReadbacks[i])
+            ));
+            NAME_D3D12_OBJECT_INDEXED(m_particleCountReadbacks, i);
+
 #ifdef DEBUG_PARTICLE_DATA
-        ThrowIfFailed(m_device->CreateCommittedResource(
-            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
-            D3D12_HEAP_FLAG_NONE,
-            &CD3DX12_RESOURCE_DESC::Buffer(deadListBufferSize, D3D12_RESOURCE_FLAG_NONE),
-            D3D12_RESOURCE_STATE_COPY_DEST,
-            nullptr,
-            IID_PPV_ARGS(&m_deadListReadback)
-        ));
-        NAME_D3D12_OBJECT(m_deadListReadback);
+            ThrowIfFailed(m_device->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(deadListBufferSize, D3D12_RESOURCE_FLAG_NONE),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                nullptr,
+                IID_PPV_ARGS(&m_deadListReadbacks[i])
+            ));
+            NAME_D3D12_OBJECT_INDEXED(m_deadListReadbacks, i);
 #endif
+        }
 
         ThrowIfFailed(m_device->CreateCommittedResource(
             &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
@@ -702,34 +930,279 @@ void DX12Particles::LoadAssets()
             IID_PPV_ARGS(&deadListBufferUpload)
         ));
 
-        auto pDataToUpload = std::make_unique<DeadListBufferData>();
-        for (int i = 0; i < ParticleBufferSize; i++)
+        std::vector<UINT> dataToUpload(m_nParticleBufferSize + 1);
+        for (UINT i = 0; i < m_nParticleBufferSize; i++)
         {
-            pDataToUpload->m_availableIndices[i] = i;
+            dataToUpload[i + 1] = i;
         }
-        pDataToUpload->m_nParticleCount = InitialParticleCount;
+        dataToUpload[0] = InitialParticleCount;
+        m_nParticleCount = InitialParticleCount;
 
         D3D12_SUBRESOURCE_DATA deadListBufferData;
-        deadListBufferData.pData = reinterpret_cast<void*>(pDataToUpload.get());
-        deadListBufferData.SlicePitch = sizeof(DeadListBufferData);
-        deadListBufferData.RowPitch = sizeof(DeadListBufferData);
+        deadListBufferData.pData = reinterpret_cast<void*>(dataToUpload.data());
+        deadListBufferData.SlicePitch = deadListBufferSize;
+        deadListBufferData.RowPitch = deadListBufferSize;
         UpdateSubresources<1>(m_commandList.Get(), m_deadListBuffer.Get(), deadListBufferUpload.Get(), 0, 0, 1, &deadListBufferData);
         m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_deadListBuffer.Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+    }
+
+    // The default emitter owns the whole pool and the initial particles. Its range starts at 0, so the dead list above
+    // already holds the right local indices.
+    ComPtr<ID3D12Resource> emitterParticleCountsUpload;
+    {
+        m_rangeAllocator = ParticleRangeAllocator(m_nParticleBufferSize);
+        m_rangeAllocator.Allocate(m_nParticleBufferSize);
+        m_emitters.resize(1);
+        m_emitters[DefaultEmitter].bAlive = true;
+
+        m_emitterParticleCounts.assign(MAX_EMITTER_COUNT, 0);
+        m_emitterParticleCounts[DefaultEmitter] = InitialParticleCount;
+
+        UINT64 emitterParticleCountsSize = sizeof(UINT) * MAX_EMITTER_COUNT;
+        ThrowIfFailed(m_device->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+            D3D12_HEAP_FLAG_NONE,
+            &CD3DX12_RESOURCE_DESC::Buffer(emitterParticleCountsSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+            D3D12_RESOURCE_STATE_COPY_DEST,
+            nullptr,
+            IID_PPV_ARGS(&m_emitterParticleCountsBuffer)
+        ));
+        NAME_D3D12_OBJECT(m_emitterParticleCountsBuffer);
+
+        for (UINT i = 0; i < FrameCount; i++)
+        {
+            ThrowIfFailed(m_device->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(emitterParticleCountsSize, D3D12_RESOURCE_FLAG_NONE),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                nullptr,
+                IID_PPV_ARGS(&m_emitterParticleCountsReadbacks[i])
+            ));
+            NAME_D3D12_OBJECT_INDEXED(m_emitterParticleCountsReadbacks, i);
+        }
+
+        ThrowIfFailed(m_device->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+            D3D12_HEAP_FLAG_NONE,
+            &CD3DX12_RESOURCE_DESC::Buffer(emitterParticleCountsSize),
+            D3D12_RESOURCE_STATE_GENERIC_READ,
+            nullptr,
+            IID_PPV_ARGS(&emitterParticleCountsUpload)
+        ));
 
+        D3D12_SUBRESOURCE_DATA emitterParticleCountsData;
+        emitterParticleCountsData.pData = reinterpret_cast<void*>(m_emitterParticleCounts.data());
+        emitterParticleCountsData.SlicePitch = emitterParticleCountsSize;
+        emitterParticleCountsData.RowPitch = emitterParticleCountsSize;
+        UpdateSubresources<1>(m_commandList.Get(), m_emitterParticleCountsBuffer.Get(), emitterParticleCountsUpload.Get(), 0, 0, 1, &emitterParticleCountsData);
+        m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_emitterParticleCountsBuffer.Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
 
         D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
         uavDesc.Format = DXGI_FORMAT_UNKNOWN;
         uavDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
         uavDesc.Buffer.FirstElement = 0;
-        uavDesc.Buffer.NumElements = ParticleBufferSize + 1;
+        uavDesc.Buffer.NumElements = MAX_EMITTER_COUNT;
         uavDesc.Buffer.StructureByteStride = sizeof(UINT);
         uavDesc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
-        uavDesc.Buffer.CounterOffsetInBytes = 0;
 
-        CD3DX12_CPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::DeadListUAV, m_cbvSrvDescriptorSize);
-        m_device->CreateUnorderedAccessView(m_deadListBuffer.Get(), m_deadListBuffer.Get(), &uavDesc, uavHandle);
+        CD3DX12_CPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::EmitterParticleCountsUAV, m_cbvSrvDescriptorSize);
+        m_device->CreateUnorderedAccessView(m_emitterParticleCountsBuffer.Get(), nullptr, &uavDesc, uavHandle);
+    }
+
+    // The cell counts have to start out zero, CSHashScan clears them after that. The rest of the hash buffers are
+    // transient, see CreateTransientResources.
+    ComPtr<ID3D12Resource> hashCellCountsUpload;
+    {
+        UINT64 hashCellCountsSize = sizeof(UINT) * HASH_COUNTER_COUNT;
+        ThrowIfFailed(m_device->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+            D3D12_HEAP_FLAG_NONE,
+            &CD3DX12_RESOURCE_DESC::Buffer(hashCellCountsSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+            D3D12_RESOURCE_STATE_COPY_DEST,
+            nullptr,
+            IID_PPV_ARGS(&m_hashCellCountsBuffer)
+        ));
+        NAME_D3D12_OBJECT(m_hashCellCountsBuffer);
+
+        ThrowIfFailed(m_device->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+            D3D12_HEAP_FLAG_NONE,
+            &CD3DX12_RESOURCE_DESC::Buffer(hashCellCountsSize),
+            D3D12_RESOURCE_STATE_GENERIC_READ,
+            nullptr,
+            IID_PPV_ARGS(&hashCellCountsUpload)
+        ));
+
+        std::vector<UINT> hashCellCounts(HASH_COUNTER_COUNT, 0);
+        D3D12_SUBRESOURCE_DATA hashCellCountsData;
+        hashCellCountsData.pData = reinterpret_cast<void*>(hashCellCounts.data());
+        hashCellCountsData.SlicePitch = hashCellCountsSize;
+        hashCellCountsData.RowPitch = hashCellCountsSize;
+        UpdateSubresources<1>(m_commandList.Get(), m_hashCellCountsBuffer.Get(), hashCellCountsUpload.Get(), 0, 0, 1, &hashCellCountsData);
+        m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_hashCellCountsBuffer.Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+
+        D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+        uavDesc.Format = DXGI_FORMAT_UNKNOWN;
+        uavDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+        uavDesc.Buffer.FirstElement = 0;
+        uavDesc.Buffer.StructureByteStride = sizeof(UINT);
+        uavDesc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
+
+        uavDesc.Buffer.NumElements = HASH_COUNTER_COUNT;
+        CD3DX12_CPU_DESCRIPTOR_HANDLE countsHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::HashCellCountsUAV, m_cbvSrvDescriptorSize);
+        m_device->CreateUnorderedAccessView(m_hashCellCountsBuffer.Get(), nullptr, &uavDesc, countsHandle);
+    }
+
+    // The emitter tables are written by OnUpdate every frame, so they stay mapped like the per frame constant buffers.
+    // Both sets of views point to the same relocation buffer.
+    {
+        auto fnCreateMappedBuffer = [&](ComPtr<ID3D12Resource>& buffer, UINT64 nSize, void** ppData)
+        {
+            ThrowIfFailed(m_device->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(nSize),
+                D3D12_RESOURCE_STATE_GENERIC_READ,
+                nullptr,
+                IID_PPV_ARGS(&buffer)
+            ));
+
+            CD3DX12_RANGE readRange(0, 0);		// We do not intend to read from this resource on the CPU.
+            ThrowIfFailed(buffer->Map(0, &readRange, ppData));
+            ZeroMemory(*ppData, (SIZE_T)nSize);
+        };
+
+        fnCreateMappedBuffer(m_relocationBuffer, sizeof(ParticleRelocationData) * MAX_EMITTER_COUNT, reinterpret_cast<void**>(&m_relocationBufferData));
+        NAME_D3D12_OBJECT(m_relocationBuffer);
+
+        D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+        srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+        srvDesc.Format = DXGI_FORMAT_UNKNOWN;
+        srvDesc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+        srvDesc.Buffer.FirstElement = 0;
+        srvDesc.Buffer.NumElements = MAX_EMITTER_COUNT;
+        srvDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_NONE;
+
+        int nEnumOffsetPerFrame = (int)DescOffset::EmitterSRV1 - (int)DescOffset::EmitterSRV0;
+        for (int i = 0; i < FrameCount; i++)
+        {
+            fnCreateMappedBuffer(m_emitterBuffers[i], sizeof(ParticleEmitterData) * MAX_EMITTER_COUNT, reinterpret_cast<void**>(&m_emitterBufferData[i]));
+            NAME_D3D12_OBJECT_INDEXED(m_emitterBuffers, i);
+
+            srvDesc.Buffer.StructureByteStride = sizeof(ParticleEmitterData);
+            CD3DX12_CPU_DESCRIPTOR_HANDLE emitterHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::EmitterSRV0 + i * nEnumOffsetPerFrame, m_cbvSrvDescriptorSize);
+            m_device->CreateShaderResourceView(m_emitterBuffers[i].Get(), &srvDesc, emitterHandle);
+
+            srvDesc.Buffer.StructureByteStride = sizeof(ParticleRelocationData);
+            CD3DX12_CPU_DESCRIPTOR_HANDLE relocationHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::RelocationSRV0 + i * nEnumOffsetPerFrame, m_cbvSrvDescriptorSize);
+            m_device->CreateShaderResourceView(m_relocationBuffer.Get(), &srvDesc, relocationHandle);
+        }
+    }
+
+
+    // Create the alive lists. The initial particles are in the second particle buffer so they go to the second list.
+    ComPtr<ID3D12Resource> aliveListBufferUploads[ParticleBufferCount];
+    ComPtr<ID3D12Resource> drawArgsBufferUploads[ParticleBufferCount];
+    {
+        UINT64 aliveListBufferSize = sizeof(UINT) * (m_nParticleBufferSize + 1);
+        UINT64 drawArgsBufferSize = sizeof(UINT) * DRAW_ARGS_SIZE;
+
+        std::vector<UINT> aliveListData(m_nParticleBufferSize + 1);
+        for (UINT i = 0; i < m_nParticleBufferSize; i++)
+        {
+            aliveListData[i + 1] = i;
+        }
+
+        for (int i = 0; i < ParticleBufferCount; i++)
+        {
+            ThrowIfFailed(m_device->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(aliveListBufferSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                nullptr,
+                IID_PPV_ARGS(&m_aliveListBuffers[i])
+            ));
+            NAME_D3D12_OBJECT_INDEXED(m_aliveListBuffers, i);
+
+            ThrowIfFailed(m_device->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(drawArgsBufferSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                nullptr,
+                IID_PPV_ARGS(&m_drawArgsBuffers[i])
+            ));
+            NAME_D3D12_OBJECT_INDEXED(m_drawArgsBuffers, i);
+
+            ThrowIfFailed(m_device->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(aliveListBufferSize),
+                D3D12_RESOURCE_STATE_GENERIC_READ,
+                nullptr,
+                IID_PPV_ARGS(&aliveListBufferUploads[i])
+            ));
+
+            ThrowIfFailed(m_device->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(drawArgsBufferSize),
+                D3D12_RESOURCE_STATE_GENERIC_READ,
+                nullptr,
+                IID_PPV_ARGS(&drawArgsBufferUploads[i])
+            ));
+
+            UINT nAliveCount = i == 1 ? InitialParticleCount : 0;
+            aliveListData[0] = nAliveCount;
+
+            D3D12_SUBRESOURCE_DATA aliveListBufferData;
+            aliveListBufferData.pData = reinterpret_cast<void*>(aliveListData.data());
+            aliveListBufferData.SlicePitch = aliveListBufferSize;
+            aliveListBufferData.RowPitch = aliveListBufferSize;
+            UpdateSubresources<1>(m_commandList.Get(), m_aliveListBuffers[i].Get(), aliveListBufferUploads[i].Get(), 0, 0, 1, &aliveListBufferData);
+            m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_aliveListBuffers[i].Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+
+            D3D12_DRAW_ARGUMENTS drawArgs = { nAliveCount, 1, 0, 0 };
+            D3D12_SUBRESOURCE_DATA drawArgsBufferData;
+            drawArgsBufferData.pData = reinterpret_cast<void*>(&drawArgs);
+            drawArgsBufferData.SlicePitch = sizeof(D3D12_DRAW_ARGUMENTS);
+            drawArgsBufferData.RowPitch = sizeof(D3D12_DRAW_ARGUMENTS);
+            UpdateSubresources<1>(m_commandList.Get(), m_drawArgsBuffers[i].Get(), drawArgsBufferUploads[i].Get(), 0, 0, 1, &drawArgsBufferData);
+            m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_drawArgsBuffers[i].Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT));
+        }
+
+        // Filled by CSPrepareUpdate and CSTileScan every frame before it's used
+        ThrowIfFailed(m_device->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+            D3D12_HEAP_FLAG_NONE,
+            &CD3DX12_RESOURCE_DESC::Buffer(sizeof(UINT) * DISPATCH_ARGS_SIZE, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+            D3D12_RESOURCE_STATE_COPY_DEST,
+            nullptr,
+            IID_PPV_ARGS(&m_dispatchArgsBuffer)
+        ));
+        NAME_D3D12_OBJECT(m_dispatchArgsBuffer);
+        m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_dispatchArgsBuffer.Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT));
+
+        D3D12_INDIRECT_ARGUMENT_DESC argumentDesc = {};
+        D3D12_COMMAND_SIGNATURE_DESC commandSignatureDesc = {};
+        commandSignatureDesc.NumArgumentDescs = 1;
+        commandSignatureDesc.pArgumentDescs = &argumentDesc;
+
+        argumentDesc.Type = D3D12_INDIRECT_ARGUMENT_TYPE_DISPATCH;
+        commandSignatureDesc.ByteStride = sizeof(D3D12_DISPATCH_ARGUMENTS);
+        ThrowIfFailed(m_device->CreateCommandSignature(&commandSignatureDesc, nullptr, IID_PPV_ARGS(&m_dispatchCommandSignature)));
+        NAME_D3D12_OBJECT(m_dispatchCommandSignature);
+
+        argumentDesc.Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW;
+        commandSignatureDesc.ByteStride = sizeof(D3D12_DRAW_ARGUMENTS);
+        ThrowIfFailed(m_device->CreateCommandSignature(&commandSignatureDesc, nullptr, IID_PPV_ARGS(&m_drawCommandSignature)));
+        NAME_D3D12_OBJECT(m_drawCommandSignature);
     }
 
+    CreateTransientResources();
+    CreateParticleBufferViews();
     
     // @Note: This could be done in a single buffer using multiple views with different offsets
     for(int i = 0; i < FrameCount; i++)
@@ -758,7 +1231,7 @@ void DX12Particles::LoadAssets()
 
 #ifdef TILED_STUFF_CAN_HAPPEN
     {
-        //Create Root signature for the tile gathering process
+        //Create Root signature for the tile binning and rasterization
         D3D12_FEATURE_DATA_ROOT_SIGNATURE featureData = {};
 
         // This is the highest version the sample supports. If CheckFeatureSupport succeeds, the HighestVersion returned will not be greater than this.
@@ -769,13 +1242,15 @@ void DX12Particles::LoadAssets()
             featureData.HighestVersion = D3D_ROOT_SIGNATURE_VERSION_1_0;
         }
 
+        UINT aliveListDescriptorCount = (UINT)DescOffset::AliveListInUAV1 - (UINT)DescOffset::AliveListInUAV0;
+
         CD3DX12_DESCRIPTOR_RANGE1 ranges[6];
         ranges[0].Init(D3D12_DESCRIPTOR_RANGE_TYPE_CBV, 1, 0, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_STATIC);
         ranges[1].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, particleBufferCount, 0, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE);    // For the readable particle data
-        ranges[5].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 10, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);
-        ranges[2].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 11, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);
-        ranges[3].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 12, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);
-        ranges[4].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 13, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);
+        ranges[2].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, aliveListDescriptorCount, 14, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);    // The particles to bin are g_aliveListIn
+        ranges[3].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 3, 11, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);     // Offset counter, offsets per tile and the tile lists
+        ranges[4].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 2, 25, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);     // Particle count per tile and raster setup per particle
+        ranges[5].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 5, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_VOLATILE);      // Output of the rasterization
 
         CD3DX12_ROOT_PARAMETER1 rootParameters[6];
         rootParameters[0].InitAsDescriptorTable(1, &ranges[0], D3D12_SHADER_VISIBILITY_ALL);
@@ -800,68 +1275,13 @@ void DX12Particles::LoadAssets()
         NAME_D3D12_OBJECT(m_tileRootSignature);
     }
 
-    {
-        // Create pipeline state objects for the tile gathering process
-        ComPtr<ID3DBlob> tileShader;
-        ComPtr<ID3DBlob> tileRasterizerShader;
+    CreateTilePipelineStates(m_nTileSize);
 
-#if defined(_DEBUG)
-        // Enable better shader debugging with the graphics debugging tools.
-        UINT compileFlags = D3DCOMPILE_DEBUG | D3DCOMPILE_SKIP_OPTIMIZATION;
-#else
-        UINT compileFlags = 0;
-#endif
+    {
+        // Offset per tile Resource, big enough for the smallest tiles so it never has to change with the tile size
 
-        ComPtr<ID3DBlob> errorBlob = nullptr;
-        // @Incomplete: Precompile the shaders! See how to set up compile flags that way.
-        if FAILED(D3DCompileFromFile(GetAssetFullPath(L"ParticleTile.hlsl").c_str(), nullptr, D3D_COMPILE_STANDARD_FILE_INCLUDE, "CSCollectParticles", "cs_5_0", compileFlags, 0, &tileShader, &errorBlob))
-        {
-            if (errorBlob)
-            {
-                OutputDebugStringA((char*)errorBlob->GetBufferPointer());
-            }
-        }
-
-        if FAILED(D3DCompileFromFile(GetAssetFullPath(L"ParticleTile.hlsl").c_str(), nullptr, D3D_COMPILE_STANDARD_FILE_INCLUDE, "CSRasterizeParticles", "cs_5_0", compileFlags, 0, &tileRasterizerShader, &errorBlob))
-        {
-            if (errorBlob)
-            {
-                OutputDebugStringA((char*)errorBlob->GetBufferPointer());
-            }
-        }
-        
-        // Describe and create the graphics pipeline state objects (PSO).
-        D3D12_COMPUTE_PIPELINE_STATE_DESC psoDesc = {};
-        psoDesc.pRootSignature = m_tileRootSignature.Get();
-        psoDesc.CS = CD3DX12_SHADER_BYTECODE(tileShader.Get());
-
-        ThrowIfFailed(m_device->CreateComputePipelineState(&psoDesc, IID_PPV_ARGS(&m_tilePipelineStates[(int)TileComputePass::GatherParticles])));
-        NAME_D3D12_OBJECT(m_tilePipelineStates[(int)TileComputePass::GatherParticles]);
-
-        psoDesc.CS = CD3DX12_SHADER_BYTECODE(tileRasterizerShader.Get());
-
-        ThrowIfFailed(m_device->CreateComputePipelineState(&psoDesc, IID_PPV_ARGS(&m_tilePipelineStates[(int)TileComputePass::RasterizeParticles])));
-        NAME_D3D12_OBJECT(m_tilePipelineStates[(int)TileComputePass::RasterizeParticles]);
-
-
-        if FAILED(D3DCompileFromFile(GetAssetFullPath(L"ParticleTile.hlsl").c_str(), nullptr, D3D_COMPILE_STANDARD_FILE_INCLUDE, "CSResetTileOffsetCounter", "cs_5_0", compileFlags, 0, &tileShader, &errorBlob))
-        {
-            if (errorBlob)
-            {
-                OutputDebugStringA((char*)errorBlob->GetBufferPointer());
-            }
-        }
-
-        psoDesc.CS = CD3DX12_SHADER_BYTECODE(tileShader.Get());
-        ThrowIfFailed(m_device->CreateComputePipelineState(&psoDesc, IID_PPV_ARGS(&m_tilePipelineStates[(int)TileComputePass::ResetCounter])));
-        NAME_D3D12_OBJECT(m_tilePipelineStates[(int)TileComputePass::ResetCounter]);
-    }
-
-    {
-        // Offset per tile Resource
-
-        UINT tileCountX = (UINT)((float)m_width / TILE_SIZE_IN_PIXELS + 0.5f);
-        UINT tileCountY = (UINT)((float)m_height/ TILE_SIZE_IN_PIXELS + 0.5f);
+        UINT tileCountX = TILE_COUNT_FOR_SIZE(m_width, TILE_SIZE_MIN_IN_PIXELS);
+        UINT tileCountY = TILE_COUNT_FOR_SIZE(m_height, TILE_SIZE_MIN_IN_PIXELS);
 
         // Create the resources for the tile process as well as the UAVs
         ThrowIfFailed(m_device->CreateCommittedResource(
@@ -882,36 +1302,65 @@ void DX12Particles::LoadAssets()
     }
 
     {
-        // Particle index buffer for tiles
-
-        UINT tileCountX = (UINT)((float)m_width / TILE_SIZE_IN_PIXELS + 0.5f);
-        UINT tileCountY = (UINT)((float)m_height / TILE_SIZE_IN_PIXELS + 0.5f);
-        UINT tileOffsetBufferSize = (tileCountX * tileCountY * MAX_PARTICLE_PER_TILE + 1) * sizeof(UINT);
+        // The counters at the start of the index buffer, they stay the same with every tile size
+        for (UINT i = 0; i < FrameCount; i++)
+        {
+            ThrowIfFailed(m_device->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(sizeof(UINT) * TILE_COUNTER_COUNT, D3D12_RESOURCE_FLAG_NONE),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                nullptr,
+                IID_PPV_ARGS(&m_tileListCountersReadbacks[i])
+            ));
+            NAME_D3D12_OBJECT_INDEXED(m_tileListCountersReadbacks, i);
+        }
+        m_tileListCounters.assign(TILE_COUNTER_COUNT, 0);
+    }
 
-        // Create the resources for the tile process as well as the UAVs
+    // The tile counts have to start out zero like the hash cell counts, CSTileSort clears them after that.
+    // Sized for the smallest tiles too, the counts of every tile size are all zero between the frames.
+    ComPtr<ID3D12Resource> tileParticleCountsUpload;
+    {
+        UINT tileCount = TILE_COUNT_FOR_SIZE(m_width, TILE_SIZE_MIN_IN_PIXELS) * TILE_COUNT_FOR_SIZE(m_height, TILE_SIZE_MIN_IN_PIXELS);
+        UINT64 tileParticleCountsSize = sizeof(UINT) * tileCount;
         ThrowIfFailed(m_device->CreateCommittedResource(
             &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
             D3D12_HEAP_FLAG_NONE,
-            &CD3DX12_RESOURCE_DESC::Buffer(tileOffsetBufferSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
-            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+            &CD3DX12_RESOURCE_DESC::Buffer(tileParticleCountsSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+            D3D12_RESOURCE_STATE_COPY_DEST,
+            nullptr,
+            IID_PPV_ARGS(&m_tileParticleCounts)
+        ));
+        NAME_D3D12_OBJECT(m_tileParticleCounts);
+
+        ThrowIfFailed(m_device->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+            D3D12_HEAP_FLAG_NONE,
+            &CD3DX12_RESOURCE_DESC::Buffer(tileParticleCountsSize),
+            D3D12_RESOURCE_STATE_GENERIC_READ,
             nullptr,
-            IID_PPV_ARGS(&m_ParticleIndicesForTiles)
+            IID_PPV_ARGS(&tileParticleCountsUpload)
         ));
-        NAME_D3D12_OBJECT(m_ParticleIndicesForTiles);
+
+        std::vector<UINT> tileParticleCounts(tileCount, 0);
+        D3D12_SUBRESOURCE_DATA tileParticleCountsData;
+        tileParticleCountsData.pData = reinterpret_cast<void*>(tileParticleCounts.data());
+        tileParticleCountsData.SlicePitch = tileParticleCountsSize;
+        tileParticleCountsData.RowPitch = tileParticleCountsSize;
+        UpdateSubresources<1>(m_commandList.Get(), m_tileParticleCounts.Get(), tileParticleCountsUpload.Get(), 0, 0, 1, &tileParticleCountsData);
+        m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_tileParticleCounts.Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
 
         D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+        uavDesc.Format = DXGI_FORMAT_UNKNOWN;
         uavDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
-        uavDesc.Buffer.NumElements = tileCountX * tileCountY * MAX_PARTICLE_PER_TILE;
-        uavDesc.Buffer.FirstElement = 1;
+        uavDesc.Buffer.FirstElement = 0;
+        uavDesc.Buffer.NumElements = tileCount;
         uavDesc.Buffer.StructureByteStride = sizeof(UINT);
+        uavDesc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
 
-        CD3DX12_CPU_DESCRIPTOR_HANDLE cpuHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticleIndicesForTilesUAV, m_cbvSrvDescriptorSize);
-        m_device->CreateUnorderedAccessView(m_ParticleIndicesForTiles.Get(), nullptr, &uavDesc, cpuHandle);
-
-        uavDesc.Buffer.NumElements = 1;
-        uavDesc.Buffer.FirstElement = 0;
-        CD3DX12_CPU_DESCRIPTOR_HANDLE cpuHandleCounter(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::OffsetCounterUAV, m_cbvSrvDescriptorSize);
-        m_device->CreateUnorderedAccessView(m_ParticleIndicesForTiles.Get(), nullptr, &uavDesc, cpuHandleCounter);
+        CD3DX12_CPU_DESCRIPTOR_HANDLE cpuHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::TileParticleCountsUAV, m_cbvSrvDescriptorSize);
+        m_device->CreateUnorderedAccessView(m_tileParticleCounts.Get(), nullptr, &uavDesc, cpuHandle);
     }
 
     {
@@ -933,6 +1382,15 @@ void DX12Particles::LoadAssets()
 
             CD3DX12_CPU_DESCRIPTOR_HANDLE cpuHandle(m_cbvSrvHeap->GetCPUDescriptorHandleForHeapStart(), (int)DescOffset::TileRenderDebugUAV, m_cbvSrvDescriptorSize);
             m_device->CreateUnorderedAccessView(m_TileDebugRenderTarget.Get(), nullptr, &uavDesc, cpuHandle);
+
+            // ClearUnorderedAccessViewFloat also wants the view in a heap the CPU can read
+            D3D12_DESCRIPTOR_HEAP_DESC clearHeapDesc = {};
+            clearHeapDesc.NumDescriptors = 1;
+            clearHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
+            clearHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
+            ThrowIfFailed(m_device->CreateDescriptorHeap(&clearHeapDesc, IID_PPV_ARGS(&m_tileClearHeap)));
+            NAME_D3D12_OBJECT(m_tileClearHeap);
+            m_device->CreateUnorderedAccessView(m_TileDebugRenderTarget.Get(), nullptr, &uavDesc, m_tileClearHeap->GetCPUDescriptorHandleForHeapStart());
         }
 
         {
@@ -1030,10 +1488,10 @@ void DX12Particles::LoadAssets()
         depthStencilDesc.DepthEnable = FALSE;
         depthStencilDesc.DepthWriteMask = D3D12_DEPTH_WRITE_MASK_ZERO;
 
-        // Alpha blend blend state
+        // Alpha blend blend state, CSRasterizeParticles writes premultiplied alpha
         CD3DX12_BLEND_DESC blendDesc(D3D12_DEFAULT);
         blendDesc.RenderTarget[0].BlendEnable = TRUE;
-        blendDesc.RenderTarget[0].SrcBlend = D3D12_BLEND_SRC_ALPHA;
+        blendDesc.RenderTarget[0].SrcBlend = D3D12_BLEND_ONE;
         blendDesc.RenderTarget[0].DestBlend = D3D12_BLEND_INV_SRC_ALPHA;
         blendDesc.RenderTarget[0].BlendOp = D3D12_BLEND_OP_ADD;
         blendDesc.RenderTarget[0].SrcBlendAlpha = D3D12_BLEND_ONE;
@@ -1062,6 +1520,8 @@ void DX12Particles::LoadAssets()
         NAME_D3D12_OBJECT(m_debugRenderPipelineState);
     }
 
+#endif // TILED_STUFF_CAN_HAPPEN
+
     // Create stuff for profiling
     {
         // The heap contains a begin-end timestamp pair for each statistic we want to measure.
@@ -1086,7 +1546,6 @@ void DX12Particles::LoadAssets()
 
         NAME_D3D12_OBJECT(m_TimingQueryResult);
     }
-#endif // TILED_STUFF_CAN_HAPPEN
 
     // Close the command list and execute it to begin the initial GPU setup.
     ThrowIfFailed(m_commandList->Close());
@@ -1118,8 +1577,94 @@ void DX12Particles::LoadAssets()
         ThrowIfFailed(m_fence->SetEventOnCompletion(fenceToWaitFor, m_fenceEvent));
         WaitForSingleObject(m_fenceEvent, INFINITE);
     }
+
+    // The device signals its own fences from here on
+    ID3D12CommandAllocator* pCommandAllocators[FrameCount];
+    ID3D12CommandAllocator* pCommandAllocatorsCompute[FrameCount];
+    for (UINT i = 0; i < FrameCount; i++)
+    {
+        pCommandAllocators[i] = m_commandAllocators[i].Get();
+        pCommandAllocatorsCompute[i] = m_commandAllocatorsCompute[i].Get();
+    }
+
+    m_particleDevice.reset(new ParticleDeviceD3D12(*this, m_device.Get()));
+    m_particleDevice->SetQueue(ParticleQueue::Graphics, m_commandQueue.Get(), pCommandAllocators, FrameCount, m_commandList.Get());
+    m_particleDevice->SetQueue(ParticleQueue::Compute, m_commandQueueCompute.Get(), pCommandAllocatorsCompute, FrameCount, m_commandListCompute.Get());
+    m_particleDevice->SetCommandSignatures(m_dispatchCommandSignature.Get(), m_drawCommandSignature.Get());
+    m_particleDevice->SetTimestampQueries(m_TimingQueryHeap.Get());
+    m_particleDevice->SetSwapChain(m_swapChain.Get());
+    m_particleDevice->SetViewport(m_viewport, m_scissorRect);
+    m_framePipeline.reset(new ParticleFramePipeline(*m_particleDevice, FrameCount));
+    m_framePipeline->SetTransientLayout(m_transientLayout);
 }
 
+#ifdef TILED_STUFF_CAN_HAPPEN
+// ParticleTile.hlsl for one tile size, compiled the first time the size is used
+void DX12Particles::CreateTilePipelineStates(UINT nTileSize)
+{
+    UINT nTileSizeIndex = ParticleTileSizePolicy::GetTileSizeIndex(nTileSize);
+    if (m_tilePipelineStates[nTileSizeIndex][0])
+    {
+        return;
+    }
+
+    // Create pipeline state objects for the tile binning and rasterization
+    ComPtr<ID3DBlob> tileShaders[(int)TileComputePass::Count];
+    const char* shaderFunctions[(int)TileComputePass::Count] = {};
+    shaderFunctions[(int)TileComputePass::TileCount] = "CSTileCount";
+    shaderFunctions[(int)TileComputePass::TileScan] = "CSTileScan";
+    shaderFunctions[(int)TileComputePass::TileScatter] = "CSTileScatter";
+    shaderFunctions[(int)TileComputePass::TileSort] = "CSTileSort";
+    shaderFunctions[(int)TileComputePass::TileSortSpill] = "CSTileSortSpill";
+    shaderFunctions[(int)TileComputePass::ParticleRasterSetup] = "CSParticleRasterSetup";
+    shaderFunctions[(int)TileComputePass::RasterizeParticles] = "CSRasterizeParticles";
+
+    std::string tileSizeDefinition = std::to_string(nTileSize);
+    const D3D_SHADER_MACRO defines[] =
+    {
+        { "TILE_SIZE_IN_PIXELS", tileSizeDefinition.c_str() },
+        { nullptr, nullptr }
+    };
+
+#if defined(_DEBUG)
+    // Enable better shader debugging with the graphics debugging tools.
+    UINT compileFlags = D3DCOMPILE_DEBUG | D3DCOMPILE_SKIP_OPTIMIZATION;
+#else
+    UINT compileFlags = 0;
+#endif
+
+    for (int i = 0; i < (int)TileComputePass::Count; i++)
+    {
+        ComPtr<ID3DBlob> errorBlob = nullptr;
+        // @Incomplete: Precompile the shaders! See how to set up compile flags that way.
+        if FAILED(D3DCompileFromFile(GetAssetFullPath(L"ParticleTile.hlsl").c_str(), defines, D3D_COMPILE_STANDARD_FILE_INCLUDE, shaderFunctions[i], "cs_5_0", compileFlags, 0, &tileShaders[i], &errorBlob))
+        {
+            if (errorBlob)
+            {
+                OutputDebugStringA((char*)errorBlob->GetBufferPointer());
+            }
+        }
+
+        D3D12_COMPUTE_PIPELINE_STATE_DESC psoDesc = {};
+        psoDesc.pRootSignature = m_tileRootSignature.Get();
+        psoDesc.CS = CD3DX12_SHADER_BYTECODE(tileShaders[i].Get());
+
+        ThrowIfFailed(m_device->CreateComputePipelineState(&psoDesc, IID_PPV_ARGS(&m_tilePipelineStates[nTileSizeIndex][i])));
+        NAME_D3D12_OBJECT_INDEXED(m_tilePipelineStates[nTileSizeIndex], i);
+    }
+}
+
+// Switches the tiled path to another tile size. The offsets and the counts have room for any size, the pipeline
+// states are compiled once and kept, so only the transient buffers with the lists are replaced. The GPU has to be idle.
+void DX12Particles::SetTileSize(UINT nTileSize)
+{
+    m_nTileSize = nTileSize;
+    m_tileSizePolicy.Reset(nTileSize);
+    CreateTilePipelineStates(nTileSize);
+    CreateTransientResources();
+}
+#endif
+
 // Update frame-based values.
 void DX12Particles::OnUpdate()
 {
@@ -1153,6 +1698,11 @@ void DX12Particles::OnUpdate()
     }
 #endif
 
+    // Waits for the frame this slot had FrameCount frames ago, the CPU doesn't get further ahead than that.
+    // Everything OnUpdate writes for the GPU belongs to the slot.
+    m_framePipeline->BeginFrame(m_frameIndex);
+    ReadBackFrame();
+
     m_timer.Tick(NULL);
 
     if (m_frameCounter == 50)
@@ -1161,392 +1711,829 @@ void DX12Particles::OnUpdate()
         float fPrimitiveRenderTimeMs = (float)((double)elapsedTimeUs[(int)FramePerformanceStatistics::PrimitiveRenderTime] / 1000.0);
 
         // Update window text with FPS value.
-        wchar_t fps[200];
+        wchar_t fps[300];
         swprintf_s(fps, L"%ufps; TileCollectionTime: %0.3f ms; PrimitiveRender : %.03f ms",
             m_timer.GetFramesPerSecond(),
             fTileCollectionTimeMs,
             fPrimitiveRenderTimeMs);
+        if (m_bCollisions)
+        {
+            size_t nLength = wcslen(fps);
+            swprintf_s(fps + nLength, _countof(fps) - nLength, L"; HashBuild: %.03f ms; HashQuery: %.03f ms", m_fHashBuildTimeMs, m_fHashQueryTimeMs);
+        }
+#ifdef TILED_STUFF_CAN_HAPPEN
+        if (m_RenderMode == RenderMode::TiledRasterization || m_RenderMode == RenderMode::Debug_TileOccupancy)
+        {
+            size_t nLength = wcslen(fps);
+            swprintf_s(fps + nLength, _countof(fps) - nLength, L"; TileSize: %u; OccupiedTiles: %u/%u; LargestTile: %u; SpilledTiles: %u; Dropped: %u; Saturated: %.1f%%",
+                m_nTileSize,
+                m_tileListCounters[TILE_COUNTER_OCCUPIED_TILES],
+                TILE_COUNT_FOR_SIZE(m_width, m_nTileSize) * TILE_COUNT_FOR_SIZE(m_height, m_nTileSize),
+                m_tileListCounters[TILE_COUNTER_LARGEST_TILE],
+                m_tileListCounters[TILE_COUNTER_SPILLED_TILES],
+                m_tileListCounters[TILE_COUNTER_DROPPED_ENTRIES],
+                100.0f * m_tileListCounters[TILE_COUNTER_SATURATED_PIXELS] / (m_width * m_height));
+        }
+#endif
         m_frameCounter = 0;
         SetCustomWindowText(fps);
     }
 
     m_frameCounter++;
 
-    struct ConstBufferData
+    m_emitters[DefaultEmitter].nPendingEmitCount += m_nEmitCountNextFrame;
+    m_nEmitCountNextFrame = 0;
+    if (m_bPaused)
     {
-        UINT m_EmitCount = 0;
-        UINT m_nRandomSeed = 0;
-        float m_fElapsedTime;
-    };
+        for (Emitter& emitter : m_emitters)
+        {
+            emitter.nPendingEmitCount = 0;
+        }
+    }
+
+    ParticleFrameConstants& DataToUpload = *reinterpret_cast<ParticleFrameConstants*>(m_constantBufferPerFrameData[m_frameIndex]);
+    UpdateEmitters(DataToUpload);
 
-    ConstBufferData& DataToUpload = *reinterpret_cast<ConstBufferData*>(m_constantBufferPerFrameData[m_frameIndex]);
+#ifdef TILED_STUFF_CAN_HAPPEN
+    // The frames in flight still bin into the old lists
+    if (m_tileSizePolicy.GetTileSize() != m_nTileSize)
+    {
+        m_framePipeline->WaitForIdle();
+        SetTileSize(m_tileSizePolicy.GetTileSize());
+    }
+#endif
+
+    DataToUpload.m_nRelocationCount = 0;
+    DataToUpload.m_fCollisionStiffness = m_bCollisions ? HASH_COLLISION_STIFFNESS : 0.0f;
     if (m_bPaused)
     {
-        DataToUpload.m_EmitCount = 0;
         DataToUpload.m_fElapsedTime = 0.0f;
     }
     else
     {
-        DataToUpload.m_EmitCount = m_nEmitCountNextFrame;
         DataToUpload.m_fElapsedTime = (float)m_timer.GetElapsedSeconds();
         DataToUpload.m_nRandomSeed = std::uniform_int_distribution<UINT>{}(m_randomNumberEngine);
     }
-    m_nEmitCountNextFrame = 0;
 }
 
-void DX12Particles::RunComputeShader(int readableBufferIndex, int writableBufferIndex)
+// m_emitterParticleCounts is FrameCount - 1 frames old, the frames in flight may have emitted more since. Those only
+// decide when a range grows, CSGenerate drops what doesn't fit into a full range. The GPU has to be idle before the buffers
+// are replaced.
+void DX12Particles::UpdateEmitters(ParticleFrameConstants& constants)
 {
-    ThrowIfFailed(m_commandAllocatorCompute->Reset());
-    ThrowIfFailed(m_commandListCompute->Reset(m_commandAllocatorCompute.Get(), m_computePipelineStates[(int)ComputePass::Generate].Get()));
+    // The last frame's update didn't find these in the table, so it killed every particle they had
+    for (UINT nEmitter : m_emittersToFree)
+    {
+        m_rangeAllocator.Free(nEmitter);
+    }
+    m_emittersToFree.swap(m_destroyedEmitters);
+    m_destroyedEmitters.clear();
 
-    m_commandListCompute->SetComputeRootSignature(m_rootSignature.Get());
+    const UINT nOldParticleBufferSize = m_nParticleBufferSize;
+    std::vector<ParticleRangeAllocator::Range> oldRanges(m_emitters.size());
+    for (UINT nEmitter = 0; nEmitter < m_emitters.size(); nEmitter++)
+    {
+        if (m_rangeAllocator.IsValid(nEmitter))
+        {
+            oldRanges[nEmitter] = m_rangeAllocator.GetRange(nEmitter);
+        }
+        else
+        {
+            oldRanges[nEmitter] = { 0, 0 };
+        }
+    }
 
-    ID3D12DescriptorHeap* ppHeaps[] = { m_cbvSrvHeap.Get() };
-    m_commandListCompute->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
+    for (const EmitterCreateRequest& request : m_emitterCreateRequests)
+    {
+        UINT nEmitter = m_rangeAllocator.Allocate(request.nCapacity);
+        if (nEmitter == ParticleRangeAllocator::InvalidHandle && GrowFreeSize(request.nCapacity))
+        {
+            nEmitter = m_rangeAllocator.Allocate(request.nCapacity);
+            if (nEmitter == ParticleRangeAllocator::InvalidHandle)
+            {
+                std::vector<ParticleRangeAllocator::Move> moves;
+                m_rangeAllocator.Defragment(moves);
+                nEmitter = m_rangeAllocator.Allocate(request.nCapacity);
+            }
+        }
+
+        if (nEmitter == ParticleRangeAllocator::InvalidHandle)
+        {
+            continue;
+        }
 
-    // The constant buffer view needs to be set even though we dont use it. The reason is that we specified it in the root signature.
-    CD3DX12_GPU_DESCRIPTOR_HANDLE cbvStaticHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::StaticConstantBuffer, m_cbvSrvDescriptorSize);
-    m_commandListCompute->SetComputeRootDescriptorTable(0, cbvStaticHandle);
+        if (nEmitter >= MAX_EMITTER_COUNT)
+        {
+            m_rangeAllocator.Free(nEmitter);
+            continue;
+        }
+
+        if (nEmitter >= m_emitters.size())
+        {
+            m_emitters.resize(nEmitter + 1);
+            oldRanges.resize(nEmitter + 1, { 0, 0 });
+        }
+
+        Emitter& emitter = m_emitters[nEmitter];
+        emitter.Params = request.Params;
+        emitter.nPendingEmitCount = m_bPaused ? 0 : request.nEmitCount;
+        emitter.bAlive = true;
+        m_emitterParticleCounts[nEmitter] = 0;
+    }
+    m_emitterCreateRequests.clear();
 
-    CD3DX12_GPU_DESCRIPTOR_HANDLE cbvHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::PerFrameConstantBuffer0 + readableBufferIndex, m_cbvSrvDescriptorSize);
-    m_commandListCompute->SetComputeRootDescriptorTable(1, cbvHandle);
+    // Emitters that would run out of slots grow geometrically, same as ParticleSimulationCPU::Generate
+    for (UINT nEmitter = 0; nEmitter < m_emitters.size(); nEmitter++)
+    {
+        const Emitter& emitter = m_emitters[nEmitter];
+        UINT nRangeSize = m_rangeAllocator.IsValid(nEmitter) ? m_rangeAllocator.GetRange(nEmitter).nSize : 0;
+        if (!emitter.bAlive || emitter.nPendingEmitCount <= nRangeSize - m_emitterParticleCounts[nEmitter])
+        {
+            continue;
+        }
 
-    CD3DX12_GPU_DESCRIPTOR_HANDLE counterHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::DeadListUAV, m_cbvSrvDescriptorSize);
-    m_commandListCompute->SetComputeRootDescriptorTable(2, counterHandle);
+        UINT64 nRequiredSize = (UINT64)m_emitterParticleCounts[nEmitter] + emitter.nPendingEmitCount;
+        UINT nNewRangeSize = ParticleDeadList::GetGrownCapacity(nRangeSize, nRequiredSize > UINT_MAX ? UINT_MAX : (UINT)nRequiredSize, m_nMaxParticleBufferSize);
+        if (nNewRangeSize > nRangeSize)
+        {
+            ResizeEmitterRange(nEmitter, nNewRangeSize);
+        }
+    }
 
-    // Make sure the the read buffer can be read and the write buffer can be written to
-    for (auto& buffer : m_particleBuffers[readableBufferIndex].Buffers)
+    bool bArenaChanged = m_nParticleBufferSize != nOldParticleBufferSize;
+    for (UINT nEmitter = 0; nEmitter < m_emitters.size() && !bArenaChanged; nEmitter++)
     {
-        m_commandListCompute->ResourceBarrier(1,
-            &CD3DX12_RESOURCE_BARRIER::Transition(buffer.Get(),
-                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
+        if (m_rangeAllocator.IsValid(nEmitter))
+        {
+            const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(nEmitter);
+            bArenaChanged = range.nBegin != oldRanges[nEmitter].nBegin || range.nSize != oldRanges[nEmitter].nSize;
+        }
     }
 
-    for (auto& buffer : m_particleBuffers[writableBufferIndex].Buffers)
+    if (bArenaChanged)
     {
-        m_commandListCompute->ResourceBarrier(1,
-            &CD3DX12_RESOURCE_BARRIER::Transition(buffer.Get(),
-                D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE,
-                D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+        m_framePipeline->WaitForIdle();
+        ApplyParticleArenaChanges(nOldParticleBufferSize, oldRanges);
     }
 
-    int descriptorOffsetPerFrame = (int)DescOffset::ParticlePositionSRV1 - (int)DescOffset::ParticlePositionSRV0;
-    int readDescriptorOffset = readableBufferIndex * descriptorOffsetPerFrame;
-    int writeDescriptorOffset = writableBufferIndex * descriptorOffsetPerFrame;
+    // One table for every emitter, CSGenerate finds its emitter in it with a binary search over nEmitOffset
+    m_rangeAllocator.GetRangesInAddressOrder(m_emitterOrder);
 
+    ParticleEmitterData* pEmitterData = m_emitterBufferData[m_frameIndex];
+    UINT nEmitterCount = 0;
+    UINT nEmitCount = 0;
+    for (UINT nEmitter : m_emitterOrder)
     {
-        CD3DX12_GPU_DESCRIPTOR_HANDLE srvHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticlePositionSRV0 + readDescriptorOffset, m_cbvSrvDescriptorSize);
-        m_commandListCompute->SetComputeRootDescriptorTable(3, srvHandle);
+        Emitter& emitter = m_emitters[nEmitter];
+        if (!emitter.bAlive)
+        {
+            continue;
+        }
 
-        CD3DX12_GPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticlePositionUAV0 + writeDescriptorOffset, m_cbvSrvDescriptorSize);
-        m_commandListCompute->SetComputeRootDescriptorTable(4, uavHandle);
+        const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(nEmitter);
+        ParticleEmitterData& data = pEmitterData[nEmitterCount++];
+        data.m_Params = emitter.Params;
+        data.m_nEmitterIndex = nEmitter;
+        data.m_nEmitOffset = nEmitCount;
+        data.m_nEmitCount = emitter.nPendingEmitCount;
+        data.m_nRangeBegin = range.nBegin;
+        data.m_nRangeSize = range.nSize;
+        data.m_padding = 0;
+
+        nEmitCount += emitter.nPendingEmitCount;
+        emitter.nPendingEmitCount = 0;
     }
 
-    m_commandListCompute->SetPipelineState(m_computePipelineStates[(int)ComputePass::Generate].Get());
-    //m_commandListCompute->Dispatch((UINT)ceilf((float)ParticleBufferSize / 1000), 1, 1);
+    constants.m_EmitCount = nEmitCount;
+    constants.m_nEmitterCount = nEmitterCount;
+}
 
-    // After the generation part we swap the buffers so that the update pass doesn't override the emitted particles
-    for (auto& buffer : m_particleBuffers[readableBufferIndex].Buffers)
+bool DX12Particles::GrowFreeSize(UINT nFreeSize)
+{
+    if (m_rangeAllocator.GetFreeSize() >= nFreeSize)
     {
-        m_commandListCompute->ResourceBarrier(1,
-            &CD3DX12_RESOURCE_BARRIER::Transition(buffer.Get(),
-                D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE,
-                D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+        return true;
     }
 
-    for (auto& buffer : m_particleBuffers[writableBufferIndex].Buffers)
+    UINT64 nRequiredSize = (UINT64)(m_nParticleBufferSize - m_rangeAllocator.GetFreeSize()) + nFreeSize;
+    if (nRequiredSize > m_nMaxParticleBufferSize)
     {
-        m_commandListCompute->ResourceBarrier(1,
-            &CD3DX12_RESOURCE_BARRIER::Transition(buffer.Get(),
-                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
+        return false;
     }
 
-    std::swap(readableBufferIndex, writableBufferIndex);
-    readDescriptorOffset = readableBufferIndex * descriptorOffsetPerFrame;
-    writeDescriptorOffset = writableBufferIndex * descriptorOffsetPerFrame;
+    // Only the bookkeeping, ApplyParticleArenaChanges replaces the buffers
+    m_nParticleBufferSize = ParticleDeadList::GetGrownCapacity(m_nParticleBufferSize, (UINT)nRequiredSize, m_nMaxParticleBufferSize);
+    m_rangeAllocator.Grow(m_nParticleBufferSize);
+    return true;
+}
 
-    {
-        CD3DX12_GPU_DESCRIPTOR_HANDLE srvHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticlePositionSRV0 + readDescriptorOffset, m_cbvSrvDescriptorSize);
-        m_commandListCompute->SetComputeRootDescriptorTable(3, srvHandle);
+// Same order of attempts as ParticleSimulationCPU::ResizeEmitterRange. The moves aren't needed,
+// ApplyParticleArenaChanges copies every range from where it was at the start of the frame.
+bool DX12Particles::ResizeEmitterRange(UINT nEmitter, UINT nNewSize)
+{
+    const UINT nOldSize = m_rangeAllocator.GetRange(nEmitter).nSize;
+    std::vector<ParticleRangeAllocator::Move> moves;
 
-        CD3DX12_GPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticlePositionUAV0 + writeDescriptorOffset, m_cbvSrvDescriptorSize);
-        m_commandListCompute->SetComputeRootDescriptorTable(4, uavHandle);
+    bool bResized = m_rangeAllocator.Resize(nEmitter, nNewSize, moves);
+    if (!bResized && GrowFreeSize(nNewSize - nOldSize))
+    {
+        bResized = m_rangeAllocator.Resize(nEmitter, nNewSize, moves);
+        if (!bResized)
+        {
+            m_rangeAllocator.Defragment(moves);
+            bResized = m_rangeAllocator.Resize(nEmitter, nNewSize, moves);
+        }
+        if (!bResized && GrowFreeSize(nNewSize))
+        {
+            bResized = m_rangeAllocator.Resize(nEmitter, nNewSize, moves);
+        }
     }
+    return bResized;
+}
 
-    m_commandListCompute->SetPipelineState(m_computePipelineStates[(int)ComputePass::Move].Get());
-    m_commandListCompute->Dispatch((UINT)ceilf((float)ParticleBufferSize / 1000), 1, 1);
-
-    m_commandListCompute->SetPipelineState(m_computePipelineStates[(int)ComputePass::Destroy].Get());
-    m_commandListCompute->Dispatch((UINT)ceilf((float)ParticleBufferSize / 1000), 1, 1);
+// Moves the emitter ranges from oldRanges to where the allocator has them now and makes room for m_nParticleBufferSize particles.
+// The particle buffers and the dead list are always replaced, so every range is a single copy from the old buffer to the new one
+// no matter how the ranges moved around. The live particles keep their data, only the alive list needs fixing up, see CSRelocate.
+// Has to be called between frames while the GPU is idle.
+void DX12Particles::ApplyParticleArenaChanges(UINT nOldParticleBufferSize, const std::vector<ParticleRangeAllocator::Range>& oldRanges)
+{
+    const UINT nParticleBufferSize = m_nParticleBufferSize;
+    const bool bGrown = nParticleBufferSize != nOldParticleBufferSize;
+
+    // BeginFrame was before, nothing uses the slot's allocator
+    ThrowIfFailed(m_commandAllocators[m_frameIndex]->Reset());
+    ThrowIfFailed(m_commandList->Reset(m_commandAllocators[m_frameIndex].Get(), nullptr));
+
+    // Buffers decay to the common state at the end of every ExecuteCommandLists, so the copies below
+    // promote both the old and the new ones to the copy states on their own.
+    // The old buffers have to stay alive until the copies are done.
+    std::vector<ComPtr<ID3D12Resource>> oldBuffers;
+    auto fnReplaceBuffer = [&](ComPtr<ID3D12Resource>& buffer, UINT64 nSize) -> ID3D12Resource*
+    {
+        oldBuffers.push_back(buffer);
+        ThrowIfFailed(m_device->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+            D3D12_HEAP_FLAG_NONE,
+            &CD3DX12_RESOURCE_DESC::Buffer(nSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+            D3D12_RESOURCE_STATE_COMMON,
+            nullptr,
+            IID_PPV_ARGS(&buffer)
+        ));
+        return oldBuffers.back().Get();
+    };
 
-#ifdef DEBUG_PARTICLE_DATA
-    m_commandListCompute->ResourceBarrier(1,
-        &CD3DX12_RESOURCE_BARRIER::Transition(m_deadListBuffer.Get(),
-            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-            D3D12_RESOURCE_STATE_COPY_SOURCE));
+    std::vector<UINT> emitters;
+    m_rangeAllocator.GetRangesInAddressOrder(emitters);
 
-    m_commandListCompute->CopyResource(m_deadListReadback.Get(), m_deadListBuffer.Get());
+    // Slots that weren't part of a range before are dead, the alive lists make sure nothing reads them before they are emitted into
+    for (int i = 0; i < ParticleBufferCount; i++)
+    {
+        for (int iBuffer = 0; iBuffer < (int)ParticleBufferTypes::Count; iBuffer++)
+        {
+            auto&& buffer = m_particleBuffers[i].Buffers[iBuffer];
+            auto bufferSize = particleBufferStrides[iBuffer];
+            ID3D12Resource* pOldBuffer = fnReplaceBuffer(buffer, bufferSize * nParticleBufferSize);
+            SetNameIndexed(buffer.Get(), particleBufferNames[iBuffer], i);
 
-    m_commandListCompute->ResourceBarrier(1,
-        &CD3DX12_RESOURCE_BARRIER::Transition(m_deadListBuffer.Get(),
-            D3D12_RESOURCE_STATE_COPY_SOURCE,
-            D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
-#endif
+            for (UINT nEmitter : emitters)
+            {
+                const ParticleRangeAllocator::Range& oldRange = nEmitter < oldRanges.size() ? oldRanges[nEmitter] : ParticleRangeAllocator::Range{ 0, 0 };
+                if (oldRange.nSize != 0)
+                {
+                    const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(nEmitter);
+                    m_commandList->CopyBufferRegion(buffer.Get(), bufferSize * range.nBegin, pOldBuffer, bufferSize * oldRange.nBegin, bufferSize * oldRange.nSize);
+                }
+            }
+        }
+    }
 
-#ifdef TILE_STUFF_CAN_HAPPEN
-    if(m_RenderMode == RenderMode::TiledRasterization || m_RenderMode == RenderMode::Debug_TileOccupancy)
+    // Every emitter's part of the dead list is laid out like a whole dead list without the counter. The old entries
+    // move to the end of the new part and the new slots go in front of them. Same as ParticleDeadList::Grow.
+    // New emitters get all their slots and a zero particle count, the upload holds the indices followed by a zero.
+    std::vector<UINT> uploadData;
+    std::vector<ParticleRelocationData> relocations;
+    ComPtr<ID3D12Resource> deadListBufferUpload;
     {
-        // Run the gather compute shader
-        m_commandListCompute->SetComputeRootSignature(m_tileRootSignature.Get());
-        
-        CD3DX12_GPU_DESCRIPTOR_HANDLE cbvHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::StaticConstantBuffer, m_cbvSrvDescriptorSize);
-        m_commandListCompute->SetComputeRootDescriptorTable(0, cbvHandle);
+        ID3D12Resource* pOldDeadList = fnReplaceBuffer(m_deadListBuffer, sizeof(UINT) * (nParticleBufferSize + 1));
+        NAME_D3D12_OBJECT(m_deadListBuffer);
+        m_commandList->CopyBufferRegion(m_deadListBuffer.Get(), 0, pOldDeadList, 0, sizeof(UINT));
 
-        CD3DX12_GPU_DESCRIPTOR_HANDLE srvHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticleSRV0 + readableBufferIndex, m_cbvSrvDescriptorSize);
-        m_commandListCompute->SetComputeRootDescriptorTable(1, srvHandle);
+        struct DeadListUpload
+        {
+            UINT nEmitter;
+            UINT nUploadOffset;
+        };
+        std::vector<DeadListUpload> deadListUploads;
 
+        for (UINT nEmitter : emitters)
         {
-            CD3DX12_GPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::OffsetCounterUAV, m_cbvSrvDescriptorSize);
-            m_commandListCompute->SetComputeRootDescriptorTable(2, uavHandle);
+            const ParticleRangeAllocator::Range& oldRange = nEmitter < oldRanges.size() ? oldRanges[nEmitter] : ParticleRangeAllocator::Range{ 0, 0 };
+            const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(nEmitter);
+            const UINT nAddedCount = range.nSize - oldRange.nSize;
+
+            if (oldRange.nSize != 0)
+            {
+                m_commandList->CopyBufferRegion(m_deadListBuffer.Get(), sizeof(UINT) * (1 + range.nBegin + nAddedCount), pOldDeadList, sizeof(UINT) * (1 + oldRange.nBegin), sizeof(UINT) * oldRange.nSize);
+                if (oldRange.nBegin != range.nBegin)
+                {
+                    relocations.push_back({ oldRange.nBegin, range.nBegin, oldRange.nSize, 0 });
+                }
+            }
+
+            if (nAddedCount != 0)
+            {
+                deadListUploads.push_back({ nEmitter, (UINT)uploadData.size() });
+                for (UINT i = oldRange.nSize; i < range.nSize; i++)
+                {
+                    uploadData.push_back(i);
+                }
+            }
         }
+        const UINT nZeroOffset = (UINT)uploadData.size();
+        uploadData.push_back(0);
+
+        ThrowIfFailed(m_device->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+            D3D12_HEAP_FLAG_NONE,
+            &CD3DX12_RESOURCE_DESC::Buffer(sizeof(UINT) * uploadData.size()),
+            D3D12_RESOURCE_STATE_GENERIC_READ,
+            nullptr,
+            IID_PPV_ARGS(&deadListBufferUpload)
+        ));
+
+        UINT* pUploadData;
+        CD3DX12_RANGE readRange(0, 0);
+        ThrowIfFailed(deadListBufferUpload->Map(0, &readRange, reinterpret_cast<void**>(&pUploadData)));
+        memcpy(pUploadData, uploadData.data(), sizeof(UINT) * uploadData.size());
+        deadListBufferUpload->Unmap(0, nullptr);
+
+        for (const DeadListUpload& upload : deadListUploads)
         {
-            CD3DX12_GPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::OffsetPerTilesUAV, m_cbvSrvDescriptorSize);
-            m_commandListCompute->SetComputeRootDescriptorTable(3, uavHandle);
+            const ParticleRangeAllocator::Range& oldRange = upload.nEmitter < oldRanges.size() ? oldRanges[upload.nEmitter] : ParticleRangeAllocator::Range{ 0, 0 };
+            const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(upload.nEmitter);
+            m_commandList->CopyBufferRegion(m_deadListBuffer.Get(), sizeof(UINT) * (1 + range.nBegin), deadListBufferUpload.Get(), sizeof(UINT) * upload.nUploadOffset, sizeof(UINT) * (range.nSize - oldRange.nSize));
+
+            if (oldRange.nSize == 0)
+            {
+                m_commandList->CopyBufferRegion(m_emitterParticleCountsBuffer.Get(), sizeof(UINT) * upload.nEmitter, deadListBufferUpload.Get(), sizeof(UINT) * nZeroOffset, sizeof(UINT));
+            }
         }
+
+#ifdef DEBUG_PARTICLE_DATA
+        if (bGrown)
         {
-            CD3DX12_GPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticleIndicesForTilesUAV, m_cbvSrvDescriptorSize);
-            m_commandListCompute->SetComputeRootDescriptorTable(4, uavHandle);
+            for (int i = 0; i < FrameCount; i++)
+            {
+                ThrowIfFailed(m_device->CreateCommittedResource(
+                    &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+                    D3D12_HEAP_FLAG_NONE,
+                    &CD3DX12_RESOURCE_DESC::Buffer(sizeof(UINT) * (nParticleBufferSize + 1), D3D12_RESOURCE_FLAG_NONE),
+                    D3D12_RESOURCE_STATE_COPY_DEST,
+                    nullptr,
+                    IID_PPV_ARGS(&m_deadListReadbacks[i])
+                ));
+                NAME_D3D12_OBJECT_INDEXED(m_deadListReadbacks, i);
+            }
         }
+#endif
+    }
+
+    ComPtr<ID3D12Resource> constantBufferUpload;
+    if (bGrown)
+    {
+        // The alive lists only use their beginning, the counter and the indices stay where they are
+        for (int i = 0; i < ParticleBufferCount; i++)
         {
-            CD3DX12_GPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::DeadListUAV, m_cbvSrvDescriptorSize);
-            m_commandListCompute->SetComputeRootDescriptorTable(5, uavHandle);
+            ID3D12Resource* pOldAliveList = fnReplaceBuffer(m_aliveListBuffers[i], sizeof(UINT) * (nParticleBufferSize + 1));
+            NAME_D3D12_OBJECT_INDEXED(m_aliveListBuffers, i);
+            m_commandList->CopyBufferRegion(m_aliveListBuffers[i].Get(), 0, pOldAliveList, 0, sizeof(UINT) * (nOldParticleBufferSize + 1));
         }
+
+        // Only used inside a frame, nothing to keep
+        CreateTransientResources();
+
+        ThrowIfFailed(m_device->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+            D3D12_HEAP_FLAG_NONE,
+            &CD3DX12_RESOURCE_DESC::Buffer(256),
+            D3D12_RESOURCE_STATE_GENERIC_READ,
+            nullptr,
+            IID_PPV_ARGS(&constantBufferUpload)
+        ));
+        UploadStaticConstantBuffer(constantBufferUpload.Get());
+    }
+
+    // The relocation pass below already goes through the new views
+    CreateParticleBufferViews();
+
+    // Only the alive list the next update reads matters, the other one gets overwritten by the compaction
+    if (!relocations.empty())
+    {
+        std::sort(relocations.begin(), relocations.end(), [](const ParticleRelocationData& a, const ParticleRelocationData& b) { return a.m_nSrcBegin < b.m_nSrcBegin; });
+        memcpy(m_relocationBufferData, relocations.data(), sizeof(ParticleRelocationData) * relocations.size());
+
+        ParticleFrameConstants& constants = *reinterpret_cast<ParticleFrameConstants*>(m_constantBufferPerFrameData[m_frameIndex]);
+        constants.m_nRelocationCount = (UINT)relocations.size();
+
+        const int nextAliveListIndex = (m_currentParticleBufferIndex + 1) % ParticleBufferCount;
+        if (bGrown)
         {
-            CD3DX12_GPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::TileRenderDebugUAV, m_cbvSrvDescriptorSize);
-            m_commandListCompute->SetComputeRootDescriptorTable(6, uavHandle);
+            m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_aliveListBuffers[nextAliveListIndex].Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
         }
 
-        UINT tileCountX = (UINT)((float)m_width / TILE_SIZE_IN_PIXELS + 0.5f);
-        UINT tileCountY = (UINT)((float)m_height / TILE_SIZE_IN_PIXELS + 0.5f);
-
-        // @TODO Timing this doesn't work because the command processor starts the dispatches and moves on
-        // so it won't ever wait for them to finish.
-        //UINT queryCountPerFrame = (int)FramePerformanceStatistics::FramePerfomanceStatisticCount * 2;
-        //UINT timeQueryIndex = queryCountPerFrame * m_frameIndex + (int)FramePerformanceStatistics::TileCollectionTime * 2;
-        //m_commandListCompute->EndQuery(m_TimingQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, timeQueryIndex);
+        m_commandList->SetComputeRootSignature(m_rootSignature.Get());
+        ID3D12DescriptorHeap* ppHeaps[] = { m_cbvSrvHeap.Get() };
+        m_commandList->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
 
-        m_commandListCompute->SetPipelineState(m_tilePipelineStates[(int)TileComputePass::GatherParticles].Get());
-        
-        m_commandListCompute->Dispatch(tileCountX, tileCountY, 1);
+        CD3DX12_GPU_DESCRIPTOR_HANDLE cbvHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::PerFrameConstantBuffer0 + m_frameIndex, m_cbvSrvDescriptorSize);
+        m_commandList->SetComputeRootDescriptorTable(1, cbvHandle);
 
-        m_commandListCompute->SetPipelineState(m_tilePipelineStates[(int)TileComputePass::RasterizeParticles].Get());
-        m_commandListCompute->Dispatch(tileCountX, tileCountY, 1);
+        int aliveListDescriptorOffset = (int)DescOffset::AliveListInUAV1 - (int)DescOffset::AliveListInUAV0;
+        CD3DX12_GPU_DESCRIPTOR_HANDLE aliveListHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::AliveListInUAV0 + nextAliveListIndex * aliveListDescriptorOffset, m_cbvSrvDescriptorSize);
+        m_commandList->SetComputeRootDescriptorTable(5, aliveListHandle);
 
-        m_commandListCompute->SetPipelineState(m_tilePipelineStates[(int)TileComputePass::ResetCounter].Get());
-        m_commandListCompute->Dispatch(1, 1, 1);
+        int emitterDescriptorOffset = (int)DescOffset::EmitterSRV1 - (int)DescOffset::EmitterSRV0;
+        CD3DX12_GPU_DESCRIPTOR_HANDLE emitterHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::EmitterSRV0 + m_frameIndex * emitterDescriptorOffset, m_cbvSrvDescriptorSize);
+        m_commandList->SetComputeRootDescriptorTable(6, emitterHandle);
 
-        //m_commandListCompute->EndQuery(m_TimingQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, timeQueryIndex + 1);
-        //UINT startQueryIndex = m_frameIndex * queryCountPerFrame;
-        //m_commandListCompute->ResolveQueryData(m_TimingQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, startQueryIndex, queryCountPerFrame, m_TimingQueryResult.Get(), startQueryIndex * sizeof(UINT64));
+        // m_nParticleCount is a few frames old, CSRelocate stops at the count of the alive list on its own
+        m_commandList->SetPipelineState(m_computePipelineStates[(int)ComputePass::Relocate].Get());
+        m_commandList->Dispatch((nOldParticleBufferSize + UPDATE_GROUP_SIZE - 1) / UPDATE_GROUP_SIZE, 1, 1);
     }
-#endif
 
-    m_commandListCompute->Close();
+    ThrowIfFailed(m_commandList->Close());
+    ID3D12CommandList* ppCommandLists[] = { m_commandList.Get() };
+    m_commandQueue->ExecuteCommandLists(_countof(ppCommandLists), ppCommandLists);
+    WaitForFence(true, false);
 
-    ID3D12CommandList* ppCommandLists[] = { m_commandListCompute.Get() };
-    m_commandQueueCompute->ExecuteCommandLists(_countof(ppCommandLists), ppCommandLists);
+    // The new buffers decayed back to the common state after their copies, only the transition above stays
+    ParticleResourceTracker& tracker = m_framePipeline->GetResourceTracker();
+    for (uint32_t iStream = 0; iStream < ParticleStreamCount; iStream++)
+    {
+        tracker.SetState(GetParticleStream(0, iStream), ParticleResourceState::Common);
+        tracker.SetState(GetParticleStream(1, iStream), ParticleResourceState::Common);
+    }
+    tracker.SetState(ParticleResource::DeadList, ParticleResourceState::Common);
+    if (bGrown)
+    {
+        const int nextAliveListIndex = (m_currentParticleBufferIndex + 1) % ParticleBufferCount;
+        tracker.SetState(GetAliveList(m_currentParticleBufferIndex), ParticleResourceState::Common);
+        tracker.SetState(GetAliveList(nextAliveListIndex), relocations.empty() ? ParticleResourceState::Common : ParticleResourceState::UnorderedAccess);
+    }
 }
 
-void DX12Particles::WaitForFence(bool waitOnCpu, bool bCompute)
-{
-    const UINT64 fence = m_fenceValue;
-    m_fenceValue++;
+static_assert(ParticleStreamCount == (int)DX12Particles::ParticleBufferTypes::Count, "The streams of ParticleDevice.h are the particle buffers");
+static_assert((uint32_t)DX12Particles::FrameCount <= ParticleMaxBackBufferCount, "Not enough back buffers in ParticleResource");
+static_assert((uint32_t)DX12Particles::FrameCount <= ParticleMaxFrameLatency, "Not enough frame slots in ParticleDeviceD3D12");
+static_assert((int)DX12Particles::DescOffset::PerFrameConstantBuffer0 + DX12Particles::FrameCount == (int)DX12Particles::DescOffset::DeadListUAV,
+    "A constant buffer view for every frame slot");
+static_assert((int)DX12Particles::DescOffset::EmitterSRV0 + 2 * DX12Particles::FrameCount == (int)DX12Particles::DescOffset::EmitterParticleCountsUAV,
+    "An emitter table and a relocation view for every frame slot");
 
-    ID3D12CommandQueue* pCommandQueue;
-    if (bCompute)
+// The pipelines of the ParticlePass values, in their order
+static const DX12Particles::ComputePass ComputePasses[] =
+{
+    DX12Particles::ComputePass::Generate,
+    DX12Particles::ComputePass::PrepareUpdate,
+    DX12Particles::ComputePass::HashCount,
+    DX12Particles::ComputePass::HashScan,
+    DX12Particles::ComputePass::HashScatter,
+    DX12Particles::ComputePass::Collide,
+    DX12Particles::ComputePass::Move,
+    DX12Particles::ComputePass::CompactCount,
+    DX12Particles::ComputePass::CompactScanGroups,
+    DX12Particles::ComputePass::CompactScatter,
+    DX12Particles::ComputePass::Destroy,
+};
+
+static const DX12Particles::TileComputePass TileComputePasses[] =
+{
+    DX12Particles::TileComputePass::TileCount,
+    DX12Particles::TileComputePass::ParticleRasterSetup,
+    DX12Particles::TileComputePass::TileScan,
+    DX12Particles::TileComputePass::TileScatter,
+    DX12Particles::TileComputePass::TileSort,
+    DX12Particles::TileComputePass::TileSortSpill,
+    DX12Particles::TileComputePass::RasterizeParticles,
+};
+
+static_assert(_countof(ComputePasses) == (int)ParticlePass::TileCount, "Every simulation pass needs its pipeline");
+static_assert(_countof(TileComputePasses) == (int)ParticlePass::RasterizeParticles - (int)ParticlePass::TileCount + 1, "Every tile pass needs its pipeline");
+
+ID3D12Resource* DX12Particles::GetResource(ParticleResource resource)
+{
+    if (resource < ParticleResource::DeadList)
     {
-        pCommandQueue = m_commandQueueCompute.Get();
+        UINT nStream = (UINT)resource - (UINT)ParticleResource::ParticleStreams0;
+        return m_particleBuffers[nStream / ParticleStreamCount].Buffers[nStream % ParticleStreamCount].Get();
     }
-    else
+    if (resource >= ParticleResource::BackBuffers)
     {
-        pCommandQueue = m_commandQueue.Get();
+        return m_renderTargets[(UINT)resource - (UINT)ParticleResource::BackBuffers].Get();
     }
 
-    // Wait until the previous frame is finished.
-    ThrowIfFailed(pCommandQueue->Signal(m_fence.Get(), fence));
-    if (m_fence->GetCompletedValue() < fence)
+    switch (resource)
     {
-        if (waitOnCpu)
-        {
-            ThrowIfFailed(m_fence->SetEventOnCompletion(fence, m_fenceEvent));
-            WaitForSingleObject(m_fenceEvent, INFINITE);
-        }
-        else
-        {
-            ThrowIfFailed(pCommandQueue->Wait(m_fence.Get(), fence));
-        }
+    case ParticleResource::DeadList:                        return m_deadListBuffer.Get();
+    case ParticleResource::AliveList0:                      return m_aliveListBuffers[0].Get();
+    case ParticleResource::AliveList1:                      return m_aliveListBuffers[1].Get();
+    case ParticleResource::DrawArgs0:                       return m_drawArgsBuffers[0].Get();
+    case ParticleResource::DrawArgs1:                       return m_drawArgsBuffers[1].Get();
+    case ParticleResource::DispatchArgs:                    return m_dispatchArgsBuffer.Get();
+    case ParticleResource::EmitterParticleCounts:           return m_emitterParticleCountsBuffer.Get();
+    case ParticleResource::HashCellCounts:                  return m_hashCellCountsBuffer.Get();
+    case ParticleResource::HashCellStarts:                  return m_hashCellStartsBuffer.Get();
+    case ParticleResource::HashParticleCells:               return m_hashParticleCellsBuffer.Get();
+    case ParticleResource::HashSortedParticles:             return m_hashSortedParticlesBuffer.Get();
+    case ParticleResource::CollisionImpulses:               return m_collisionImpulsesBuffer.Get();
+    case ParticleResource::CompactionGroupOffsets:          return m_compactionGroupOffsetsBuffer.Get();
+    case ParticleResource::TileParticleCounts:              return m_tileParticleCounts.Get();
+    case ParticleResource::TileOffsets:                     return m_tileOffsets.Get();
+    case ParticleResource::ParticleRasterSetups:            return m_particleRasterSetups.Get();
+    case ParticleResource::TileIndices:                     return m_ParticleIndicesForTiles.Get();
+    case ParticleResource::TileOutput:                      return m_TileDebugRenderTarget.Get();
+    case ParticleResource::ParticleCountReadback:           return m_particleCountReadbacks[m_frameIndex].Get();
+    case ParticleResource::EmitterParticleCountsReadback:   return m_emitterParticleCountsReadbacks[m_frameIndex].Get();
+#ifdef DEBUG_PARTICLE_DATA
+    case ParticleResource::DeadListReadback:                return m_deadListReadbacks[m_frameIndex].Get();
+#endif
+    case ParticleResource::TileListCountersReadback:        return m_tileListCountersReadbacks[m_frameIndex].Get();
+    case ParticleResource::TimestampReadback:               return m_TimingQueryResult.Get();
+    default:                                                return nullptr;
     }
 }
 
-void DX12Particles::DrawParticlesWithPrimitives(int readableBufferIndex)
+ID3D12RootSignature* DX12Particles::GetRootSignature(ParticlePass pass)
 {
-    m_commandList->SetPipelineState(m_pipelineState.Get());
-    m_commandList->SetGraphicsRootSignature(m_rootSignature.Get());
+    if (IsParticleTilePass(pass))
+    {
+        return m_tileRootSignature.Get();
+    }
+    if (pass == ParticlePass::DrawTileOutput)
+    {
+        return m_debugRenderRootSignature.Get();
+    }
 
-    ID3D12DescriptorHeap* ppHeaps[] = { m_cbvSrvHeap.Get() };
-    m_commandList->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
+    // The simulation and the draw of the particles share one
+    return m_rootSignature.Get();
+}
 
-    CD3DX12_GPU_DESCRIPTOR_HANDLE cbvHandleStatic(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::StaticConstantBuffer, m_cbvSrvDescriptorSize);
-    m_commandList->SetGraphicsRootDescriptorTable(0, cbvHandleStatic);
+ID3D12PipelineState* DX12Particles::GetPipelineState(ParticlePass pass, const ParticlePassParams& params)
+{
+    switch (pass)
+    {
+    case ParticlePass::DrawParticles:
+        return m_pipelineState.Get();
+    case ParticlePass::DrawTileOutput:
+        return m_debugRenderPipelineState.Get();
+    default:
+        break;
+    }
 
-    CD3DX12_GPU_DESCRIPTOR_HANDLE cbvHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::PerFrameConstantBuffer0 + readableBufferIndex, m_cbvSrvDescriptorSize);
-    m_commandList->SetGraphicsRootDescriptorTable(1, cbvHandle);
+    if (IsParticleTilePass(pass))
+    {
+        UINT nTileSizeIndex = ParticleTileSizePolicy::GetTileSizeIndex(params.nTileSize);
+        return m_tilePipelineStates[nTileSizeIndex][(int)TileComputePasses[(int)pass - (int)ParticlePass::TileCount]].Get();
+    }
+    return m_computePipelineStates[(int)ComputePasses[(int)pass]].Get();
+}
 
-    CD3DX12_GPU_DESCRIPTOR_HANDLE deadlistHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::DeadListUAV, m_cbvSrvDescriptorSize);
-    m_commandList->SetGraphicsRootDescriptorTable(2, deadlistHandle);
+void DX12Particles::SetRootArguments(ID3D12GraphicsCommandList* pCommandList, ParticlePass pass, const ParticlePassParams& params)
+{
+    ID3D12DescriptorHeap* ppHeaps[] = { m_cbvSrvHeap.Get() };
+    pCommandList->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
 
-    int descriptorOffsetPerFrame = (int)DescOffset::ParticlePositionSRV1 - (int)DescOffset::ParticlePositionSRV0;
-    int currentDescriptorOffset = readableBufferIndex * descriptorOffsetPerFrame;
+    auto fnHandle = [&](DescOffset descOffset, int offset)
+    {
+        return CD3DX12_GPU_DESCRIPTOR_HANDLE(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)descOffset + offset, m_cbvSrvDescriptorSize);
+    };
 
-    CD3DX12_GPU_DESCRIPTOR_HANDLE srvHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticlePositionSRV0 + currentDescriptorOffset, m_cbvSrvDescriptorSize);
-    m_commandList->SetGraphicsRootDescriptorTable(3, srvHandle);
+    int descriptorOffsetPerFrame = (int)DescOffset::ParticlePositionSRV1 - (int)DescOffset::ParticlePositionSRV0;
+    int aliveListDescriptorOffset = (int)DescOffset::AliveListInUAV1 - (int)DescOffset::AliveListInUAV0;
+    int emitterDescriptorOffset = (int)DescOffset::EmitterSRV1 - (int)DescOffset::EmitterSRV0;
+    int readDescriptorOffset = params.nReadBuffer * descriptorOffsetPerFrame;
+    int writeDescriptorOffset = params.nWriteBuffer * descriptorOffsetPerFrame;
 
-    CD3DX12_GPU_DESCRIPTOR_HANDLE uavHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::ParticlePositionUAV0, m_cbvSrvDescriptorSize);
-    m_commandList->SetGraphicsRootDescriptorTable(4, uavHandle);
+    if (pass == ParticlePass::DrawTileOutput)
+    {
+        pCommandList->SetGraphicsRootDescriptorTable(0, fnHandle(DescOffset::TileRenderDebugSRV, 0));
+    }
+    else if (pass == ParticlePass::DrawParticles)
+    {
+        // The draw doesn't write the particles, the UAVs only have to be there
+        pCommandList->SetGraphicsRootDescriptorTable(0, fnHandle(DescOffset::StaticConstantBuffer, 0));
+        pCommandList->SetGraphicsRootDescriptorTable(1, fnHandle(DescOffset::PerFrameConstantBuffer0, params.nConstantBuffer));
+        pCommandList->SetGraphicsRootDescriptorTable(2, fnHandle(DescOffset::DeadListUAV, 0));
+        pCommandList->SetGraphicsRootDescriptorTable(3, fnHandle(DescOffset::ParticlePositionSRV0, readDescriptorOffset));
+        pCommandList->SetGraphicsRootDescriptorTable(4, fnHandle(DescOffset::ParticlePositionUAV0, writeDescriptorOffset));
+        pCommandList->SetGraphicsRootDescriptorTable(5, fnHandle(DescOffset::AliveListInUAV0, params.nAliveList * aliveListDescriptorOffset));
+    }
+    else if (IsParticleTilePass(pass))
+    {
+        pCommandList->SetComputeRootDescriptorTable(0, fnHandle(DescOffset::StaticConstantBuffer, 0));
+        pCommandList->SetComputeRootDescriptorTable(1, fnHandle(DescOffset::ParticlePositionSRV0, readDescriptorOffset));
+        pCommandList->SetComputeRootDescriptorTable(2, fnHandle(DescOffset::AliveListInUAV0, params.nAliveList * aliveListDescriptorOffset));
+        pCommandList->SetComputeRootDescriptorTable(3, fnHandle(DescOffset::OffsetCounterUAV, 0));
+        pCommandList->SetComputeRootDescriptorTable(4, fnHandle(DescOffset::TileParticleCountsUAV, 0));
+        pCommandList->SetComputeRootDescriptorTable(5, fnHandle(DescOffset::TileRenderDebugUAV, 0));
+    }
+    else
+    {
+        // The constant buffer view needs to be set even though we dont use it. The reason is that we specified it in the root signature.
+        pCommandList->SetComputeRootDescriptorTable(0, fnHandle(DescOffset::StaticConstantBuffer, 0));
+        pCommandList->SetComputeRootDescriptorTable(1, fnHandle(DescOffset::PerFrameConstantBuffer0, params.nConstantBuffer));
+        pCommandList->SetComputeRootDescriptorTable(2, fnHandle(DescOffset::DeadListUAV, 0));
+        pCommandList->SetComputeRootDescriptorTable(3, fnHandle(DescOffset::ParticlePositionSRV0, readDescriptorOffset));
+        pCommandList->SetComputeRootDescriptorTable(4, fnHandle(DescOffset::ParticlePositionUAV0, writeDescriptorOffset));
+        pCommandList->SetComputeRootDescriptorTable(5, fnHandle(DescOffset::AliveListInUAV0, params.nAliveList * aliveListDescriptorOffset));
+
+        // The emitter table goes with the constant buffer, OnUpdate filled both of them
+        pCommandList->SetComputeRootDescriptorTable(6, fnHandle(DescOffset::EmitterSRV0, params.nConstantBuffer * emitterDescriptorOffset));
+        pCommandList->SetComputeRootDescriptorTable(7, fnHandle(DescOffset::EmitterParticleCountsUAV, 0));
+        pCommandList->SetComputeRootDescriptorTable(8, fnHandle(DescOffset::HashCellCountsUAV, 0));
+    }
+}
 
-    m_commandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_POINTLIST);
-    m_commandList->RSSetScissorRects(1, &m_scissorRect);
+// Only the tile output gets cleared, m_tileClearHeap has its UAV again
+void DX12Particles::ClearUnorderedAccessView(ID3D12GraphicsCommandList* pCommandList, ParticleResource resource)
+{
+    const float clearColor[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    CD3DX12_GPU_DESCRIPTOR_HANDLE outputHandle(m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::TileRenderDebugUAV, m_cbvSrvDescriptorSize);
+    pCommandList->ClearUnorderedAccessViewFloat(outputHandle, m_tileClearHeap->GetCPUDescriptorHandleForHeapStart(), GetResource(resource), clearColor, 0, nullptr);
+}
 
-    m_commandList->DrawInstanced(ParticleBufferSize, 1, 0, 0);
+D3D12_CPU_DESCRIPTOR_HANDLE DX12Particles::GetRenderTargetView(ParticleResource resource)
+{
+    return CD3DX12_CPU_DESCRIPTOR_HANDLE(m_rtvHeap->GetCPUDescriptorHandleForHeapStart(), (int)resource - (int)ParticleResource::BackBuffers, m_rtvDescriptorSize);
 }
 
-void DX12Particles::RenderParticles(int readableBufferIndex)
+void DX12Particles::WaitForFence(bool waitOnCpu, bool bCompute)
 {
-    // Record all the commands we need to render the scene into the command list.
-    ThrowIfFailed(m_commandAllocator->Reset());
-    ThrowIfFailed(m_commandList->Reset(m_commandAllocator.Get(), m_pipelineState.Get()));
+    ParticleQueue queue = bCompute ? ParticleQueue::Compute : ParticleQueue::Graphics;
 
-#if 0
+    // Wait until the previous frame is finished.
+    const UINT64 fence = m_particleDevice->Signal(queue);
+    if (!m_particleDevice->IsFenceComplete(fence))
+    {
+        if (waitOnCpu)
+        {
+            m_particleDevice->WaitOnCpu(fence);
+        }
+        else
+        {
+            m_particleDevice->Wait(queue, fence);
+        }
+    }
+}
+
+// Render the scene.
+void DX12Particles::OnRender()
+{
+    const ParticleFrameConstants& frameConstants = *reinterpret_cast<const ParticleFrameConstants*>(m_constantBufferPerFrameData[m_frameIndex]);
     UINT queryCountPerFrame = (int)FramePerformanceStatistics::FramePerfomanceStatisticCount * 2;
-    UINT timeQueryIndex = queryCountPerFrame * m_frameIndex + (int)FramePerformanceStatistics::PrimitiveRenderTime * 2;
-    m_commandList->EndQuery(m_TimingQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, timeQueryIndex);
+    UINT buildQueryIndex = queryCountPerFrame * m_frameIndex + (int)FramePerformanceStatistics::HashBuildTime * 2;
+
+    // The simulation reads the current particle buffer and the render draws the other one. The constants,
+    // the emitter table, the back buffer and the readbacks are the slot's.
+    ParticleFrameDesc desc;
+    desc.nReadableBuffer = m_currentParticleBufferIndex;
+    desc.nWritableBuffer = (m_currentParticleBufferIndex + 1) % ParticleBufferCount;
+    desc.nBackBuffer = m_frameIndex;
+    desc.nConstantBuffer = m_frameIndex;
+    desc.nEmitCount = frameConstants.m_EmitCount;
+    desc.nParticleBufferSize = m_nParticleBufferSize;
+    desc.nWidth = m_width;
+    desc.nHeight = m_height;
+    desc.nTileSize = m_nTileSize;
+    desc.bCollisions = frameConstants.m_fCollisionStiffness > 0.0f;
+#ifdef TILED_STUFF_CAN_HAPPEN
+    desc.bBinTiles = m_RenderMode == RenderMode::TiledRasterization || m_RenderMode == RenderMode::Debug_TileOccupancy;
 #endif
-
-    // Indicate that the back buffer will be used as a render target.
-    m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_renderTargets[m_frameIndex].Get(), D3D12_RESOURCE_STATE_PRESENT, D3D12_RESOURCE_STATE_RENDER_TARGET));
-
-    CD3DX12_CPU_DESCRIPTOR_HANDLE rtvHandle(m_rtvHeap->GetCPUDescriptorHandleForHeapStart(), m_frameIndex, m_rtvDescriptorSize);
-    m_commandList->OMSetRenderTargets(1, &rtvHandle, FALSE, nullptr);
-
-    // Record commands.
-    const float clearColor[] = { 0.0f, 0.0f, 0.0f, 0.0f };
-    m_commandList->ClearRenderTargetView(rtvHandle, clearColor, 0, nullptr);
-
-    m_commandList->RSSetViewports(1, &m_viewport);
+#ifdef DEBUG_PARTICLE_DATA
+    desc.bReadBackDeadList = true;
+#endif
+    desc.bComputeFirst = m_computeFirst;
+    desc.nHashTimestampQuery = buildQueryIndex;
 
     switch (m_RenderMode)
     {
     case RenderMode::TiledRasterization:
-        {
-            RenderDebugTexture();
-        }
+        desc.drawMode = ParticleDrawMode::TileOutput;
         break;
     case RenderMode::DrawWithPrimitives:
-        {
-            DrawParticlesWithPrimitives(readableBufferIndex);
-        }
+        desc.drawMode = ParticleDrawMode::Primitives;
         break;
     default:
+        desc.drawMode = ParticleDrawMode::None;
         break;
     }
 
-#if 0
-    m_commandList->EndQuery(m_TimingQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, timeQueryIndex + 1);
-    UINT startQueryIndex = m_frameIndex * queryCountPerFrame;
-    m_commandList->ResolveQueryData(m_TimingQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, startQueryIndex, queryCountPerFrame, m_TimingQueryResult.Get(), startQueryIndex * sizeof(UINT64));
-#endif
-
-    m_commandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(m_renderTargets[m_frameIndex].Get(), D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT));
-    m_commandList->Close();
+    // Records, submits and presents without waiting for the GPU, the readbacks come in once the slot's next BeginFrame is through
+    m_framePipeline->SubmitFrame(desc);
+    m_frameDescs[m_frameIndex] = desc;
+    m_bFrameSubmitted[m_frameIndex] = true;
 
-    // Execute the command list.
-    ID3D12CommandList* ppCommandLists[] = { m_commandList.Get() };
-    m_commandQueue->ExecuteCommandLists(_countof(ppCommandLists), ppCommandLists);
+    m_currentParticleBufferIndex = desc.nWritableBuffer;
+    m_frameIndex = m_swapChain->GetCurrentBackBufferIndex();
 }
 
-void DX12Particles::RenderDebugTexture()
+void DX12Particles::ReadBackFrame()
 {
-    // Record all the commands we need to render the scene into the command list.
-    m_commandList->SetPipelineState(m_debugRenderPipelineState.Get());
-    m_commandList->SetGraphicsRootSignature(m_debugRenderRootSignature.Get());
-
-    ID3D12DescriptorHeap* ppHeaps[] = { m_cbvSrvHeap.Get() };
-    m_commandList->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
-
-    m_commandList->SetGraphicsRootDescriptorTable(0, CD3DX12_GPU_DESCRIPTOR_HANDLE(
-        m_cbvSrvHeap->GetGPUDescriptorHandleForHeapStart(), (int)DescOffset::TileRenderDebugSRV, m_cbvSrvDescriptorSize
-    ));
+    if (!m_bFrameSubmitted[m_frameIndex])
+    {
+        return;
+    }
+    const ParticleFrameDesc& desc = m_frameDescs[m_frameIndex];
 
-    m_commandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_POINTLIST);
-    m_commandList->RSSetScissorRects(1, &m_scissorRect);
+    m_particleDevice->ReadBuffer(ParticleResource::ParticleCountReadback, 0, sizeof(UINT), &m_nParticleCount);
 
-    m_commandList->RSSetViewports(1, &m_viewport);
-    m_commandList->DrawInstanced(1, 1, 0, 0);
-}
+    m_emitterParticleCounts.resize(MAX_EMITTER_COUNT);
+    m_particleDevice->ReadBuffer(ParticleResource::EmitterParticleCountsReadback, 0, sizeof(UINT) * MAX_EMITTER_COUNT, m_emitterParticleCounts.data());
 
-// Render the scene.
-void DX12Particles::OnRender()
-{
-    if (m_computeFirst)
+#ifdef TILED_STUFF_CAN_HAPPEN
+    if (desc.bBinTiles)
     {
-        // This one seems to be slightly faster
-        RunComputeShader(m_frameIndex, (m_frameIndex + 1) % FrameCount);
-        RenderParticles((m_frameIndex + 1) % FrameCount);
+        m_tileListCounters.resize(TILE_COUNTER_COUNT);
+        m_particleDevice->ReadBuffer(ParticleResource::TileListCountersReadback, 0, sizeof(UINT) * TILE_COUNTER_COUNT, m_tileListCounters.data());
+
+        // Picks the tile size of the next frames, OnUpdate switches to it. A tile size from the command line stays.
+        if (m_nFixedTileSize == 0)
+        {
+            TileOccupancy occupancy;
+            occupancy.nTileSize = desc.nTileSize;
+            occupancy.nTileCount = TILE_COUNT_FOR_SIZE(desc.nWidth, desc.nTileSize) * TILE_COUNT_FOR_SIZE(desc.nHeight, desc.nTileSize);
+            occupancy.nBinnedParticleCount = m_tileListCounters[TILE_COUNTER_BINNED_PARTICLES];
+            occupancy.nEntryCount = m_tileListCounters[TILE_COUNTER_LIST_ENTRIES] + m_tileListCounters[TILE_COUNTER_DROPPED_ENTRIES];
+            occupancy.nLargestTileCount = m_tileListCounters[TILE_COUNTER_LARGEST_TILE];
+            m_tileSizePolicy.Update(occupancy);
+        }
     }
-    else
+#endif
+
+    if (desc.bCollisions)
     {
-        RenderParticles((m_frameIndex + 1) % FrameCount);
-        RunComputeShader(m_frameIndex, (m_frameIndex + 1) % FrameCount);
+        // HashBuildTime and HashQueryTime are next to each other
+        UINT64 timestamps[4];
+        m_particleDevice->ReadBuffer(ParticleResource::TimestampReadback, desc.nHashTimestampQuery * sizeof(UINT64), sizeof(timestamps), timestamps);
+        m_fHashBuildTimeMs = (float)((double)(timestamps[1] - timestamps[0]) * 1000.0 / m_nComputeTimestampFreq);
+        m_fHashQueryTimeMs = (float)((double)(timestamps[3] - timestamps[2]) * 1000.0 / m_nComputeTimestampFreq);
     }
 
-    // Present and update the frame index for the next frame.
-    ThrowIfFailed(m_swapChain->Present(0, 0));
-    WaitForFence(true, false);
-    WaitForFence(true, true);
-
 #ifdef DEBUG_PARTICLE_DATA
-    DeadListBufferData* deadListBufferData;
-    CD3DX12_RANGE ReadRange(0, sizeof(DeadListBufferData));
-    ThrowIfFailed(m_deadListReadback->Map(0, &ReadRange, reinterpret_cast<void**>(&deadListBufferData)));
-    m_LastFrameDeadListBufferData = std::make_unique<DeadListBufferData>(*deadListBufferData);
-    m_deadListReadback->Unmap(0, nullptr);
+    m_LastFrameDeadListBufferData.resize(desc.nParticleBufferSize + 1);
+    m_particleDevice->ReadBuffer(ParticleResource::DeadListReadback, 0, sizeof(UINT) * (desc.nParticleBufferSize + 1), m_LastFrameDeadListBufferData.data());
 #endif
-
-    m_frameIndex = m_swapChain->GetCurrentBackBufferIndex();
-
 }
 
 void DX12Particles::OnDestroy()
 {
     // Ensure that the GPU is no longer referencing resources that are about to be
     // cleaned up by the destructor.
-    {
-        const UINT64 fence = m_fenceValue;
-        const UINT64 lastCompletedFence = m_fence->GetCompletedValue();
+    m_framePipeline->WaitForIdle();
+}
 
-        // Signal and increment the fence value.
-        ThrowIfFailed(m_commandQueue->Signal(m_fence.Get(), m_fenceValue));
-        m_fenceValue++;
+void DX12Particles::ParseCommandLineArgs(WCHAR* argv[], int argc)
+{
+    DXSample::ParseCommandLineArgs(argv, argc);
+
+    for (int i = 1; i < argc - 1; ++i)
+    {
+        UINT* pValue = nullptr;
+        if (_wcsicmp(argv[i], L"-particles") == 0 || _wcsicmp(argv[i], L"/particles") == 0)
+        {
+            pValue = &m_nParticleBufferSize;
+        }
+        else if (_wcsicmp(argv[i], L"-maxparticles") == 0 || _wcsicmp(argv[i], L"/maxparticles") == 0)
+        {
+            pValue = &m_nMaxParticleBufferSize;
+        }
+        else if (_wcsicmp(argv[i], L"-tilesize") == 0 || _wcsicmp(argv[i], L"/tilesize") == 0)
+        {
+            pValue = &m_nFixedTileSize;
+        }
 
-        // Wait until the previous frame is finished.
-        if (lastCompletedFence < fence)
+        if (pValue)
         {
-            ThrowIfFailed(m_fence->SetEventOnCompletion(fence, m_fenceEvent));
-            WaitForSingleObject(m_fenceEvent, INFINITE);
+            UINT nValue = (UINT)wcstoul(argv[++i], nullptr, 10);
+            if (nValue > 0)
+            {
+                *pValue = nValue;
+            }
         }
     }
+
+    if (m_nMaxParticleBufferSize < m_nParticleBufferSize)
+    {
+        m_nMaxParticleBufferSize = m_nParticleBufferSize;
+    }
+
+    // One of the sizes there are shaders for
+    if (m_nFixedTileSize != 0)
+    {
+        m_nFixedTileSize = ParticleTileSizePolicy::GetTileSizeFromIndex(ParticleTileSizePolicy::GetTileSizeIndex(m_nFixedTileSize));
+        m_nTileSize = m_nFixedTileSize;
+        m_tileSizePolicy.Reset(m_nTileSize);
+    }
 }
 
 void DX12Particles::OnKeyDown(UINT8 key)
@@ -1558,18 +2545,52 @@ void DX12Particles::OnKeyDown(UINT8 key)
     case 'C':
         m_computeFirst = !m_computeFirst;
         break;
-    case 'G':
-        m_waitForComputeOnGPU = !m_waitForComputeOnGPU;
-        break;
     case 'E':
         m_nEmitCountNextFrame = 1;
         break;
     case 'R':
-        m_nEmitCountNextFrame = ParticleBufferSize;
+        m_nEmitCountNextFrame = m_nParticleBufferSize;
         break;
     case 'P':
         m_bPaused = !m_bPaused;
         break;
+    case 'K':
+        m_bCollisions = !m_bCollisions;
+        break;
+    case 'N':
+    {
+        auto fnGetRandomFloatInRange = [&](float from, float to) -> float
+        {
+            return std::uniform_real_distribution<float>{ from, to }(m_randomNumberEngine);
+        };
+
+        EmitterCreateRequest request;
+        request.Params.m_Position = { fnGetRandomFloatInRange(-0.8f, 0.8f), fnGetRandomFloatInRange(-0.8f, 0.8f) };
+        request.Params.m_Color = { fnGetRandomFloatInRange(0.2f, 1.0f), fnGetRandomFloatInRange(0.2f, 1.0f), fnGetRandomFloatInRange(0.2f, 1.0f), 0.02f };
+        request.Params.m_fSpeed = fnGetRandomFloatInRange(0.2f, 0.5f);
+        request.Params.m_fLifetime = fnGetRandomFloatInRange(1.0f, 5.0f);
+        request.nCapacity = NewEmitterCapacity;
+        request.nEmitCount = NewEmitterCapacity;
+        m_emitterCreateRequests.push_back(request);
+        break;
+    }
+    case 'M':
+    {
+        // The last one in address order, the default emitter always stays
+        std::vector<UINT> emitters;
+        m_rangeAllocator.GetRangesInAddressOrder(emitters);
+        for (auto it = emitters.rbegin(); it != emitters.rend(); ++it)
+        {
+            if (*it != DefaultEmitter && m_emitters[*it].bAlive)
+            {
+                m_emitters[*it].bAlive = false;
+                m_emitters[*it].nPendingEmitCount = 0;
+                m_destroyedEmitters.push_back(*it);
+                break;
+            }
+        }
+        break;
+    }
     case 'D':
         m_RenderMode = (RenderMode)(((int)m_RenderMode + 1) % 2);
         break;
@@ -14,6 +14,11 @@
 #include "DXSample.h"
 #include "StepTimer.h"
 #include "SimpleCamera.h"
+#include "ParticleSimulationCPU.h"
+#include "ParticleRangeAllocator.h"
+#include "ParticleTileSizePolicy.h"
+#include "ParticleDeviceD3D12.h"
+#include "ParticleFrame.h"
 
 using namespace DirectX;
 
@@ -26,30 +31,45 @@ using namespace DirectX;
 // An example of this can be found in the class method: OnDestroy().
 using Microsoft::WRL::ComPtr;
 
-class DX12Particles : public DXSample
+// The frame itself is recorded by ParticleFrame.h, this owns the D3D12 objects behind it
+class DX12Particles : public DXSample, private ParticleD3D12Bindings
 {
 public:
 	DX12Particles(UINT width, UINT height, std::wstring name);
 	~DX12Particles();
 
-    static const UINT ParticleBufferSize = 50000;
-    static const int FrameCount = 2;
+    // Can be changed with -particles <count>. The pools grow on their own up to -maxparticles <count>.
+    static const UINT DefaultParticleBufferSize = 50000;
+    static const UINT DefaultMaxParticleBufferSize = 1 << 25;
+
+    // Frames in flight, every one has its back buffer, command allocators, constants and readbacks.
+    // The particles ping-pong between ParticleBufferCount sets of buffers however many there are.
+    static const int FrameCount = 3;
+    static const int ParticleBufferCount = 2;
 
 	virtual void OnInit();
 	virtual void OnUpdate();
-    void RunComputeShader(int readableBufferIndex, int writableBufferIndex);
     void WaitForFence(bool waitOnCpu, bool bCompute);
-    void DrawParticlesWithPrimitives(int readableBufferIndex);
-    void RenderParticles(int readableBufferIndex);
-    void RenderDebugTexture();
     virtual void OnRender();
 	virtual void OnDestroy();
 	virtual void OnKeyDown(UINT8 key);
 	virtual void OnKeyUp(UINT8 key);
+	virtual void ParseCommandLineArgs(_In_reads_(argc) WCHAR* argv[], int argc);
 
     void LoadPipeline();
     void LoadAssets();
 
+    // The counters the current slot's last frame copied back, its BeginFrame has waited for it
+    void ReadBackFrame();
+
+    // ParticleD3D12Bindings
+    virtual ID3D12Resource* GetResource(ParticleResource resource);
+    virtual ID3D12RootSignature* GetRootSignature(ParticlePass pass);
+    virtual ID3D12PipelineState* GetPipelineState(ParticlePass pass, const ParticlePassParams& params);
+    virtual void SetRootArguments(ID3D12GraphicsCommandList* pCommandList, ParticlePass pass, const ParticlePassParams& params);
+    virtual void ClearUnorderedAccessView(ID3D12GraphicsCommandList* pCommandList, ParticleResource resource);
+    virtual D3D12_CPU_DESCRIPTOR_HANDLE GetRenderTargetView(ParticleResource resource);
+
 	struct ParticleVertex
 	{
 		XMFLOAT4 color;
@@ -84,19 +104,47 @@ public:
         ParticleColorUAV1,
         PerFrameConstantBuffer0,
         PerFrameConstantBuffer1,
+        PerFrameConstantBuffer2,
         DeadListUAV,
         OffsetCounterUAV,
         OffsetPerTilesUAV,
         ParticleIndicesForTilesUAV,
         TileRenderDebugUAV,
         TileRenderDebugSRV,
+        AliveListInUAV0,
+        AliveListOutUAV0,
+        DrawArgsOutUAV0,
+        CompactionGroupOffsetsUAV0,
+        DispatchArgsUAV0,
+        AliveListInUAV1,
+        AliveListOutUAV1,
+        DrawArgsOutUAV1,
+        CompactionGroupOffsetsUAV1,
+        DispatchArgsUAV1,
+        EmitterSRV0,
+        RelocationSRV0,
+        EmitterSRV1,
+        RelocationSRV1,
+        EmitterSRV2,
+        RelocationSRV2,
+        EmitterParticleCountsUAV,
+        HashCellCountsUAV,
+        HashCellStartsUAV,
+        HashParticleCellsUAV,
+        HashSortedParticlesUAV,
+        CollisionImpulsesUAV,
+        TileParticleCountsUAV,
+        ParticleRasterSetupsUAV,
         Count
     };
 
-    struct DeadListBufferData
+    // The dead list and the alive lists are m_nParticleBufferSize + 1 UINTs: the particle count followed by the indices
+    struct ConstantBufferData
     {
-        UINT m_nParticleCount;
-        UINT m_availableIndices[ParticleBufferSize];
+        float m_AspectRatio;
+        UINT m_ParticleCount;
+        UINT m_ResolutionX;
+        UINT m_ResolutionY;
     };
 
 	// Pipeline objects.
@@ -110,7 +158,7 @@ public:
 	ComPtr<ID3D12DescriptorHeap> m_cbvSrvHeap;
 
 	//Rendering
-	ComPtr<ID3D12CommandAllocator> m_commandAllocator;
+	ComPtr<ID3D12CommandAllocator> m_commandAllocators[FrameCount];
 	ComPtr<ID3D12CommandQueue> m_commandQueue;
 	ComPtr<ID3D12RootSignature >m_rootSignature;	
     ComPtr<ID3D12PipelineState> m_pipelineState;
@@ -123,29 +171,58 @@ public:
         Generate,
         Move,
         Destroy,
+        PrepareUpdate,
+        CompactCount,
+        CompactScanGroups,
+        CompactScatter,
+        Relocate,
+        HashCount,
+        HashScan,
+        HashScatter,
+        Collide,
         Count
     };
 
 	ComPtr<ID3D12RootSignature >m_rootSignatureCompute;
-	ComPtr<ID3D12CommandAllocator> m_commandAllocatorCompute;
+	ComPtr<ID3D12CommandAllocator> m_commandAllocatorsCompute[FrameCount];
 	ComPtr<ID3D12CommandQueue> m_commandQueueCompute;
     ComPtr<ID3D12PipelineState> m_computePipelineStates[(int)ComputePass::Count] = {};
 	ComPtr<ID3D12GraphicsCommandList> m_commandListCompute;
 
     enum class TileComputePass
     {
-        ResetCounter,
-        GatherParticles,
+        TileCount,
+        TileScan,
+        TileScatter,
+        TileSort,
+        TileSortSpill,
+        ParticleRasterSetup,
         RasterizeParticles,
         Count
     };
 
+    // Every tile size has its own shaders, ParticleTileSizePolicy picks the size from the counters of the last frame.
+    // A size given on the command line stays.
+    UINT m_nTileSize = TILE_SIZE_IN_PIXELS;
+    UINT m_nFixedTileSize = 0;
+    ParticleTileSizePolicy m_tileSizePolicy;
+
+    void CreateTilePipelineStates(UINT nTileSize);
+    void SetTileSize(UINT nTileSize);
+
     ComPtr<ID3D12RootSignature> m_tileRootSignature;
-    ComPtr<ID3D12PipelineState> m_tilePipelineStates[(int)TileComputePass::Count];
-    ComPtr<ID3D12Resource> m_tileOffsets;
-    ComPtr<ID3D12Resource> m_ParticleIndicesForTiles;
+    ComPtr<ID3D12PipelineState> m_tilePipelineStates[TILE_SIZE_OPTION_COUNT][(int)TileComputePass::Count];
+    ComPtr<ID3D12Resource> m_tileOffsets;               // For the smallest tiles, the bigger ones use a corner of it
+    ComPtr<ID3D12Resource> m_ParticleIndicesForTiles;   // Transient, replaced with the tile size
+    ComPtr<ID3D12Resource> m_tileParticleCounts;        // For the smallest tiles
+    ComPtr<ID3D12Resource> m_particleRasterSetups;      // Plane equations of every particle's quad, by particle index. Transient.
+
+    // The TILE_COUNTER_* counters of the last binned frame, read back at the end of every frame
+    std::vector<UINT> m_tileListCounters;
+    ComPtr<ID3D12Resource> m_tileListCountersReadbacks[FrameCount];
 
     ComPtr<ID3D12Resource> m_TileDebugRenderTarget;
+    ComPtr<ID3D12DescriptorHeap> m_tileClearHeap;      // The UAV of the render target again, for clearing the empty tiles
 
     ComPtr<ID3D12RootSignature> m_debugRenderRootSignature;
     ComPtr<ID3D12PipelineState> m_debugRenderPipelineState;
@@ -167,17 +244,94 @@ public:
         std::array<ComPtr<ID3D12Resource>, (int)ParticleBufferTypes::Count> Buffers;
     };
 
-    ParticleBuffers m_particleBuffers[FrameCount];
+    ParticleBuffers m_particleBuffers[ParticleBufferCount];
     ComPtr<ID3D12Resource> m_deadListBuffer;
+
+    // One alive list per particle buffer (same layout as DeadListBufferData) and the draw arguments that go with it.
+    // The update and the draw only go through the live particles, see CSPrepareUpdate and the CSCompact passes.
+    ComPtr<ID3D12Resource> m_aliveListBuffers[ParticleBufferCount];
+    ComPtr<ID3D12Resource> m_drawArgsBuffers[ParticleBufferCount];
+    ComPtr<ID3D12Resource> m_compactionGroupOffsetsBuffer;     // Transient
+    ComPtr<ID3D12Resource> m_dispatchArgsBuffer;
+    ComPtr<ID3D12CommandSignature> m_dispatchCommandSignature;
+    ComPtr<ID3D12CommandSignature> m_drawCommandSignature;
 	ComPtr<ID3D12Resource> m_constantBufferGS;
     
     UINT CreateParticleBuffers(ParticleBuffers& UploadBuffers);
+    void CreateParticleBufferViews();
+    void CreateTransientResources();
+    void UploadStaticConstantBuffer(ID3D12Resource* pUploadBuffer);
+    void ApplyParticleArenaChanges(UINT nOldParticleBufferSize, const std::vector<ParticleRangeAllocator::Range>& oldRanges);
+
+    // Emitters, same idea as in ParticleSimulationCPU: every one owns a range of the particle buffers and its part of the dead list.
+    // Creating, growing and moving them needs copies on the GPU, so it's all done in OnUpdate while the GPU is idle.
+    struct Emitter
+    {
+        ParticleEmitterParams Params;
+        UINT nPendingEmitCount = 0;
+        bool bAlive = false;        // False once destroyed, the range stays allocated until its particles are gone
+    };
+
+    struct EmitterCreateRequest
+    {
+        ParticleEmitterParams Params;
+        UINT nCapacity;
+        UINT nEmitCount;
+    };
+
+    // Frees, creates and grows emitters, then fills this frame's emitter table
+    void UpdateEmitters(ParticleFrameConstants& constants);
+    bool ResizeEmitterRange(UINT nEmitter, UINT nNewSize);
+    bool GrowFreeSize(UINT nFreeSize);
+
+    // The default emitter starts out with the whole pool and gets the particles of the E and R keys.
+    // N adds an emitter with NewEmitterCapacity particles at a random place, M destroys the last one.
+    static const UINT DefaultEmitter = 0;
+    static const UINT NewEmitterCapacity = 20000;
+
+    ParticleRangeAllocator m_rangeAllocator;
+    std::vector<Emitter> m_emitters;                    // Indexed by the handle of the emitter's range
+    std::vector<UINT> m_emitterOrder;
+    std::vector<EmitterCreateRequest> m_emitterCreateRequests;
+    std::vector<UINT> m_destroyedEmitters;              // Left out of the next frame's table, that update kills their particles
+    std::vector<UINT> m_emittersToFree;                 // Their particles are gone, the ranges can be reused
+
+    std::vector<UINT> m_emitterParticleCounts;          // Read back from g_emitterParticleCounts, FrameCount - 1 frames late
+    ComPtr<ID3D12Resource> m_emitterParticleCountsBuffer;
+    ComPtr<ID3D12Resource> m_emitterParticleCountsReadbacks[FrameCount];
+
+    // The emitter table goes with the per frame constant buffer, the relocations are only used while the GPU is idle
+    ComPtr<ID3D12Resource> m_emitterBuffers[FrameCount];
+    ParticleEmitterData* m_emitterBufferData[FrameCount];
+    ComPtr<ID3D12Resource> m_relocationBuffer;
+    ParticleRelocationData* m_relocationBufferData;
+
+    // Spatial hash of the particle-particle collisions, rebuilt by the compute queue every frame. See CSHashCount.
+    // The cell buffers have a fixed size, the rest grows with the particle buffers. All but the counts are transient.
+    ComPtr<ID3D12Resource> m_hashCellCountsBuffer;
+    ComPtr<ID3D12Resource> m_hashCellStartsBuffer;
+    ComPtr<ID3D12Resource> m_hashParticleCellsBuffer;
+    ComPtr<ID3D12Resource> m_hashSortedParticlesBuffer;
+    ComPtr<ID3D12Resource> m_collisionImpulsesBuffer;
+    bool m_bCollisions = false;
+
+    // The buffers only a frame uses, placed where GetParticleTransientLayout says. The ones the frame never uses
+    // at the same time share memory.
+    ComPtr<ID3D12Heap> m_transientHeap;
+    ParticleTransientLayout m_transientLayout;
+
+    UINT m_nParticleBufferSize = DefaultParticleBufferSize;
+    UINT m_nMaxParticleBufferSize = DefaultMaxParticleBufferSize;
+
+    // Number of live particles at the end of the slot's last frame, read back from the dead list counter
+    UINT m_nParticleCount = 0;
+    ComPtr<ID3D12Resource> m_particleCountReadbacks[FrameCount];
 
     ComPtr<ID3D12Resource> m_constantBufferPerFrame[FrameCount];
     UINT* m_constantBufferPerFrameData[FrameCount];     //We constantly have the buffer mapped since it's in the upload heap.
 
 	D3D12_VERTEX_BUFFER_VIEW m_vertexBufferView;
-    UINT m_currentParticleBufferIndex = 0;
+    UINT m_currentParticleBufferIndex = 0;          // The readable one of the next frame
     UINT m_cbvSrvDescriptorSize;
 	UINT m_rtvDescriptorSize;
 
@@ -187,11 +341,14 @@ public:
 	UINT m_frameCounter;
 	HANDLE m_fenceEvent;
 	ComPtr<ID3D12Fence> m_fence;
-	UINT64 m_fenceValue;
+	UINT64 m_fenceValue;                // Only until LoadAssets is done, the device has its own fences
+    std::unique_ptr<ParticleDeviceD3D12> m_particleDevice;
+    std::unique_ptr<ParticleFramePipeline> m_framePipeline;
+    ParticleFrameDesc m_frameDescs[FrameCount];     // The last frame of every slot, ReadBackFrame goes by it
+    bool m_bFrameSubmitted[FrameCount] = {};
 
     // Setting variables
     bool m_computeFirst = false;
-    bool m_waitForComputeOnGPU = false;
 
     // Runtime variables
     enum class RenderMode
@@ -212,6 +369,8 @@ public:
         PrimitiveRenderTime,
         TileCollectionTime,
         TiledRasterizationTime,
+        HashBuildTime,
+        HashQueryTime,
         FramePerfomanceStatisticCount
     };
 
@@ -229,6 +388,8 @@ public:
     UINT64 m_nComputeTimestampFreq;
     ComPtr<ID3D12QueryHeap> m_TimingQueryHeap;
     ComPtr<ID3D12Resource> m_TimingQueryResult;
+    float m_fHashBuildTimeMs = 0.0f;    // GPU time of the last frame's spatial hash passes, read back in OnRender
+    float m_fHashQueryTimeMs = 0.0f;
 
     bool m_bPaused = false;
     RenderMode m_RenderMode = RenderMode::DrawWithPrimitives;
@@ -240,7 +401,7 @@ public:
 
     // Debug variables
 #ifdef DEBUG_PARTICLE_DATA
-    std::unique_ptr<DeadListBufferData> m_LastFrameDeadListBufferData;
-    ComPtr<ID3D12Resource> m_deadListReadback;
+    std::vector<UINT> m_LastFrameDeadListBufferData;
+    ComPtr<ID3D12Resource> m_deadListReadbacks[FrameCount];
 #endif
 };
@@ -34,7 +34,8 @@ public:
 	UINT GetHeight() const          { return m_height; }
 	const WCHAR* GetTitle() const   { return m_title.c_str(); }
 
-	void ParseCommandLineArgs(_In_reads_(argc) WCHAR* argv[], int argc);
+	// Samples override this to add their own arguments, the base version handles -warp.
+	virtual void ParseCommandLineArgs(_In_reads_(argc) WCHAR* argv[], int argc);
 
 protected:
 	std::wstring GetAssetFullPath(LPCWSTR assetName);
@@ -0,0 +1,8 @@
+#ifdef EMITTER_CONSTANTS_HEADER_GUARD
+#else
+#define EMITTER_CONSTANTS_HEADER_GUARD
+
+#define MAX_EMITTER_COUNT 1024      // Size of the emitter table, the counters and the relocation table
+#define INVALID_EMITTER 0xffffffff
+
+#endif
\ No newline at end of file
@@ -0,0 +1,24 @@
+#include "AliveListConstants.h"
+
+// Scan over a single group of COMPACTION_GROUP_SIZE threads, shared by the stream compaction, the spatial hash
+// and the tile binning passes.
+
+groupshared uint gs_aCompactionScan[COMPACTION_GROUP_SIZE];
+
+// Exclusive prefix sum over the group (Hillis-Steele). Every thread of the group has to call it.
+uint GroupExclusivePrefixSum(uint nValue, uint GI)
+{
+    gs_aCompactionScan[GI] = nValue;
+    GroupMemoryBarrierWithGroupSync();
+
+    [unroll]
+    for (uint nOffset = 1; nOffset < COMPACTION_GROUP_SIZE; nOffset <<= 1)
+    {
+        uint nAddend = GI >= nOffset ? gs_aCompactionScan[GI - nOffset] : 0;
+        GroupMemoryBarrierWithGroupSync();
+        gs_aCompactionScan[GI] += nAddend;
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    return gs_aCompactionScan[GI] - nValue;
+}
@@ -0,0 +1,124 @@
+// Stable LSD radix sort of up to RADIX_SORT_MAX_COUNT key/value pairs in group shared memory, the GPU side of
+// RadixSortKeyValues in ParticleRadixSort.h. RADIX_SORT_GROUP_SIZE and RADIX_SORT_MAX_COUNT have to be defined before the include.
+//
+// The digits are 4 bits. Every thread owns RADIX_SORT_PER_THREAD neighbouring entries and counts their digits into its own
+// column of the histogram. A scan over the histogram in digit major order gives every thread the place of its first entry
+// of every digit, and a thread writes its entries in order, so equal keys keep their order. That's about twenty group syncs
+// per digit no matter how many entries there are, where the bitonic network needs one per step of its log^2 steps.
+// The digits where all the keys agree are skipped, like on the CPU.
+
+#define RADIX_SORT_DIGIT_COUNT 16
+#define RADIX_SORT_PER_THREAD ((RADIX_SORT_MAX_COUNT + RADIX_SORT_GROUP_SIZE - 1) / RADIX_SORT_GROUP_SIZE)
+
+// Two halves, the passes go back and forth between them
+groupshared uint gs_aRadixKeys[2 * RADIX_SORT_MAX_COUNT];
+groupshared uint gs_aRadixValues[2 * RADIX_SORT_MAX_COUNT];
+
+groupshared uint gs_aRadixHistogram[RADIX_SORT_DIGIT_COUNT * RADIX_SORT_GROUP_SIZE];
+groupshared uint gs_aRadixScan[RADIX_SORT_GROUP_SIZE];
+groupshared uint gs_nRadixVaryingBits;
+
+// Order preserving map of floats to keys, same as FloatToSortKey on the CPU
+uint FloatToSortKey(float fValue)
+{
+    uint nBits = asuint(fValue);
+    return (nBits & 0x80000000) ? ~nBits : (nBits | 0x80000000);
+}
+
+// Same as GroupExclusivePrefixSum over the RADIX_SORT_GROUP_SIZE threads of the sort
+uint RadixExclusivePrefixSum(uint nValue, uint GI)
+{
+    gs_aRadixScan[GI] = nValue;
+    GroupMemoryBarrierWithGroupSync();
+
+    [unroll]
+    for (uint nOffset = 1; nOffset < RADIX_SORT_GROUP_SIZE; nOffset <<= 1)
+    {
+        uint nAddend = GI >= nOffset ? gs_aRadixScan[GI - nOffset] : 0;
+        GroupMemoryBarrierWithGroupSync();
+        gs_aRadixScan[GI] += nAddend;
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    return gs_aRadixScan[GI] - nValue;
+}
+
+// The pairs go into gs_aRadixKeys[0, nCount) and gs_aRadixValues[0, nCount), and the group has to be synced before the call.
+// Every thread of the group has to call it. Returns where the sorted pairs start in the arrays, 0 or RADIX_SORT_MAX_COUNT.
+uint GroupRadixSort(uint nCount, uint GI)
+{
+    if (GI == 0)
+    {
+        gs_nRadixVaryingBits = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    uint nFirstKey = gs_aRadixKeys[0];
+    uint nThreadVaryingBits = 0;
+    for (uint iKey = GI; iKey < nCount; iKey += RADIX_SORT_GROUP_SIZE)
+    {
+        nThreadVaryingBits |= gs_aRadixKeys[iKey] ^ nFirstKey;
+    }
+    InterlockedOr(gs_nRadixVaryingBits, nThreadVaryingBits);
+    GroupMemoryBarrierWithGroupSync();
+    uint nVaryingBits = gs_nRadixVaryingBits;
+
+    // The wait is required for the flow control
+    GroupMemoryBarrierWithGroupSync();
+
+    uint nFirst = min(GI * RADIX_SORT_PER_THREAD, nCount);
+    uint nLast = min(nFirst + RADIX_SORT_PER_THREAD, nCount);
+    uint nIn = 0;
+    for (uint nShift = 0; nShift < 32; nShift += 4)
+    {
+        // Every key has the same digit here, the pass wouldn't move anything
+        if (((nVaryingBits >> nShift) & (RADIX_SORT_DIGIT_COUNT - 1)) == 0)
+        {
+            continue;
+        }
+        uint nOut = RADIX_SORT_MAX_COUNT - nIn;
+
+        // Only the thread's own column, nobody else touches it until the scan
+        uint iDigit;
+        for (iDigit = 0; iDigit < RADIX_SORT_DIGIT_COUNT; iDigit++)
+        {
+            gs_aRadixHistogram[iDigit * RADIX_SORT_GROUP_SIZE + GI] = 0;
+        }
+        for (uint iCount = nFirst; iCount < nLast; iCount++)
+        {
+            gs_aRadixHistogram[((gs_aRadixKeys[nIn + iCount] >> nShift) & (RADIX_SORT_DIGIT_COUNT - 1)) * RADIX_SORT_GROUP_SIZE + GI]++;
+        }
+        GroupMemoryBarrierWithGroupSync();
+
+        // Every thread scans RADIX_SORT_DIGIT_COUNT neighbouring entries of the histogram, they're not its own column
+        uint nHistogramFirst = GI * RADIX_SORT_DIGIT_COUNT;
+        uint nSum = 0;
+        for (iDigit = 0; iDigit < RADIX_SORT_DIGIT_COUNT; iDigit++)
+        {
+            nSum += gs_aRadixHistogram[nHistogramFirst + iDigit];
+        }
+
+        uint nOffset = RadixExclusivePrefixSum(nSum, GI);
+        for (iDigit = 0; iDigit < RADIX_SORT_DIGIT_COUNT; iDigit++)
+        {
+            uint nDigitCount = gs_aRadixHistogram[nHistogramFirst + iDigit];
+            gs_aRadixHistogram[nHistogramFirst + iDigit] = nOffset;
+            nOffset += nDigitCount;
+        }
+        GroupMemoryBarrierWithGroupSync();
+
+        for (uint iScatter = nFirst; iScatter < nLast; iScatter++)
+        {
+            uint nKey = gs_aRadixKeys[nIn + iScatter];
+            uint nSlot = ((nKey >> nShift) & (RADIX_SORT_DIGIT_COUNT - 1)) * RADIX_SORT_GROUP_SIZE + GI;
+            uint nPlace = gs_aRadixHistogram[nSlot];
+            gs_aRadixHistogram[nSlot] = nPlace + 1;
+            gs_aRadixKeys[nOut + nPlace] = nKey;
+            gs_aRadixValues[nOut + nPlace] = gs_aRadixValues[nIn + iScatter];
+        }
+        GroupMemoryBarrierWithGroupSync();
+
+        nIn = nOut;
+    }
+    return nIn;
+}
@@ -0,0 +1,667 @@
+// Console entry point of the headless build, see CMakeLists.txt. Runs the validation checks of the CPU engine and
+// the recorded frame, and the benchmarks, without a GPU or any Windows header.
+//
+//   ParticleHeadless [validate|benchmark|all]
+//
+// validate only runs the checks on small problems and returns a non-zero exit code if any of them failed,
+// benchmark only prints the timings. Without an argument both run.
+
+#include "JobSystem.h"
+#include "ParticleDeadList.h"
+#include "ParticleDeviceCPU.h"
+#include "ParticleFluid.h"
+#include "ParticleFrame.h"
+#include "ParticleQuadtree.h"
+#include "ParticleRadixSort.h"
+#include "ParticleRangeAllocator.h"
+#include "ParticleSimulationCPU.h"
+#include "ParticleSpatialHash.h"
+#include "ParticleTileBinner.h"
+#include "ParticleTileRasterizer.h"
+#include "ParticleTileSizePolicy.h"
+#include "ParticleUpdateKernels.h"
+#include "SpatialHashConstants.h"
+#include "TileConstants.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+static uint32_t s_nFailureCount = 0;
+
+static void Check(bool bPassed, const char* pName)
+{
+    std::printf("%s %s\n", bPassed ? "  ok    " : "  FAILED", pName);
+    if (!bPassed)
+    {
+        s_nFailureCount++;
+    }
+}
+
+static void SimulateFrames(ParticleSimulationCPU& simulation, ParticleFrameConstants constants, uint32_t nFrameCount)
+{
+    for (uint32_t iFrame = 0; iFrame < nFrameCount; iFrame++)
+    {
+        constants.m_nRandomSeed = iFrame;
+        simulation.Simulate(constants);
+    }
+}
+
+// Every stream the update writes, bit for bit
+static bool SameParticles(const ParticleSimulationCPU& a, const ParticleSimulationCPU& b)
+{
+    const ParticleStreams& streamsA = a.GetStreams();
+    const ParticleStreams& streamsB = b.GetStreams();
+    const size_t nCount = streamsA.Size();
+    return a.GetParticleCount() == b.GetParticleCount() && streamsB.Size() == nCount &&
+        std::memcmp(streamsA.Positions.data(), streamsB.Positions.data(), nCount * sizeof(Float2)) == 0 &&
+        std::memcmp(streamsA.Velocities.data(), streamsB.Velocities.data(), nCount * sizeof(Float2)) == 0 &&
+        std::memcmp(streamsA.Rotations.data(), streamsB.Rotations.data(), nCount * sizeof(float)) == 0 &&
+        std::memcmp(streamsA.Lifetimes.data(), streamsB.Lifetimes.data(), nCount * sizeof(float)) == 0;
+}
+
+static void ValidateSimulation(JobSystem& jobSystem)
+{
+    std::printf("Simulation\n");
+
+    // Fills the pool halfway through and keeps emitting into the full one after that
+    const uint32_t nParticleBufferSize = 10000;
+    const uint32_t nFrameCount = 100;
+    ParticleFrameConstants constants;
+    constants.m_EmitCount = 200;
+    constants.m_fElapsedTime = 1.0f / 60.0f;
+
+    ParticleSimulationCPU reference(nParticleBufferSize);
+    reference.SetInstructionSet(SimdInstructionSet::Scalar);
+    bool bCountMatches = true;
+    bool bInside = true;
+    for (uint32_t iFrame = 0; iFrame < nFrameCount; iFrame++)
+    {
+        constants.m_nRandomSeed = iFrame;
+        reference.Simulate(constants);
+
+        // The dead slots have no lifetime left, the emitted particles live forever with a negative one
+        const ParticleStreams& streams = reference.GetStreams();
+        uint32_t nLiveSlotCount = 0;
+        for (uint32_t i = 0; i < streams.Size(); i++)
+        {
+            if (streams.Lifetimes[i] != 0.0f)
+            {
+                nLiveSlotCount++;
+                bInside &= std::fabs(streams.Positions[i].x) <= 1.0f && std::fabs(streams.Positions[i].y) <= 1.0f;
+            }
+        }
+        bCountMatches &= nLiveSlotCount == reference.GetParticleCount();
+    }
+
+    char name[96];
+    std::snprintf(name, sizeof(name), "%u frames, the particle count matches the live slots and the pool fills up", nFrameCount);
+    Check(bCountMatches && reference.GetParticleCount() == nParticleBufferSize, name);
+    Check(bInside, "The live particles stay inside the bounds");
+
+    for (uint32_t i = 1; i < (uint32_t)SimdInstructionSet::Count; i++)
+    {
+        SimdInstructionSet instructionSet = (SimdInstructionSet)i;
+        if (!IsInstructionSetSupported(instructionSet))
+        {
+            continue;
+        }
+
+        ParticleSimulationCPU simulation(nParticleBufferSize);
+        simulation.SetInstructionSet(instructionSet);
+        SimulateFrames(simulation, constants, nFrameCount);
+        std::snprintf(name, sizeof(name), "%s, same particles as scalar", GetInstructionSetName(instructionSet));
+        Check(SameParticles(simulation, reference), name);
+    }
+
+    ParticleSimulationCPU simulation(nParticleBufferSize);
+    simulation.SetInstructionSet(SimdInstructionSet::Scalar);
+    simulation.SetJobSystem(&jobSystem);
+    SimulateFrames(simulation, constants, nFrameCount);
+    std::snprintf(name, sizeof(name), "%u workers, same particles as a single thread", jobSystem.GetWorkerCount());
+    Check(SameParticles(simulation, reference), name);
+}
+
+static void ValidateDeadList()
+{
+    std::printf("Dead list\n");
+    for (uint32_t nThreadCount : { 1u, 4u, 16u })
+    {
+        // Few slots, so the threads run it dry all the time and the reserves and releases overlap on the same entries
+        DeadListBenchmarkResult result = BenchmarkDeadList(nThreadCount, 4096, 200);
+        char name[64];
+        std::snprintf(name, sizeof(name), "%u threads, no slot handed out twice or lost", nThreadCount);
+        Check(result.nDuplicateCount == 0 && result.nLostCount == 0, name);
+    }
+}
+
+static void ValidateAliveList(JobSystem& jobSystem)
+{
+    std::printf("Alive list\n");
+    for (uint32_t i = 0; i < (uint32_t)SimdInstructionSet::Count; i++)
+    {
+        SimdInstructionSet instructionSet = (SimdInstructionSet)i;
+        if (!IsInstructionSetSupported(instructionSet))
+        {
+            continue;
+        }
+
+        for (bool bPacked : { false, true })
+        {
+            AliveListBenchmarkResult result = BenchmarkAliveList(instructionSet, 100000, 0.1f, bPacked, 20, &jobSystem);
+            char name[96];
+            std::snprintf(name, sizeof(name), "%s, %s, same particles as the dense update", GetInstructionSetName(instructionSet), bPacked ? "packed" : "scattered");
+            Check(result.bMatchesDense, name);
+        }
+    }
+}
+
+static void ValidatePoolGrowth(JobSystem& jobSystem)
+{
+    std::printf("Pool growth\n");
+    PoolGrowthValidationResult result = ValidatePoolGrowth(1000, 500, 100, &jobSystem);
+    char name[128];
+    std::snprintf(name, sizeof(name), "%u to %u slots in %u steps, same live particles as a pool that started big enough",
+        result.nInitialSize, result.nFinalSize, result.nGrowCount);
+    Check(result.bPassed, name);
+}
+
+static void ValidateEmitters(JobSystem& jobSystem)
+{
+    std::printf("Emitters\n");
+    RangeAllocatorBenchmarkResult allocator = BenchmarkRangeAllocator(1 << 16, 100, 20000);
+    Check(allocator.bConsistent, "Range allocator keeps the pool tiled through frees, allocates, resizes and a defragment");
+
+    EmitterChurnValidationResult result = ValidateEmitterChurn(200, &jobSystem);
+    char name[160];
+    std::snprintf(name, sizeof(name), "%u created, %u destroyed, %u defragments, pool at %u slots: emitter counts match the alive list",
+        result.nCreatedCount, result.nDestroyedCount, result.nDefragmentCount, result.nFinalParticleBufferSize);
+    Check(result.nInvariantFailureCount == 0 && result.nCreatedCount > 0 && result.nDestroyedCount > 0, name);
+    Check(result.nDamagedStepCount == 0, "Creating, destroying, defragmenting and growing keep the other live particles as they were");
+}
+
+static void ValidateSpatialHash(JobSystem& jobSystem)
+{
+    std::printf("Spatial hash\n");
+
+    // Below half a cell, the default scale, and big enough that the query reaches far past the 3x3 cells
+    for (float fScale : { 0.0005f, 0.01f, 0.05f })
+    {
+        SpatialHashValidationResult result = ValidateSpatialHash(4000, fScale, &jobSystem);
+        char name[128];
+        std::snprintf(name, sizeof(name), "scale %.4f, reach %u cells, same %llu pairs and velocities as every pair of particles",
+            fScale, result.nQueryReach, (unsigned long long)result.nBruteForcePairCount);
+        Check(result.bPassed, name);
+    }
+}
+
+static void ValidateQuadtree(JobSystem& jobSystem)
+{
+    std::printf("Quadtree gravity\n");
+
+    // Theta 0 opens every node, so only the float rounding is left against the double precision sum over every pair
+    QuadtreeBenchmarkResult result = BenchmarkQuadtreeGravity(4000, 1, 0.0f, 4000, &jobSystem);
+    char name[96];
+    std::snprintf(name, sizeof(name), "theta 0, same as the direct sum (error %.2e)", result.fRelativeError);
+    Check(result.fRelativeError < 1e-4, name);
+}
+
+static void ValidateFluid()
+{
+    std::printf("Fluid\n");
+
+    // Its own workers, so the chunks get split up even on a machine with a single hardware thread
+    JobSystem jobSystem(4);
+    FluidValidationResult result = ValidateFluid(10000, 200, &jobSystem);
+    char name[128];
+    std::snprintf(name, sizeof(name), "%u particles, %u steps, no NaN and inside the box (%u NaN, %u outside)",
+        result.nParticleCount, result.nStepCount, result.nNonFiniteCount, result.nOutsideCount);
+    Check(result.nNonFiniteCount == 0 && result.nOutsideCount == 0, name);
+    std::snprintf(name, sizeof(name), "%u workers, same as a single thread", jobSystem.GetWorkerCount());
+    Check(result.bMatchesSingleThread, name);
+}
+
+static void ValidateTileSort()
+{
+    std::printf("Tile sort\n");
+    for (uint32_t i = 0; i < (uint32_t)SimdInstructionSet::Count; i++)
+    {
+        SimdInstructionSet instructionSet = (SimdInstructionSet)i;
+        if (!IsInstructionSetSupported(instructionSet))
+        {
+            continue;
+        }
+
+        static const char* keyNames[] = { "particle index", "depth", "spawn time" };
+        for (uint32_t iKey = 0; iKey < (uint32_t)TileSortKey::Count; iKey++)
+        {
+            TileSortBenchmarkResult result = BenchmarkTileSort(instructionSet, (TileSortKey)iKey, 1000, 16);
+            char name[96];
+            std::snprintf(name, sizeof(name), "%s, %s keys, same as std::stable_sort", GetInstructionSetName(instructionSet), keyNames[iKey]);
+            Check(result.bMatchesStableSort && result.bBitonicMatchesKeys, name);
+        }
+    }
+}
+
+static void ValidateTileBinning(JobSystem& jobSystem)
+{
+    std::printf("Tile binning\n");
+
+    // Enough particles that every scene but the uniform one goes over MAX_PARTICLE_PER_TILE somewhere,
+    // and the screen covering one past TILE_LIST_CAPACITY
+    static const char* sceneNames[] = { "uniform", "big particles", "dense cluster", "single tile", "screen covering" };
+    static const uint32_t particleCounts[] = { 20000, 50000, 20000, 5000, 2000 };
+    for (uint32_t i = 0; i < (uint32_t)TileBinningScene::Count; i++)
+    {
+        TileBinningScene scene = (TileBinningScene)i;
+        TileBinningValidationResult result = ValidateTileBinning(scene, particleCounts[i], 640, 360, &jobSystem);
+        char name[96];
+        std::snprintf(name, sizeof(name), "%s, same lists and overflow as the brute force binner", sceneNames[i]);
+        Check(result.bPassed, name);
+        if (scene != TileBinningScene::Uniform)
+        {
+            std::snprintf(name, sizeof(name), "%s, spills (%u tiles, %u dropped entries)", sceneNames[i], result.overflow.nSpilledTileCount, result.overflow.nDroppedEntryCount);
+            Check(result.overflow.nSpilledTileCount > 0, name);
+        }
+    }
+}
+
+static void ValidateTileRasterization(JobSystem& jobSystem)
+{
+    std::printf("Tile rasterization\n");
+    for (uint32_t i = 0; i < (uint32_t)SimdInstructionSet::Count; i++)
+    {
+        SimdInstructionSet instructionSet = (SimdInstructionSet)i;
+        if (!IsInstructionSetSupported(instructionSet))
+        {
+            continue;
+        }
+
+        TileRasterBenchmarkResult result = BenchmarkTileRasterization(instructionSet, 20000, 2, 640, 360, 0.3f, &jobSystem, nullptr);
+        char name[64];
+        std::snprintf(name, sizeof(name), "%s, same image as the scalar rasterizer", GetInstructionSetName(instructionSet));
+        Check(result.bMatchesScalar, name);
+    }
+
+    TileSizeBenchmarkResult tileSizes = BenchmarkTileSizes(TileBinningScene::Uniform, GetBestSupportedInstructionSet(), 20000, 4, 640, 360, 0.3f, &jobSystem);
+    Check(tileSizes.bImagesMatch, "Same image with every tile size");
+
+    ParticleReorderBenchmarkResult reorder = BenchmarkParticleReorder(GetBestSupportedInstructionSet(), 20000, 4, 2, 640, 360, 0.3f, &jobSystem);
+    Check(reorder.bSameParticles, "Same particles and tile lists with and without the reorder");
+}
+
+static ParticleFrameDesc GetValidationFrameDesc()
+{
+    ParticleFrameDesc desc;
+    desc.nParticleBufferSize = 10000;
+    desc.nEmitCount = 100;
+    desc.nWidth = 640;
+    desc.nHeight = 360;
+    desc.nTileSize = 32;
+    return desc;
+}
+
+// The CPU takes 500 us for a frame and the GPU 50 us for every pass, more than the CPU with the tiles binned
+static ParticlePipelineBenchmarkDesc GetValidationPipelineDesc(uint32_t nFrameLatency)
+{
+    ParticlePipelineBenchmarkDesc desc;
+    desc.frame = GetValidationFrameDesc();
+    desc.frame.bCollisions = true;
+    desc.frame.bBinTiles = true;
+    desc.nFrameLatency = nFrameLatency;
+    desc.nFrameCount = 30;
+    desc.fCpuMicroseconds = 500.0;
+    for (double& fPassMicroseconds : desc.fPassMicroseconds)
+    {
+        fPassMicroseconds = 50.0;
+    }
+    return desc;
+}
+
+// The frame recorded on ParticleDeviceRecording has to follow its own states and barriers in every configuration
+static void ValidateParticleFrame()
+{
+    std::printf("Particle frame\n");
+    static const char* drawModeNames[] = { "no draw", "primitives", "tile output" };
+    for (uint32_t iDrawMode = 0; iDrawMode < 3; iDrawMode++)
+    {
+        for (uint32_t iConfig = 0; iConfig < 8; iConfig++)
+        {
+            ParticleFrameDesc desc = GetValidationFrameDesc();
+            desc.drawMode = (ParticleDrawMode)iDrawMode;
+            desc.bCollisions = (iConfig & 1) != 0;
+            desc.bBinTiles = (iConfig & 2) != 0;
+            desc.bComputeFirst = (iConfig & 4) != 0;
+            desc.bReadBackDeadList = iConfig == 7;
+            if (!desc.bBinTiles && desc.drawMode != ParticleDrawMode::Primitives)
+            {
+                // Both draw the tiles or nothing
+                continue;
+            }
+
+            ParticleFrameBenchmarkResult result = BenchmarkParticleFrame(desc, 10);
+            char name[128];
+            std::snprintf(name, sizeof(name), "%s%s%s%s%s, no state mismatches, barrier errors or alias conflicts", drawModeNames[iDrawMode],
+                desc.bCollisions ? ", collisions" : "", desc.bBinTiles ? ", tiles" : "", desc.bComputeFirst ? ", compute first" : "",
+                desc.bReadBackDeadList ? ", dead list readback" : "");
+            Check(result.nStateMismatchCount == 0 && result.bStatesConsistent && result.nBarrierErrorCount == 0 && result.nAliasConflictCount == 0, name);
+        }
+    }
+
+    std::printf("Particle pipeline\n");
+    uint32_t nSingleFrameWaitCount = 0;
+    for (uint32_t nFrameLatency = 1; nFrameLatency <= ParticleMaxFrameLatency; nFrameLatency++)
+    {
+        ParticlePipelineBenchmarkResult result = BenchmarkParticlePipeline(GetValidationPipelineDesc(nFrameLatency));
+        char name[128];
+        std::snprintf(name, sizeof(name), "%u frames in flight, no order violations, frame slot hazards or state mismatches", nFrameLatency);
+        Check(result.nOrderViolationCount == 0 && result.nFrameSlotHazardCount == 0 && result.nStateMismatchCount == 0, name);
+
+        // A single frame in flight waits for the GPU every frame and never works next to it
+        if (nFrameLatency == 1)
+        {
+            nSingleFrameWaitCount = result.nCpuWaitCount;
+        }
+        else
+        {
+            std::snprintf(name, sizeof(name), "%u frames in flight, the CPU works next to the GPU and waits less than with one", nFrameLatency);
+            Check(result.fCpuGpuOverlapFraction > 0.0 && result.nCpuWaitCount < nSingleFrameWaitCount, name);
+            std::snprintf(name, sizeof(name), "%u frames in flight, part of the simulation runs next to the render", nFrameLatency);
+            Check(result.fHiddenSimulationFraction > 0.0, name);
+        }
+    }
+}
+
+// The frame run on ParticleDeviceCPU has to give the same particles and tile lists as the CPU engine on its own
+static void ValidateParticleDeviceCPU(JobSystem& jobSystem)
+{
+    std::printf("CPU backend\n");
+    static const char* drawModeNames[] = { "no draw", "primitives", "tile output" };
+    for (uint32_t iDrawMode = 0; iDrawMode < 3; iDrawMode++)
+    {
+        ParticleFrameDesc desc = GetValidationFrameDesc();
+        desc.drawMode = (ParticleDrawMode)iDrawMode;
+        desc.bCollisions = true;
+        desc.bBinTiles = true;
+
+        ParticleSimulationCPU simulation(desc.nParticleBufferSize);
+        ParticleTileBinner binner(desc.nWidth, desc.nHeight, desc.nTileSize);
+        ParticleTileRasterizer rasterizer;
+        ParticleDeviceCPU device(simulation, &binner, &rasterizer, &jobSystem);
+        ParticleResourceTracker tracker;
+
+        ParticleSimulationCPU referenceSimulation(desc.nParticleBufferSize);
+        ParticleTileBinner referenceBinner(desc.nWidth, desc.nHeight, desc.nTileSize);
+
+        ParticleFrameConstants constants;
+        constants.m_EmitCount = desc.nEmitCount;
+        constants.m_fElapsedTime = 1.0f / 60.0f;
+        constants.m_fCollisionStiffness = HASH_COLLISION_STIFFNESS;
+        for (uint32_t iFrame = 0; iFrame < 20; iFrame++)
+        {
+            constants.m_nRandomSeed = iFrame;
+            device.SetFrameConstants(constants);
+            RunParticleFrame(device, tracker, desc);
+            std::swap(desc.nReadableBuffer, desc.nWritableBuffer);
+
+            referenceSimulation.Simulate(constants);
+        }
+
+        const ParticleStreams& streams = referenceSimulation.GetStreams();
+        referenceBinner.Bin(streams.Positions.data(), streams.Scales.data(), streams.Rotations.data(),
+            referenceSimulation.GetAliveIndices(), referenceSimulation.GetAliveCount(), &jobSystem);
+
+        uint32_t nParticleCount = 0;
+        uint32_t counters[TILE_COUNTER_COUNT] = {};
+        device.ReadBuffer(ParticleResource::ParticleCountReadback, 0, sizeof(nParticleCount), &nParticleCount);
+        device.ReadBuffer(ParticleResource::TileListCountersReadback, 0, sizeof(counters), counters);
+
+        const size_t nFloat2Bytes = desc.nParticleBufferSize * sizeof(Float2);
+        bool bSameParticles = nParticleCount == referenceSimulation.GetParticleCount() &&
+            std::memcmp(simulation.GetStreams().Positions.data(), streams.Positions.data(), nFloat2Bytes) == 0 &&
+            std::memcmp(simulation.GetStreams().Velocities.data(), streams.Velocities.data(), nFloat2Bytes) == 0;
+        bool bSameTiles = counters[TILE_COUNTER_LIST_ENTRIES] == referenceBinner.GetOverlapCount() &&
+            counters[TILE_COUNTER_OCCUPIED_TILES] == referenceBinner.GetOccupiedTileCount();
+
+        char name[128];
+        std::snprintf(name, sizeof(name), "%s, same particles and tile lists as ParticleSimulationCPU::Simulate", drawModeNames[iDrawMode]);
+        Check(bSameParticles && bSameTiles, name);
+    }
+}
+
+static void BenchmarkSimulation(JobSystem& jobSystem)
+{
+    const uint32_t nParticleCount = 1 << 20;
+    const uint32_t nFrameCount = 60;
+
+    std::printf("Simulation, %u particles, %u frames\n", nParticleCount, nFrameCount);
+    for (uint32_t i = 0; i < (uint32_t)SimdInstructionSet::Count; i++)
+    {
+        SimdInstructionSet instructionSet = (SimdInstructionSet)i;
+        if (!IsInstructionSetSupported(instructionSet))
+        {
+            continue;
+        }
+
+        for (JobSystem* pJobSystem : { (JobSystem*)nullptr, &jobSystem })
+        {
+            ParticleSimulationCPU simulation(nParticleCount);
+            simulation.SetInstructionSet(instructionSet);
+            simulation.SetJobSystem(pJobSystem);
+            simulation.SpawnGrid(1);
+
+            ParticleFrameConstants constants;
+            constants.m_fElapsedTime = 1.0f / 60.0f;
+            constants.m_EmitCount = 1000;
+
+            if (pJobSystem)
+            {
+                pJobSystem->ResetStatistics();
+            }
+            auto start = std::chrono::steady_clock::now();
+            SimulateFrames(simulation, constants, nFrameCount);
+            double fMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nFrameCount;
+            std::printf("  %-8s %2u workers  %8.3f ms/frame  %8.1f Mparticles/s\n", GetInstructionSetName(instructionSet),
+                pJobSystem ? pJobSystem->GetWorkerCount() : 1, fMilliseconds, nParticleCount / fMilliseconds / 1000.0);
+            if (pJobSystem)
+            {
+                // Low ones mean the chunks are too coarse or the serial parts of the frame dominate
+                std::printf("           busy");
+                for (uint32_t iWorker = 0; iWorker < pJobSystem->GetWorkerCount(); iWorker++)
+                {
+                    std::printf(" %5.1f%%", pJobSystem->GetWorkerUtilization(iWorker) * 100.0f);
+                }
+                std::printf("\n");
+            }
+        }
+    }
+}
+
+static void RunBenchmarks(JobSystem& jobSystem)
+{
+    BenchmarkSimulation(jobSystem);
+
+    std::printf("Alive list, 1M slots, us per frame, dense / alive list\n");
+    for (bool bPacked : { false, true })
+    {
+        std::printf("  %-9s", bPacked ? "packed" : "scattered");
+        for (float fOccupancy : { 0.01f, 0.05f, 0.1f, 0.5f, 1.0f })
+        {
+            AliveListBenchmarkResult result = BenchmarkAliveList(GetBestSupportedInstructionSet(), 1 << 20, fOccupancy, bPacked, 100, &jobSystem);
+            std::printf("  %3.0f%% %6.0f / %6.0f", fOccupancy * 100.0f, result.fDenseMicroseconds, result.fAliveListMicroseconds);
+        }
+        std::printf("\n");
+    }
+
+    std::printf("Dead list, 1M slots\n");
+    for (uint32_t nThreadCount = 1; nThreadCount <= 64; nThreadCount *= 2)
+    {
+        DeadListBenchmarkResult result = BenchmarkDeadList(nThreadCount, 1 << 20, 200);
+        std::printf("  %2u threads  %8.1f Mslots/s\n", nThreadCount, result.fMillionSlotsPerSecond);
+    }
+
+    std::printf("Range allocator, 16M slots, 1000 ranges, 1M frees, allocates and resizes\n");
+    {
+        RangeAllocatorBenchmarkResult result = BenchmarkRangeAllocator(1 << 24, 1000, 1000000);
+        std::printf("  %8.2f Mops/s  %u free ranges  defragment %8.1f us  %u failed\n", result.fMillionOperationsPerSecond,
+            result.nFreeRangeCount, result.fDefragmentMicroseconds, result.nFailedCount);
+    }
+
+    std::printf("Spatial hash\n");
+    for (uint32_t nParticleCount : { 100000u, 1000000u })
+    {
+        SpatialHashBenchmarkResult result = BenchmarkSpatialHash(nParticleCount, 10, &jobSystem);
+        std::printf("  %8u particles  build %8.3f ms  query %8.3f ms  %llu pairs\n", nParticleCount,
+            result.fBuildMilliseconds, result.fQueryMilliseconds, (unsigned long long)result.nPairCount);
+    }
+
+    std::printf("Quadtree gravity, theta 0.5\n");
+    for (uint32_t nParticleCount : { 100000u, 1000000u })
+    {
+        QuadtreeBenchmarkResult result = BenchmarkQuadtreeGravity(nParticleCount, 3, 0.5f, 256, &jobSystem);
+        std::printf("  %8u particles  build %8.3f ms  traversal %8.3f ms  error %.5f\n", nParticleCount,
+            result.fBuildMilliseconds, result.fTraversalMilliseconds, result.fRelativeError);
+    }
+
+    // Small enough that theta 0, every pair, still finishes
+    std::printf("Quadtree gravity, 20000 particles, accuracy against theta\n");
+    for (float fTheta : { 0.0f, 0.3f, 0.5f, 0.8f, 1.0f })
+    {
+        QuadtreeBenchmarkResult result = BenchmarkQuadtreeGravity(20000, 1, fTheta, 1000, &jobSystem);
+        std::printf("  theta %.1f  traversal %10.3f ms  error %.6f\n", fTheta, result.fTraversalMilliseconds, result.fRelativeError);
+    }
+
+    std::printf("Fluid\n");
+    for (uint32_t nParticleCount : { 100000u, 1000000u })
+    {
+        FluidBenchmarkResult result = BenchmarkFluid(nParticleCount, 20, &jobSystem);
+        std::printf("  %8u particles  %8.3f ms/step  %8.1f Mparticle steps/s\n", nParticleCount,
+            result.fStepMilliseconds, result.fParticlesPerSecond / 1000000.0);
+    }
+
+    std::printf("Tile binning, 100000 particles, 1280x720\n");
+    static const char* sceneNames[] = { "uniform", "big particles", "dense cluster", "single tile", "screen covering" };
+    for (uint32_t i = 0; i < (uint32_t)TileBinningScene::Count; i++)
+    {
+        TileBinningBenchmarkResult result = BenchmarkTileBinning((TileBinningScene)i, 100000, 5, 1280, 720, &jobSystem);
+        std::printf("  %-16s flat %8.3f ms  hierarchical %8.3f ms  %6.2f overlaps/particle\n", sceneNames[i],
+            result.fBinMilliseconds, result.fHierarchicalBinMilliseconds, result.fOverlapsPerParticle);
+    }
+
+    // From a sparse tile to four times MAX_PARTICLE_PER_TILE, about 256K elements over the lists of each size
+    std::printf("Tile sort, depth keys, us per list\n");
+    for (uint32_t nElementCount : { 16u, 64u, 256u, 1024u, 4096u })
+    {
+        TileSortBenchmarkResult result = BenchmarkTileSort(GetBestSupportedInstructionSet(), TileSortKey::Depth, nElementCount, (1 << 18) / nElementCount);
+        std::printf("  %4u elements  radix %8.3f  bitonic %8.3f  std::stable_sort %8.3f\n", nElementCount,
+            result.fRadixSortMicroseconds, result.fBitonicSortMicroseconds, result.fStableSortMicroseconds);
+    }
+
+    std::printf("Tile rasterization, 1280x720\n");
+    {
+        TileRasterBenchmarkResult result = BenchmarkTileRasterization(GetBestSupportedInstructionSet(), 200000, 10, 1280, 720, 0.3f, &jobSystem, nullptr);
+        std::printf("  bin %8.3f ms  setup %8.3f ms  shade %8.3f ms\n", result.fBinMilliseconds, result.fSetupMilliseconds, result.fShadeMilliseconds);
+        std::printf("  set up per tile instead, shade %8.3f ms\n", result.fPerTileShadeMilliseconds);
+        std::printf("  without the early out, shade %8.3f ms  %5.1f%% of the pixels saturated  %5.1f%% of the listed quads skipped\n",
+            result.fNoEarlyOutShadeMilliseconds, result.fSaturatedPixelRate * 100.0, result.fSkippedQuadRate * 100.0);
+    }
+
+    // 12 frames give the policy time to switch, it has to see SwitchFrameCount frames first
+    std::printf("Tile sizes, 20000 particles, 640x360, ms per frame\n");
+    for (uint32_t i = 0; i < (uint32_t)TileBinningScene::Count; i++)
+    {
+        TileSizeBenchmarkResult result = BenchmarkTileSizes((TileBinningScene)i, GetBestSupportedInstructionSet(), 20000, 12, 640, 360, 0.3f, &jobSystem);
+        std::printf("  %-16s", sceneNames[i]);
+        for (uint32_t iSize = 0; iSize < TILE_SIZE_OPTION_COUNT; iSize++)
+        {
+            std::printf("  %2u %9.3f", ParticleTileSizePolicy::GetTileSizeFromIndex(iSize), result.fFixedMilliseconds[iSize]);
+        }
+        std::printf("  adaptive %9.3f  fastest %2u  chosen %2u  final %2u\n", result.fAdaptiveMilliseconds,
+            result.nFastestTileSize, result.nChosenTileSize, result.nFinalTileSize);
+    }
+
+    // With a high alpha the reorder loses early outs, with a low one it only saves
+    std::printf("Particle reorder, 100000 particles, every 4 frames, 1280x720\n");
+    for (float fAlpha : { 0.3f, 0.9f })
+    {
+        ParticleReorderBenchmarkResult result = BenchmarkParticleReorder(GetBestSupportedInstructionSet(), 100000, 10, 4, 1280, 720, fAlpha, &jobSystem);
+        std::printf("  alpha %.1f  bin %8.3f -> %8.3f ms  raster %8.3f -> %8.3f ms  skipped %5.1f%% -> %5.1f%%  reorder %8.3f ms\n", fAlpha,
+            result.fBinMilliseconds, result.fReorderedBinMilliseconds, result.fRasterMilliseconds, result.fReorderedRasterMilliseconds,
+            result.fSkippedQuadRate * 100.0, result.fReorderedSkippedQuadRate * 100.0, result.fReorderMilliseconds);
+    }
+
+    std::printf("Particle pipeline, modeled, 500 us of CPU and 50 us per pass\n");
+    for (uint32_t nFrameLatency = 1; nFrameLatency <= ParticleMaxFrameLatency; nFrameLatency++)
+    {
+        ParticlePipelineBenchmarkResult result = BenchmarkParticlePipeline(GetValidationPipelineDesc(nFrameLatency));
+        std::printf("  %u in flight  frame %8.1f us  CPU waits %2u/%u for %8.1f us  GPU busy %5.1f%%  queues overlap %5.1f%%  CPU next to GPU %5.1f%%\n",
+            nFrameLatency, result.fFrameMicroseconds, result.nCpuWaitCount, result.nFrameCount, result.fCpuWaitMicroseconds,
+            result.fGpuBusyFraction * 100.0, result.fQueueOverlapFraction * 100.0, result.fCpuGpuOverlapFraction * 100.0);
+        std::printf("               simulation %8.1f us, %8.1f us of it hidden behind the render\n",
+            result.fSimulationMicroseconds, result.fHiddenSimulationMicroseconds);
+    }
+
+    std::printf("Particle frame, recorded\n");
+    {
+        ParticleFrameDesc desc;
+        desc.nParticleBufferSize = 1 << 20;
+        desc.nEmitCount = 1000;
+        desc.nWidth = 1280;
+        desc.nHeight = 720;
+        desc.nTileSize = 32;
+        desc.bCollisions = true;
+        desc.bBinTiles = true;
+        ParticleFrameBenchmarkResult result = BenchmarkParticleFrame(desc, 100);
+        std::printf("  %u commands  %u barrier calls  %8.3f us to record\n", result.nCommandCount, result.nBarrierCallCount, result.fRecordMicroseconds);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bool bValidate = true;
+    bool bBenchmark = true;
+    if (argc > 1)
+    {
+        bValidate = std::strcmp(argv[1], "validate") == 0 || std::strcmp(argv[1], "all") == 0;
+        bBenchmark = std::strcmp(argv[1], "benchmark") == 0 || std::strcmp(argv[1], "all") == 0;
+        if (!bValidate && !bBenchmark)
+        {
+            std::printf("Usage: %s [validate|benchmark|all]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    JobSystem jobSystem;
+    std::printf("%u workers, best instruction set %s\n", jobSystem.GetWorkerCount(), GetInstructionSetName(GetBestSupportedInstructionSet()));
+
+    if (bValidate)
+    {
+        ValidateSimulation(jobSystem);
+        ValidateDeadList();
+        ValidateAliveList(jobSystem);
+        ValidatePoolGrowth(jobSystem);
+        ValidateEmitters(jobSystem);
+        ValidateSpatialHash(jobSystem);
+        ValidateQuadtree(jobSystem);
+        ValidateFluid();
+        ValidateTileSort();
+        ValidateTileBinning(jobSystem);
+        ValidateTileRasterization(jobSystem);
+        ValidateParticleFrame();
+        ValidateParticleDeviceCPU(jobSystem);
+    }
+
+    if (bBenchmark)
+    {
+        RunBenchmarks(jobSystem);
+    }
+
+    if (s_nFailureCount > 0)
+    {
+        std::printf("%u checks FAILED\n", s_nFailureCount);
+        return 1;
+    }
+    return 0;
+}
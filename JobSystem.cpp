@@ -0,0 +1,221 @@
+#include "JobSystem.h"
+
+#include <algorithm>
+
+JobSystem::JobSystem(uint32_t nWorkerCount)
+{
+    if (nWorkerCount == 0)
+    {
+        nWorkerCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (uint32_t i = 0; i < nWorkerCount; i++)
+    {
+        m_workers.push_back(std::make_unique<Worker>());
+    }
+
+    // Worker 0 is whoever calls ParallelFor
+    for (uint32_t i = 1; i < nWorkerCount; i++)
+    {
+        m_workers[i]->Thread = std::thread(&JobSystem::WorkerLoop, this, i);
+    }
+
+    ResetStatistics();
+}
+
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_wakeMutex);
+        m_bQuit = true;
+    }
+    m_wakeCondition.notify_all();
+
+    for (auto& worker : m_workers)
+    {
+        if (worker->Thread.joinable())
+        {
+            worker->Thread.join();
+        }
+    }
+}
+
+void JobSystem::ParallelFor(uint32_t nCount, uint32_t nChunkSize, const RangeJob& fnJob)
+{
+    if (nCount == 0)
+    {
+        return;
+    }
+
+    nChunkSize = std::max(1u, nChunkSize);
+    uint32_t nChunkCount = (nCount + nChunkSize - 1) / nChunkSize;
+    uint32_t nWorkerCount = GetWorkerCount();
+
+    // Not worth waking anybody up
+    if (nChunkCount == 1 || nWorkerCount == 1)
+    {
+        for (uint32_t nBegin = 0; nBegin < nCount; nBegin += nChunkSize)
+        {
+            RunChunk(fnJob, 0, Chunk{ nBegin, std::min(nCount, nBegin + nChunkSize) }, false);
+        }
+        return;
+    }
+
+    m_pCurrentJob = &fnJob;
+    m_nPendingChunks.store(nChunkCount);
+
+    // Every worker starts with a contiguous block of chunks so neighbouring particles stay on the same core
+    for (uint32_t iWorker = 0; iWorker < nWorkerCount; iWorker++)
+    {
+        uint32_t nFirstChunk = (uint32_t)((uint64_t)nChunkCount * iWorker / nWorkerCount);
+        uint32_t nLastChunk = (uint32_t)((uint64_t)nChunkCount * (iWorker + 1) / nWorkerCount);
+
+        Worker& worker = *m_workers[iWorker];
+        std::lock_guard<std::mutex> lock(worker.Mutex);
+        for (uint32_t iChunk = nFirstChunk; iChunk < nLastChunk; iChunk++)
+        {
+            uint32_t nBegin = iChunk * nChunkSize;
+            worker.Chunks.push_back(Chunk{ nBegin, std::min(nCount, nBegin + nChunkSize) });
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_wakeMutex);
+        m_nJobGeneration++;
+    }
+    m_wakeCondition.notify_all();
+
+    while (m_nPendingChunks.load() != 0)
+    {
+        if (!RunPendingChunks(0))
+        {
+            // The rest of the chunks are being processed by other workers
+            std::this_thread::yield();
+        }
+    }
+
+    m_pCurrentJob = nullptr;
+}
+
+bool JobSystem::PopChunk(uint32_t nWorkerIndex, Chunk& chunk)
+{
+    Worker& worker = *m_workers[nWorkerIndex];
+    std::lock_guard<std::mutex> lock(worker.Mutex);
+    if (worker.Chunks.empty())
+    {
+        return false;
+    }
+
+    // Taking from the front keeps the owner walking forward in memory, thieves take from the back
+    chunk = worker.Chunks.front();
+    worker.Chunks.pop_front();
+    return true;
+}
+
+bool JobSystem::StealChunk(uint32_t nWorkerIndex, Chunk& chunk)
+{
+    uint32_t nWorkerCount = GetWorkerCount();
+    for (uint32_t iOffset = 1; iOffset < nWorkerCount; iOffset++)
+    {
+        Worker& victim = *m_workers[(nWorkerIndex + iOffset) % nWorkerCount];
+        std::lock_guard<std::mutex> lock(victim.Mutex);
+        if (!victim.Chunks.empty())
+        {
+            chunk = victim.Chunks.back();
+            victim.Chunks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobSystem::RunChunk(const RangeJob& fnJob, uint32_t nWorkerIndex, const Chunk& chunk, bool bStolen)
+{
+    Worker& worker = *m_workers[nWorkerIndex];
+    auto start = std::chrono::steady_clock::now();
+
+    fnJob(chunk.nBegin, chunk.nEnd, nWorkerIndex);
+
+    auto end = std::chrono::steady_clock::now();
+    worker.nBusyNanoseconds += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    worker.nChunkCount++;
+    if (bStolen)
+    {
+        worker.nStolenChunkCount++;
+    }
+}
+
+bool JobSystem::RunPendingChunks(uint32_t nWorkerIndex)
+{
+    bool bRanAnything = false;
+    Chunk chunk;
+    for (;;)
+    {
+        bool bStolen = false;
+        if (!PopChunk(nWorkerIndex, chunk))
+        {
+            if (!StealChunk(nWorkerIndex, chunk))
+            {
+                break;
+            }
+            bStolen = true;
+        }
+
+        RunChunk(*m_pCurrentJob, nWorkerIndex, chunk, bStolen);
+        m_nPendingChunks--;
+        bRanAnything = true;
+    }
+    return bRanAnything;
+}
+
+void JobSystem::WorkerLoop(uint32_t nWorkerIndex)
+{
+    uint64_t nSeenGeneration = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_wakeMutex);
+            m_wakeCondition.wait(lock, [&]() { return m_bQuit || m_nJobGeneration != nSeenGeneration; });
+            if (m_bQuit)
+            {
+                return;
+            }
+            nSeenGeneration = m_nJobGeneration;
+        }
+
+        RunPendingChunks(nWorkerIndex);
+    }
+}
+
+void JobSystem::ResetStatistics()
+{
+    for (auto& worker : m_workers)
+    {
+        worker->nBusyNanoseconds = 0;
+        worker->nChunkCount = 0;
+        worker->nStolenChunkCount = 0;
+    }
+    m_statisticsStart = std::chrono::steady_clock::now();
+}
+
+JobSystem::WorkerStatistics JobSystem::GetWorkerStatistics(uint32_t nWorkerIndex) const
+{
+    const Worker& worker = *m_workers[nWorkerIndex];
+
+    WorkerStatistics stats;
+    stats.nBusyNanoseconds = worker.nBusyNanoseconds.load();
+    stats.nChunkCount = worker.nChunkCount.load();
+    stats.nStolenChunkCount = worker.nStolenChunkCount.load();
+    return stats;
+}
+
+float JobSystem::GetWorkerUtilization(uint32_t nWorkerIndex) const
+{
+    auto elapsed = std::chrono::steady_clock::now() - m_statisticsStart;
+    uint64_t nElapsedNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    if (nElapsedNanoseconds == 0)
+    {
+        return 0.0f;
+    }
+    return (float)((double)m_workers[nWorkerIndex]->nBusyNanoseconds.load() / nElapsedNanoseconds);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+// Small work-stealing thread pool for the CPU simulation.
+// A ParallelFor splits the range into chunks (the CPU side equivalent of a thread group) and hands
+// every worker a contiguous block of them. Workers take chunks from the front of their own deque and steal
+// from the back of the others once they run out, so the ones that finish early help out the slow ones.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class JobSystem
+{
+public:
+    // Called with [nBegin, nEnd) and the index of the worker that runs it
+    typedef std::function<void(uint32_t nBegin, uint32_t nEnd, uint32_t nWorkerIndex)> RangeJob;
+
+    // Zero means one worker per hardware thread. The thread calling ParallelFor counts as worker 0.
+    explicit JobSystem(uint32_t nWorkerCount = 0);
+    ~JobSystem();
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    uint32_t GetWorkerCount() const { return (uint32_t)m_workers.size(); }
+
+    // Blocks until every chunk has been processed. Not reentrant, only call it from one thread at a time.
+    void ParallelFor(uint32_t nCount, uint32_t nChunkSize, const RangeJob& fnJob);
+
+    struct WorkerStatistics
+    {
+        uint64_t nBusyNanoseconds;
+        uint32_t nChunkCount;
+        uint32_t nStolenChunkCount;
+    };
+
+    void ResetStatistics();
+    WorkerStatistics GetWorkerStatistics(uint32_t nWorkerIndex) const;
+
+    // Fraction of the time since the last ResetStatistics that the worker spent running chunks
+    float GetWorkerUtilization(uint32_t nWorkerIndex) const;
+
+private:
+    struct Chunk
+    {
+        uint32_t nBegin;
+        uint32_t nEnd;
+    };
+
+    struct Worker
+    {
+        std::mutex Mutex;
+        std::deque<Chunk> Chunks;
+        std::thread Thread;
+
+        std::atomic<uint64_t> nBusyNanoseconds{ 0 };
+        std::atomic<uint32_t> nChunkCount{ 0 };
+        std::atomic<uint32_t> nStolenChunkCount{ 0 };
+    };
+
+    bool PopChunk(uint32_t nWorkerIndex, Chunk& chunk);
+    bool StealChunk(uint32_t nWorkerIndex, Chunk& chunk);
+    void RunChunk(const RangeJob& fnJob, uint32_t nWorkerIndex, const Chunk& chunk, bool bStolen);
+    bool RunPendingChunks(uint32_t nWorkerIndex);
+    void WorkerLoop(uint32_t nWorkerIndex);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+
+    const RangeJob* m_pCurrentJob = nullptr;
+    std::atomic<uint32_t> m_nPendingChunks{ 0 };
+
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wakeCondition;
+    uint64_t m_nJobGeneration = 0;
+    bool m_bQuit = false;
+
+    std::chrono::steady_clock::time_point m_statisticsStart;
+};
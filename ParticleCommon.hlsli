@@ -13,9 +13,82 @@ RWStructuredBuffer<float>  g_particleLifetimesOut:  register(u4);
 RWStructuredBuffer<float4> g_particleColorsOut:     register(u5);
 
 globallycoherent RWStructuredBuffer<uint> g_deadList      : register(u10);	// UAV - g_deadList[g_nParticleBufferSize] = the current particle count
-globallycoherent RWStructuredBuffer<uint> g_offsetCounter : register(u11);
-RWTexture2D<uint2> g_offsetPerTiles                       : register(u12);
+
+// Tile lists of the tiled rasterization, see ParticleTileBinner.h. Built every frame from the alive list.
+globallycoherent RWStructuredBuffer<uint> g_offsetCounter : register(u11);   // TILE_COUNTER_COUNT counters, then the work list and the spilled tiles
+RWTexture2D<uint2> g_offsetPerTiles                       : register(u12);   // Offset into g_particleIndicesForTiles and count, by tile
 RWStructuredBuffer<uint> g_particleIndicesForTiles        : register(u13);
+RWStructuredBuffer<uint> g_tileParticleCounts             : register(u25);   // One per tile, row major, zero between frames
+
+// Same layout as QuadPlanes in ParticleTileRasterizer.h. The barycentric coordinates of a pixel in the particle's quad are
+// u = uPlane.x * x + (uPlane.y * y + uPlane.z) and the same with vPlane, the pixel is in the quad when both are in [0, 1].
+struct ParticleRasterSetup
+{
+    float3 uPlane;
+    float3 vPlane;
+};
+RWStructuredBuffer<ParticleRasterSetup> g_particleRasterSetups : register(u26);   // By particle index, written by CSParticleRasterSetup
+
+// Same layout as the dead list: [0] is the number of live particles followed by their indices.
+// Every particle buffer has its own list. The update reads In and compacts the survivors into Out.
+RWStructuredBuffer<uint> g_aliveListIn                    : register(u14);
+RWStructuredBuffer<uint> g_aliveListOut                   : register(u15);
+RWStructuredBuffer<uint> g_drawArgsOut                    : register(u16);   // D3D12_DRAW_ARGUMENTS for drawing g_aliveListOut
+RWStructuredBuffer<uint> g_compactionGroupOffsets         : register(u17);
+RWStructuredBuffer<uint> g_dispatchArgs                   : register(u18);
+
+// Every emitter owns a contiguous range of the particle buffers. Its part of the dead list is at the same place:
+// g_deadList[1 + nRangeBegin, 1 + nRangeBegin + nRangeSize) is a stack of slots relative to nRangeBegin.
+// g_deadList[0] is still the total number of live particles.
+struct EmitterParams
+{
+    float2 position;
+    float2 scale;
+    float4 color;       // The random color is multiplied with rgb, alpha is used as is
+    float  speed;
+    float  lifetime;
+    float2 padding;
+};
+
+// Same layout as ParticleEmitterData. Sorted by nRangeBegin, and so by nEmitOffset as well.
+struct EmitterData
+{
+    EmitterParams params;
+    uint nEmitterIndex;     // Index into g_emitterParticleCounts
+    uint nEmitOffset;       // The first CSGenerate thread of this emitter
+    uint nEmitCount;
+    uint nRangeBegin;
+    uint nRangeSize;
+    uint padding;
+};
+
+// Same layout as ParticleRelocationData, sorted by nSrcBegin
+struct ParticleRelocation
+{
+    uint nSrcBegin;
+    uint nDstBegin;
+    uint nSize;
+    uint padding;
+};
+
+StructuredBuffer<EmitterData> g_emitters                  : register(t6);
+StructuredBuffer<ParticleRelocation> g_relocations        : register(t7);
+globallycoherent RWStructuredBuffer<uint> g_emitterParticleCounts : register(u19);
+
+// Spatial hash for the particle-particle collisions, see ParticleSpatialHash.h. Rebuilt every frame from the alive list.
+// Same layout as HashedParticle in ParticleSpatialHash.h
+struct HashedParticle
+{
+    float2 pos;
+    float  radius;
+    uint   nIndex;
+};
+
+RWStructuredBuffer<uint> g_hashCellCounts                 : register(u20);   // HASH_COUNTER_COUNT, zero between frames
+RWStructuredBuffer<uint> g_hashCellStarts                 : register(u21);   // HASH_START_COUNT
+RWStructuredBuffer<uint2> g_hashParticleCells             : register(u22);   // Cell and place in the cell, by alive list index
+RWStructuredBuffer<HashedParticle> g_hashSortedParticles  : register(u23);
+RWStructuredBuffer<float2> g_collisionImpulses            : register(u24);   // Velocity change of the frame, by particle index
 
 struct Particle
 {
@@ -36,7 +109,12 @@ cbuffer globals : register(b0)
 
 cbuffer perFrame : register(b1)
 {
-    uint g_nEmitCount;
+    uint g_nEmitCount;      // Sum of the nEmitCount of the emitters
     uint g_nRandomSeed;
     float g_fElapsedTime;
+    uint g_nEmitterCount;
+    uint g_nRelocationCount;
+    float g_fCollisionStiffness;    // Zero turns the collisions off
+    float g_fGravity;               // Only the CPU simulation has the N-body gravity so far, see ParticleQuadtree.h
+    float g_fFluidStiffness;        // Same for the SPH fluid, see ParticleFluid.h
 };
\ No newline at end of file
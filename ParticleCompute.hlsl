@@ -1,5 +1,9 @@
 #include "ParticleCommon.hlsli"
 #include "TileConstants.h"
+#include "AliveListConstants.h"
+#include "GroupPrefixSum.hlsli"
+#include "EmitterConstants.h"
+#include "SpatialHashConstants.h"
 
 float GetRandomNumber(inout uint seed)
 {
@@ -13,14 +17,14 @@ float GetRandomNumber(inout uint seed)
     return float(seed) * (1.0 / 4294967296.0);
 }
 
-void GenerateNewParticle(uint rndSeed, out Particle particle)
+void GenerateNewParticle(EmitterParams params, uint rndSeed, out Particle particle)
 {
-    particle.pos = float2(0, 0);
-    particle.timeLeft = -1.0f;
-    particle.velocity = float2(GetRandomNumber(rndSeed) * 2.0f - 1.0f, GetRandomNumber(rndSeed) * 2.0f - 1.0f);
-    particle.color = float4(GetRandomNumber(rndSeed), GetRandomNumber(rndSeed), GetRandomNumber(rndSeed), 0.02f);
+    particle.pos = params.position;
+    particle.timeLeft = params.lifetime;
+    particle.velocity = float2(GetRandomNumber(rndSeed) * 2.0f - 1.0f, GetRandomNumber(rndSeed) * 2.0f - 1.0f) * params.speed;
+    particle.color = float4(GetRandomNumber(rndSeed) * params.color.r, GetRandomNumber(rndSeed) * params.color.g, GetRandomNumber(rndSeed) * params.color.b, params.color.a);
     //particle.color = saturate(particle.color * 3);
-    particle.scale = float2(0.01, 0.01);
+    particle.scale = params.scale;
 #ifdef DISABLE_ROTATION
     particle.rotate = 0;
 #else
@@ -28,62 +32,132 @@ void GenerateNewParticle(uint rndSeed, out Particle particle)
 #endif
 }
 
+// The emitter whose CSGenerate threads contain nThread. Emitters that don't emit have the same nEmitOffset
+// as the next one, the last of them is the one that emits.
+uint FindEmitterOfThread(uint nThread)
+{
+    uint nFirst = 0;
+    uint nCount = g_nEmitterCount;
+    while (nCount > 0)
+    {
+        uint nStep = nCount / 2;
+        if (g_emitters[nFirst + nStep].nEmitOffset <= nThread)
+        {
+            nFirst += nStep + 1;
+            nCount -= nStep + 1;
+        }
+        else
+        {
+            nCount = nStep;
+        }
+    }
+    return nFirst - 1;
+}
+
+// The emitter whose range contains nParticle, INVALID_EMITTER if it isn't in the table anymore
+uint FindEmitterOfParticle(uint nParticle)
+{
+    uint nFirst = 0;
+    uint nCount = g_nEmitterCount;
+    while (nCount > 0)
+    {
+        uint nStep = nCount / 2;
+        if (g_emitters[nFirst + nStep].nRangeBegin <= nParticle)
+        {
+            nFirst += nStep + 1;
+            nCount -= nStep + 1;
+        }
+        else
+        {
+            nCount = nStep;
+        }
+    }
+
+    if (nFirst == 0 || nParticle - g_emitters[nFirst - 1].nRangeBegin >= g_emitters[nFirst - 1].nRangeSize)
+    {
+        return INVALID_EMITTER;
+    }
+    return nFirst - 1;
+}
+
+// One dispatch for every emitter. The threads of an emitter are [nEmitOffset, nEmitOffset + nEmitCount).
 [numthreads(1000, 1, 1)]
 void CSGenerate(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
 {
     if (DTid.x < g_nEmitCount)
     {
-        uint nPrevParticleCount = g_deadList.IncrementCounter();
-        if (nPrevParticleCount < g_nParticleBufferSize)
+        EmitterData emitter = g_emitters[FindEmitterOfThread(DTid.x)];
+
+        uint nPrevParticleCount;
+        InterlockedAdd(g_emitterParticleCounts[emitter.nEmitterIndex], 1, nPrevParticleCount);
+        if (nPrevParticleCount < emitter.nRangeSize)
         {
             //There's still space left for a new particle. Mark one for creation
-            uint nLastParticle = g_deadList[g_nParticleBufferSize - nPrevParticleCount];
-            g_deadList[g_nParticleBufferSize - nPrevParticleCount] = 9;
+            uint nLastParticle = emitter.nRangeBegin + g_deadList[emitter.nRangeBegin + emitter.nRangeSize - nPrevParticleCount];
+            g_deadList.IncrementCounter();
 
             Particle newParticle;
-            GenerateNewParticle(g_nRandomSeed + DTid.x, newParticle);
+            GenerateNewParticle(emitter.params, g_nRandomSeed + DTid.x, newParticle);
             g_particlePositionsOut[nLastParticle] = newParticle.pos;
             g_particleScalesOut[nLastParticle] = newParticle.scale;
             g_particleVelocitiesOut[nLastParticle] = newParticle.velocity;
             g_particleRotationsOut[nLastParticle] = newParticle.rotate;
             g_particleLifetimesOut[nLastParticle] = newParticle.timeLeft;
             g_particleColorsOut[nLastParticle] = newParticle.color;
+
+            // The update only sees the particles in the alive list
+            uint nAliveListIndex;
+            InterlockedAdd(g_aliveListIn[0], 1, nAliveListIndex);
+            g_aliveListIn[1 + nAliveListIndex] = nLastParticle;
         }
         else
         {
             uint nTmp;
-            InterlockedMin(g_deadList[0], g_nParticleBufferSize, nTmp);
+            InterlockedMin(g_emitterParticleCounts[emitter.nEmitterIndex], emitter.nRangeSize, nTmp);
         }
     }
 }
 
-[numthreads(1000, 1, 1)]
+// The number of live particles is only known on the GPU, so this fills the arguments of the indirect dispatches.
+[numthreads(1, 1, 1)]
+void CSPrepareUpdate(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    uint nAliveCount = g_aliveListIn[0];
+
+    g_dispatchArgs[DISPATCH_ARGS_UPDATE + 0] = (nAliveCount + UPDATE_GROUP_SIZE - 1) / UPDATE_GROUP_SIZE;
+    g_dispatchArgs[DISPATCH_ARGS_UPDATE + 1] = 1;
+    g_dispatchArgs[DISPATCH_ARGS_UPDATE + 2] = 1;
+
+    g_dispatchArgs[DISPATCH_ARGS_COMPACTION + 0] = (nAliveCount + COMPACTION_GROUP_SIZE - 1) / COMPACTION_GROUP_SIZE;
+    g_dispatchArgs[DISPATCH_ARGS_COMPACTION + 1] = 1;
+    g_dispatchArgs[DISPATCH_ARGS_COMPACTION + 2] = 1;
+}
+
+[numthreads(UPDATE_GROUP_SIZE, 1, 1)]
 void CSUpdate(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
 {
-    if (DTid.x >= g_nParticleBufferSize)
+    if (DTid.x >= g_aliveListIn[0])
     {
         return;
     }
 
+    // Dead particles aren't in the alive list, so they don't get copied to the output buffer anymore.
+    // Nothing reads their stale copies, they get overwritten by CSGenerate before they are added to a list again.
+    uint nParticle = g_aliveListIn[1 + DTid.x];
+
     Particle particle;
     
-    particle.pos = g_particlePositions[DTid.x];
-    particle.scale = g_particleScales[DTid.x];
-    particle.velocity = g_particleVelocities[DTid.x];
-    particle.rotate = g_particleRotations[DTid.x];
-    particle.timeLeft = g_particleLifetimes[DTid.x];
-    particle.color = g_particleColors[DTid.x];
-
-    if (particle.timeLeft == 0.0)
-    {
-        g_particlePositionsOut[DTid.x] = particle.pos;
-        g_particleScalesOut[DTid.x] = particle.scale;
-        g_particleVelocitiesOut[DTid.x] = particle.velocity;
-        g_particleRotationsOut[DTid.x] = particle.rotate;
-        g_particleLifetimesOut[DTid.x] = particle.timeLeft;
-        g_particleColorsOut[DTid.x] = particle.color;
+    particle.pos = g_particlePositions[nParticle];
+    particle.scale = g_particleScales[nParticle];
+    particle.velocity = g_particleVelocities[nParticle];
+    particle.rotate = g_particleRotations[nParticle];
+    particle.timeLeft = g_particleLifetimes[nParticle];
+    particle.color = g_particleColors[nParticle];
 
-        return;
+    // The velocity change CSCollide came up with this frame
+    if (g_fCollisionStiffness > 0.0)
+    {
+        particle.velocity += g_collisionImpulses[nParticle];
     }
 
     // Negative time means it lives forever (sounds like a bad idea tbh)
@@ -120,21 +194,294 @@ void CSUpdate(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GT
         particle.velocity.y *= -1;
     }
 
+    // The particles of a destroyed emitter die here. Its range is only freed after this ran once without it in the table,
+    // so nobody else can own the slot yet and it doesn't go back to any dead list.
+    // @Performance: The lookup is only needed for that and for the dying particles, a per particle emitter index would avoid it.
+    uint nEmitter = FindEmitterOfParticle(nParticle);
+    if (nEmitter == INVALID_EMITTER)
+    {
+        particle.timeLeft = 0;
+    }
+
     if (particle.timeLeft == 0)
     {
-        int nNewParticleCount = g_deadList.DecrementCounter();
-        g_deadList[g_nParticleBufferSize - nNewParticleCount] = DTid.x;
+        g_deadList.DecrementCounter();
+        if (nEmitter != INVALID_EMITTER)
+        {
+            EmitterData emitter = g_emitters[nEmitter];
+            uint nPrevParticleCount;
+            InterlockedAdd(g_emitterParticleCounts[emitter.nEmitterIndex], 0xffffffff, nPrevParticleCount);
+            g_deadList[emitter.nRangeBegin + emitter.nRangeSize - (nPrevParticleCount - 1)] = nParticle - emitter.nRangeBegin;
+        }
     }
 
-    g_particlePositionsOut[DTid.x] = particle.pos;
-    g_particleScalesOut[DTid.x] = particle.scale;
-    g_particleVelocitiesOut[DTid.x] = particle.velocity;
-    g_particleRotationsOut[DTid.x] = particle.rotate;
-    g_particleLifetimesOut[DTid.x] = particle.timeLeft;
-    g_particleColorsOut[DTid.x] = particle.color;
+    g_particlePositionsOut[nParticle] = particle.pos;
+    g_particleScalesOut[nParticle] = particle.scale;
+    g_particleVelocitiesOut[nParticle] = particle.velocity;
+    g_particleRotationsOut[nParticle] = particle.rotate;
+    g_particleLifetimesOut[nParticle] = particle.timeLeft;
+    g_particleColorsOut[nParticle] = particle.color;
+}
+
+// The particle data of the moved emitter ranges has already been copied, this fixes up the indices in the alive list
+[numthreads(UPDATE_GROUP_SIZE, 1, 1)]
+void CSRelocate(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    if (DTid.x >= g_aliveListIn[0])
+    {
+        return;
+    }
+
+    uint nParticle = g_aliveListIn[1 + DTid.x];
+
+    uint nFirst = 0;
+    uint nCount = g_nRelocationCount;
+    while (nCount > 0)
+    {
+        uint nStep = nCount / 2;
+        if (g_relocations[nFirst + nStep].nSrcBegin <= nParticle)
+        {
+            nFirst += nStep + 1;
+            nCount -= nStep + 1;
+        }
+        else
+        {
+            nCount = nStep;
+        }
+    }
+
+    if (nFirst > 0)
+    {
+        ParticleRelocation relocation = g_relocations[nFirst - 1];
+        if (nParticle - relocation.nSrcBegin < relocation.nSize)
+        {
+            g_aliveListIn[1 + DTid.x] = nParticle - relocation.nSrcBegin + relocation.nDstBegin;
+        }
+    }
 }
 
 [numthreads(1000, 1, 1)]
 void CSDestroy(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
 {
-}
\ No newline at end of file
+}
+
+// Stream compaction of the alive list: count the survivors per group, scan the counts, then scatter.
+// The order of the particles is kept, which keeps the reads of the next update close to each other.
+
+groupshared uint gs_nCompactionCount;
+
+bool IsSurvivor(uint nAliveListIndex)
+{
+    return nAliveListIndex < g_aliveListIn[0] && g_particleLifetimesOut[g_aliveListIn[1 + nAliveListIndex]] != 0.0;
+}
+
+[numthreads(COMPACTION_GROUP_SIZE, 1, 1)]
+void CSCompactCount(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    if (GI == 0)
+    {
+        gs_nCompactionCount = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    if (IsSurvivor(DTid.x))
+    {
+        InterlockedAdd(gs_nCompactionCount, 1);
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    if (GI == 0)
+    {
+        g_compactionGroupOffsets[Gid.x] = gs_nCompactionCount;
+    }
+}
+
+// Dispatched with a single group. Every thread turns a contiguous run of group counts into offsets,
+// so this works for any number of groups.
+[numthreads(COMPACTION_GROUP_SIZE, 1, 1)]
+void CSCompactScanGroups(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    uint nGroupCount = (g_aliveListIn[0] + COMPACTION_GROUP_SIZE - 1) / COMPACTION_GROUP_SIZE;
+    uint nGroupsPerThread = (nGroupCount + COMPACTION_GROUP_SIZE - 1) / COMPACTION_GROUP_SIZE;
+    uint nFirstGroup = min(GI * nGroupsPerThread, nGroupCount);
+    uint nLastGroup = min(nFirstGroup + nGroupsPerThread, nGroupCount);
+
+    uint nSurvivorCount = 0;
+    for (uint iGroup = nFirstGroup; iGroup < nLastGroup; iGroup++)
+    {
+        nSurvivorCount += g_compactionGroupOffsets[iGroup];
+    }
+
+    uint nOffset = GroupExclusivePrefixSum(nSurvivorCount, GI);
+    for (uint iOffsetGroup = nFirstGroup; iOffsetGroup < nLastGroup; iOffsetGroup++)
+    {
+        uint nGroupSurvivorCount = g_compactionGroupOffsets[iOffsetGroup];
+        g_compactionGroupOffsets[iOffsetGroup] = nOffset;
+        nOffset += nGroupSurvivorCount;
+    }
+
+    // The last thread ends up with the total
+    if (GI == COMPACTION_GROUP_SIZE - 1)
+    {
+        g_aliveListOut[0] = nOffset;
+
+        g_drawArgsOut[0] = nOffset; // VertexCountPerInstance
+        g_drawArgsOut[1] = 1;       // InstanceCount
+        g_drawArgsOut[2] = 0;       // StartVertexLocation
+        g_drawArgsOut[3] = 0;       // StartInstanceLocation
+    }
+}
+
+[numthreads(COMPACTION_GROUP_SIZE, 1, 1)]
+void CSCompactScatter(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    bool bSurvivor = IsSurvivor(DTid.x);
+    uint nLocalOffset = GroupExclusivePrefixSum(bSurvivor ? 1 : 0, GI);
+
+    if (bSurvivor)
+    {
+        g_aliveListOut[1 + g_compactionGroupOffsets[Gid.x] + nLocalOffset] = g_aliveListIn[1 + DTid.x];
+    }
+}
+
+// Particle-particle collisions with a uniform grid, same steps as ParticleSpatialHash on the CPU:
+// count the particles per cell, scan the counts, scatter the particles into cell order, then every particle
+// looks at the 3x3 cells around it. A row of those is a single contiguous run of the sorted particles.
+// The hash passes run over the alive list of the update, so they are dispatched with the update's arguments.
+
+// Same float math as ParticleSpatialHash::GetCellKey
+uint2 GetHashCell(float2 pos)
+{
+    return (uint2)clamp((pos + 1.0f) * (HASH_GRID_DIM * 0.5f), 0.0f, HASH_GRID_DIM - 1.0f);
+}
+
+// Collision radius of a particle, the bigger half extent of its scale
+float GetHashRadius(float2 scale)
+{
+    return max(scale.x, scale.y);
+}
+
+groupshared uint gs_nMaxRadiusBits;
+
+// Also takes the largest radius for the query reach. The radii aren't negative, so their bits order like the floats.
+[numthreads(UPDATE_GROUP_SIZE, 1, 1)]
+void CSHashCount(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    if (GI == 0)
+    {
+        gs_nMaxRadiusBits = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    if (DTid.x < g_aliveListIn[0])
+    {
+        uint nParticle = g_aliveListIn[1 + DTid.x];
+        uint2 cell = GetHashCell(g_particlePositions[nParticle]);
+        uint nCell = cell.y * HASH_GRID_DIM + cell.x;
+
+        uint nOffsetInCell;
+        InterlockedAdd(g_hashCellCounts[nCell], 1, nOffsetInCell);
+        g_hashParticleCells[DTid.x] = uint2(nCell, nOffsetInCell);
+        InterlockedMax(gs_nMaxRadiusBits, asuint(GetHashRadius(g_particleScales[nParticle])));
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    if (GI == 0)
+    {
+        InterlockedMax(g_hashCellCounts[HASH_COUNTER_MAX_RADIUS], gs_nMaxRadiusBits);
+    }
+}
+
+// Dispatched with a single group like CSCompactScanGroups. Clears the counts for the next frame on the way.
+[numthreads(COMPACTION_GROUP_SIZE, 1, 1)]
+void CSHashScan(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    const uint nCellsPerThread = HASH_CELL_COUNT / COMPACTION_GROUP_SIZE;
+    uint nFirstCell = GI * nCellsPerThread;
+
+    uint nCount = 0;
+    for (uint iCell = nFirstCell; iCell < nFirstCell + nCellsPerThread; iCell++)
+    {
+        nCount += g_hashCellCounts[iCell];
+    }
+
+    uint nOffset = GroupExclusivePrefixSum(nCount, GI);
+    for (uint iOffsetCell = nFirstCell; iOffsetCell < nFirstCell + nCellsPerThread; iOffsetCell++)
+    {
+        uint nCellCount = g_hashCellCounts[iOffsetCell];
+        g_hashCellStarts[iOffsetCell] = nOffset;
+        g_hashCellCounts[iOffsetCell] = 0;
+        nOffset += nCellCount;
+    }
+
+    if (GI == COMPACTION_GROUP_SIZE - 1)
+    {
+        g_hashCellStarts[HASH_CELL_COUNT] = nOffset;
+
+        // Same float math as ParticleSpatialHash::Build
+        float fMaxRadius = asfloat(g_hashCellCounts[HASH_COUNTER_MAX_RADIUS]);
+        g_hashCellStarts[HASH_START_QUERY_REACH] = (uint)clamp(ceil(fMaxRadius * HASH_GRID_DIM), 1.0f, HASH_GRID_DIM);
+        g_hashCellCounts[HASH_COUNTER_MAX_RADIUS] = 0;
+    }
+}
+
+[numthreads(UPDATE_GROUP_SIZE, 1, 1)]
+void CSHashScatter(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    if (DTid.x >= g_aliveListIn[0])
+    {
+        return;
+    }
+
+    uint nParticle = g_aliveListIn[1 + DTid.x];
+    float2 scale = g_particleScales[nParticle];
+    uint2 particleCell = g_hashParticleCells[DTid.x];
+
+    HashedParticle hashedParticle;
+    hashedParticle.pos = g_particlePositions[nParticle];
+    hashedParticle.radius = GetHashRadius(scale);
+    hashedParticle.nIndex = nParticle;
+    g_hashSortedParticles[g_hashCellStarts[particleCell.x] + particleCell.y] = hashedParticle;
+}
+
+// One thread per sorted particle, so the threads of a group read the same few rows of cells. A row of the query
+// is still one contiguous run, however far it reaches.
+[numthreads(UPDATE_GROUP_SIZE, 1, 1)]
+void CSCollide(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    if (DTid.x >= g_aliveListIn[0])
+    {
+        return;
+    }
+
+    HashedParticle particle = g_hashSortedParticles[DTid.x];
+    uint2 cell = GetHashCell(particle.pos);
+    uint nReach = g_hashCellStarts[HASH_START_QUERY_REACH];
+    uint nFirstX = cell.x - min(cell.x, nReach);
+    uint nLastX = min(cell.x + nReach, HASH_GRID_DIM - 1);
+    uint nFirstY = cell.y - min(cell.y, nReach);
+    uint nLastY = min(cell.y + nReach, HASH_GRID_DIM - 1);
+
+    float2 impulse = float2(0, 0);
+    for (uint nY = nFirstY; nY <= nLastY; nY++)
+    {
+        uint nRowBegin = g_hashCellStarts[nY * HASH_GRID_DIM + nFirstX];
+        uint nRowEnd = g_hashCellStarts[nY * HASH_GRID_DIM + nLastX + 1];
+        for (uint j = nRowBegin; j < nRowEnd; j++)
+        {
+            HashedParticle other = g_hashSortedParticles[j];
+            float2 delta = particle.pos - other.pos;
+            float fDistanceSq = dot(delta, delta);
+            float fRadiusSum = particle.radius + other.radius;
+
+            // Particles right on top of each other have no direction to push in, that includes the particle itself
+            if (fDistanceSq < fRadiusSum * fRadiusSum && fDistanceSq > 0.0f)
+            {
+                float fDistance = sqrt(fDistanceSq);
+                impulse += delta * ((fRadiusSum - fDistance) / (fRadiusSum * fDistance));
+            }
+        }
+    }
+
+    g_collisionImpulses[particle.nIndex] = impulse * (g_fCollisionStiffness * g_fElapsedTime);
+}
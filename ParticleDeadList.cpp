@@ -0,0 +1,301 @@
+#include "ParticleDeadList.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+ParticleDeadList::ParticleDeadList(uint32_t nCapacity) :
+    m_nParticleCount(0),
+    m_nCapacity(nCapacity),
+    m_availableIndices(new std::atomic<uint32_t>[nCapacity])
+{
+    Reset();
+}
+
+void ParticleDeadList::ClearAboveTop()
+{
+    for (uint32_t i = GetFreeCount(); i < GetCapacity(); i++)
+    {
+        m_availableIndices[i].store(InvalidIndex, std::memory_order_relaxed);
+    }
+}
+
+void ParticleDeadList::Reset()
+{
+    for (uint32_t i = 0; i < GetCapacity(); i++)
+    {
+        m_availableIndices[i].store(i, std::memory_order_relaxed);
+    }
+    m_nParticleCount.store(0);
+}
+
+void ParticleDeadList::MarkAllUsed()
+{
+    m_nParticleCount.store(GetCapacity());
+    ClearAboveTop();
+}
+
+void ParticleDeadList::MarkFirstUsed(uint32_t nUsedCount)
+{
+    const uint32_t nFreeCount = GetCapacity() - nUsedCount;
+    for (uint32_t i = 0; i < nFreeCount; i++)
+    {
+        m_availableIndices[i].store(nUsedCount + i, std::memory_order_relaxed);
+    }
+    m_nParticleCount.store(nUsedCount);
+    ClearAboveTop();
+}
+
+void ParticleDeadList::Grow(uint32_t nNewCapacity)
+{
+    const uint32_t nOldCapacity = GetCapacity();
+    if (nNewCapacity <= nOldCapacity)
+    {
+        return;
+    }
+
+    // The free slots are at the front, the top of the stack is at GetFreeCount() - 1. The new slots go in
+    // before them in the same order Reset uses, everything that was there moves up by the same amount.
+    const uint32_t nAddedCount = nNewCapacity - nOldCapacity;
+    std::unique_ptr<std::atomic<uint32_t>[]> newIndices(new std::atomic<uint32_t>[nNewCapacity]);
+    for (uint32_t i = 0; i < nAddedCount; i++)
+    {
+        newIndices[i].store(nOldCapacity + i, std::memory_order_relaxed);
+    }
+    for (uint32_t i = 0; i < nOldCapacity; i++)
+    {
+        newIndices[nAddedCount + i].store(m_availableIndices[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    m_availableIndices = std::move(newIndices);
+    m_nCapacity = nNewCapacity;
+}
+
+uint32_t ParticleDeadList::GetGrownCapacity(uint32_t nCapacity, uint32_t nRequiredCapacity, uint32_t nMaxCapacity)
+{
+    if (nRequiredCapacity <= nCapacity || nCapacity >= nMaxCapacity)
+    {
+        return nCapacity;
+    }
+
+    uint64_t nGrownCapacity = std::max<uint64_t>((uint64_t)nCapacity * 2, nRequiredCapacity);
+    return (uint32_t)std::min<uint64_t>(nGrownCapacity, nMaxCapacity);
+}
+
+uint32_t ParticleDeadList::Reserve(uint32_t nCount, uint32_t* pIndices)
+{
+    const uint32_t nCapacity = GetCapacity();
+
+    // A compare exchange instead of a fetch_add so the counter never goes past the capacity.
+    // It only loops when another thread reserved or released at the same time.
+    uint32_t nPrevParticleCount = m_nParticleCount.load(std::memory_order_relaxed);
+    uint32_t nReserveCount;
+    do
+    {
+        nReserveCount = std::min(nCount, nCapacity - nPrevParticleCount);
+        if (nReserveCount == 0)
+        {
+            return 0;
+        }
+    } while (!m_nParticleCount.compare_exchange_weak(nPrevParticleCount, nPrevParticleCount + nReserveCount, std::memory_order_relaxed));
+
+    // The i-th slot is the one the i-th IncrementCounter would have returned. The entries are taken from the bottom
+    // up like Release writes them, so two threads waiting on each other's entries can't wait in a circle.
+    std::atomic<uint32_t>* pTop = m_availableIndices.get() + nCapacity - nPrevParticleCount - 1;
+    for (uint32_t i = nReserveCount; i-- > 0;)
+    {
+        std::atomic<uint32_t>& entry = *(pTop - i);
+        uint32_t nIndex = entry.load(std::memory_order_acquire);
+        while (nIndex == InvalidIndex || !entry.compare_exchange_weak(nIndex, InvalidIndex, std::memory_order_acquire, std::memory_order_acquire))
+        {
+            // The release that claimed the entry before us hasn't written it yet
+            if (nIndex == InvalidIndex)
+            {
+                std::this_thread::yield();
+                nIndex = entry.load(std::memory_order_acquire);
+            }
+        }
+        pIndices[i] = nIndex;
+    }
+    return nReserveCount;
+}
+
+void ParticleDeadList::Release(uint32_t nCount, const uint32_t* pIndices)
+{
+    if (nCount == 0)
+    {
+        return;
+    }
+
+    uint32_t nPrevParticleCount = m_nParticleCount.fetch_sub(nCount, std::memory_order_relaxed);
+    std::atomic<uint32_t>* pBlock = m_availableIndices.get() + GetCapacity() - nPrevParticleCount;
+    for (uint32_t i = 0; i < nCount; i++)
+    {
+        // Only publishes the index once it's written, a reserve that claimed the entry before us may still
+        // have to take the index that was there
+        uint32_t nExpected = InvalidIndex;
+        while (!pBlock[i].compare_exchange_weak(nExpected, pIndices[i], std::memory_order_release, std::memory_order_relaxed))
+        {
+            if (nExpected != InvalidIndex)
+            {
+                std::this_thread::yield();
+                nExpected = InvalidIndex;
+            }
+        }
+    }
+}
+
+bool ParticleDeadList::Magazine::Allocate(uint32_t& nIndex)
+{
+    if (m_nCount == 0)
+    {
+        m_nCount = m_deadList.Reserve(BatchSize, m_indices);
+        if (m_nCount == 0)
+        {
+            return false;
+        }
+
+        // Reserve returns the slots in pop order, hand them out in the same order
+        std::reverse(m_indices, m_indices + m_nCount);
+    }
+
+    nIndex = m_indices[--m_nCount];
+    return true;
+}
+
+void ParticleDeadList::Magazine::Free(uint32_t nIndex)
+{
+    if (m_nCount == 2 * BatchSize)
+    {
+        // Keep half of them around so an alternating allocate/free doesn't hit the counter every time
+        m_deadList.Release(BatchSize, m_indices);
+        std::copy(m_indices + BatchSize, m_indices + 2 * BatchSize, m_indices);
+        m_nCount = BatchSize;
+    }
+    m_indices[m_nCount++] = nIndex;
+}
+
+void ParticleDeadList::Magazine::Flush()
+{
+    m_deadList.Release(m_nCount, m_indices);
+    m_nCount = 0;
+}
+
+DeadListBenchmarkResult BenchmarkDeadList(uint32_t nThreadCount, uint32_t nCapacity, uint32_t nRoundCount)
+{
+    const uint32_t BulkSize = 64;
+    const uint32_t MagazineSize = 3 * ParticleDeadList::Magazine::BatchSize;
+
+    ParticleDeadList deadList(nCapacity);
+    std::unique_ptr<std::atomic<uint8_t>[]> owned(new std::atomic<uint8_t>[nCapacity]);
+    for (uint32_t i = 0; i < nCapacity; i++)
+    {
+        owned[i].store(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint32_t> nDuplicateCount(0);
+    std::atomic<uint64_t> nAllocatedCount(0);
+
+    auto run = [&](uint32_t iThread)
+    {
+        std::mt19937 randomNumberEngine(iThread);
+        ParticleDeadList::Magazine magazine(deadList);
+        std::vector<uint32_t> heldIndices;
+        uint32_t bulkIndices[BulkSize];
+        uint64_t nThreadAllocatedCount = 0;
+
+        auto take = [&](uint32_t nIndex)
+        {
+            if (owned[nIndex].exchange(1, std::memory_order_relaxed) != 0)
+            {
+                nDuplicateCount.fetch_add(1, std::memory_order_relaxed);
+            }
+            heldIndices.push_back(nIndex);
+            nThreadAllocatedCount++;
+        };
+
+        for (uint32_t iRound = 0; iRound < nRoundCount; iRound++)
+        {
+            // Bulk reserves and magazine allocations in a random mix, then the same for giving them back.
+            // The other threads are somewhere else in their rounds, so all of it overlaps.
+            for (uint32_t iStep = 0; iStep < 8; iStep++)
+            {
+                if (randomNumberEngine() & 1)
+                {
+                    uint32_t nReservedCount = deadList.Reserve(1 + randomNumberEngine() % BulkSize, bulkIndices);
+                    for (uint32_t i = 0; i < nReservedCount; i++)
+                    {
+                        take(bulkIndices[i]);
+                    }
+                }
+                else
+                {
+                    uint32_t nIndex;
+                    for (uint32_t i = randomNumberEngine() % MagazineSize; i > 0 && magazine.Allocate(nIndex); i--)
+                    {
+                        take(nIndex);
+                    }
+                }
+            }
+
+            std::shuffle(heldIndices.begin(), heldIndices.end(), randomNumberEngine);
+            for (uint32_t nIndex : heldIndices)
+            {
+                owned[nIndex].store(0, std::memory_order_relaxed);
+            }
+            uint32_t nHeldCount = (uint32_t)heldIndices.size();
+            uint32_t nBulkCount = nHeldCount / 2;
+            for (uint32_t i = 0; i < nBulkCount; i += BulkSize)
+            {
+                deadList.Release(std::min(BulkSize, nBulkCount - i), heldIndices.data() + i);
+            }
+            for (uint32_t i = nBulkCount; i < nHeldCount; i++)
+            {
+                magazine.Free(heldIndices[i]);
+            }
+            heldIndices.clear();
+        }
+
+        nAllocatedCount.fetch_add(nThreadAllocatedCount, std::memory_order_relaxed);
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t iThread = 1; iThread < nThreadCount; iThread++)
+    {
+        threads.emplace_back(run, iThread);
+    }
+    run(0);
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    DeadListBenchmarkResult result = {};
+    result.nThreadCount = nThreadCount;
+    result.nCapacity = nCapacity;
+    result.fMillionSlotsPerSecond = fSeconds > 0.0 ? nAllocatedCount.load() / fSeconds / 1000000.0 : 0.0;
+    result.nDuplicateCount = nDuplicateCount.load();
+
+    // Everything was given back, so one reserve of the whole capacity has to get every slot exactly once
+    std::vector<uint32_t> indices(nCapacity);
+    uint32_t nReservedCount = deadList.Reserve(nCapacity, indices.data());
+    std::vector<uint8_t> found(nCapacity, 0);
+    uint32_t nFoundCount = 0;
+    for (uint32_t i = 0; i < nReservedCount; i++)
+    {
+        if (indices[i] < nCapacity && !found[indices[i]])
+        {
+            found[indices[i]] = 1;
+            nFoundCount++;
+        }
+        else
+        {
+            result.nDuplicateCount++;
+        }
+    }
+    result.nLostCount = nCapacity - nFoundCount;
+    return result;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+// CPU side version of the dead list (DeadListBufferData / g_deadList).
+// Same layout as on the GPU: a counter with the number of live particles followed by the slot indices.
+// The free slots are at the front of the index array and the top of the stack is the last free one.
+//
+// Reserving or releasing any number of slots claims their entries with a single atomic operation on the counter.
+// Reserves and releases may run at the same time from any number of threads. That is the race described in
+// "emitting problems.txt" on the GPU: a reserve can claim an entry that a release has claimed but not written yet.
+// Here the entries above the top of the stack hold InvalidIndex. A release only publishes an index by writing it over
+// an InvalidIndex and a reserve only takes one that isn't InvalidIndex, putting InvalidIndex back. Whoever gets to a
+// claimed entry first waits for the other one, so no slot is handed out twice or read before it was written.
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+class ParticleDeadList
+{
+public:
+    // What the entries above the top of the stack hold
+    static const uint32_t InvalidIndex = UINT32_MAX;
+
+    explicit ParticleDeadList(uint32_t nCapacity);
+
+    // Marks every slot free
+    void Reset();
+
+    // Marks every slot used, for pools that start out full
+    void MarkAllUsed();
+
+    // Marks the slots [0, nUsedCount) used and the rest free in the order Reset puts them, for particles packed to the front
+    void MarkFirstUsed(uint32_t nUsedCount);
+
+    // Adds the slots [GetCapacity(), nNewCapacity) to the bottom of the stack, so the slots that were already free
+    // get reused first. The particle count doesn't change. Can't run at the same time as anything else.
+    void Grow(uint32_t nNewCapacity);
+
+    // Geometric growth: at least doubles the capacity so a steadily rising particle count only reallocates a few times.
+    // Never goes above nMaxCapacity, returns nCapacity if it can't grow at all.
+    static uint32_t GetGrownCapacity(uint32_t nCapacity, uint32_t nRequiredCapacity, uint32_t nMaxCapacity);
+
+    // Pops up to nCount free slots into pIndices. Returns how many it could get, the rest are dropped
+    // just like the InterlockedMin clamp in CSGenerate does.
+    uint32_t Reserve(uint32_t nCount, uint32_t* pIndices);
+
+    // Pushes nCount slots back. The entries are taken in the same order nCount single DecrementCounter pushes
+    // would take them.
+    void Release(uint32_t nCount, const uint32_t* pIndices);
+
+    uint32_t GetCapacity() const                    { return m_nCapacity; }
+    uint32_t GetParticleCount() const               { return m_nParticleCount.load(std::memory_order_relaxed); }
+    uint32_t GetFreeCount() const                   { return GetCapacity() - GetParticleCount(); }
+
+    // Per thread cache of free slots. Allocating and freeing through it only touches the shared counter
+    // once every BatchSize slots. Slots sitting in a magazine count as used until it is flushed.
+    class Magazine
+    {
+    public:
+        static const uint32_t BatchSize = 256;
+
+        explicit Magazine(ParticleDeadList& deadList) : m_deadList(deadList) {}
+        ~Magazine() { Flush(); }
+
+        Magazine(const Magazine&) = delete;
+        Magazine& operator=(const Magazine&) = delete;
+
+        // Returns false when the dead list ran out of slots
+        bool Allocate(uint32_t& nIndex);
+        void Free(uint32_t nIndex);
+
+        // Gives every cached slot back to the dead list
+        void Flush();
+
+        uint32_t GetCachedCount() const             { return m_nCount; }
+
+    private:
+        ParticleDeadList& m_deadList;
+        uint32_t m_nCount = 0;
+        uint32_t m_indices[2 * BatchSize];
+    };
+
+private:
+    // Fills the entries above the top of the stack with InvalidIndex
+    void ClearAboveTop();
+
+    std::atomic<uint32_t> m_nParticleCount;
+    uint32_t m_nCapacity;
+    std::unique_ptr<std::atomic<uint32_t>[]> m_availableIndices;
+};
+
+struct DeadListBenchmarkResult
+{
+    uint32_t nThreadCount;
+    uint32_t nCapacity;
+    double fMillionSlotsPerSecond;      // Reserved and released, counted once each
+    uint32_t nDuplicateCount;           // Slots handed out to two owners at once, has to be zero
+    uint32_t nLostCount;                // Slots missing from the list after all threads flushed, has to be zero
+};
+
+// Runs nThreadCount threads nRoundCount times over a dead list of nCapacity slots. Every thread mixes bulk reserves and
+// releases with magazine allocations and frees, so reserves and releases overlap all the time. Every slot that is
+// handed out gets marked in an ownership table, so a slot handed out twice or never given back shows up in the result.
+DeadListBenchmarkResult BenchmarkDeadList(uint32_t nThreadCount, uint32_t nCapacity, uint32_t nRoundCount);
@@ -0,0 +1,70 @@
+#include "ParticleDevice.h"
+
+const char* GetParticleResourceName(ParticleResource resource)
+{
+    static const char* const StreamResourceNames[2][ParticleStreamCount] =
+    {
+        { "Position0", "Scale0", "Velocity0", "Rotation0", "Lifetime0", "Color0" },
+        { "Position1", "Scale1", "Velocity1", "Rotation1", "Lifetime1", "Color1" },
+    };
+    static const char* const BackBufferNames[ParticleMaxBackBufferCount] = { "BackBuffer0", "BackBuffer1", "BackBuffer2" };
+
+    uint32_t nResource = (uint32_t)resource;
+    if (resource < ParticleResource::DeadList)
+    {
+        return StreamResourceNames[nResource / ParticleStreamCount][nResource % ParticleStreamCount];
+    }
+    if (resource >= ParticleResource::BackBuffers && resource < ParticleResource::Count)
+    {
+        return BackBufferNames[nResource - (uint32_t)ParticleResource::BackBuffers];
+    }
+
+    switch (resource)
+    {
+    case ParticleResource::DeadList:                        return "DeadList";
+    case ParticleResource::AliveList0:                      return "AliveList0";
+    case ParticleResource::AliveList1:                      return "AliveList1";
+    case ParticleResource::DrawArgs0:                       return "DrawArgs0";
+    case ParticleResource::DrawArgs1:                       return "DrawArgs1";
+    case ParticleResource::DispatchArgs:                    return "DispatchArgs";
+    case ParticleResource::EmitterParticleCounts:           return "EmitterParticleCounts";
+    case ParticleResource::HashCellCounts:                  return "HashCellCounts";
+    case ParticleResource::HashCellStarts:                  return "HashCellStarts";
+    case ParticleResource::HashParticleCells:               return "HashParticleCells";
+    case ParticleResource::HashSortedParticles:             return "HashSortedParticles";
+    case ParticleResource::CollisionImpulses:               return "CollisionImpulses";
+    case ParticleResource::CompactionGroupOffsets:          return "CompactionGroupOffsets";
+    case ParticleResource::TileParticleCounts:              return "TileParticleCounts";
+    case ParticleResource::TileOffsets:                     return "TileOffsets";
+    case ParticleResource::ParticleRasterSetups:            return "ParticleRasterSetups";
+    case ParticleResource::TileIndices:                     return "TileIndices";
+    case ParticleResource::TileOutput:                      return "TileOutput";
+    case ParticleResource::ParticleCountReadback:           return "ParticleCountReadback";
+    case ParticleResource::EmitterParticleCountsReadback:   return "EmitterParticleCountsReadback";
+    case ParticleResource::DeadListReadback:                return "DeadListReadback";
+    case ParticleResource::TileListCountersReadback:        return "TileListCountersReadback";
+    case ParticleResource::TimestampReadback:               return "TimestampReadback";
+    default:                                                return "All";
+    }
+}
+
+const char* GetParticleResourceStateName(ParticleResourceState state)
+{
+    static const char* const Names[(int)ParticleResourceState::Count] =
+    {
+        "Common", "UnorderedAccess", "NonPixelShaderResource", "PixelShaderResource", "IndirectArgument", "CopySource", "CopyDest", "RenderTarget", "Present"
+    };
+    return Names[(int)state];
+}
+
+const char* GetParticlePassName(ParticlePass pass)
+{
+    static const char* const Names[(int)ParticlePass::Count] =
+    {
+        "Generate", "PrepareUpdate", "HashCount", "HashScan", "HashScatter", "Collide", "Move",
+        "CompactCount", "CompactScanGroups", "CompactScatter", "Destroy",
+        "TileCount", "ParticleRasterSetup", "TileScan", "TileScatter", "TileSort", "TileSortSpill", "RasterizeParticles",
+        "DrawParticles", "DrawTileOutput"
+    };
+    return Names[(int)pass];
+}
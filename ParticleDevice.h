@@ -0,0 +1,242 @@
+#pragma once
+
+// What the frame loop needs from a GPU, without D3D12 in it. ParticleFrame.h records the passes of a frame against this,
+// and the backend decides what happens to them:
+//  - ParticleDeviceD3D12 turns them into D3D12 commands for DX12Particles
+//  - ParticleDeviceCPU runs the passes with ParticleSimulationCPU, ParticleTileBinner and ParticleTileRasterizer
+//  - ParticleDeviceRecording only writes them down, so the frame can be checked and timed anywhere
+// Resources are named by ParticleResource and the backend maps them to its own objects. Every pass is a pipeline
+// plus the root arguments the shaders of DX12Particles expect, ParticlePassParams picks the buffers they go to.
+
+#include <cstdint>
+
+// Position, scale, velocity, rotation, lifetime and color, the order of DX12Particles::ParticleBufferTypes
+const uint32_t ParticleStreamCount = 6;
+
+// The swap chain never has more buffers than this
+const uint32_t ParticleMaxBackBufferCount = 3;
+
+// Frames in flight at most. Every one records into its own slot of command memory, see ParticleFramePipeline.
+const uint32_t ParticleMaxFrameLatency = 3;
+
+enum class ParticleQueue
+{
+    Graphics,
+    Compute,
+    Count
+};
+
+enum class ParticleResource
+{
+    ParticleStreams0,                                           // ParticleStreamCount each
+    ParticleStreams1 = ParticleStreams0 + ParticleStreamCount,
+    DeadList = ParticleStreams1 + ParticleStreamCount,
+    AliveList0,
+    AliveList1,
+    DrawArgs0,
+    DrawArgs1,
+    DispatchArgs,
+    EmitterParticleCounts,
+    HashCellCounts,                                             // Zero between the frames
+    HashCellStarts,
+    HashParticleCells,
+    HashSortedParticles,
+    CollisionImpulses,
+    CompactionGroupOffsets,
+    TileParticleCounts,                                         // Zero between the frames
+    TileOffsets,
+    ParticleRasterSetups,
+    TileIndices,                                                // m_ParticleIndicesForTiles, the counters come first
+    TileOutput,
+    ParticleCountReadback,
+    EmitterParticleCountsReadback,
+    DeadListReadback,
+    TileListCountersReadback,
+    TimestampReadback,
+    BackBuffers,                                                // ParticleMaxBackBufferCount of them
+    Count = BackBuffers + ParticleMaxBackBufferCount
+};
+
+// The ones of a ping-pong set or the back buffers
+inline ParticleResource GetParticleStream(uint32_t nBuffer, uint32_t nStream)  { return (ParticleResource)((uint32_t)ParticleResource::ParticleStreams0 + nBuffer * ParticleStreamCount + nStream); }
+inline ParticleResource GetAliveList(uint32_t nBuffer)                          { return (ParticleResource)((uint32_t)ParticleResource::AliveList0 + nBuffer); }
+inline ParticleResource GetDrawArgs(uint32_t nBuffer)                           { return (ParticleResource)((uint32_t)ParticleResource::DrawArgs0 + nBuffer); }
+inline ParticleResource GetBackBuffer(uint32_t nBuffer)                         { return (ParticleResource)((uint32_t)ParticleResource::BackBuffers + nBuffer); }
+
+const char* GetParticleResourceName(ParticleResource resource);
+
+// The D3D12_RESOURCE_STATES the frame uses
+enum class ParticleResourceState
+{
+    Common,
+    UnorderedAccess,
+    NonPixelShaderResource,
+    PixelShaderResource,
+    IndirectArgument,
+    CopySource,
+    CopyDest,
+    RenderTarget,
+    Present,
+    Count
+};
+
+const char* GetParticleResourceStateName(ParticleResourceState state);
+
+// Same as D3D12_RESOURCE_BARRIER_FLAGS, a split transition is begun in one place and ended in another
+enum class ParticleBarrierFlags
+{
+    None,
+    BeginOnly,
+    EndOnly
+};
+
+struct ParticleBarrier
+{
+    enum class Type
+    {
+        Transition,
+        UnorderedAccess,
+        Aliasing        // The resource takes over memory another one used before
+    };
+
+    Type type;
+    ParticleResource resource;      // Count for an unordered access barrier on every resource
+    ParticleResourceState before;
+    ParticleResourceState after;
+    ParticleBarrierFlags flags;
+
+    static ParticleBarrier Transition(ParticleResource resource, ParticleResourceState before, ParticleResourceState after, ParticleBarrierFlags flags = ParticleBarrierFlags::None)
+    {
+        return { Type::Transition, resource, before, after, flags };
+    }
+
+    static ParticleBarrier UnorderedAccess(ParticleResource resource = ParticleResource::Count)
+    {
+        return { Type::UnorderedAccess, resource, ParticleResourceState::UnorderedAccess, ParticleResourceState::UnorderedAccess, ParticleBarrierFlags::None };
+    }
+
+    // Whatever used the memory before, like a null pResourceBefore
+    static ParticleBarrier Aliasing(ParticleResource resource)
+    {
+        return { Type::Aliasing, resource, ParticleResourceState::Common, ParticleResourceState::Common, ParticleBarrierFlags::None };
+    }
+};
+
+// Every compute shader of ParticleCompute.hlsl and ParticleTile.hlsl the frame dispatches and the two draws
+enum class ParticlePass
+{
+    Generate,
+    PrepareUpdate,
+    HashCount,
+    HashScan,
+    HashScatter,
+    Collide,
+    Move,
+    CompactCount,
+    CompactScanGroups,
+    CompactScatter,
+    Destroy,
+    TileCount,
+    ParticleRasterSetup,
+    TileScan,
+    TileScatter,
+    TileSort,
+    TileSortSpill,
+    RasterizeParticles,
+    DrawParticles,
+    DrawTileOutput,
+    Count
+};
+
+const char* GetParticlePassName(ParticlePass pass);
+
+// The draws go to the graphics queue, the rest are compute shaders
+inline bool IsParticleDrawPass(ParticlePass pass)   { return pass == ParticlePass::DrawParticles || pass == ParticlePass::DrawTileOutput; }
+inline bool IsParticleTilePass(ParticlePass pass)   { return pass >= ParticlePass::TileCount && pass <= ParticlePass::RasterizeParticles; }
+
+// Which of the ping-pong buffers the root arguments of a pass point to
+struct ParticlePassParams
+{
+    uint32_t nConstantBuffer = 0;   // The per frame constants and the emitter table
+    uint32_t nReadBuffer = 0;       // The particle streams bound as SRVs
+    uint32_t nWriteBuffer = 0;      // And as UAVs
+    uint32_t nAliveList = 0;
+    uint32_t nTileSize = 0;         // The tile passes have a pipeline per size
+
+    bool operator==(const ParticlePassParams& other) const
+    {
+        return nConstantBuffer == other.nConstantBuffer && nReadBuffer == other.nReadBuffer && nWriteBuffer == other.nWriteBuffer &&
+            nAliveList == other.nAliveList && nTileSize == other.nTileSize;
+    }
+    bool operator!=(const ParticlePassParams& other) const { return !(*this == other); }
+};
+
+// The commands of one queue. Everything between two BeginPass calls belongs to the first pass.
+class ParticleCommandList
+{
+public:
+    virtual ~ParticleCommandList() {}
+
+    // Sets the pipeline of the pass and its root arguments
+    virtual void BeginPass(ParticlePass pass, const ParticlePassParams& params) = 0;
+
+    virtual void Dispatch(uint32_t nGroupCountX, uint32_t nGroupCountY, uint32_t nGroupCountZ) = 0;
+
+    // The group counts are three uints at nArgumentOffset bytes into the arguments
+    virtual void DispatchIndirect(ParticleResource arguments, uint32_t nArgumentOffset) = 0;
+
+    virtual void Draw(uint32_t nVertexCount) = 0;
+    virtual void DrawIndirect(ParticleResource arguments, uint32_t nArgumentOffset) = 0;
+
+    virtual void ResourceBarrier(const ParticleBarrier* pBarriers, uint32_t nCount) = 0;
+    void ResourceBarrier(const ParticleBarrier& barrier)    { ResourceBarrier(&barrier, 1); }
+
+    virtual void CopyBufferRegion(ParticleResource destination, uint32_t nDestinationOffset, ParticleResource source, uint32_t nSourceOffset, uint32_t nSize) = 0;
+    virtual void CopyResource(ParticleResource destination, ParticleResource source) = 0;
+
+    // Zeroes a texture that's in the unordered access state
+    virtual void ClearUnorderedAccess(ParticleResource resource) = 0;
+
+    // Binds the render target with the viewport of the window and clears it
+    virtual void SetRenderTarget(ParticleResource renderTarget, const float* pClearColor) = 0;
+
+    // Timestamps go to a query heap and ResolveTimestamps copies them to ParticleResource::TimestampReadback
+    virtual void WriteTimestamp(uint32_t nQuery) = 0;
+    virtual void ResolveTimestamps(uint32_t nFirstQuery, uint32_t nCount) = 0;
+};
+
+// The queues, a fence timeline shared by both and the readbacks.
+// The fence values go up with every Signal, whatever queue it's on, and any queue can wait for any of them.
+class ParticleDevice
+{
+public:
+    virtual ~ParticleDevice() {}
+
+    // The lists are recorded into the command memory of the slot from here on. Everything the slot's last frame
+    // submitted has to be done, nothing else knows when the memory can be reused.
+    virtual void BeginFrame(uint32_t nFrameSlot) = 0;
+
+    // Resets the queue's command list, only one can be open per queue. A queue can submit several lists in a frame,
+    // they share the slot's command memory.
+    virtual ParticleCommandList& Open(ParticleQueue queue) = 0;
+
+    // Closes the list of the queue and executes it
+    virtual void Submit(ParticleQueue queue) = 0;
+
+    // Returns the fence value the queue reaches once everything submitted so far is done
+    virtual uint64_t Signal(ParticleQueue queue) = 0;
+
+    // The queue doesn't start on what's submitted after this until the fence has the value
+    virtual void Wait(ParticleQueue queue, uint64_t nFenceValue) = 0;
+
+    virtual void WaitOnCpu(uint64_t nFenceValue) = 0;
+    virtual bool IsFenceComplete(uint64_t nFenceValue) = 0;
+
+    virtual void Present() = 0;
+
+    // Only for the readback resources, and only once the fence says the copies are done
+    virtual void ReadBuffer(ParticleResource resource, uint32_t nOffset, uint32_t nSize, void* pData) = 0;
+
+    // Signals the queue and waits for it on the CPU
+    void Flush(ParticleQueue queue)                     { WaitOnCpu(Signal(queue)); }
+};
@@ -0,0 +1,136 @@
+#include "ParticleDeviceCPU.h"
+#include "ParticleTileBinner.h"
+#include "ParticleTileRasterizer.h"
+#include "EmitterConstants.h"
+#include "TileConstants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+ParticleDeviceCPU::ParticleDeviceCPU(ParticleSimulationCPU& simulation, ParticleTileBinner* pBinner, ParticleTileRasterizer* pRasterizer, JobSystem* pJobSystem) :
+    m_simulation(simulation),
+    m_pBinner(pBinner),
+    m_pRasterizer(pRasterizer),
+    m_pJobSystem(pJobSystem)
+{
+}
+
+ParticleCommandList& ParticleDeviceCPU::Open(ParticleQueue queue)
+{
+    CommandList& commandList = m_commandLists[(int)queue];
+    commandList.m_pass = ParticlePass::Count;
+    commandList.m_commands.clear();
+    return commandList;
+}
+
+void ParticleDeviceCPU::Submit(ParticleQueue queue)
+{
+    for (const CommandList::Command& command : m_commandLists[(int)queue].m_commands)
+    {
+        Execute(command);
+    }
+}
+
+uint64_t ParticleDeviceCPU::Signal(ParticleQueue /*queue*/)
+{
+    return ++m_nFenceValue;
+}
+
+void ParticleDeviceCPU::ReadBuffer(ParticleResource resource, uint32_t nOffset, uint32_t nSize, void* pData)
+{
+    memset(pData, 0, nSize);
+
+    const std::vector<uint32_t>& readback = m_readbacks[(int)resource];
+    uint32_t nReadbackSize = (uint32_t)(readback.size() * sizeof(uint32_t));
+    if (nOffset < nReadbackSize)
+    {
+        memcpy(pData, reinterpret_cast<const uint8_t*>(readback.data()) + nOffset, std::min(nSize, nReadbackSize - nOffset));
+    }
+}
+
+void ParticleDeviceCPU::Execute(const CommandList::Command& command)
+{
+    const ParticleStreams& streams = m_simulation.GetStreams();
+
+    if (command.readback != ParticleResource::Count)
+    {
+        std::vector<uint32_t>& readback = m_readbacks[(int)command.readback];
+        switch (command.readback)
+        {
+        case ParticleResource::ParticleCountReadback:
+            readback.assign(1, m_simulation.GetParticleCount());
+            break;
+        case ParticleResource::EmitterParticleCountsReadback:
+            readback.assign(MAX_EMITTER_COUNT, 0);
+            for (uint32_t iEmitter = 0; iEmitter < MAX_EMITTER_COUNT; iEmitter++)
+            {
+                if (m_simulation.IsEmitterValid(iEmitter))
+                {
+                    readback[iEmitter] = m_simulation.GetEmitterParticleCount(iEmitter);
+                }
+            }
+            break;
+        case ParticleResource::TileListCountersReadback:
+            readback.assign(TILE_COUNTER_COUNT, 0);
+            if (m_pBinner)
+            {
+                // No list has a capacity on the CPU, nothing spills or gets dropped
+                readback[TILE_COUNTER_LIST_ENTRIES] = m_pBinner->GetOverlapCount();
+                readback[TILE_COUNTER_LARGEST_TILE] = m_pBinner->GetOverflow().nLargestTileCount;
+                readback[TILE_COUNTER_BINNED_PARTICLES] = m_pBinner->GetBinnedParticleCount();
+                readback[TILE_COUNTER_OCCUPIED_TILES] = m_pBinner->GetOccupiedTileCount();
+            }
+            if (m_pRasterizer)
+            {
+                readback[TILE_COUNTER_SATURATED_PIXELS] = (uint32_t)m_pRasterizer->GetCompositeStats().nSaturatedPixelCount;
+            }
+            break;
+        default:
+            break;
+        }
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    switch (command.pass)
+    {
+    case ParticlePass::Generate:
+        m_simulation.Generate(m_constants);
+        break;
+    case ParticlePass::Move:
+        m_simulation.Update(m_constants);
+        break;
+    case ParticlePass::TileCount:
+        if (m_pBinner)
+        {
+            if (command.params.nTileSize != 0 && command.params.nTileSize != m_pBinner->GetTileSize())
+            {
+                m_pBinner->SetTileSize(command.params.nTileSize);
+            }
+            m_pBinner->Bin(streams.Positions.data(), streams.Scales.data(), streams.Rotations.data(), m_simulation.GetAliveIndices(), m_simulation.GetAliveCount(), m_pJobSystem);
+        }
+        break;
+    case ParticlePass::RasterizeParticles:
+        if (m_pBinner && m_pRasterizer)
+        {
+            m_pRasterizer->Rasterize(*m_pBinner, streams.Positions.data(), streams.Scales.data(), streams.Rotations.data(), streams.Colors.data(),
+                m_simulation.GetAliveIndices(), m_simulation.GetAliveCount(), m_pJobSystem);
+        }
+        break;
+    default:
+        break;
+    }
+    m_nPassNanoseconds[(int)command.pass] = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void ParticleDeviceCPU::CommandList::AddPass()
+{
+    m_commands.push_back({ m_pass, m_params, ParticleResource::Count });
+}
+
+// Only the destination matters, the counts are taken when the copy runs
+void ParticleDeviceCPU::CommandList::CopyBufferRegion(ParticleResource destination, uint32_t /*nDestinationOffset*/, ParticleResource /*source*/, uint32_t /*nSourceOffset*/, uint32_t /*nSize*/)
+{
+    m_commands.push_back({ ParticlePass::Count, ParticlePassParams(), destination });
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+// Backend that runs the frame on the CPU engine. The GPU splits the work into more passes than the CPU versions have,
+// so every CPU call stands in for a group of them and the other passes of the group don't do anything:
+//  - Generate is ParticleSimulationCPU::Generate
+//  - Move is ParticleSimulationCPU::Update, which also does what PrepareUpdate, the spatial hash, Collide, the compaction
+//    and Destroy do on the GPU
+//  - TileCount is ParticleTileBinner::Bin, with the scan, the scatter and the sorts
+//  - RasterizeParticles is ParticleTileRasterizer::Rasterize, with the setup
+// The draws and the barriers don't do anything either. A list runs on Submit, so the fence values are reached right away.
+// The copies to the readbacks take the particle counts and the tile list counters the GPU would have copied, the rest
+// of the readbacks stay zero.
+
+#include "ParticleDevice.h"
+#include "ParticleSimulationCPU.h"
+
+#include <cstdint>
+#include <vector>
+
+class JobSystem;
+class ParticleTileBinner;
+class ParticleTileRasterizer;
+
+class ParticleDeviceCPU : public ParticleDevice
+{
+public:
+    // The binner and the rasterizer can be null if no frame bins the tiles. The binner keeps its resolution,
+    // the tile size comes from the passes.
+    ParticleDeviceCPU(ParticleSimulationCPU& simulation, ParticleTileBinner* pBinner, ParticleTileRasterizer* pRasterizer, JobSystem* pJobSystem);
+
+    // What the per frame constant buffer would hold, for Generate and Move
+    void SetFrameConstants(const ParticleFrameConstants& constants)    { m_constants = constants; }
+
+    virtual void BeginFrame(uint32_t /*nFrameSlot*/)                    {}
+    virtual ParticleCommandList& Open(ParticleQueue queue);
+    virtual void Submit(ParticleQueue queue);
+    virtual uint64_t Signal(ParticleQueue queue);
+    virtual void Wait(ParticleQueue /*queue*/, uint64_t /*nFenceValue*/)   {}
+    virtual void WaitOnCpu(uint64_t /*nFenceValue*/)                    {}
+    virtual bool IsFenceComplete(uint64_t nFenceValue)                  { return nFenceValue <= m_nFenceValue; }
+    virtual void Present()                                              {}
+    virtual void ReadBuffer(ParticleResource resource, uint32_t nOffset, uint32_t nSize, void* pData);
+
+    // Wall clock time of the pass in the last list that had it, zero for the ones that don't do anything
+    uint64_t GetPassNanoseconds(ParticlePass pass) const                { return m_nPassNanoseconds[(int)pass]; }
+
+private:
+    // Only the passes that dispatch and the copies to the readbacks are kept
+    class CommandList : public ParticleCommandList
+    {
+    public:
+        virtual void BeginPass(ParticlePass pass, const ParticlePassParams& params)         { m_pass = pass; m_params = params; }
+        virtual void Dispatch(uint32_t /*nGroupCountX*/, uint32_t /*nGroupCountY*/, uint32_t /*nGroupCountZ*/)   { AddPass(); }
+        virtual void DispatchIndirect(ParticleResource /*arguments*/, uint32_t /*nArgumentOffset*/)    { AddPass(); }
+        virtual void Draw(uint32_t /*nVertexCount*/)                                        {}
+        virtual void DrawIndirect(ParticleResource /*arguments*/, uint32_t /*nArgumentOffset*/) {}
+        virtual void ResourceBarrier(const ParticleBarrier* /*pBarriers*/, uint32_t /*nCount*/) {}
+        virtual void CopyBufferRegion(ParticleResource destination, uint32_t nDestinationOffset, ParticleResource source, uint32_t nSourceOffset, uint32_t nSize);
+        virtual void CopyResource(ParticleResource destination, ParticleResource source)    { CopyBufferRegion(destination, 0, source, 0, 0); }
+        virtual void ClearUnorderedAccess(ParticleResource /*resource*/)                    {}
+        virtual void SetRenderTarget(ParticleResource /*renderTarget*/, const float* /*pClearColor*/)   {}
+        virtual void WriteTimestamp(uint32_t /*nQuery*/)                                    {}
+        virtual void ResolveTimestamps(uint32_t /*nFirstQuery*/, uint32_t /*nCount*/)       {}
+
+        void AddPass();
+
+        // A pass with its params, or a copy to a readback when readback isn't Count
+        struct Command
+        {
+            ParticlePass pass;
+            ParticlePassParams params;
+            ParticleResource readback;
+        };
+
+        ParticlePass m_pass = ParticlePass::Count;
+        ParticlePassParams m_params;
+        std::vector<Command> m_commands;
+    };
+
+    void Execute(const CommandList::Command& command);
+
+    ParticleSimulationCPU& m_simulation;
+    ParticleTileBinner* m_pBinner;
+    ParticleTileRasterizer* m_pRasterizer;
+    JobSystem* m_pJobSystem;
+    ParticleFrameConstants m_constants;
+
+    CommandList m_commandLists[(int)ParticleQueue::Count];
+    std::vector<uint32_t> m_readbacks[(int)ParticleResource::Count];
+    uint64_t m_nPassNanoseconds[(int)ParticlePass::Count] = {};
+    uint64_t m_nFenceValue = 0;
+};
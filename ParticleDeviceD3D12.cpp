@@ -0,0 +1,281 @@
+#include "stdafx.h"
+#include "DXSampleHelper.h"
+#include "ParticleDeviceD3D12.h"
+
+#include <cassert>
+
+static const D3D12_RESOURCE_STATES ResourceStates[(int)ParticleResourceState::Count] =
+{
+    D3D12_RESOURCE_STATE_COMMON,
+    D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+    D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE,
+    D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE,
+    D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT,
+    D3D12_RESOURCE_STATE_COPY_SOURCE,
+    D3D12_RESOURCE_STATE_COPY_DEST,
+    D3D12_RESOURCE_STATE_RENDER_TARGET,
+    D3D12_RESOURCE_STATE_PRESENT,
+};
+
+static const D3D12_RESOURCE_BARRIER_FLAGS BarrierFlags[] =
+{
+    D3D12_RESOURCE_BARRIER_FLAG_NONE,
+    D3D12_RESOURCE_BARRIER_FLAG_BEGIN_ONLY,
+    D3D12_RESOURCE_BARRIER_FLAG_END_ONLY,
+};
+
+ParticleDeviceD3D12::ParticleDeviceD3D12(ParticleD3D12Bindings& bindings, ID3D12Device* pDevice) :
+    m_bindings(bindings)
+{
+    for (CommandList& commandList : m_commandLists)
+    {
+        commandList.m_pDevice = this;
+    }
+
+    for (UINT iQueue = 0; iQueue < (UINT)ParticleQueue::Count; iQueue++)
+    {
+        ThrowIfFailed(pDevice->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&m_fences[iQueue])));
+        NAME_D3D12_OBJECT_INDEXED(m_fences, iQueue);
+    }
+
+    m_fenceEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (m_fenceEvent == nullptr)
+    {
+        ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
+    }
+}
+
+ParticleDeviceD3D12::~ParticleDeviceD3D12()
+{
+    CloseHandle(m_fenceEvent);
+}
+
+void ParticleDeviceD3D12::SetQueue(ParticleQueue queue, ID3D12CommandQueue* pCommandQueue, ID3D12CommandAllocator* const* ppCommandAllocators, UINT nFrameSlotCount,
+    ID3D12GraphicsCommandList* pCommandList)
+{
+    assert(nFrameSlotCount <= ParticleMaxFrameLatency);
+
+    CommandList& commandList = m_commandLists[(int)queue];
+    commandList.m_pCommandQueue = pCommandQueue;
+    for (UINT iSlot = 0; iSlot < nFrameSlotCount; iSlot++)
+    {
+        commandList.m_pCommandAllocators[iSlot] = ppCommandAllocators[iSlot];
+    }
+    commandList.m_pCommandList = pCommandList;
+}
+
+void ParticleDeviceD3D12::SetCommandSignatures(ID3D12CommandSignature* pDispatchSignature, ID3D12CommandSignature* pDrawSignature)
+{
+    m_pDispatchSignature = pDispatchSignature;
+    m_pDrawSignature = pDrawSignature;
+}
+
+void ParticleDeviceD3D12::SetTimestampQueries(ID3D12QueryHeap* pQueryHeap)
+{
+    m_pQueryHeap = pQueryHeap;
+}
+
+void ParticleDeviceD3D12::SetViewport(const D3D12_VIEWPORT& viewport, const D3D12_RECT& scissorRect)
+{
+    m_viewport = viewport;
+    m_scissorRect = scissorRect;
+}
+
+void ParticleDeviceD3D12::BeginFrame(uint32_t nFrameSlot)
+{
+    assert(m_commandLists[0].m_pCommandAllocators[nFrameSlot] != nullptr);
+    m_nFrameSlot = nFrameSlot;
+    for (CommandList& commandList : m_commandLists)
+    {
+        commandList.m_bResetAllocator = true;
+    }
+}
+
+// The allocator of the slot is only reset by the first list of the frame, every list of the slot's last frame is done by now.
+// The ones after it add to the allocator, the lists before them might still run.
+ParticleCommandList& ParticleDeviceD3D12::Open(ParticleQueue queue)
+{
+    CommandList& commandList = m_commandLists[(int)queue];
+    ID3D12CommandAllocator* pCommandAllocator = commandList.m_pCommandAllocators[m_nFrameSlot];
+    if (commandList.m_bResetAllocator)
+    {
+        ThrowIfFailed(pCommandAllocator->Reset());
+        commandList.m_bResetAllocator = false;
+    }
+    ThrowIfFailed(commandList.m_pCommandList->Reset(pCommandAllocator, nullptr));
+    commandList.m_pRootSignature = nullptr;
+    return commandList;
+}
+
+void ParticleDeviceD3D12::Submit(ParticleQueue queue)
+{
+    CommandList& commandList = m_commandLists[(int)queue];
+    ThrowIfFailed(commandList.m_pCommandList->Close());
+
+    ID3D12CommandList* ppCommandLists[] = { commandList.m_pCommandList };
+    commandList.m_pCommandQueue->ExecuteCommandLists(_countof(ppCommandLists), ppCommandLists);
+}
+
+uint64_t ParticleDeviceD3D12::Signal(ParticleQueue queue)
+{
+    m_nSignalCount++;
+    const UINT64 nFenceValue = m_nSignalCount * (int)ParticleQueue::Count + (int)queue;
+    ThrowIfFailed(m_commandLists[(int)queue].m_pCommandQueue->Signal(GetFence(nFenceValue), nFenceValue));
+    return nFenceValue;
+}
+
+void ParticleDeviceD3D12::Wait(ParticleQueue queue, uint64_t nFenceValue)
+{
+    ThrowIfFailed(m_commandLists[(int)queue].m_pCommandQueue->Wait(GetFence(nFenceValue), nFenceValue));
+}
+
+void ParticleDeviceD3D12::WaitOnCpu(uint64_t nFenceValue)
+{
+    if (!IsFenceComplete(nFenceValue))
+    {
+        ThrowIfFailed(GetFence(nFenceValue)->SetEventOnCompletion(nFenceValue, m_fenceEvent));
+        WaitForSingleObject(m_fenceEvent, INFINITE);
+    }
+}
+
+bool ParticleDeviceD3D12::IsFenceComplete(uint64_t nFenceValue)
+{
+    return GetFence(nFenceValue)->GetCompletedValue() >= nFenceValue;
+}
+
+void ParticleDeviceD3D12::Present()
+{
+    ThrowIfFailed(m_pSwapChain->Present(0, 0));
+}
+
+void ParticleDeviceD3D12::ReadBuffer(ParticleResource resource, uint32_t nOffset, uint32_t nSize, void* pData)
+{
+    ID3D12Resource* pResource = m_bindings.GetResource(resource);
+
+    void* pMapped;
+    CD3DX12_RANGE readRange(nOffset, nOffset + nSize);
+    ThrowIfFailed(pResource->Map(0, &readRange, &pMapped));
+    memcpy(pData, static_cast<const UINT8*>(pMapped) + nOffset, nSize);
+
+    // Nothing was written
+    CD3DX12_RANGE writtenRange(0, 0);
+    pResource->Unmap(0, &writtenRange);
+}
+
+void ParticleDeviceD3D12::CommandList::BeginPass(ParticlePass pass, const ParticlePassParams& params)
+{
+    ParticleD3D12Bindings& bindings = m_pDevice->m_bindings;
+
+    ID3D12RootSignature* pRootSignature = bindings.GetRootSignature(pass);
+    if (pRootSignature != m_pRootSignature || params != m_params)
+    {
+        if (IsParticleDrawPass(pass))
+        {
+            m_pCommandList->SetGraphicsRootSignature(pRootSignature);
+        }
+        else
+        {
+            m_pCommandList->SetComputeRootSignature(pRootSignature);
+        }
+        bindings.SetRootArguments(m_pCommandList, pass, params);
+        m_pRootSignature = pRootSignature;
+        m_params = params;
+    }
+
+    m_pCommandList->SetPipelineState(bindings.GetPipelineState(pass, params));
+    if (IsParticleDrawPass(pass))
+    {
+        m_pCommandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_POINTLIST);
+    }
+}
+
+void ParticleDeviceD3D12::CommandList::Dispatch(uint32_t nGroupCountX, uint32_t nGroupCountY, uint32_t nGroupCountZ)
+{
+    m_pCommandList->Dispatch(nGroupCountX, nGroupCountY, nGroupCountZ);
+}
+
+void ParticleDeviceD3D12::CommandList::DispatchIndirect(ParticleResource arguments, uint32_t nArgumentOffset)
+{
+    m_pCommandList->ExecuteIndirect(m_pDevice->m_pDispatchSignature, 1, m_pDevice->m_bindings.GetResource(arguments), nArgumentOffset, nullptr, 0);
+}
+
+void ParticleDeviceD3D12::CommandList::Draw(uint32_t nVertexCount)
+{
+    m_pCommandList->DrawInstanced(nVertexCount, 1, 0, 0);
+}
+
+void ParticleDeviceD3D12::CommandList::DrawIndirect(ParticleResource arguments, uint32_t nArgumentOffset)
+{
+    m_pCommandList->ExecuteIndirect(m_pDevice->m_pDrawSignature, 1, m_pDevice->m_bindings.GetResource(arguments), nArgumentOffset, nullptr, 0);
+}
+
+void ParticleDeviceD3D12::CommandList::ResourceBarrier(const ParticleBarrier* pBarriers, uint32_t nCount)
+{
+    ParticleD3D12Bindings& bindings = m_pDevice->m_bindings;
+
+    // The frame doesn't batch more than a handful
+    D3D12_RESOURCE_BARRIER barriers[64];
+    while (nCount > 0)
+    {
+        UINT nBatchCount = nCount < _countof(barriers) ? nCount : _countof(barriers);
+        for (UINT iBarrier = 0; iBarrier < nBatchCount; iBarrier++)
+        {
+            const ParticleBarrier& barrier = pBarriers[iBarrier];
+            ID3D12Resource* pResource = barrier.resource == ParticleResource::Count ? nullptr : bindings.GetResource(barrier.resource);
+            if (barrier.type == ParticleBarrier::Type::Transition)
+            {
+                barriers[iBarrier] = CD3DX12_RESOURCE_BARRIER::Transition(pResource, ResourceStates[(int)barrier.before], ResourceStates[(int)barrier.after],
+                    D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES, BarrierFlags[(int)barrier.flags]);
+            }
+            else if (barrier.type == ParticleBarrier::Type::Aliasing)
+            {
+                barriers[iBarrier] = CD3DX12_RESOURCE_BARRIER::Aliasing(nullptr, pResource);
+            }
+            else
+            {
+                barriers[iBarrier] = CD3DX12_RESOURCE_BARRIER::UAV(pResource);
+            }
+        }
+        m_pCommandList->ResourceBarrier(nBatchCount, barriers);
+
+        pBarriers += nBatchCount;
+        nCount -= nBatchCount;
+    }
+}
+
+void ParticleDeviceD3D12::CommandList::CopyBufferRegion(ParticleResource destination, uint32_t nDestinationOffset, ParticleResource source, uint32_t nSourceOffset, uint32_t nSize)
+{
+    ParticleD3D12Bindings& bindings = m_pDevice->m_bindings;
+    m_pCommandList->CopyBufferRegion(bindings.GetResource(destination), nDestinationOffset, bindings.GetResource(source), nSourceOffset, nSize);
+}
+
+void ParticleDeviceD3D12::CommandList::CopyResource(ParticleResource destination, ParticleResource source)
+{
+    ParticleD3D12Bindings& bindings = m_pDevice->m_bindings;
+    m_pCommandList->CopyResource(bindings.GetResource(destination), bindings.GetResource(source));
+}
+
+void ParticleDeviceD3D12::CommandList::ClearUnorderedAccess(ParticleResource resource)
+{
+    m_pDevice->m_bindings.ClearUnorderedAccessView(m_pCommandList, resource);
+}
+
+void ParticleDeviceD3D12::CommandList::SetRenderTarget(ParticleResource renderTarget, const float* pClearColor)
+{
+    D3D12_CPU_DESCRIPTOR_HANDLE rtvHandle = m_pDevice->m_bindings.GetRenderTargetView(renderTarget);
+    m_pCommandList->OMSetRenderTargets(1, &rtvHandle, FALSE, nullptr);
+    m_pCommandList->ClearRenderTargetView(rtvHandle, pClearColor, 0, nullptr);
+    m_pCommandList->RSSetViewports(1, &m_pDevice->m_viewport);
+    m_pCommandList->RSSetScissorRects(1, &m_pDevice->m_scissorRect);
+}
+
+void ParticleDeviceD3D12::CommandList::WriteTimestamp(uint32_t nQuery)
+{
+    m_pCommandList->EndQuery(m_pDevice->m_pQueryHeap, D3D12_QUERY_TYPE_TIMESTAMP, nQuery);
+}
+
+void ParticleDeviceD3D12::CommandList::ResolveTimestamps(uint32_t nFirstQuery, uint32_t nCount)
+{
+    ID3D12Resource* pReadback = m_pDevice->m_bindings.GetResource(ParticleResource::TimestampReadback);
+    m_pCommandList->ResolveQueryData(m_pDevice->m_pQueryHeap, D3D12_QUERY_TYPE_TIMESTAMP, nFirstQuery, nCount, pReadback, nFirstQuery * sizeof(UINT64));
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+// The D3D12 backend. It owns nothing but the fences, the queues, lists and the rest belong to DX12Particles,
+// which also knows the resources, descriptors and pipelines behind the names of ParticleDevice.h.
+// The root arguments only get set again when the root signature or the buffers of the pass change.
+// Every queue signals its own fence, two queues on one fence could make it go backwards. The values are still one
+// timeline: the queue is the remainder of the value, so a wait finds the fence from the value alone.
+
+#include "ParticleDevice.h"
+
+// What the backend asks DX12Particles for
+class ParticleD3D12Bindings
+{
+public:
+    virtual ID3D12Resource* GetResource(ParticleResource resource) = 0;
+    virtual ID3D12RootSignature* GetRootSignature(ParticlePass pass) = 0;
+    virtual ID3D12PipelineState* GetPipelineState(ParticlePass pass, const ParticlePassParams& params) = 0;
+
+    // The root signature is set already, this sets the descriptor heaps and the tables
+    virtual void SetRootArguments(ID3D12GraphicsCommandList* pCommandList, ParticlePass pass, const ParticlePassParams& params) = 0;
+
+    virtual void ClearUnorderedAccessView(ID3D12GraphicsCommandList* pCommandList, ParticleResource resource) = 0;
+    virtual D3D12_CPU_DESCRIPTOR_HANDLE GetRenderTargetView(ParticleResource resource) = 0;
+};
+
+class ParticleDeviceD3D12 : public ParticleDevice
+{
+public:
+    ParticleDeviceD3D12(ParticleD3D12Bindings& bindings, ID3D12Device* pDevice);
+    virtual ~ParticleDeviceD3D12();
+
+    // One allocator per frame slot, BeginFrame picks the one the lists are recorded into
+    void SetQueue(ParticleQueue queue, ID3D12CommandQueue* pCommandQueue, ID3D12CommandAllocator* const* ppCommandAllocators, UINT nFrameSlotCount,
+        ID3D12GraphicsCommandList* pCommandList);
+    void SetCommandSignatures(ID3D12CommandSignature* pDispatchSignature, ID3D12CommandSignature* pDrawSignature);
+    void SetTimestampQueries(ID3D12QueryHeap* pQueryHeap);
+    void SetSwapChain(IDXGISwapChain3* pSwapChain)                      { m_pSwapChain = pSwapChain; }
+    void SetViewport(const D3D12_VIEWPORT& viewport, const D3D12_RECT& scissorRect);
+
+    virtual void BeginFrame(uint32_t nFrameSlot);
+    virtual ParticleCommandList& Open(ParticleQueue queue);
+    virtual void Submit(ParticleQueue queue);
+    virtual uint64_t Signal(ParticleQueue queue);
+    virtual void Wait(ParticleQueue queue, uint64_t nFenceValue);
+    virtual void WaitOnCpu(uint64_t nFenceValue);
+    virtual bool IsFenceComplete(uint64_t nFenceValue);
+    virtual void Present();
+    virtual void ReadBuffer(ParticleResource resource, uint32_t nOffset, uint32_t nSize, void* pData);
+
+private:
+    class CommandList : public ParticleCommandList
+    {
+    public:
+        virtual void BeginPass(ParticlePass pass, const ParticlePassParams& params);
+        virtual void Dispatch(uint32_t nGroupCountX, uint32_t nGroupCountY, uint32_t nGroupCountZ);
+        virtual void DispatchIndirect(ParticleResource arguments, uint32_t nArgumentOffset);
+        virtual void Draw(uint32_t nVertexCount);
+        virtual void DrawIndirect(ParticleResource arguments, uint32_t nArgumentOffset);
+        virtual void ResourceBarrier(const ParticleBarrier* pBarriers, uint32_t nCount);
+        virtual void CopyBufferRegion(ParticleResource destination, uint32_t nDestinationOffset, ParticleResource source, uint32_t nSourceOffset, uint32_t nSize);
+        virtual void CopyResource(ParticleResource destination, ParticleResource source);
+        virtual void ClearUnorderedAccess(ParticleResource resource);
+        virtual void SetRenderTarget(ParticleResource renderTarget, const float* pClearColor);
+        virtual void WriteTimestamp(uint32_t nQuery);
+        virtual void ResolveTimestamps(uint32_t nFirstQuery, uint32_t nCount);
+
+        ParticleDeviceD3D12* m_pDevice = nullptr;
+        ID3D12CommandQueue* m_pCommandQueue = nullptr;
+        ID3D12CommandAllocator* m_pCommandAllocators[ParticleMaxFrameLatency] = {};
+        ID3D12GraphicsCommandList* m_pCommandList = nullptr;
+        bool m_bResetAllocator = true;      // Until the first Open after BeginFrame
+
+        // What's bound since the last Open
+        ID3D12RootSignature* m_pRootSignature = nullptr;
+        ParticlePassParams m_params;
+    };
+
+    ParticleD3D12Bindings& m_bindings;
+    CommandList m_commandLists[(int)ParticleQueue::Count];
+
+    ID3D12Fence* GetFence(uint64_t nFenceValue)                        { return m_fences[nFenceValue % (int)ParticleQueue::Count].Get(); }
+
+    Microsoft::WRL::ComPtr<ID3D12Fence> m_fences[(int)ParticleQueue::Count];
+    HANDLE m_fenceEvent;
+    UINT64 m_nSignalCount = 0;
+    UINT m_nFrameSlot = 0;
+
+    ID3D12CommandSignature* m_pDispatchSignature = nullptr;
+    ID3D12CommandSignature* m_pDrawSignature = nullptr;
+    ID3D12QueryHeap* m_pQueryHeap = nullptr;
+    IDXGISwapChain3* m_pSwapChain = nullptr;
+    D3D12_VIEWPORT m_viewport = {};
+    D3D12_RECT m_scissorRect = {};
+};
@@ -0,0 +1,390 @@
+#include "ParticleDeviceRecording.h"
+
+#include <cassert>
+#include <cstring>
+
+static const char* const QueueNames[(int)ParticleQueue::Count] = { "Graphics", "Compute" };
+
+ParticleDeviceRecording::ParticleDeviceRecording()
+{
+    for (int iQueue = 0; iQueue < (int)ParticleQueue::Count; iQueue++)
+    {
+        m_commandLists[iQueue].m_queue = (ParticleQueue)iQueue;
+    }
+    for (ParticleResourceState& state : m_resourceStates)
+    {
+        state = ParticleResourceState::Common;
+    }
+}
+
+void ParticleDeviceRecording::BeginFrame(uint32_t nFrameSlot)
+{
+    assert(nFrameSlot < ParticleMaxFrameLatency);
+    if (m_fSlotEndMicroseconds[nFrameSlot] > m_fCpuMicroseconds)
+    {
+        m_nFrameSlotHazardCount++;
+    }
+    m_nFrameSlot = nFrameSlot;
+    Add(ParticleQueue::Graphics, ParticleRecordedCommand::Type::BeginFrame).nOffset = nFrameSlot;
+}
+
+ParticleCommandList& ParticleDeviceRecording::Open(ParticleQueue queue)
+{
+    CommandList& commandList = m_commandLists[(int)queue];
+    assert(!commandList.m_bOpen);
+    commandList.m_bOpen = true;
+    commandList.m_pass = ParticlePass::Count;
+    commandList.m_params = ParticlePassParams();
+    commandList.m_commands.clear();
+    commandList.m_barriers.clear();
+    return commandList;
+}
+
+// The barriers take effect in the order the queues execute them, which is the order of the submits
+void ParticleDeviceRecording::Submit(ParticleQueue queue)
+{
+    CommandList& commandList = m_commandLists[(int)queue];
+    assert(commandList.m_bOpen);
+    commandList.m_bOpen = false;
+
+    double fDuration = 0.0;
+    for (const ParticleRecordedCommand& command : commandList.m_commands)
+    {
+        switch (command.type)
+        {
+        case ParticleRecordedCommand::Type::Dispatch:
+        case ParticleRecordedCommand::Type::DispatchIndirect:
+        case ParticleRecordedCommand::Type::Draw:
+        case ParticleRecordedCommand::Type::DrawIndirect:
+            fDuration += m_fPassMicroseconds[(int)command.pass];
+            break;
+        default:
+            break;
+        }
+    }
+
+    double& fQueueMicroseconds = m_fQueueMicroseconds[(int)queue];
+    ParticleRecordedCommand& execute = Add(queue, ParticleRecordedCommand::Type::Execute);
+    execute.fStartMicroseconds = fQueueMicroseconds > m_fCpuMicroseconds ? fQueueMicroseconds : m_fCpuMicroseconds;
+    execute.fEndMicroseconds = execute.fStartMicroseconds + fDuration;
+    fQueueMicroseconds = execute.fEndMicroseconds;
+
+    double& fSlotEndMicroseconds = m_fSlotEndMicroseconds[m_nFrameSlot];
+    if (fSlotEndMicroseconds < fQueueMicroseconds)
+    {
+        fSlotEndMicroseconds = fQueueMicroseconds;
+    }
+
+    const uint32_t nBarrierBase = (uint32_t)m_barriers.size();
+    for (ParticleRecordedCommand command : commandList.m_commands)
+    {
+        if (command.type == ParticleRecordedCommand::Type::ResourceBarrier)
+        {
+            for (uint32_t iBarrier = 0; iBarrier < command.nBarrierCount; iBarrier++)
+            {
+                const ParticleBarrier& barrier = commandList.m_barriers[command.nFirstBarrier + iBarrier];
+                if (barrier.type != ParticleBarrier::Type::Transition)
+                {
+                    continue;
+                }
+
+                // The resource is somewhere in between until the end of a split transition
+                ParticleResourceState& state = m_resourceStates[(int)barrier.resource];
+                if (barrier.flags != ParticleBarrierFlags::EndOnly && state != barrier.before)
+                {
+                    m_nStateMismatchCount++;
+                }
+                if (barrier.flags != ParticleBarrierFlags::BeginOnly)
+                {
+                    state = barrier.after;
+                }
+            }
+            command.nFirstBarrier += nBarrierBase;
+        }
+        m_commands.push_back(command);
+    }
+    m_barriers.insert(m_barriers.end(), commandList.m_barriers.begin(), commandList.m_barriers.end());
+}
+
+ParticleRecordedCommand& ParticleDeviceRecording::Add(ParticleQueue queue, ParticleRecordedCommand::Type type)
+{
+    ParticleRecordedCommand command = {};
+    command.type = type;
+    command.queue = queue;
+    command.pass = ParticlePass::Count;
+    m_commands.push_back(command);
+    return m_commands.back();
+}
+
+// The value is reached once the queue is done with everything before the signal
+uint64_t ParticleDeviceRecording::Signal(ParticleQueue queue)
+{
+    m_nFenceValue++;
+    m_fenceMicroseconds.push_back(m_fQueueMicroseconds[(int)queue]);
+    Add(queue, ParticleRecordedCommand::Type::Signal).nFenceValue = m_nFenceValue;
+    return m_nFenceValue;
+}
+
+double ParticleDeviceRecording::GetFenceMicroseconds(uint64_t nFenceValue)
+{
+    if (nFenceValue == 0)
+    {
+        return 0.0;
+    }
+    if (nFenceValue > m_nFenceValue)
+    {
+        m_nUnsignaledWaitCount++;
+        return 0.0;
+    }
+    return m_fenceMicroseconds[nFenceValue - 1];
+}
+
+// Nothing on the queue after the wait starts before the value is reached
+void ParticleDeviceRecording::Wait(ParticleQueue queue, uint64_t nFenceValue)
+{
+    double fFenceMicroseconds = GetFenceMicroseconds(nFenceValue);
+    double& fQueueMicroseconds = m_fQueueMicroseconds[(int)queue];
+    if (fQueueMicroseconds < fFenceMicroseconds)
+    {
+        fQueueMicroseconds = fFenceMicroseconds;
+    }
+    Add(queue, ParticleRecordedCommand::Type::Wait).nFenceValue = nFenceValue;
+}
+
+void ParticleDeviceRecording::WaitOnCpu(uint64_t nFenceValue)
+{
+    double fFenceMicroseconds = GetFenceMicroseconds(nFenceValue);
+    ParticleRecordedCommand& command = Add(ParticleQueue::Graphics, ParticleRecordedCommand::Type::WaitOnCpu);
+    command.nFenceValue = nFenceValue;
+    command.fStartMicroseconds = m_fCpuMicroseconds;
+    if (m_fCpuMicroseconds < fFenceMicroseconds)
+    {
+        m_fCpuWaitMicroseconds += fFenceMicroseconds - m_fCpuMicroseconds;
+        m_fCpuMicroseconds = fFenceMicroseconds;
+    }
+    command.fEndMicroseconds = m_fCpuMicroseconds;
+}
+
+bool ParticleDeviceRecording::IsFenceComplete(uint64_t nFenceValue)
+{
+    if (nFenceValue == 0)
+    {
+        return true;
+    }
+    return nFenceValue <= m_nFenceValue && m_fenceMicroseconds[nFenceValue - 1] <= m_fCpuMicroseconds;
+}
+
+void ParticleDeviceRecording::AdvanceCpu(double fMicroseconds)
+{
+    ParticleRecordedCommand& command = Add(ParticleQueue::Graphics, ParticleRecordedCommand::Type::CpuWork);
+    command.fStartMicroseconds = m_fCpuMicroseconds;
+    m_fCpuMicroseconds += fMicroseconds;
+    command.fEndMicroseconds = m_fCpuMicroseconds;
+}
+
+void ParticleDeviceRecording::Present()
+{
+    Add(ParticleQueue::Graphics, ParticleRecordedCommand::Type::Present);
+}
+
+void ParticleDeviceRecording::ReadBuffer(ParticleResource /*resource*/, uint32_t /*nOffset*/, uint32_t nSize, void* pData)
+{
+    memset(pData, 0, nSize);
+}
+
+void ParticleDeviceRecording::ClearCommands()
+{
+    m_commands.clear();
+    m_barriers.clear();
+}
+
+void ParticleDeviceRecording::Print(std::ostream& stream) const
+{
+    typedef ParticleRecordedCommand::Type Type;
+
+    for (const ParticleRecordedCommand& command : m_commands)
+    {
+        const bool bCpu = command.type == Type::WaitOnCpu || command.type == Type::CpuWork || command.type == Type::BeginFrame;
+        stream << (bCpu ? "Cpu" : QueueNames[(int)command.queue]) << ' ';
+        if (command.pass != ParticlePass::Count)
+        {
+            stream << GetParticlePassName(command.pass) << ' ';
+        }
+
+        switch (command.type)
+        {
+        case Type::Dispatch:
+            stream << "Dispatch " << command.nGroupCount[0] << ' ' << command.nGroupCount[1] << ' ' << command.nGroupCount[2];
+            break;
+        case Type::DispatchIndirect:
+            stream << "DispatchIndirect " << GetParticleResourceName(command.resource) << '+' << command.nOffset;
+            break;
+        case Type::Draw:
+            stream << "Draw " << command.nGroupCount[0];
+            break;
+        case Type::DrawIndirect:
+            stream << "DrawIndirect " << GetParticleResourceName(command.resource) << '+' << command.nOffset;
+            break;
+        case Type::ResourceBarrier:
+            stream << "ResourceBarrier";
+            for (uint32_t iBarrier = 0; iBarrier < command.nBarrierCount; iBarrier++)
+            {
+                const ParticleBarrier& barrier = m_barriers[command.nFirstBarrier + iBarrier];
+                stream << ' ' << GetParticleResourceName(barrier.resource);
+                if (barrier.type == ParticleBarrier::Type::Transition)
+                {
+                    stream << ' ' << GetParticleResourceStateName(barrier.before) << "->" << GetParticleResourceStateName(barrier.after);
+                    if (barrier.flags == ParticleBarrierFlags::BeginOnly)
+                    {
+                        stream << " (begin)";
+                    }
+                    else if (barrier.flags == ParticleBarrierFlags::EndOnly)
+                    {
+                        stream << " (end)";
+                    }
+                }
+                else if (barrier.type == ParticleBarrier::Type::Aliasing)
+                {
+                    stream << " Aliasing";
+                }
+                else
+                {
+                    stream << " UAV";
+                }
+            }
+            break;
+        case Type::CopyBufferRegion:
+            stream << "CopyBufferRegion " << GetParticleResourceName(command.resource) << '+' << command.nOffset << " <- "
+                << GetParticleResourceName(command.source) << '+' << command.nSourceOffset << ' ' << command.nSize;
+            break;
+        case Type::CopyResource:
+            stream << "CopyResource " << GetParticleResourceName(command.resource) << " <- " << GetParticleResourceName(command.source);
+            break;
+        case Type::ClearUnorderedAccess:
+            stream << "ClearUnorderedAccess " << GetParticleResourceName(command.resource);
+            break;
+        case Type::SetRenderTarget:
+            stream << "SetRenderTarget " << GetParticleResourceName(command.resource);
+            break;
+        case Type::WriteTimestamp:
+            stream << "WriteTimestamp " << command.nOffset;
+            break;
+        case Type::ResolveTimestamps:
+            stream << "ResolveTimestamps " << command.nOffset << ' ' << command.nSize;
+            break;
+        case Type::Signal:
+            stream << "Signal " << command.nFenceValue;
+            break;
+        case Type::Wait:
+            stream << "Wait " << command.nFenceValue;
+            break;
+        case Type::WaitOnCpu:
+            stream << "WaitOnCpu " << command.nFenceValue << ' ' << command.fStartMicroseconds << '-' << command.fEndMicroseconds;
+            break;
+        case Type::Present:
+            stream << "Present";
+            break;
+        case Type::BeginFrame:
+            stream << "BeginFrame " << command.nOffset;
+            break;
+        case Type::CpuWork:
+            stream << "CpuWork " << command.fStartMicroseconds << '-' << command.fEndMicroseconds;
+            break;
+        case Type::Execute:
+            stream << "Execute " << command.fStartMicroseconds << '-' << command.fEndMicroseconds;
+            break;
+        }
+        stream << '\n';
+    }
+}
+
+ParticleRecordedCommand& ParticleDeviceRecording::CommandList::Add(ParticleRecordedCommand::Type type)
+{
+    ParticleRecordedCommand command = {};
+    command.type = type;
+    command.queue = m_queue;
+    command.pass = m_pass;
+    command.params = m_params;
+    m_commands.push_back(command);
+    return m_commands.back();
+}
+
+void ParticleDeviceRecording::CommandList::BeginPass(ParticlePass pass, const ParticlePassParams& params)
+{
+    m_pass = pass;
+    m_params = params;
+}
+
+void ParticleDeviceRecording::CommandList::Dispatch(uint32_t nGroupCountX, uint32_t nGroupCountY, uint32_t nGroupCountZ)
+{
+    ParticleRecordedCommand& command = Add(ParticleRecordedCommand::Type::Dispatch);
+    command.nGroupCount[0] = nGroupCountX;
+    command.nGroupCount[1] = nGroupCountY;
+    command.nGroupCount[2] = nGroupCountZ;
+}
+
+void ParticleDeviceRecording::CommandList::DispatchIndirect(ParticleResource arguments, uint32_t nArgumentOffset)
+{
+    ParticleRecordedCommand& command = Add(ParticleRecordedCommand::Type::DispatchIndirect);
+    command.resource = arguments;
+    command.nOffset = nArgumentOffset;
+}
+
+void ParticleDeviceRecording::CommandList::Draw(uint32_t nVertexCount)
+{
+    Add(ParticleRecordedCommand::Type::Draw).nGroupCount[0] = nVertexCount;
+}
+
+void ParticleDeviceRecording::CommandList::DrawIndirect(ParticleResource arguments, uint32_t nArgumentOffset)
+{
+    ParticleRecordedCommand& command = Add(ParticleRecordedCommand::Type::DrawIndirect);
+    command.resource = arguments;
+    command.nOffset = nArgumentOffset;
+}
+
+void ParticleDeviceRecording::CommandList::ResourceBarrier(const ParticleBarrier* pBarriers, uint32_t nCount)
+{
+    ParticleRecordedCommand& command = Add(ParticleRecordedCommand::Type::ResourceBarrier);
+    command.nFirstBarrier = (uint32_t)m_barriers.size();
+    command.nBarrierCount = nCount;
+    m_barriers.insert(m_barriers.end(), pBarriers, pBarriers + nCount);
+}
+
+void ParticleDeviceRecording::CommandList::CopyBufferRegion(ParticleResource destination, uint32_t nDestinationOffset, ParticleResource source, uint32_t nSourceOffset, uint32_t nSize)
+{
+    ParticleRecordedCommand& command = Add(ParticleRecordedCommand::Type::CopyBufferRegion);
+    command.resource = destination;
+    command.nOffset = nDestinationOffset;
+    command.source = source;
+    command.nSourceOffset = nSourceOffset;
+    command.nSize = nSize;
+}
+
+void ParticleDeviceRecording::CommandList::CopyResource(ParticleResource destination, ParticleResource source)
+{
+    ParticleRecordedCommand& command = Add(ParticleRecordedCommand::Type::CopyResource);
+    command.resource = destination;
+    command.source = source;
+}
+
+void ParticleDeviceRecording::CommandList::ClearUnorderedAccess(ParticleResource resource)
+{
+    Add(ParticleRecordedCommand::Type::ClearUnorderedAccess).resource = resource;
+}
+
+void ParticleDeviceRecording::CommandList::SetRenderTarget(ParticleResource renderTarget, const float* /*pClearColor*/)
+{
+    Add(ParticleRecordedCommand::Type::SetRenderTarget).resource = renderTarget;
+}
+
+void ParticleDeviceRecording::CommandList::WriteTimestamp(uint32_t nQuery)
+{
+    Add(ParticleRecordedCommand::Type::WriteTimestamp).nOffset = nQuery;
+}
+
+void ParticleDeviceRecording::CommandList::ResolveTimestamps(uint32_t nFirstQuery, uint32_t nCount)
+{
+    ParticleRecordedCommand& command = Add(ParticleRecordedCommand::Type::ResolveTimestamps);
+    command.nOffset = nFirstQuery;
+    command.nSize = nCount;
+}
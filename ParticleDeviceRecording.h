@@ -0,0 +1,156 @@
+#pragma once
+
+// Backend that doesn't run anything: every command, barrier and fence operation is written down in the order the queues
+// would see it. The commands of a list are only added on Submit, so two queues never interleave inside a list.
+// It follows the state of every resource through the transitions it sees and counts the ones that start from a state
+// the resource isn't in, which is what the debug layer would complain about.
+//
+// It also keeps a model of when the work would run, to see how the frames overlap. Every dispatch and draw costs what
+// SetPassMicroseconds says for its pass, the rest is free. A queue starts a list once the CPU submitted it, the queue is
+// done with the one before and every GPU Wait before it is met. The CPU clock only moves on with AdvanceCpu and with
+// WaitOnCpu, which waits for the time the value is reached.
+
+#include "ParticleDevice.h"
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+struct ParticleRecordedCommand
+{
+    enum class Type
+    {
+        Dispatch,
+        DispatchIndirect,
+        Draw,
+        DrawIndirect,
+        ResourceBarrier,
+        CopyBufferRegion,
+        CopyResource,
+        ClearUnorderedAccess,
+        SetRenderTarget,
+        WriteTimestamp,
+        ResolveTimestamps,
+        Signal,
+        Wait,
+        WaitOnCpu,
+        Present,
+        BeginFrame,
+        CpuWork,
+        Execute             // A submitted list running on the queue, between fStartMicroseconds and fEndMicroseconds
+    };
+
+    Type type;
+    ParticleQueue queue;
+    ParticlePass pass;                  // The last BeginPass of the list, Count before the first one
+    ParticlePassParams params;
+    uint32_t nGroupCount[3];            // Of a Dispatch, the vertex count of a Draw is the first one
+    ParticleResource resource;          // The arguments, the destination of a copy or the target
+    ParticleResource source;
+    uint32_t nOffset;                   // Of the arguments or the destination, the first timestamp
+    uint32_t nSourceOffset;
+    uint32_t nSize;                     // Of a copy, the timestamp count
+    uint32_t nFirstBarrier;             // Into GetBarriers()
+    uint32_t nBarrierCount;
+    uint64_t nFenceValue;
+    double fStartMicroseconds;          // Of an Execute, a CpuWork or a WaitOnCpu, on the timeline of the model
+    double fEndMicroseconds;
+};
+
+class ParticleDeviceRecording : public ParticleDevice
+{
+public:
+    ParticleDeviceRecording();
+
+    // The slot goes in nOffset of the BeginFrame command
+    virtual void BeginFrame(uint32_t nFrameSlot);
+    virtual ParticleCommandList& Open(ParticleQueue queue);
+    virtual void Submit(ParticleQueue queue);
+    virtual uint64_t Signal(ParticleQueue queue);
+    virtual void Wait(ParticleQueue queue, uint64_t nFenceValue);
+    virtual void WaitOnCpu(uint64_t nFenceValue);
+    virtual bool IsFenceComplete(uint64_t nFenceValue);
+    virtual void Present();
+
+    // Zeroes, nothing ever gets copied
+    virtual void ReadBuffer(ParticleResource resource, uint32_t nOffset, uint32_t nSize, void* pData);
+
+    // Every resource starts out in Common
+    void SetResourceState(ParticleResource resource, ParticleResourceState state)  { m_resourceStates[(int)resource] = state; }
+    ParticleResourceState GetResourceState(ParticleResource resource) const         { return m_resourceStates[(int)resource]; }
+
+    const std::vector<ParticleRecordedCommand>& GetCommands() const    { return m_commands; }
+    const std::vector<ParticleBarrier>& GetBarriers() const             { return m_barriers; }
+
+    // Forgets the commands, the states and the fence stay
+    void ClearCommands();
+
+    // Transitions whose before state wasn't the state of the resource, since the start
+    uint32_t GetStateMismatchCount() const                  { return m_nStateMismatchCount; }
+
+    // Zero for every pass until it's set
+    void SetPassMicroseconds(ParticlePass pass, double fMicroseconds)  { m_fPassMicroseconds[(int)pass] = fMicroseconds; }
+
+    // The CPU works for that long, it records a CpuWork command
+    void AdvanceCpu(double fMicroseconds);
+
+    double GetCpuMicroseconds() const                                   { return m_fCpuMicroseconds; }
+    double GetCpuWaitMicroseconds() const                               { return m_fCpuWaitMicroseconds; }
+    double GetQueueEndMicroseconds(ParticleQueue queue) const           { return m_fQueueMicroseconds[(int)queue]; }
+
+    // BeginFrame on a slot whose lists the model still runs, the command memory would be reset under the GPU.
+    // Waits for fence values nobody signaled yet count too, the model can't tell when they'd be met.
+    uint32_t GetFrameSlotHazardCount() const                { return m_nFrameSlotHazardCount; }
+    uint32_t GetUnsignaledWaitCount() const                 { return m_nUnsignaledWaitCount; }
+
+    // One line per command
+    void Print(std::ostream& stream) const;
+
+private:
+    class CommandList : public ParticleCommandList
+    {
+    public:
+        virtual void BeginPass(ParticlePass pass, const ParticlePassParams& params);
+        virtual void Dispatch(uint32_t nGroupCountX, uint32_t nGroupCountY, uint32_t nGroupCountZ);
+        virtual void DispatchIndirect(ParticleResource arguments, uint32_t nArgumentOffset);
+        virtual void Draw(uint32_t nVertexCount);
+        virtual void DrawIndirect(ParticleResource arguments, uint32_t nArgumentOffset);
+        virtual void ResourceBarrier(const ParticleBarrier* pBarriers, uint32_t nCount);
+        virtual void CopyBufferRegion(ParticleResource destination, uint32_t nDestinationOffset, ParticleResource source, uint32_t nSourceOffset, uint32_t nSize);
+        virtual void CopyResource(ParticleResource destination, ParticleResource source);
+        virtual void ClearUnorderedAccess(ParticleResource resource);
+        virtual void SetRenderTarget(ParticleResource renderTarget, const float* pClearColor);
+        virtual void WriteTimestamp(uint32_t nQuery);
+        virtual void ResolveTimestamps(uint32_t nFirstQuery, uint32_t nCount);
+
+        ParticleRecordedCommand& Add(ParticleRecordedCommand::Type type);
+
+        ParticleQueue m_queue = ParticleQueue::Graphics;
+        ParticlePass m_pass = ParticlePass::Count;
+        ParticlePassParams m_params;
+        std::vector<ParticleRecordedCommand> m_commands;
+        std::vector<ParticleBarrier> m_barriers;        // nFirstBarrier is into these until Submit
+        bool m_bOpen = false;
+    };
+
+    ParticleRecordedCommand& Add(ParticleQueue queue, ParticleRecordedCommand::Type type);
+    double GetFenceMicroseconds(uint64_t nFenceValue);
+
+    CommandList m_commandLists[(int)ParticleQueue::Count];
+    std::vector<ParticleRecordedCommand> m_commands;
+    std::vector<ParticleBarrier> m_barriers;
+    ParticleResourceState m_resourceStates[(int)ParticleResource::Count];
+    uint32_t m_nStateMismatchCount = 0;
+    uint64_t m_nFenceValue = 0;
+
+    // The model
+    double m_fPassMicroseconds[(int)ParticlePass::Count] = {};
+    double m_fCpuMicroseconds = 0.0;
+    double m_fCpuWaitMicroseconds = 0.0;
+    double m_fQueueMicroseconds[(int)ParticleQueue::Count] = {};    // When the queue is done with what it has
+    std::vector<double> m_fenceMicroseconds;                        // When every value is reached, from 1 on
+    uint32_t m_nFrameSlot = 0;
+    double m_fSlotEndMicroseconds[ParticleMaxFrameLatency] = {};    // When the last list recorded in the slot is done
+    uint32_t m_nFrameSlotHazardCount = 0;
+    uint32_t m_nUnsignaledWaitCount = 0;
+};
@@ -53,10 +53,13 @@ VSParticleDrawOut VSParticleDraw(uint id : SV_VERTEXID)
 {
     VSParticleDrawOut output;
 
-    output.pos = float4(g_particlePositions[id].xy, 0, g_particleLifetimes[id]);
-    output.color = g_particleColors[id];
-	output.scale = float4(g_particleScales[id].xy, 0, 0);
-	output.rotate = float4(g_particleRotations[id], 0, 0, 0);
+    // Only the live particles are drawn, the vertex id is an index into the alive list
+    uint nParticle = g_aliveListIn[1 + id];
+
+    output.pos = float4(g_particlePositions[nParticle].xy, 0, g_particleLifetimes[nParticle]);
+    output.color = g_particleColors[nParticle];
+	output.scale = float4(g_particleScales[nParticle].xy, 0, 0);
+	output.rotate = float4(g_particleRotations[nParticle], 0, 0, 0);
 
     return output;
 }
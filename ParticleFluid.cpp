@@ -0,0 +1,301 @@
+#include "ParticleFluid.h"
+#include "ParticleSimulationCPU.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+static const float Pi = 3.14159265f;
+
+// The biggest grid the neighbour search uses, smaller smoothing lengths just get more particles per cell
+static const uint32_t MaxGridDim = 2048;
+
+ParticleFluid::ParticleFluid()
+{
+    SetParams(ParticleFluidParams());
+}
+
+void ParticleFluid::SetParams(const ParticleFluidParams& params)
+{
+    m_params = params;
+    m_fParticleMass = m_params.m_fRestDensity * Pi * m_params.m_fSmoothingLength * m_params.m_fSmoothingLength / TargetNeighbourCount;
+
+    uint32_t nGridDim = std::min(std::max((uint32_t)(2.0f / m_params.m_fSmoothingLength), 1u), MaxGridDim);
+    if (nGridDim != m_grid.GetGridDim())
+    {
+        m_grid.SetGridDim(nGridDim);
+    }
+}
+
+void ParticleFluid::ForEachChunk(uint32_t nCount, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob)
+{
+    if (pJobSystem)
+    {
+        pJobSystem->ParallelFor(nCount, ChunkSize, fnJob);
+        return;
+    }
+
+    for (uint32_t nBegin = 0; nBegin < nCount; nBegin += ChunkSize)
+    {
+        fnJob(nBegin, std::min(nCount, nBegin + ChunkSize), 0);
+    }
+}
+
+void ParticleFluid::GetNeighbourRows(float x, float y, uint32_t* pRowBegins, uint32_t* pRowEnds, uint32_t& nRowCount) const
+{
+    const uint32_t nGridDim = m_grid.GetGridDim();
+    const uint32_t* pCellStarts = m_grid.GetCellStarts();
+
+    uint32_t nCell = m_grid.GetCellKey(x, y);
+    uint32_t nCellX = nCell % nGridDim;
+    uint32_t nCellY = nCell / nGridDim;
+
+    uint32_t nFirstX = nCellX > 0 ? nCellX - 1 : 0;
+    uint32_t nLastX = std::min(nCellX + 1, nGridDim - 1);
+    uint32_t nFirstY = nCellY > 0 ? nCellY - 1 : 0;
+    uint32_t nLastY = std::min(nCellY + 1, nGridDim - 1);
+
+    nRowCount = 0;
+    for (uint32_t nY = nFirstY; nY <= nLastY; nY++)
+    {
+        pRowBegins[nRowCount] = pCellStarts[nY * nGridDim + nFirstX];
+        pRowEnds[nRowCount] = pCellStarts[nY * nGridDim + nLastX + 1];
+        nRowCount++;
+    }
+}
+
+void ParticleFluid::Step(ParticleStreams& streams, const uint32_t* pIndices, uint32_t nCount, float fStiffness, float fElapsedTime, JobSystem* pJobSystem)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    m_grid.Build(streams.Positions.data(), nullptr, pIndices, nCount, pJobSystem);
+    if (m_sortedDensities.size() < nCount)
+    {
+        m_sortedDensities.resize(nCount);
+        m_sortedPressures.resize(nCount);
+        m_sortedVelocityX.resize(nCount);
+        m_sortedVelocityY.resize(nCount);
+    }
+
+    const HashedParticle* pSortedParticles = m_grid.GetSortedParticles();
+    const float h = m_params.m_fSmoothingLength;
+    const float hSq = h * h;
+    const float fPoly6 = 4.0f / (Pi * hSq * hSq * hSq * hSq);
+    const float fSpikyGradient = -30.0f / (Pi * hSq * hSq * h);
+    const float fViscosityLaplacian = 40.0f / (Pi * hSq * hSq * h);
+    const float fRestDensity = m_params.m_fRestDensity;
+    const float fMass = m_fParticleMass;
+
+    // Density and pressure. The particle itself is part of the sum, so the density is never zero.
+    ForEachChunk(nCount, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        uint32_t rowBegins[3];
+        uint32_t rowEnds[3];
+        uint32_t nRowCount;
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            const HashedParticle particle = pSortedParticles[i];
+            GetNeighbourRows(particle.x, particle.y, rowBegins, rowEnds, nRowCount);
+
+            float fKernelSum = 0.0f;
+            for (uint32_t iRow = 0; iRow < nRowCount; iRow++)
+            {
+                for (uint32_t j = rowBegins[iRow]; j < rowEnds[iRow]; j++)
+                {
+                    float fDx = particle.x - pSortedParticles[j].x;
+                    float fDy = particle.y - pSortedParticles[j].y;
+                    float fDistanceSq = fDx * fDx + fDy * fDy;
+                    if (fDistanceSq < hSq)
+                    {
+                        float fFalloff = hSq - fDistanceSq;
+                        fKernelSum += fFalloff * fFalloff * fFalloff;
+                    }
+                }
+            }
+
+            // Only pushes, a negative pressure would clump the particles together at the surface
+            float fDensity = fMass * fPoly6 * fKernelSum;
+            float fPressure = fStiffness * std::max(fDensity - fRestDensity, 0.0f);
+
+            m_sortedDensities[i] = fDensity;
+            m_sortedPressures[i] = fPressure;
+            m_sortedVelocityX[i] = streams.Velocities[particle.nIndex].x;
+            m_sortedVelocityY[i] = streams.Velocities[particle.nIndex].y;
+            streams.Densities[particle.nIndex] = fDensity;
+            streams.Pressures[particle.nIndex] = fPressure;
+        }
+    });
+
+    // Pressure, viscosity, gravity and the walls. Every particle only writes its own velocity, the neighbours' come from the sorted copy.
+    ForEachChunk(nCount, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        uint32_t rowBegins[3];
+        uint32_t rowEnds[3];
+        uint32_t nRowCount;
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            const HashedParticle particle = pSortedParticles[i];
+            const float fDensity = m_sortedDensities[i];
+            const float fPressureTerm = m_sortedPressures[i] / (fDensity * fDensity);
+            const float fVelocityX = m_sortedVelocityX[i];
+            const float fVelocityY = m_sortedVelocityY[i];
+            GetNeighbourRows(particle.x, particle.y, rowBegins, rowEnds, nRowCount);
+
+            float fPressureX = 0.0f;
+            float fPressureY = 0.0f;
+            float fViscosityX = 0.0f;
+            float fViscosityY = 0.0f;
+            for (uint32_t iRow = 0; iRow < nRowCount; iRow++)
+            {
+                for (uint32_t j = rowBegins[iRow]; j < rowEnds[iRow]; j++)
+                {
+                    float fDx = particle.x - pSortedParticles[j].x;
+                    float fDy = particle.y - pSortedParticles[j].y;
+                    float fDistanceSq = fDx * fDx + fDy * fDy;
+
+                    // Particles right on top of each other have no direction to push in, that includes the particle itself
+                    if (fDistanceSq < hSq && fDistanceSq > 0.0f)
+                    {
+                        float fDistance = std::sqrt(fDistanceSq);
+                        float fFalloff = h - fDistance;
+                        float fNeighbourDensity = m_sortedDensities[j];
+
+                        // Symmetric form, the pair pushes each other equally hard
+                        float fPush = -(fPressureTerm + m_sortedPressures[j] / (fNeighbourDensity * fNeighbourDensity)) * fSpikyGradient * fFalloff * fFalloff / fDistance;
+                        fPressureX += fDx * fPush;
+                        fPressureY += fDy * fPush;
+
+                        float fDrag = fViscosityLaplacian * fFalloff / fNeighbourDensity;
+                        fViscosityX += (m_sortedVelocityX[j] - fVelocityX) * fDrag;
+                        fViscosityY += (m_sortedVelocityY[j] - fVelocityY) * fDrag;
+                    }
+                }
+            }
+
+            float fAccelerationX = fMass * (fPressureX + m_params.m_fViscosity * fViscosityX) + m_params.m_fGravityX;
+            float fAccelerationY = fMass * (fPressureY + m_params.m_fViscosity * fViscosityY) + m_params.m_fGravityY;
+            float fNewVelocityX = fVelocityX + fAccelerationX * fElapsedTime;
+            float fNewVelocityY = fVelocityY + fAccelerationY * fElapsedTime;
+
+            // Bounce off the walls the integration would move the particle through
+            float fNextX = particle.x + fNewVelocityX * fElapsedTime;
+            float fNextY = particle.y + fNewVelocityY * fElapsedTime;
+            if ((fNextX < -1.0f && fNewVelocityX < 0.0f) || (fNextX > 1.0f && fNewVelocityX > 0.0f))
+            {
+                fNewVelocityX *= -m_params.m_fWallDamping;
+            }
+            if ((fNextY < -1.0f && fNewVelocityY < 0.0f) || (fNextY > 1.0f && fNewVelocityY > 0.0f))
+            {
+                fNewVelocityY *= -m_params.m_fWallDamping;
+            }
+
+            streams.Velocities[particle.nIndex] = { fNewVelocityX, fNewVelocityY };
+        }
+    });
+
+    m_nStepNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The dam break of BenchmarkFluid: a square block at rest spacing, the smoothing length is set so TargetNeighbourCount
+// particles fit inside it. Returns the constants of a step.
+static ParticleFrameConstants CreateDamBreak(ParticleSimulationCPU& simulation, uint32_t nParticleCount, float fElapsedTime)
+{
+    uint32_t nParticlesPerRow = (uint32_t)std::ceil(std::sqrt((float)nParticleCount));
+    float fSpacing = 1.0f / nParticlesPerRow;
+
+    ParticleFluidParams params;
+    params.m_fSmoothingLength = fSpacing * std::sqrt(ParticleFluid::TargetNeighbourCount / Pi);
+
+    // Speed of sound at a quarter smoothing length per step
+    float fSpeedOfSound = 0.25f * params.m_fSmoothingLength / fElapsedTime;
+
+    simulation.SetFluidParams(params);
+    simulation.SpawnGrid(42);
+
+    ParticleStreams& streams = simulation.GetStreams();
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        streams.Positions[i] = { -0.95f + (i % nParticlesPerRow + 0.5f) * fSpacing, -0.95f + (i / nParticlesPerRow + 0.5f) * fSpacing };
+        streams.Velocities[i] = { 0.0f, 0.0f };
+    }
+
+    ParticleFrameConstants constants;
+    constants.m_fElapsedTime = fElapsedTime;
+    constants.m_fFluidStiffness = fSpeedOfSound * fSpeedOfSound;
+    return constants;
+}
+
+FluidBenchmarkResult BenchmarkFluid(uint32_t nParticleCount, uint32_t nStepCount, JobSystem* pJobSystem)
+{
+    ParticleSimulationCPU simulation(nParticleCount);
+    simulation.SetJobSystem(pJobSystem);
+    ParticleFrameConstants constants = CreateDamBreak(simulation, nParticleCount, 1.0f / 240.0f);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t iStep = 0; iStep < nStepCount; iStep++)
+    {
+        simulation.Simulate(constants);
+    }
+    double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    FluidBenchmarkResult result = {};
+    result.nParticleCount = nParticleCount;
+    result.nStepCount = nStepCount;
+    if (nStepCount > 0)
+    {
+        result.fStepMilliseconds = fSeconds * 1000.0 / nStepCount;
+        result.fParticlesPerSecond = (double)nParticleCount * nStepCount / fSeconds;
+
+        const ParticleStreams& streams = simulation.GetStreams();
+        double fDensitySum = 0.0;
+        for (uint32_t i = 0; i < nParticleCount; i++)
+        {
+            fDensitySum += streams.Densities[i];
+        }
+        result.fAverageDensityRatio = fDensitySum / nParticleCount / simulation.GetFluid().GetParams().m_fRestDensity;
+    }
+    return result;
+}
+
+FluidValidationResult ValidateFluid(uint32_t nParticleCount, uint32_t nStepCount, JobSystem* pJobSystem)
+{
+    ParticleSimulationCPU simulation(nParticleCount);
+    ParticleSimulationCPU reference(nParticleCount);
+    simulation.SetJobSystem(pJobSystem);
+    ParticleFrameConstants constants = CreateDamBreak(simulation, nParticleCount, 1.0f / 240.0f);
+    CreateDamBreak(reference, nParticleCount, 1.0f / 240.0f);
+
+    for (uint32_t iStep = 0; iStep < nStepCount; iStep++)
+    {
+        simulation.Simulate(constants);
+        reference.Simulate(constants);
+    }
+
+    FluidValidationResult result = {};
+    result.nParticleCount = nParticleCount;
+    result.nStepCount = nStepCount;
+
+    const ParticleStreams& streams = simulation.GetStreams();
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        const Float2& position = streams.Positions[i];
+        const Float2& velocity = streams.Velocities[i];
+        bool bFinite = std::isfinite(position.x) && std::isfinite(position.y) && std::isfinite(velocity.x) && std::isfinite(velocity.y) &&
+            std::isfinite(streams.Densities[i]) && std::isfinite(streams.Pressures[i]);
+        result.nNonFiniteCount += bFinite ? 0 : 1;
+        result.nOutsideCount += std::fabs(position.x) <= 1.0f && std::fabs(position.y) <= 1.0f ? 0 : 1;
+    }
+
+    const ParticleStreams& referenceStreams = reference.GetStreams();
+    const size_t nFloat2Bytes = nParticleCount * sizeof(Float2);
+    const size_t nFloatBytes = nParticleCount * sizeof(float);
+    result.bMatchesSingleThread = simulation.GetParticleCount() == reference.GetParticleCount() &&
+        std::memcmp(streams.Positions.data(), referenceStreams.Positions.data(), nFloat2Bytes) == 0 &&
+        std::memcmp(streams.Velocities.data(), referenceStreams.Velocities.data(), nFloat2Bytes) == 0 &&
+        std::memcmp(streams.Densities.data(), referenceStreams.Densities.data(), nFloatBytes) == 0 &&
+        std::memcmp(streams.Pressures.data(), referenceStreams.Pressures.data(), nFloatBytes) == 0;
+
+    result.bPassed = result.nNonFiniteCount == 0 && result.nOutsideCount == 0 && result.bMatchesSingleThread;
+    return result;
+}
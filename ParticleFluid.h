@@ -0,0 +1,101 @@
+#pragma once
+
+// 2D smoothed particle hydrodynamics for the liquid effects of the CPU simulation.
+// The usual three kernels (Mueller et al. 2003) in their 2D normalization:
+//  - poly6 for the density
+//  - the gradient of spiky for the pressure force, it doesn't vanish when two particles get very close
+//  - the laplacian of the viscosity kernel for the viscosity force
+// A step is two passes over the particles in cell order. The first one sums up the density and turns it into pressure,
+// the second one sums up the forces and adds them to the velocities. The positions are left to the regular integration.
+//
+// The neighbours come from a ParticleSpatialHash with cells at least as big as the smoothing length,
+// so the 3x3 cells around a particle hold every neighbour.
+
+#include "JobSystem.h"
+#include "ParticleSpatialHash.h"
+
+#include <cstdint>
+#include <vector>
+
+struct ParticleStreams;
+
+struct ParticleFluidParams
+{
+    float m_fSmoothingLength = 0.02f;   // Particles further apart than this don't interact
+    float m_fRestDensity = 1000.0f;
+    float m_fViscosity = 0.01f;         // Kinematic, so it doesn't depend on the rest density
+    float m_fGravityX = 0.0f;
+    float m_fGravityY = -1.0f;
+    float m_fWallDamping = 0.5f;        // Fraction of the velocity a particle keeps when it bounces off the [-1, 1] walls
+};
+
+class ParticleFluid
+{
+public:
+    // Number of particles a job processes at once, same as ParticleSimulationCPU::ChunkSize
+    static const uint32_t ChunkSize = 4096;
+
+    // The mass of the particles is set so this many of them inside the smoothing length give the rest density
+    static const uint32_t TargetNeighbourCount = 20;
+
+    ParticleFluid();
+
+    void SetParams(const ParticleFluidParams& params);
+    const ParticleFluidParams& GetParams() const        { return m_params; }
+    float GetParticleMass() const                       { return m_fParticleMass; }
+
+    // One step for the particles in pIndices[0, nCount). Writes the density and the pressure of every particle
+    // into the streams and adds the pressure, viscosity and gravity accelerations to the velocities.
+    // The pressure is fStiffness * (density - rest density), the square root of the stiffness is the speed of sound,
+    // which has to stay below about 0.4 smoothing lengths per step.
+    void Step(ParticleStreams& streams, const uint32_t* pIndices, uint32_t nCount, float fStiffness, float fElapsedTime, JobSystem* pJobSystem);
+
+    const ParticleSpatialHash& GetGrid() const          { return m_grid; }
+
+    // Wall clock time of the last Step, the grid build included
+    uint64_t GetStepNanoseconds() const                 { return m_nStepNanoseconds; }
+
+private:
+    void ForEachChunk(uint32_t nCount, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob);
+
+    // [begin, end) of the sorted particles in the three rows of cells around the position
+    void GetNeighbourRows(float x, float y, uint32_t* pRowBegins, uint32_t* pRowEnds, uint32_t& nRowCount) const;
+
+    ParticleFluidParams m_params;
+    float m_fParticleMass = 0.0f;
+    ParticleSpatialHash m_grid;
+
+    // By sorted particle, so the second pass reads its neighbours from memory next to each other
+    std::vector<float> m_sortedDensities;
+    std::vector<float> m_sortedPressures;
+    std::vector<float> m_sortedVelocityX;
+    std::vector<float> m_sortedVelocityY;
+
+    uint64_t m_nStepNanoseconds = 0;
+};
+
+struct FluidBenchmarkResult
+{
+    uint32_t nParticleCount;
+    uint32_t nStepCount;
+    double fStepMilliseconds;           // Average of a whole ParticleSimulationCPU::Simulate, integration included
+    double fParticlesPerSecond;         // Particle steps per second of wall clock time
+    double fAverageDensityRatio;        // Average density over the rest density after the last step
+};
+
+// Runs nStepCount fixed 1/240 s steps of a dam break: a block of nParticleCount particles at rest spacing
+// in the lower left quarter of the box. The smoothing length and the stiffness follow the particle count.
+FluidBenchmarkResult BenchmarkFluid(uint32_t nParticleCount, uint32_t nStepCount, JobSystem* pJobSystem);
+
+struct FluidValidationResult
+{
+    uint32_t nParticleCount;
+    uint32_t nStepCount;
+    uint32_t nNonFiniteCount;           // Particles with a NaN or an infinity in their position, velocity, density or pressure
+    uint32_t nOutsideCount;             // Particles outside the [-1, 1] box
+    bool bMatchesSingleThread;          // Same streams, bit for bit, as the same steps without a job system
+    bool bPassed;
+};
+
+// Runs nStepCount steps of the dam break of BenchmarkFluid on pJobSystem and on the calling thread alone
+FluidValidationResult ValidateFluid(uint32_t nParticleCount, uint32_t nStepCount, JobSystem* pJobSystem);
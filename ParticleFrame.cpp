@@ -0,0 +1,979 @@
+#include "ParticleFrame.h"
+#include "ParticleDeviceRecording.h"
+#include "ParticleSpatialHash.h"
+#include "AliveListConstants.h"
+#include "EmitterConstants.h"
+#include "SpatialHashConstants.h"
+#include "TileConstants.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+static void UseStreams(ParticleFrameGraph& graph, uint32_t nBuffer, ParticleResourceState state, ParticleFrameGraph::Access access)
+{
+    for (uint32_t iStream = 0; iStream < ParticleStreamCount; iStream++)
+    {
+        graph.Use(GetParticleStream(nBuffer, iStream), state, access);
+    }
+}
+
+// The update reads the buffer the emission wrote and writes the other one, see DeclareParticleEmission
+static ParticlePassParams GetUpdateParams(const ParticleFrameDesc& desc)
+{
+    ParticlePassParams params;
+    params.nConstantBuffer = desc.nConstantBuffer;
+    params.nReadBuffer = desc.nWritableBuffer;
+    params.nWriteBuffer = desc.nReadableBuffer;
+    params.nAliveList = desc.nWritableBuffer;
+    params.nTileSize = desc.nTileSize;
+    return params;
+}
+
+// Emits, prepares the update and finds the collisions. Only the writable buffer and the buffers of the compute queue
+// get touched, nothing the render of the frame before draws.
+static void DeclareParticleEmission(ParticleFrameGraph& graph, const ParticleFrameDesc& desc)
+{
+    typedef ParticleResourceState State;
+    typedef ParticleFrameGraph::Access Access;
+    const ParticleFrameStage stage = ParticleFrameStage::Emission;
+
+    // The emitted particles go to the writable buffer, which is what the update reads after the swap below.
+    // So the alive list of that one is the input for both passes. The emitter table goes with the constant buffer.
+    ParticlePassParams emitParams;
+    emitParams.nConstantBuffer = desc.nConstantBuffer;
+    emitParams.nReadBuffer = desc.nReadableBuffer;
+    emitParams.nWriteBuffer = desc.nWritableBuffer;
+    emitParams.nAliveList = desc.nWritableBuffer;
+    emitParams.nTileSize = desc.nTileSize;
+
+    const uint32_t nWritable = desc.nWritableBuffer;
+
+    // One dispatch for every emitter, each thread finds its emitter in the table
+    if (desc.nEmitCount > 0)
+    {
+        const uint32_t nEmitCount = desc.nEmitCount;
+        graph.AddPass("Generate", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::Generate, emitParams);
+            commandList.Dispatch((nEmitCount + 999) / 1000, 1, 1);
+        });
+        graph.ReadWrite(ParticleResource::DeadList, State::UnorderedAccess);
+        graph.ReadWrite(ParticleResource::EmitterParticleCounts, State::UnorderedAccess);
+        graph.ReadWrite(GetAliveList(nWritable), State::UnorderedAccess);
+        UseStreams(graph, nWritable, State::UnorderedAccess, Access::Write);
+    }
+
+    // After the generation part we swap the buffers so that the update pass doesn't override the emitted particles
+    const ParticlePassParams params = GetUpdateParams(desc);
+    const uint32_t nUpdateArguments = DISPATCH_ARGS_UPDATE * sizeof(uint32_t);
+
+    // Only the live particles get updated. Their number is only known on the GPU so the dispatch sizes come from CSPrepareUpdate.
+    graph.AddPass("PrepareUpdate", stage, [=](ParticleTrackedCommandList& commandList)
+    {
+        commandList.BeginPass(ParticlePass::PrepareUpdate, params);
+        commandList.Dispatch(1, 1, 1);
+    });
+    graph.Read(GetAliveList(nWritable), State::UnorderedAccess);
+    graph.Write(ParticleResource::DispatchArgs, State::UnorderedAccess);
+
+    // The collisions only change the velocities, CSUpdate adds them before it moves the particles.
+    // The hash is built from the same alive list the update reads, so it uses the same dispatch size.
+    if (desc.bCollisions)
+    {
+        const uint32_t nBuildQuery = desc.nHashTimestampQuery;
+        const uint32_t nQueryQuery = desc.nHashTimestampQuery + 2;
+
+        graph.AddPass("HashCount", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.WriteTimestamp(nBuildQuery);
+            commandList.BeginPass(ParticlePass::HashCount, params);
+            commandList.DispatchIndirect(ParticleResource::DispatchArgs, nUpdateArguments);
+        });
+        graph.Read(ParticleResource::DispatchArgs, State::IndirectArgument);
+        graph.Read(GetAliveList(nWritable), State::UnorderedAccess);
+        UseStreams(graph, nWritable, State::NonPixelShaderResource, Access::Read);
+        graph.ReadWrite(ParticleResource::HashCellCounts, State::UnorderedAccess);
+        graph.Write(ParticleResource::HashParticleCells, State::UnorderedAccess);
+
+        // Also clears the counts for the next frame
+        graph.AddPass("HashScan", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::HashScan, params);
+            commandList.Dispatch(1, 1, 1);
+        });
+        graph.ReadWrite(ParticleResource::HashCellCounts, State::UnorderedAccess);
+        graph.Write(ParticleResource::HashCellStarts, State::UnorderedAccess);
+
+        graph.AddPass("HashScatter", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::HashScatter, params);
+            commandList.DispatchIndirect(ParticleResource::DispatchArgs, nUpdateArguments);
+        });
+        graph.Read(ParticleResource::DispatchArgs, State::IndirectArgument);
+        graph.Read(ParticleResource::HashCellStarts, State::UnorderedAccess);
+        graph.Read(ParticleResource::HashParticleCells, State::UnorderedAccess);
+        graph.Write(ParticleResource::HashSortedParticles, State::UnorderedAccess);
+
+        graph.AddPass("Collide", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.WriteTimestamp(nBuildQuery + 1);
+            commandList.WriteTimestamp(nQueryQuery);
+            commandList.BeginPass(ParticlePass::Collide, params);
+            commandList.DispatchIndirect(ParticleResource::DispatchArgs, nUpdateArguments);
+        });
+        graph.Read(ParticleResource::DispatchArgs, State::IndirectArgument);
+        graph.Read(GetAliveList(nWritable), State::UnorderedAccess);
+        graph.Read(ParticleResource::HashCellStarts, State::UnorderedAccess);
+        graph.Read(ParticleResource::HashSortedParticles, State::UnorderedAccess);
+        graph.Write(ParticleResource::CollisionImpulses, State::UnorderedAccess);
+
+        // Behind the barrier after the collisions, so the last timestamp waits for them
+        graph.AddPass("HashTimestamps", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.WriteTimestamp(nQueryQuery + 1);
+            commandList.ResolveTimestamps(nBuildQuery, 4);
+        });
+        graph.Read(ParticleResource::CollisionImpulses, State::UnorderedAccess);
+        graph.Write(ParticleResource::TimestampReadback, State::CopyDest);
+    }
+}
+
+// Moves, compacts, destroys, reads back and bins the tiles. Writes the buffer the render of the frame before drew.
+static void DeclareParticleUpdate(ParticleFrameGraph& graph, const ParticleFrameDesc& desc)
+{
+    typedef ParticleResourceState State;
+    typedef ParticleFrameGraph::Access Access;
+    const ParticleFrameStage stage = ParticleFrameStage::Update;
+
+    const ParticlePassParams params = GetUpdateParams(desc);
+    const uint32_t nReadable = params.nReadBuffer;
+    const uint32_t writableBufferIndex = params.nWriteBuffer;
+
+    const uint32_t nUpdateArguments = DISPATCH_ARGS_UPDATE * sizeof(uint32_t);
+    const uint32_t nCompactionArguments = DISPATCH_ARGS_COMPACTION * sizeof(uint32_t);
+
+    graph.AddPass("Move", stage, [=](ParticleTrackedCommandList& commandList)
+    {
+        commandList.BeginPass(ParticlePass::Move, params);
+        commandList.DispatchIndirect(ParticleResource::DispatchArgs, nUpdateArguments);
+    });
+    graph.Read(ParticleResource::DispatchArgs, State::IndirectArgument);
+    graph.Read(GetAliveList(nReadable), State::UnorderedAccess);
+    UseStreams(graph, nReadable, State::NonPixelShaderResource, Access::Read);
+    UseStreams(graph, writableBufferIndex, State::UnorderedAccess, Access::Write);
+    graph.ReadWrite(ParticleResource::DeadList, State::UnorderedAccess);
+    graph.ReadWrite(ParticleResource::EmitterParticleCounts, State::UnorderedAccess);
+    if (desc.bCollisions)
+    {
+        graph.Read(ParticleResource::CollisionImpulses, State::UnorderedAccess);
+    }
+
+    // Compact the survivors into the other alive list: count them per group, scan the counts, scatter.
+    // Only the draw arguments of the output list (the one that goes with the buffer the update writes) get written,
+    // the graphics queue might be drawing the input one.
+    graph.AddPass("CompactCount", stage, [=](ParticleTrackedCommandList& commandList)
+    {
+        commandList.BeginPass(ParticlePass::CompactCount, params);
+        commandList.DispatchIndirect(ParticleResource::DispatchArgs, nCompactionArguments);
+    });
+    graph.Read(ParticleResource::DispatchArgs, State::IndirectArgument);
+    graph.Read(GetAliveList(nReadable), State::UnorderedAccess);
+    UseStreams(graph, writableBufferIndex, State::UnorderedAccess, Access::Read);
+    graph.Write(ParticleResource::CompactionGroupOffsets, State::UnorderedAccess);
+
+    graph.AddPass("CompactScanGroups", stage, [=](ParticleTrackedCommandList& commandList)
+    {
+        commandList.BeginPass(ParticlePass::CompactScanGroups, params);
+        commandList.Dispatch(1, 1, 1);
+    });
+    graph.ReadWrite(ParticleResource::CompactionGroupOffsets, State::UnorderedAccess);
+    graph.Read(GetAliveList(nReadable), State::UnorderedAccess);
+    graph.Write(GetAliveList(writableBufferIndex), State::UnorderedAccess);
+    graph.Write(GetDrawArgs(writableBufferIndex), State::UnorderedAccess);
+
+    graph.AddPass("CompactScatter", stage, [=](ParticleTrackedCommandList& commandList)
+    {
+        commandList.BeginPass(ParticlePass::CompactScatter, params);
+        commandList.DispatchIndirect(ParticleResource::DispatchArgs, nCompactionArguments);
+    });
+    graph.Read(ParticleResource::DispatchArgs, State::IndirectArgument);
+    graph.Read(GetAliveList(nReadable), State::UnorderedAccess);
+    UseStreams(graph, writableBufferIndex, State::UnorderedAccess, Access::Read);
+    graph.Read(ParticleResource::CompactionGroupOffsets, State::UnorderedAccess);
+    graph.Write(GetAliveList(writableBufferIndex), State::UnorderedAccess);
+
+    // CSDestroy has nothing left to do since the compaction, it writes nothing and gets culled
+    const uint32_t nParticleBufferSize = desc.nParticleBufferSize;
+    graph.AddPass("Destroy", stage, [=](ParticleTrackedCommandList& commandList)
+    {
+        commandList.BeginPass(ParticlePass::Destroy, params);
+        commandList.Dispatch((nParticleBufferSize + 999) / 1000, 1, 1);
+    });
+
+    // The counter of the dead list goes back to the CPU so OnUpdate knows when the pools have to grow
+    const bool bReadBackDeadList = desc.bReadBackDeadList;
+    graph.AddPass("ReadBackDeadList", stage, [=](ParticleTrackedCommandList& commandList)
+    {
+        commandList.CopyBufferRegion(ParticleResource::ParticleCountReadback, 0, ParticleResource::DeadList, 0, sizeof(uint32_t));
+        if (bReadBackDeadList)
+        {
+            commandList.CopyResource(ParticleResource::DeadListReadback, ParticleResource::DeadList);
+        }
+    });
+    graph.Read(ParticleResource::DeadList, State::CopySource);
+    graph.Write(ParticleResource::ParticleCountReadback, State::CopyDest);
+    if (bReadBackDeadList)
+    {
+        graph.Write(ParticleResource::DeadListReadback, State::CopyDest);
+    }
+
+    // Same for the particle count of every emitter, OnUpdate grows the ones that would run out of slots
+    graph.AddPass("ReadBackEmitterCounts", stage, [=](ParticleTrackedCommandList& commandList)
+    {
+        commandList.CopyResource(ParticleResource::EmitterParticleCountsReadback, ParticleResource::EmitterParticleCounts);
+    });
+    graph.Read(ParticleResource::EmitterParticleCounts, State::CopySource);
+    graph.Write(ParticleResource::EmitterParticleCountsReadback, State::CopyDest);
+
+    if (desc.bBinTiles)
+    {
+        // Bin the particles the update just wrote, their alive list is the In list of the writable buffer's set.
+        // Every particle finds its own tiles: count, scan the counts, scatter, then sort every tile's list.
+        // Next to the count every particle sets up its quad once, so the rasterization only evaluates the planes per pixel.
+        // The tiles over MAX_PARTICLE_PER_TILE don't fit into CSTileSort, they spill over to CSTileSortSpill.
+        // The scan also lists the tiles with particles, only those are rasterized. The rest of the output is cleared at once.
+        ParticlePassParams tileParams = params;
+        tileParams.nReadBuffer = writableBufferIndex;
+        tileParams.nAliveList = writableBufferIndex;
+
+        const uint32_t nTileCountX = TILE_COUNT_FOR_SIZE(desc.nWidth, desc.nTileSize);
+        const uint32_t nTileCountY = TILE_COUNT_FOR_SIZE(desc.nHeight, desc.nTileSize);
+
+        // The survivor count is only known on the GPU, the per particle passes cover the whole pool and skip the dead part
+        const uint32_t nBinGroupCount = (desc.nParticleBufferSize + TILE_BIN_GROUP_SIZE - 1) / TILE_BIN_GROUP_SIZE;
+
+        graph.AddPass("TileCount", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::TileCount, tileParams);
+            commandList.Dispatch(nBinGroupCount, 1, 1);
+        });
+        graph.Read(GetAliveList(writableBufferIndex), State::UnorderedAccess);
+        UseStreams(graph, writableBufferIndex, State::NonPixelShaderResource, Access::Read);
+        graph.ReadWrite(ParticleResource::TileParticleCounts, State::UnorderedAccess);
+
+        // Only writes its own buffer and nothing before the rasterization reads it
+        graph.AddPass("ParticleRasterSetup", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::ParticleRasterSetup, tileParams);
+            commandList.Dispatch(nBinGroupCount, 1, 1);
+        });
+        graph.Read(GetAliveList(writableBufferIndex), State::UnorderedAccess);
+        UseStreams(graph, writableBufferIndex, State::NonPixelShaderResource, Access::Read);
+        graph.Write(ParticleResource::ParticleRasterSetups, State::UnorderedAccess);
+
+        // Writes the counters at the start of the tile indices before anything reads them, and the arguments of the rasterization
+        graph.AddPass("TileScan", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::TileScan, tileParams);
+            commandList.Dispatch(1, 1, 1);
+        });
+        graph.ReadWrite(ParticleResource::TileParticleCounts, State::UnorderedAccess);
+        graph.Write(ParticleResource::TileOffsets, State::UnorderedAccess);
+        graph.Write(ParticleResource::TileIndices, State::UnorderedAccess);
+        graph.ReadWrite(ParticleResource::DispatchArgs, State::UnorderedAccess);
+
+        graph.AddPass("TileScatter", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::TileScatter, tileParams);
+            commandList.Dispatch(nBinGroupCount, 1, 1);
+        });
+        graph.Read(GetAliveList(writableBufferIndex), State::UnorderedAccess);
+        UseStreams(graph, writableBufferIndex, State::NonPixelShaderResource, Access::Read);
+        graph.Read(ParticleResource::TileOffsets, State::UnorderedAccess);
+        graph.ReadWrite(ParticleResource::TileIndices, State::UnorderedAccess);
+        graph.ReadWrite(ParticleResource::TileParticleCounts, State::UnorderedAccess);
+
+        // The two sorts never touch the same tile. CSTileSort clears the counts for the next frame.
+        graph.AddPass("TileSort", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::TileSort, tileParams);
+            commandList.Dispatch(nTileCountX, nTileCountY, 1);
+        });
+        graph.Read(ParticleResource::TileOffsets, State::UnorderedAccess);
+        graph.Use(ParticleResource::TileIndices, State::UnorderedAccess, Access::DisjointWrite);
+        graph.ReadWrite(ParticleResource::TileParticleCounts, State::UnorderedAccess);
+
+        graph.AddPass("TileSortSpill", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::TileSortSpill, tileParams);
+            commandList.Dispatch(TILE_SPILL_GROUP_COUNT, 1, 1);
+        });
+        graph.Read(ParticleResource::TileOffsets, State::UnorderedAccess);
+        graph.Use(ParticleResource::TileIndices, State::UnorderedAccess, Access::DisjointWrite);
+
+        // The empty tiles aren't in the work list, they only get this
+        graph.AddPass("ClearTileOutput", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.ClearUnorderedAccess(ParticleResource::TileOutput);
+        });
+        graph.Write(ParticleResource::TileOutput, State::UnorderedAccess);
+
+        graph.AddPass("RasterizeParticles", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::RasterizeParticles, tileParams);
+            commandList.DispatchIndirect(ParticleResource::DispatchArgs, DISPATCH_ARGS_TILE_RASTER * sizeof(uint32_t));
+        });
+        graph.Read(ParticleResource::DispatchArgs, State::IndirectArgument);
+        UseStreams(graph, writableBufferIndex, State::NonPixelShaderResource, Access::Read);
+        graph.Read(ParticleResource::TileOffsets, State::UnorderedAccess);
+        graph.Read(ParticleResource::ParticleRasterSetups, State::UnorderedAccess);
+        graph.ReadWrite(ParticleResource::TileIndices, State::UnorderedAccess);
+        graph.Write(ParticleResource::TileOutput, State::UnorderedAccess);
+
+        // The counters of the binning go back to the CPU, so the tile size can be tuned against real scenes
+        graph.AddPass("ReadBackTileCounters", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.CopyBufferRegion(ParticleResource::TileListCountersReadback, 0, ParticleResource::TileIndices, 0, sizeof(uint32_t) * TILE_COUNTER_COUNT);
+        });
+        graph.Read(ParticleResource::TileIndices, State::CopySource);
+        graph.Write(ParticleResource::TileListCountersReadback, State::CopyDest);
+    }
+}
+
+// The particles or the output of the tiles into the back buffer. The draws read what the last update wrote in whatever
+// state it left it, only the draw arguments change state on this queue.
+static void DeclareParticleRender(ParticleFrameGraph& graph, const ParticleFrameDesc& desc)
+{
+    typedef ParticleResourceState State;
+    const ParticleFrameStage stage = ParticleFrameStage::Render;
+
+    const ParticleResource backBuffer = GetBackBuffer(desc.nBackBuffer);
+
+    graph.AddPass("SetRenderTarget", stage, [=](ParticleTrackedCommandList& commandList)
+    {
+        const float clearColor[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        commandList.SetRenderTarget(backBuffer, clearColor);
+    });
+    graph.Write(backBuffer, State::RenderTarget);
+
+    // The buffer the last simulation wrote with its alive list, and the constants of this frame
+    ParticlePassParams params;
+    params.nConstantBuffer = desc.nConstantBuffer;
+    params.nReadBuffer = desc.nWritableBuffer;
+    params.nAliveList = desc.nWritableBuffer;
+    params.nTileSize = desc.nTileSize;
+
+    switch (desc.drawMode)
+    {
+    case ParticleDrawMode::TileOutput:
+        graph.AddPass("DrawTileOutput", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::DrawTileOutput, params);
+            commandList.Draw(1);
+        });
+        graph.Read(ParticleResource::TileOutput, ParticleFrameGraph::AnyState);
+        graph.ReadWrite(backBuffer, State::RenderTarget);
+        break;
+    case ParticleDrawMode::Primitives:
+        // One vertex per live particle, the count was written by CSCompactScanGroups
+        graph.AddPass("DrawParticles", stage, [=](ParticleTrackedCommandList& commandList)
+        {
+            commandList.BeginPass(ParticlePass::DrawParticles, params);
+            commandList.DrawIndirect(GetDrawArgs(params.nReadBuffer), 0);
+        });
+        graph.Read(GetDrawArgs(desc.nWritableBuffer), State::IndirectArgument);
+        graph.Read(GetAliveList(desc.nWritableBuffer), ParticleFrameGraph::AnyState);
+        UseStreams(graph, desc.nWritableBuffer, ParticleFrameGraph::AnyState, ParticleFrameGraph::Access::Read);
+        graph.ReadWrite(backBuffer, State::RenderTarget);
+        break;
+    default:
+        break;
+    }
+
+    graph.AddPass("Present", stage, nullptr);
+    graph.Write(backBuffer, State::Present);
+}
+
+// The sizes DX12Particles creates the buffers with
+static void DeclareParticleTransients(ParticleFrameGraph& graph, const ParticleFrameDesc& desc)
+{
+    const uint64_t nParticleCount = desc.nParticleBufferSize;
+    const uint32_t nTileCount = TILE_COUNT_FOR_SIZE(desc.nWidth, desc.nTileSize) * TILE_COUNT_FOR_SIZE(desc.nHeight, desc.nTileSize);
+    const uint64_t nCompactionGroupCount = (nParticleCount + COMPACTION_GROUP_SIZE - 1) / COMPACTION_GROUP_SIZE;
+
+    graph.DeclareTransient(ParticleResource::HashCellStarts, sizeof(uint32_t) * HASH_START_COUNT);
+    graph.DeclareTransient(ParticleResource::HashParticleCells, sizeof(uint32_t) * 2 * nParticleCount);
+    graph.DeclareTransient(ParticleResource::HashSortedParticles, sizeof(HashedParticle) * nParticleCount);
+    graph.DeclareTransient(ParticleResource::CollisionImpulses, sizeof(float) * 2 * nParticleCount);
+    graph.DeclareTransient(ParticleResource::CompactionGroupOffsets, sizeof(uint32_t) * nCompactionGroupCount);
+    graph.DeclareTransient(ParticleResource::ParticleRasterSetups, sizeof(float) * 6 * nParticleCount);
+    graph.DeclareTransient(ParticleResource::TileIndices, sizeof(uint32_t) * ((uint64_t)TILE_COUNTER_REGION_SIZE(nTileCount) + TILE_LIST_CAPACITY(nTileCount)));
+}
+
+void BuildParticleFrameGraph(ParticleFrameGraph& graph, const ParticleFrameDesc& desc)
+{
+    DeclareParticleTransients(graph, desc);
+    DeclareParticleEmission(graph, desc);
+    DeclareParticleUpdate(graph, desc);
+    DeclareParticleRender(graph, desc);
+}
+
+ParticleTransientLayout GetParticleTransientLayout(const ParticleFrameDesc& desc)
+{
+    ParticleFrameDesc allDesc = desc;
+    allDesc.nEmitCount = std::max(desc.nEmitCount, 1u);
+    allDesc.bCollisions = true;
+    allDesc.bBinTiles = true;
+    allDesc.drawMode = ParticleDrawMode::TileOutput;
+
+    ParticleFrameGraph graph;
+    BuildParticleFrameGraph(graph, allDesc);
+    graph.Compile();
+    return graph.GetTransientLayout();
+}
+
+void RunParticleFrame(ParticleDevice& device, ParticleResourceTracker& tracker, const ParticleFrameDesc& desc)
+{
+    typedef ParticleFrameStage Stage;
+
+    ParticleFrameGraph graph;
+    BuildParticleFrameGraph(graph, desc);
+    graph.Compile();
+
+    auto fnSimulate = [&]()
+    {
+        ParticleTrackedCommandList commandList(device.Open(ParticleQueue::Compute), tracker);
+        graph.Record(commandList, Stage::Emission, Stage::Update);
+        commandList.Close();
+        device.Submit(ParticleQueue::Compute);
+    };
+    auto fnRender = [&]()
+    {
+        ParticleTrackedCommandList commandList(device.Open(ParticleQueue::Graphics), tracker);
+        graph.Record(commandList, Stage::Render, Stage::Render);
+        commandList.Close();
+        device.Submit(ParticleQueue::Graphics);
+    };
+
+    if (desc.bComputeFirst)
+    {
+        // This one seems to be slightly faster
+        fnSimulate();
+        fnRender();
+    }
+    else
+    {
+        fnRender();
+        fnSimulate();
+    }
+
+    device.Present();
+    device.Flush(ParticleQueue::Graphics);
+    device.Flush(ParticleQueue::Compute);
+}
+
+ParticleFramePipeline::ParticleFramePipeline(ParticleDevice& device, uint32_t nFrameLatency) :
+    m_device(device),
+    m_nFrameLatency(nFrameLatency)
+{
+    assert(nFrameLatency > 0 && nFrameLatency <= ParticleMaxFrameLatency);
+    for (uint32_t iResource = 0; iResource < (uint32_t)ParticleResource::Count; iResource++)
+    {
+        m_resourceTracker.SetState((ParticleResource)iResource, GetParticleLoadedResourceState((ParticleResource)iResource));
+    }
+}
+
+bool ParticleFramePipeline::BeginFrame(uint32_t nFrameSlot)
+{
+    assert(nFrameSlot < m_nFrameLatency);
+
+    // The slot's last frame is nFrameLatency frames back, that's as far as the CPU gets ahead
+    bool bWaited = false;
+    for (uint64_t nFenceValue : m_nSlotFenceValues[nFrameSlot])
+    {
+        if (!m_device.IsFenceComplete(nFenceValue))
+        {
+            m_device.WaitOnCpu(nFenceValue);
+            bWaited = true;
+        }
+    }
+
+    m_nFrameSlot = nFrameSlot;
+    m_device.BeginFrame(nFrameSlot);
+    return bWaited;
+}
+
+// What every stage waits for. The ones on the same queue are met by the order of the queue, the others turn into GPU
+// waits. The buffers swap every frame, so the writable buffer of a frame is the one the render two frames back drew.
+struct ParticleStageDependency
+{
+    ParticleFrameStage stage;
+    ParticleFrameStage after;
+    uint32_t nFramesBack;
+};
+
+static const ParticleStageDependency s_stageDependencies[] =
+{
+    { ParticleFrameStage::Emission, ParticleFrameStage::Update, 1 },    // The dead list, the counts and the dispatch arguments
+    { ParticleFrameStage::Emission, ParticleFrameStage::Render, 2 },    // Emits into the dead slots of the buffer it drew
+    { ParticleFrameStage::Update, ParticleFrameStage::Emission, 0 },
+    { ParticleFrameStage::Update, ParticleFrameStage::Render, 1 },      // Moves and compacts the buffer it drew
+    { ParticleFrameStage::Render, ParticleFrameStage::Update, 1 },      // Draws what it wrote
+};
+
+static ParticleQueue GetStageQueue(ParticleFrameStage stage)
+{
+    return stage == ParticleFrameStage::Render ? ParticleQueue::Graphics : ParticleQueue::Compute;
+}
+
+void ParticleFramePipeline::WaitForDependencies(ParticleFrameStage stage)
+{
+    const ParticleQueue queue = GetStageQueue(stage);
+    for (const ParticleStageDependency& dependency : s_stageDependencies)
+    {
+        // Nothing to wait for before the first frames
+        if (dependency.stage != stage || GetStageQueue(dependency.after) == queue || dependency.nFramesBack > m_nFrameCount)
+        {
+            continue;
+        }
+
+        const uint64_t nFenceValue = m_nStageFenceValues[(m_nFrameCount - dependency.nFramesBack) % StageHistoryCount][(int)dependency.after];
+        assert(nFenceValue != 0);
+
+        // There's only the other queue, and it reached every value before the last one the queue waited for
+        if (nFenceValue > m_nWaitedFenceValues[(int)queue])
+        {
+            m_device.Wait(queue, nFenceValue);
+            m_nWaitedFenceValues[(int)queue] = nFenceValue;
+        }
+    }
+}
+
+void ParticleFramePipeline::SubmitStages(ParticleFrameStage first, ParticleFrameStage last)
+{
+    const ParticleQueue queue = GetStageQueue(first);
+    for (int iStage = (int)first; iStage <= (int)last; iStage++)
+    {
+        assert(GetStageQueue((ParticleFrameStage)iStage) == queue);
+        WaitForDependencies((ParticleFrameStage)iStage);
+    }
+
+    ParticleTrackedCommandList commandList(m_device.Open(queue), m_resourceTracker);
+    m_frameGraph.Record(commandList, first, last);
+    commandList.Close();
+    m_device.Submit(queue);
+
+    const uint64_t nFenceValue = m_device.Signal(queue);
+    for (int iStage = (int)first; iStage <= (int)last; iStage++)
+    {
+        m_nStageFenceValues[m_nFrameCount % StageHistoryCount][iStage] = nFenceValue;
+    }
+}
+
+void ParticleFramePipeline::SubmitFrame(const ParticleFrameDesc& desc)
+{
+    typedef ParticleFrameStage Stage;
+
+    uint64_t* pFenceValues = m_nStageFenceValues[m_nFrameCount % StageHistoryCount];
+    std::fill(pFenceValues, pFenceValues + (int)Stage::Count, 0);
+
+    m_frameGraph.Reset();
+    BuildParticleFrameGraph(m_frameGraph, desc);
+    m_frameGraph.Compile(m_bTransientLayout ? &m_transientLayout : nullptr);
+
+    auto fnSimulate = [&]()
+    {
+        SubmitStages(Stage::Emission, Stage::Update);
+    };
+    auto fnRender = [&]()
+    {
+        SubmitStages(Stage::Render, Stage::Render);
+    };
+
+    if (desc.bComputeFirst)
+    {
+        fnSimulate();
+        fnRender();
+    }
+    else
+    {
+        fnRender();
+        fnSimulate();
+    }
+
+    m_device.Present();
+
+    m_nSlotFenceValues[m_nFrameSlot][(int)ParticleQueue::Compute] = pFenceValues[(int)Stage::Update];
+    m_nSlotFenceValues[m_nFrameSlot][(int)ParticleQueue::Graphics] = pFenceValues[(int)Stage::Render];
+    m_nFrameCount++;
+}
+
+void ParticleFramePipeline::SetTransientLayout(const ParticleTransientLayout& layout)
+{
+    m_transientLayout = layout;
+    m_bTransientLayout = true;
+}
+
+void ParticleFramePipeline::WaitForIdle()
+{
+    m_device.Flush(ParticleQueue::Graphics);
+    m_device.Flush(ParticleQueue::Compute);
+}
+
+// The second set of streams still has the initial particles' upload on it
+ParticleResourceState GetParticleLoadedResourceState(ParticleResource resource)
+{
+    if (resource < ParticleResource::ParticleStreams1)
+    {
+        return ParticleResourceState::UnorderedAccess;
+    }
+    if (resource < ParticleResource::DeadList)
+    {
+        return ParticleResourceState::CopyDest;
+    }
+    if (resource >= ParticleResource::BackBuffers)
+    {
+        return ParticleResourceState::Present;
+    }
+
+    switch (resource)
+    {
+    case ParticleResource::DrawArgs0:
+    case ParticleResource::DrawArgs1:
+    case ParticleResource::DispatchArgs:
+        return ParticleResourceState::IndirectArgument;
+    case ParticleResource::ParticleCountReadback:
+    case ParticleResource::EmitterParticleCountsReadback:
+    case ParticleResource::DeadListReadback:
+    case ParticleResource::TileListCountersReadback:
+    case ParticleResource::TimestampReadback:
+        return ParticleResourceState::CopyDest;
+    default:
+        return ParticleResourceState::UnorderedAccess;
+    }
+}
+
+// What ParticleTrackedCommandList promises: one barrier call between two pieces of work, no transition that changes
+// nothing, and every split transition ends in the list it began in
+static uint32_t CountBarrierErrors(const ParticleDeviceRecording& device)
+{
+    typedef ParticleRecordedCommand::Type Type;
+
+    uint32_t nErrorCount = 0;
+    bool bOpen[(int)ParticleResource::Count] = {};
+    uint32_t nOpenCount = 0;
+    Type lastType = Type::Execute;
+    for (const ParticleRecordedCommand& command : device.GetCommands())
+    {
+        if (command.type == Type::Execute)
+        {
+            nErrorCount += nOpenCount;
+            std::fill(bOpen, bOpen + (int)ParticleResource::Count, false);
+            nOpenCount = 0;
+        }
+        else if (command.type == Type::ResourceBarrier)
+        {
+            if (lastType == Type::ResourceBarrier)
+            {
+                nErrorCount++;
+            }
+            for (uint32_t iBarrier = 0; iBarrier < command.nBarrierCount; iBarrier++)
+            {
+                const ParticleBarrier& barrier = device.GetBarriers()[command.nFirstBarrier + iBarrier];
+                if (barrier.type != ParticleBarrier::Type::Transition)
+                {
+                    continue;
+                }
+
+                bool& bResourceOpen = bOpen[(int)barrier.resource];
+                if (barrier.before == barrier.after)
+                {
+                    nErrorCount++;
+                }
+                else if (barrier.flags == ParticleBarrierFlags::BeginOnly)
+                {
+                    nErrorCount += bResourceOpen ? 1 : 0;
+                    nOpenCount += bResourceOpen ? 0 : 1;
+                    bResourceOpen = true;
+                }
+                else if (barrier.flags == ParticleBarrierFlags::EndOnly)
+                {
+                    nErrorCount += bResourceOpen ? 0 : 1;
+                    nOpenCount -= bResourceOpen ? 1 : 0;
+                    bResourceOpen = false;
+                }
+            }
+        }
+        lastType = command.type;
+    }
+    return nErrorCount + nOpenCount;
+}
+
+ParticleFrameBenchmarkResult BenchmarkParticleFrame(const ParticleFrameDesc& desc, uint32_t nFrameCount)
+{
+    ParticleDeviceRecording device;
+    ParticleResourceTracker tracker;
+    for (uint32_t iResource = 0; iResource < (uint32_t)ParticleResource::Count; iResource++)
+    {
+        device.SetResourceState((ParticleResource)iResource, GetParticleLoadedResourceState((ParticleResource)iResource));
+        tracker.SetState((ParticleResource)iResource, GetParticleLoadedResourceState((ParticleResource)iResource));
+    }
+
+    ParticleFrameBenchmarkResult result = {};
+    result.nFrameCount = nFrameCount;
+
+    ParticleFrameDesc frameDesc = desc;
+    uint64_t nRecordNanoseconds = 0;
+    for (uint32_t iFrame = 0; iFrame < nFrameCount; iFrame++)
+    {
+        device.ClearCommands();
+
+        auto start = std::chrono::steady_clock::now();
+        RunParticleFrame(device, tracker, frameDesc);
+        nRecordNanoseconds += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        result.nBarrierErrorCount += CountBarrierErrors(device);
+
+        // The swap chain flips the back buffer and with it the constant buffer and the particle buffers
+        std::swap(frameDesc.nReadableBuffer, frameDesc.nWritableBuffer);
+        frameDesc.nBackBuffer = frameDesc.nReadableBuffer;
+        frameDesc.nConstantBuffer = frameDesc.nReadableBuffer;
+    }
+
+    // The counts of the last frame, every frame has the same commands
+    for (const ParticleRecordedCommand& command : device.GetCommands())
+    {
+        result.nCommandCount++;
+        switch (command.type)
+        {
+        case ParticleRecordedCommand::Type::Dispatch:
+        case ParticleRecordedCommand::Type::DispatchIndirect:
+            result.nDispatchCount++;
+            break;
+        case ParticleRecordedCommand::Type::Draw:
+        case ParticleRecordedCommand::Type::DrawIndirect:
+            result.nDrawCount++;
+            break;
+        case ParticleRecordedCommand::Type::ResourceBarrier:
+            result.nBarrierCount += command.nBarrierCount;
+            result.nBarrierCallCount++;
+            for (uint32_t iBarrier = 0; iBarrier < command.nBarrierCount; iBarrier++)
+            {
+                result.nAliasingBarrierCount += device.GetBarriers()[command.nFirstBarrier + iBarrier].type == ParticleBarrier::Type::Aliasing ? 1 : 0;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (nFrameCount > 0)
+    {
+        result.fRecordMicroseconds = nRecordNanoseconds / 1000.0 / nFrameCount;
+        result.fElidedTransitionCount = (double)tracker.GetElidedTransitionCount() / nFrameCount;
+        result.fSplitTransitionCount = (double)tracker.GetSplitTransitionCount() / nFrameCount;
+    }
+    result.nStateMismatchCount = device.GetStateMismatchCount();
+    result.bStatesConsistent = result.nStateMismatchCount == 0;
+
+    // The frame the way ParticleFramePipeline compiles it for DX12Particles, against the layout of the heap
+    const ParticleTransientLayout layout = GetParticleTransientLayout(desc);
+    ParticleFrameGraph graph;
+    BuildParticleFrameGraph(graph, desc);
+    graph.Compile(&layout);
+    result.nPassCount = graph.GetPassCount();
+    result.nCulledPassCount = graph.GetCulledPassCount();
+    result.nTransientBytes = graph.GetTransientSize();
+    result.nTransientHeapBytes = layout.nHeapSize;
+    result.nAliasConflictCount = graph.GetAliasConflictCount();
+    return result;
+}
+
+typedef std::pair<double, double> ParticleInterval;
+
+// Into sorted intervals that don't overlap
+static std::vector<ParticleInterval> MergeIntervals(std::vector<ParticleInterval> intervals)
+{
+    std::sort(intervals.begin(), intervals.end());
+
+    std::vector<ParticleInterval> merged;
+    for (const ParticleInterval& interval : intervals)
+    {
+        if (!merged.empty() && interval.first <= merged.back().second)
+        {
+            merged.back().second = std::max(merged.back().second, interval.second);
+        }
+        else if (interval.second > interval.first)
+        {
+            merged.push_back(interval);
+        }
+    }
+    return merged;
+}
+
+static double GetLength(const std::vector<ParticleInterval>& intervals)
+{
+    double fLength = 0.0;
+    for (const ParticleInterval& interval : intervals)
+    {
+        fLength += interval.second - interval.first;
+    }
+    return fLength;
+}
+
+// Both have to be merged
+static double GetOverlap(const std::vector<ParticleInterval>& a, const std::vector<ParticleInterval>& b)
+{
+    double fOverlap = 0.0;
+    size_t iA = 0;
+    size_t iB = 0;
+    while (iA < a.size() && iB < b.size())
+    {
+        const double fStart = std::max(a[iA].first, b[iB].first);
+        const double fEnd = std::min(a[iA].second, b[iB].second);
+        if (fEnd > fStart)
+        {
+            fOverlap += fEnd - fStart;
+        }
+
+        if (a[iA].second < b[iB].second)
+        {
+            iA++;
+        }
+        else
+        {
+            iB++;
+        }
+    }
+    return fOverlap;
+}
+
+ParticlePipelineBenchmarkResult BenchmarkParticlePipeline(const ParticlePipelineBenchmarkDesc& desc)
+{
+    typedef ParticleRecordedCommand::Type Type;
+
+    ParticleDeviceRecording device;
+    for (uint32_t iResource = 0; iResource < (uint32_t)ParticleResource::Count; iResource++)
+    {
+        device.SetResourceState((ParticleResource)iResource, GetParticleLoadedResourceState((ParticleResource)iResource));
+    }
+    for (uint32_t iPass = 0; iPass < (uint32_t)ParticlePass::Count; iPass++)
+    {
+        device.SetPassMicroseconds((ParticlePass)iPass, desc.fPassMicroseconds[iPass]);
+    }
+
+    ParticlePipelineBenchmarkResult result = {};
+    result.nFrameCount = desc.nFrameCount;
+    result.nFrameLatency = desc.nFrameLatency;
+
+    ParticleFramePipeline pipeline(device, desc.nFrameLatency);
+    ParticleFrameDesc frameDesc = desc.frame;
+    for (uint32_t iFrame = 0; iFrame < desc.nFrameCount; iFrame++)
+    {
+        const uint32_t nFrameSlot = iFrame % desc.nFrameLatency;
+        if (pipeline.BeginFrame(nFrameSlot))
+        {
+            result.nCpuWaitCount++;
+        }
+        device.AdvanceCpu(desc.fCpuMicroseconds);
+
+        frameDesc.nBackBuffer = nFrameSlot;
+        frameDesc.nConstantBuffer = nFrameSlot;
+        pipeline.SubmitFrame(frameDesc);
+        std::swap(frameDesc.nReadableBuffer, frameDesc.nWritableBuffer);
+    }
+    pipeline.WaitForIdle();
+
+    // Goes by what the lists do, not by the stages of the pipeline. A draw reads the live particles of its buffer and
+    // the update passes write them, so a list that does one of them has to start after every list submitted before it
+    // that does the other one with the same buffer. CSGenerate only fills dead slots and appends to the alive list
+    // behind the count the draw reads, it may run next to the draw. The commands of a list follow its Execute.
+    std::vector<ParticleInterval> cpuIntervals;
+    std::vector<ParticleInterval> queueIntervals[(int)ParticleQueue::Count];
+    double fDrawEnd[2] = {};           // Of both ping-pong sets
+    double fUpdateEnd[2] = {};
+    const ParticleRecordedCommand* pExecute = nullptr;
+    bool bOrderViolation = false;
+    for (const ParticleRecordedCommand& command : device.GetCommands())
+    {
+        switch (command.type)
+        {
+        case Type::CpuWork:
+            cpuIntervals.push_back(ParticleInterval(command.fStartMicroseconds, command.fEndMicroseconds));
+            break;
+        case Type::Execute:
+            result.nOrderViolationCount += bOrderViolation ? 1 : 0;
+            bOrderViolation = false;
+            pExecute = &command;
+            queueIntervals[(int)command.queue].push_back(ParticleInterval(command.fStartMicroseconds, command.fEndMicroseconds));
+            break;
+        case Type::Draw:
+        case Type::DrawIndirect:
+        {
+            const uint32_t nBuffer = command.params.nReadBuffer;
+            bOrderViolation |= pExecute->fStartMicroseconds < fUpdateEnd[nBuffer];
+            fDrawEnd[nBuffer] = std::max(fDrawEnd[nBuffer], pExecute->fEndMicroseconds);
+            break;
+        }
+        case Type::Dispatch:
+        case Type::DispatchIndirect:
+            switch (command.pass)
+            {
+            case ParticlePass::Move:
+            case ParticlePass::CompactCount:
+            case ParticlePass::CompactScanGroups:
+            case ParticlePass::CompactScatter:
+            {
+                const uint32_t nBuffer = command.params.nWriteBuffer;
+                bOrderViolation |= pExecute->fStartMicroseconds < fDrawEnd[nBuffer];
+                fUpdateEnd[nBuffer] = std::max(fUpdateEnd[nBuffer], pExecute->fEndMicroseconds);
+                break;
+            }
+            default:
+                break;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    result.nOrderViolationCount += bOrderViolation ? 1 : 0;
+
+    std::vector<ParticleInterval> gpuIntervals = queueIntervals[(int)ParticleQueue::Graphics];
+    gpuIntervals.insert(gpuIntervals.end(), queueIntervals[(int)ParticleQueue::Compute].begin(), queueIntervals[(int)ParticleQueue::Compute].end());
+    gpuIntervals = MergeIntervals(gpuIntervals);
+    cpuIntervals = MergeIntervals(cpuIntervals);
+    for (std::vector<ParticleInterval>& intervals : queueIntervals)
+    {
+        intervals = MergeIntervals(intervals);
+    }
+
+    const double fTotalMicroseconds = std::max(device.GetCpuMicroseconds(),
+        std::max(device.GetQueueEndMicroseconds(ParticleQueue::Graphics), device.GetQueueEndMicroseconds(ParticleQueue::Compute)));
+    if (desc.nFrameCount > 0)
+    {
+        result.fFrameMicroseconds = fTotalMicroseconds / desc.nFrameCount;
+        result.fCpuWaitMicroseconds = device.GetCpuWaitMicroseconds() / desc.nFrameCount;
+    }
+    if (fTotalMicroseconds > 0.0)
+    {
+        result.fGpuBusyFraction = GetLength(gpuIntervals) / fTotalMicroseconds;
+        result.fQueueOverlapFraction = GetOverlap(queueIntervals[(int)ParticleQueue::Graphics], queueIntervals[(int)ParticleQueue::Compute]) / fTotalMicroseconds;
+        result.fCpuGpuOverlapFraction = GetOverlap(cpuIntervals, gpuIntervals) / fTotalMicroseconds;
+    }
+
+    // The simulation that runs while the graphics queue renders doesn't add to the frame
+    if (desc.nFrameCount > 0)
+    {
+        const double fSimulationMicroseconds = GetLength(queueIntervals[(int)ParticleQueue::Compute]);
+        const double fHiddenMicroseconds = GetOverlap(queueIntervals[(int)ParticleQueue::Compute], queueIntervals[(int)ParticleQueue::Graphics]);
+        result.fSimulationMicroseconds = fSimulationMicroseconds / desc.nFrameCount;
+        result.fHiddenSimulationMicroseconds = fHiddenMicroseconds / desc.nFrameCount;
+        result.fHiddenSimulationFraction = fSimulationMicroseconds > 0.0 ? fHiddenMicroseconds / fSimulationMicroseconds : 0.0;
+    }
+    result.nFrameSlotHazardCount = device.GetFrameSlotHazardCount() + device.GetUnsignaledWaitCount();
+    result.nStateMismatchCount = device.GetStateMismatchCount();
+    return result;
+}
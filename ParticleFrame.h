@@ -0,0 +1,172 @@
+#pragma once
+
+// The passes of a frame, the way DX12Particles runs them, recorded against any ParticleDevice.
+// BuildParticleFrameGraph declares them with what they read and write, ParticleFrameGraph orders them, places the
+// barriers and culls what nothing reads. The compute queue's part is the emission followed by the update: emit, update,
+// compact and bin the tiles. ParticleFramePipeline can submit the two on their own. The graphics queue's part is the
+// render: the particles or the output of the tiles into the back buffer.
+// ParticleFramePipeline submits them without waiting for the GPU, up to nFrameLatency frames ahead of it.
+
+#include "ParticleDevice.h"
+#include "ParticleFrameGraph.h"
+#include "ParticleResourceTracker.h"
+
+#include <cstdint>
+
+enum class ParticleDrawMode
+{
+    None,           // Only the tiles get binned and rasterized, nothing is drawn
+    Primitives,     // One point per live particle, expanded to a quad by the geometry shader
+    TileOutput      // The image of CSRasterizeParticles
+};
+
+struct ParticleFrameDesc
+{
+    // The simulation reads nReadableBuffer's streams and swaps them halfway, after the emission.
+    // The render draws nWritableBuffer, the one the last frame's simulation wrote.
+    uint32_t nReadableBuffer = 0;
+    uint32_t nWritableBuffer = 1;
+    uint32_t nBackBuffer = 0;
+    uint32_t nConstantBuffer = 0;       // The frame's constants and emitter table, OnUpdate writes the ones of its slot
+
+    uint32_t nEmitCount = 0;            // Particles the frame emits over every emitter
+    uint32_t nParticleBufferSize = 0;
+    uint32_t nWidth = 0;
+    uint32_t nHeight = 0;
+    uint32_t nTileSize = 0;
+
+    bool bCollisions = false;
+    bool bBinTiles = false;             // Bins and rasterizes the particles into the tile output
+    bool bReadBackDeadList = false;     // The whole dead list, not only its counter
+    bool bComputeFirst = false;         // Submits the simulation before the render
+    ParticleDrawMode drawMode = ParticleDrawMode::Primitives;
+
+    uint32_t nHashTimestampQuery = 0;   // The first of the four timestamps around the spatial hash passes
+};
+
+// Declares the passes of the emission, the update and the render, and the transient buffers with the sizes for desc.
+// The emission only touches the writable buffer and the buffers of the compute queue, nothing the render of the frame
+// before draws. The update writes the buffer that render drew.
+void BuildParticleFrameGraph(ParticleFrameGraph& graph, const ParticleFrameDesc& desc);
+
+// Where DX12Particles places the transient buffers, from a frame of desc with every pass that uses one of them.
+// Any frame of the same size fits into it.
+ParticleTransientLayout GetParticleTransientLayout(const ParticleFrameDesc& desc);
+
+// Records and submits both parts in the order of bComputeFirst, presents and waits for both queues.
+// The readbacks of the frame are ready after this.
+void RunParticleFrame(ParticleDevice& device, ParticleResourceTracker& tracker, const ParticleFrameDesc& desc);
+
+// What LoadAssets leaves the resources in, where the trackers start
+ParticleResourceState GetParticleLoadedResourceState(ParticleResource resource);
+
+struct ParticleFrameBenchmarkResult
+{
+    uint32_t nFrameCount;
+    uint32_t nCommandCount;             // Per frame
+    uint32_t nDispatchCount;
+    uint32_t nDrawCount;
+    uint32_t nBarrierCount;             // Single barriers, not calls
+    uint32_t nBarrierCallCount;
+    double fRecordMicroseconds;         // Recording and submitting a frame, per frame
+    double fElidedTransitionCount;      // Per frame, the ones the tracker dropped
+    double fSplitTransitionCount;
+    uint32_t nStateMismatchCount;       // Over all the frames, see ParticleDeviceRecording
+    bool bStatesConsistent;             // Every transition started from the state the resource was in
+    uint32_t nBarrierErrorCount;        // Over all the frames, two barrier calls in a row, a transition to the same state
+                                        // or a split one that doesn't end in its list
+    uint32_t nPassCount;                // Declared by BuildParticleFrameGraph
+    uint32_t nCulledPassCount;
+    uint64_t nTransientBytes;           // The transient buffers one after the other
+    uint64_t nTransientHeapBytes;       // And sharing memory, the heap of GetParticleTransientLayout
+    uint32_t nAliasConflictCount;       // Of the frame against that layout, has to be zero
+    uint32_t nAliasingBarrierCount;     // Per frame
+};
+
+// Keeps up to nFrameLatency frames in flight. Every frame records into the command memory of its slot, and only
+// BeginFrame waits on the CPU, for the frame that used the slot before. The queues wait for each other on the GPU,
+// every stage for the fences of the stages it depends on: the update writes the buffer the last render drew, and
+// the render draws what the last update wrote. The emission only writes the buffer the render two frames back drew,
+// but it goes into the list of the update: on its own it would still queue up behind the last update, which waited
+// for that render already. Waits that an earlier wait of the queue covers are left out.
+class ParticleFramePipeline
+{
+public:
+    ParticleFramePipeline(ParticleDevice& device, uint32_t nFrameLatency);
+
+    // Before anything the CPU writes for the frame in the slot, true if it had to wait for the GPU
+    bool BeginFrame(uint32_t nFrameSlot);
+
+    // Records and submits the stages, the simulation and the render in the order of bComputeFirst, and presents.
+    // The readbacks of the frame are ready after the next BeginFrame of the same slot.
+    void SubmitFrame(const ParticleFrameDesc& desc);
+
+    // Both queues, before the buffers change size or the pipelines change
+    void WaitForIdle();
+
+    uint32_t GetFrameLatency() const                { return m_nFrameLatency; }
+
+    // Starts from GetParticleLoadedResourceState, the resources created again have to be set
+    ParticleResourceTracker& GetResourceTracker()   { return m_resourceTracker; }
+
+    // Where the transient buffers are, from GetParticleTransientLayout. Without it every frame lays them out itself.
+    void SetTransientLayout(const ParticleTransientLayout& layout);
+
+private:
+    // The stages depend on up to two frames back
+    static const uint32_t StageHistoryCount = 3;
+
+    void WaitForDependencies(ParticleFrameStage stage);
+
+    // From first to last into one list of their queue
+    void SubmitStages(ParticleFrameStage first, ParticleFrameStage last);
+
+    ParticleDevice& m_device;
+    ParticleResourceTracker m_resourceTracker;
+    ParticleFrameGraph m_frameGraph;                // Of the frame being submitted
+    ParticleTransientLayout m_transientLayout;
+    bool m_bTransientLayout = false;
+    uint32_t m_nFrameLatency;
+    uint32_t m_nFrameSlot = 0;
+    uint64_t m_nFrameCount = 0;
+    uint64_t m_nStageFenceValues[StageHistoryCount][(int)ParticleFrameStage::Count] = {};  // Of the last frames, by m_nFrameCount
+    uint64_t m_nWaitedFenceValues[(int)ParticleQueue::Count] = {};                          // The last one of the other queue
+    uint64_t m_nSlotFenceValues[ParticleMaxFrameLatency][(int)ParticleQueue::Count] = {};   // Of the last frame of every slot
+};
+
+// Runs nFrameCount frames of desc on a ParticleDeviceRecording, swapping the buffers between the frames like OnRender,
+// and follows the transitions from the states LoadAssets leaves the resources in. Only the explicit transitions count,
+// the implicit decay of the buffers to the common state at the end of every ExecuteCommandLists isn't modeled.
+ParticleFrameBenchmarkResult BenchmarkParticleFrame(const ParticleFrameDesc& desc, uint32_t nFrameCount);
+
+struct ParticlePipelineBenchmarkDesc
+{
+    ParticleFrameDesc frame;
+    uint32_t nFrameLatency = 1;
+    uint32_t nFrameCount = 100;
+    double fCpuMicroseconds = 0.0;                              // OnUpdate and the recording of a frame
+    double fPassMicroseconds[(int)ParticlePass::Count] = {};    // Every dispatch or draw of the pass on the GPU
+};
+
+struct ParticlePipelineBenchmarkResult
+{
+    uint32_t nFrameCount;
+    uint32_t nFrameLatency;
+    double fFrameMicroseconds;          // From the first BeginFrame until both queues are done, per frame
+    double fCpuWaitMicroseconds;        // Blocked in BeginFrame, per frame
+    uint32_t nCpuWaitCount;             // Frames whose BeginFrame blocked
+    double fGpuBusyFraction;            // Of the whole time, either queue running
+    double fQueueOverlapFraction;       // Both queues running
+    double fCpuGpuOverlapFraction;      // The CPU working while a queue runs
+    double fSimulationMicroseconds;     // The compute queue running, per frame
+    double fHiddenSimulationMicroseconds;   // Of that, while the graphics queue runs too
+    double fHiddenSimulationFraction;
+    uint32_t nOrderViolationCount;      // A list that ran next to one that draws what it updates, or the other way round
+    uint32_t nFrameSlotHazardCount;     // See ParticleDeviceRecording, like the order has to stay zero
+    uint32_t nStateMismatchCount;
+};
+
+// Runs the frames through a ParticleFramePipeline on the timeline model of ParticleDeviceRecording. The CPU works for
+// fCpuMicroseconds between BeginFrame and SubmitFrame, the way OnUpdate and OnRender do, and the buffers swap like in
+// BenchmarkParticleFrame.
+ParticlePipelineBenchmarkResult BenchmarkParticlePipeline(const ParticlePipelineBenchmarkDesc& desc);
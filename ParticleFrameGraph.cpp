@@ -0,0 +1,516 @@
+#include "ParticleFrameGraph.h"
+
+#include <algorithm>
+#include <cassert>
+
+// What the passes since the last barrier did to a resource through its unordered access views
+enum ParticleAccessBits : uint8_t
+{
+    ParticleAccessRead = 1,
+    ParticleAccessWrite = 2,
+    ParticleAccessDisjointWrite = 4
+};
+
+static uint8_t GetAccessBits(ParticleFrameGraph::Access access)
+{
+    switch (access)
+    {
+    case ParticleFrameGraph::Access::Read:
+        return ParticleAccessRead;
+    case ParticleFrameGraph::Access::DisjointWrite:
+        return ParticleAccessDisjointWrite;
+    default:
+        return ParticleAccessWrite;
+    }
+}
+
+// Everything after a write waits for it, a write waits for the reads before it too. Disjoint writes only wait for
+// what isn't one of them.
+static bool IsHazard(uint8_t nAccesses, ParticleFrameGraph::Access access)
+{
+    if (nAccesses & ParticleAccessWrite)
+    {
+        return true;
+    }
+    if ((nAccesses & ParticleAccessDisjointWrite) && access != ParticleFrameGraph::Access::DisjointWrite)
+    {
+        return true;
+    }
+    return (nAccesses & ParticleAccessRead) && access != ParticleFrameGraph::Access::Read;
+}
+
+static uint64_t AlignTransientSize(uint64_t nSize)
+{
+    return (nSize + ParticleTransientAlignment - 1) / ParticleTransientAlignment * ParticleTransientAlignment;
+}
+
+static bool AreLifetimesOverlapping(uint32_t nFirstA, uint32_t nLastA, uint32_t nFirstB, uint32_t nLastB)
+{
+    return nFirstA <= nLastB && nFirstB <= nLastA;
+}
+
+bool ParticleTransientLayout::SharesMemory(ParticleResource first, ParticleResource second) const
+{
+    if (first == second || nSizes[(int)first] == 0 || nSizes[(int)second] == 0)
+    {
+        return false;
+    }
+    return nOffsets[(int)first] < nOffsets[(int)second] + nSizes[(int)second] && nOffsets[(int)second] < nOffsets[(int)first] + nSizes[(int)first];
+}
+
+ParticleFrameGraph::BarrierState::BarrierState()
+{
+    std::fill(m_states, m_states + (int)ParticleResource::Count, ParticleResourceState::Count);
+    std::fill(m_accesses, m_accesses + (int)ParticleResource::Count, (uint8_t)0);
+}
+
+void ParticleFrameGraph::BarrierState::GetBarriers(const ParticleFrameGraph& graph, const Pass& pass, bool* pbTransition, bool* pbUnorderedAccess) const
+{
+    *pbTransition = false;
+    *pbUnorderedAccess = false;
+    for (uint32_t iUse = pass.nFirstUse; iUse < pass.nFirstUse + pass.nUseCount; iUse++)
+    {
+        const ResourceUse& use = graph.m_uses[iUse];
+        if (use.state == AnyState)
+        {
+            continue;
+        }
+
+        const ParticleResourceState state = m_states[(int)use.resource];
+        if (state != ParticleResourceState::Count && state != use.state)
+        {
+            *pbTransition = true;
+        }
+        else if (use.state == ParticleResourceState::UnorderedAccess && IsHazard(m_accesses[(int)use.resource], use.access))
+        {
+            *pbUnorderedAccess = true;
+        }
+    }
+}
+
+void ParticleFrameGraph::BarrierState::Apply(const ParticleFrameGraph& graph, const Pass& pass, bool bUnorderedAccessBarrier)
+{
+    if (bUnorderedAccessBarrier)
+    {
+        std::fill(m_accesses, m_accesses + (int)ParticleResource::Count, (uint8_t)0);
+    }
+
+    for (uint32_t iUse = pass.nFirstUse; iUse < pass.nFirstUse + pass.nUseCount; iUse++)
+    {
+        const ResourceUse& use = graph.m_uses[iUse];
+        if (use.state == AnyState)
+        {
+            continue;
+        }
+
+        // A transition waits for everything before it on the resource
+        if (m_states[(int)use.resource] != use.state)
+        {
+            m_states[(int)use.resource] = use.state;
+            m_accesses[(int)use.resource] = 0;
+        }
+        if (use.state == ParticleResourceState::UnorderedAccess)
+        {
+            m_accesses[(int)use.resource] |= GetAccessBits(use.access);
+        }
+    }
+}
+
+void ParticleFrameGraph::AddPass(const char* pName, ParticleFrameStage stage, RecordFunction fnRecord)
+{
+    assert(m_passes.empty() || m_passes.back().stage <= stage);
+
+    Pass pass;
+    pass.pName = pName;
+    pass.stage = stage;
+    pass.fnRecord = std::move(fnRecord);
+    pass.nFirstUse = (uint32_t)m_uses.size();
+    pass.nUseCount = 0;
+    pass.bCulled = false;
+    m_passes.push_back(std::move(pass));
+}
+
+void ParticleFrameGraph::Use(ParticleResource resource, ParticleResourceState state, Access access)
+{
+    assert(!m_passes.empty());
+    assert(FindUse(m_passes.back(), resource) == nullptr);
+
+    ResourceUse use = { resource, state, access };
+    m_uses.push_back(use);
+    m_passes.back().nUseCount++;
+}
+
+void ParticleFrameGraph::DeclareTransient(ParticleResource resource, uint64_t nSize)
+{
+    assert(nSize > 0);
+    m_nTransientSizes[(int)resource] = nSize;
+}
+
+void ParticleFrameGraph::Reset()
+{
+    m_passes.clear();
+    m_uses.clear();
+    std::fill(m_nTransientSizes, m_nTransientSizes + (int)ParticleResource::Count, (uint64_t)0);
+    m_layout = ParticleTransientLayout();
+    for (std::vector<uint32_t>& order : m_orders)
+    {
+        order.clear();
+    }
+    m_nAliasConflictCount = 0;
+}
+
+const ParticleFrameGraph::ResourceUse* ParticleFrameGraph::FindUse(const Pass& pass, ParticleResource resource) const
+{
+    for (uint32_t iUse = pass.nFirstUse; iUse < pass.nFirstUse + pass.nUseCount; iUse++)
+    {
+        if (m_uses[iUse].resource == resource)
+        {
+            return &m_uses[iUse];
+        }
+    }
+    return nullptr;
+}
+
+// Anything but two reads or two disjoint writes of the same resource keeps the order. A transient resource that takes
+// over the memory of another one also waits for every use of that one.
+bool ParticleFrameGraph::DependsOn(uint32_t nPass, uint32_t nEarlierPass) const
+{
+    const Pass& pass = m_passes[nPass];
+    const Pass& earlierPass = m_passes[nEarlierPass];
+    for (uint32_t iUse = pass.nFirstUse; iUse < pass.nFirstUse + pass.nUseCount; iUse++)
+    {
+        const ResourceUse& use = m_uses[iUse];
+        const ResourceUse* pEarlierUse = FindUse(earlierPass, use.resource);
+        if (pEarlierUse != nullptr && !(use.access == Access::Read && pEarlierUse->access == Access::Read) &&
+            !(use.access == Access::DisjointWrite && pEarlierUse->access == Access::DisjointWrite))
+        {
+            return true;
+        }
+
+        if (IsTransient(use.resource) && m_nFirstUses[(int)use.resource] == nPass)
+        {
+            for (uint32_t iEarlierUse = earlierPass.nFirstUse; iEarlierUse < earlierPass.nFirstUse + earlierPass.nUseCount; iEarlierUse++)
+            {
+                if (m_layout.SharesMemory(use.resource, m_uses[iEarlierUse].resource))
+                {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Backwards from the end of the frame. A transient resource is needed from a read back to the write before it.
+void ParticleFrameGraph::Cull()
+{
+    bool bNeeded[(int)ParticleResource::Count] = {};
+    for (uint32_t iPass = (uint32_t)m_passes.size(); iPass-- > 0; )
+    {
+        Pass& pass = m_passes[iPass];
+        pass.bCulled = true;
+        for (uint32_t iUse = pass.nFirstUse; iUse < pass.nFirstUse + pass.nUseCount; iUse++)
+        {
+            const ResourceUse& use = m_uses[iUse];
+            if (use.access != Access::Read && (!IsTransient(use.resource) || bNeeded[(int)use.resource]))
+            {
+                pass.bCulled = false;
+            }
+        }
+        if (pass.bCulled)
+        {
+            continue;
+        }
+
+        for (uint32_t iUse = pass.nFirstUse; iUse < pass.nFirstUse + pass.nUseCount; iUse++)
+        {
+            const ResourceUse& use = m_uses[iUse];
+            if (IsTransient(use.resource))
+            {
+                bNeeded[(int)use.resource] = use.access != Access::Write;
+            }
+        }
+    }
+}
+
+void ParticleFrameGraph::FindLifetimes()
+{
+    std::fill(m_nFirstUses, m_nFirstUses + (int)ParticleResource::Count, UINT32_MAX);
+    std::fill(m_nLastUses, m_nLastUses + (int)ParticleResource::Count, 0);
+    for (uint32_t iPass = 0; iPass < (uint32_t)m_passes.size(); iPass++)
+    {
+        const Pass& pass = m_passes[iPass];
+        if (pass.bCulled)
+        {
+            continue;
+        }
+
+        for (uint32_t iUse = pass.nFirstUse; iUse < pass.nFirstUse + pass.nUseCount; iUse++)
+        {
+            const ResourceUse& use = m_uses[iUse];
+            if (!IsTransient(use.resource))
+            {
+                continue;
+            }
+
+            if (m_nFirstUses[(int)use.resource] == UINT32_MAX)
+            {
+                assert(use.access == Access::Write);
+                m_nFirstUses[(int)use.resource] = iPass;
+            }
+            m_nLastUses[(int)use.resource] = iPass;
+        }
+    }
+}
+
+// The biggest first, each one at the lowest offset that doesn't overlap one placed already that lives at the same time
+void ParticleFrameGraph::LayOutTransients()
+{
+    std::vector<ParticleResource> transients;
+    for (uint32_t iResource = 0; iResource < (uint32_t)ParticleResource::Count; iResource++)
+    {
+        if (IsTransient((ParticleResource)iResource) && m_nFirstUses[iResource] != UINT32_MAX)
+        {
+            transients.push_back((ParticleResource)iResource);
+        }
+    }
+    std::stable_sort(transients.begin(), transients.end(), [this](ParticleResource a, ParticleResource b) { return m_nTransientSizes[(int)a] > m_nTransientSizes[(int)b]; });
+
+    m_layout = ParticleTransientLayout();
+    std::vector<ParticleResource> placed;
+    for (ParticleResource resource : transients)
+    {
+        const uint64_t nSize = AlignTransientSize(m_nTransientSizes[(int)resource]);
+
+        // The offsets are all aligned, so the lowest free one is either zero or the end of a placed one
+        std::vector<ParticleResource> living;
+        std::vector<uint64_t> candidates(1, 0);
+        for (ParticleResource other : placed)
+        {
+            if (AreLifetimesOverlapping(m_nFirstUses[(int)resource], m_nLastUses[(int)resource], m_nFirstUses[(int)other], m_nLastUses[(int)other]))
+            {
+                living.push_back(other);
+                candidates.push_back(m_layout.nOffsets[(int)other] + m_layout.nSizes[(int)other]);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        for (uint64_t nOffset : candidates)
+        {
+            bool bFree = true;
+            for (ParticleResource other : living)
+            {
+                bFree &= nOffset + nSize <= m_layout.nOffsets[(int)other] || m_layout.nOffsets[(int)other] + m_layout.nSizes[(int)other] <= nOffset;
+            }
+            if (bFree)
+            {
+                m_layout.nOffsets[(int)resource] = nOffset;
+                break;
+            }
+        }
+
+        m_layout.nSizes[(int)resource] = nSize;
+        m_layout.nHeapSize = std::max(m_layout.nHeapSize, m_layout.nOffsets[(int)resource] + nSize);
+        placed.push_back(resource);
+    }
+}
+
+void ParticleFrameGraph::CountAliasConflicts()
+{
+    m_nAliasConflictCount = 0;
+    for (uint32_t iResource = 0; iResource < (uint32_t)ParticleResource::Count; iResource++)
+    {
+        if (!IsTransient((ParticleResource)iResource) || m_nFirstUses[iResource] == UINT32_MAX)
+        {
+            continue;
+        }
+
+        if (m_layout.nSizes[iResource] < m_nTransientSizes[iResource])
+        {
+            m_nAliasConflictCount++;
+        }
+        for (uint32_t iOther = iResource + 1; iOther < (uint32_t)ParticleResource::Count; iOther++)
+        {
+            if (IsTransient((ParticleResource)iOther) && m_nFirstUses[iOther] != UINT32_MAX &&
+                m_layout.SharesMemory((ParticleResource)iResource, (ParticleResource)iOther) &&
+                AreLifetimesOverlapping(m_nFirstUses[iResource], m_nLastUses[iResource], m_nFirstUses[iOther], m_nLastUses[iOther]))
+            {
+                m_nAliasConflictCount++;
+            }
+        }
+    }
+}
+
+// A list schedule over the dependencies. Of the passes that can go next the first declared one that needs no barrier
+// goes, or the first declared one if they all need one.
+void ParticleFrameGraph::OrderStage(ParticleFrameStage stage)
+{
+    std::vector<uint32_t> passes;
+    for (uint32_t iPass = 0; iPass < (uint32_t)m_passes.size(); iPass++)
+    {
+        if (m_passes[iPass].stage == stage && !m_passes[iPass].bCulled)
+        {
+            passes.push_back(iPass);
+        }
+    }
+
+    std::vector<uint32_t>& order = m_orders[(int)stage];
+    order.clear();
+
+    std::vector<bool> bScheduled(passes.size(), false);
+    BarrierState state;
+    while (order.size() < passes.size())
+    {
+        size_t nNext = passes.size();
+        for (size_t iCandidate = 0; iCandidate < passes.size(); iCandidate++)
+        {
+            if (bScheduled[iCandidate])
+            {
+                continue;
+            }
+
+            bool bReady = true;
+            for (size_t iEarlier = 0; iEarlier < iCandidate && bReady; iEarlier++)
+            {
+                bReady = bScheduled[iEarlier] || !DependsOn(passes[iCandidate], passes[iEarlier]);
+            }
+            if (!bReady)
+            {
+                continue;
+            }
+
+            bool bTransition;
+            bool bUnorderedAccess;
+            state.GetBarriers(*this, m_passes[passes[iCandidate]], &bTransition, &bUnorderedAccess);
+            if (!bTransition && !bUnorderedAccess)
+            {
+                nNext = iCandidate;
+                break;
+            }
+            nNext = std::min(nNext, iCandidate);
+        }
+
+        bool bTransition;
+        bool bUnorderedAccess;
+        state.GetBarriers(*this, m_passes[passes[nNext]], &bTransition, &bUnorderedAccess);
+        state.Apply(*this, m_passes[passes[nNext]], bUnorderedAccess);
+        bScheduled[nNext] = true;
+        order.push_back(passes[nNext]);
+    }
+}
+
+void ParticleFrameGraph::Compile(const ParticleTransientLayout* pLayout)
+{
+    Cull();
+    FindLifetimes();
+    if (pLayout != nullptr)
+    {
+        m_layout = *pLayout;
+    }
+    else
+    {
+        LayOutTransients();
+    }
+    CountAliasConflicts();
+    assert(m_nAliasConflictCount == 0);
+
+    for (uint32_t iStage = 0; iStage < (uint32_t)ParticleFrameStage::Count; iStage++)
+    {
+        OrderStage((ParticleFrameStage)iStage);
+    }
+}
+
+void ParticleFrameGraph::Record(ParticleTrackedCommandList& commandList, ParticleFrameStage first, ParticleFrameStage last) const
+{
+    std::vector<uint32_t> order;
+    for (int iStage = (int)first; iStage <= (int)last; iStage++)
+    {
+        order.insert(order.end(), m_orders[iStage].begin(), m_orders[iStage].end());
+    }
+
+    BarrierState state;
+    for (size_t iOrder = 0; iOrder < order.size(); iOrder++)
+    {
+        const Pass& pass = m_passes[order[iOrder]];
+
+        bool bTransition;
+        bool bUnorderedAccess;
+        state.GetBarriers(*this, pass, &bTransition, &bUnorderedAccess);
+        for (uint32_t iUse = pass.nFirstUse; iUse < pass.nFirstUse + pass.nUseCount; iUse++)
+        {
+            const ResourceUse& use = m_uses[iUse];
+            if (IsTransient(use.resource) && m_nFirstUses[(int)use.resource] == order[iOrder])
+            {
+                for (uint32_t iOther = 0; iOther < (uint32_t)ParticleResource::Count; iOther++)
+                {
+                    if (m_layout.SharesMemory(use.resource, (ParticleResource)iOther))
+                    {
+                        commandList.AliasingBarrier(use.resource);
+                        break;
+                    }
+                }
+            }
+            if (use.state != AnyState)
+            {
+                commandList.Transition(use.resource, use.state);
+            }
+        }
+        if (bUnorderedAccess)
+        {
+            commandList.UnorderedAccessBarrier();
+        }
+        state.Apply(*this, pass, bUnorderedAccess);
+
+        if (pass.fnRecord)
+        {
+            pass.fnRecord(commandList);
+        }
+
+        // The resources the next few passes don't use change state while those run
+        for (uint32_t iUse = pass.nFirstUse; iUse < pass.nFirstUse + pass.nUseCount; iUse++)
+        {
+            const ResourceUse& use = m_uses[iUse];
+            if (use.state == AnyState)
+            {
+                continue;
+            }
+
+            for (size_t iNext = iOrder + 1; iNext < order.size(); iNext++)
+            {
+                const ResourceUse* pNextUse = FindUse(m_passes[order[iNext]], use.resource);
+                if (pNextUse == nullptr)
+                {
+                    continue;
+                }
+                if (iNext > iOrder + 1 && pNextUse->state != AnyState && pNextUse->state != use.state)
+                {
+                    commandList.BeginTransition(use.resource, pNextUse->state);
+                }
+                break;
+            }
+        }
+    }
+}
+
+uint32_t ParticleFrameGraph::GetCulledPassCount() const
+{
+    uint32_t nCount = 0;
+    for (const Pass& pass : m_passes)
+    {
+        nCount += pass.bCulled ? 1 : 0;
+    }
+    return nCount;
+}
+
+uint64_t ParticleFrameGraph::GetTransientSize() const
+{
+    uint64_t nSize = 0;
+    for (uint32_t iResource = 0; iResource < (uint32_t)ParticleResource::Count; iResource++)
+    {
+        if (IsTransient((ParticleResource)iResource) && m_nFirstUses[iResource] != UINT32_MAX)
+        {
+            nSize += AlignTransientSize(m_nTransientSizes[iResource]);
+        }
+    }
+    return nSize;
+}
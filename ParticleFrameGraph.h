@@ -0,0 +1,149 @@
+#pragma once
+
+// The frame as a graph of passes. Every pass declares the resources it reads and writes and the state it needs them in,
+// and the graph works out the rest:
+//  - Passes whose writes nothing reads are culled. The resources that outlive the frame count as read.
+//  - Every stage gets an order that keeps the declared one wherever two passes touch the same resource. Past that the
+//    passes that need no barrier move up, so fewer barriers split the stage.
+//  - The transitions and the unordered access barriers go in front of the passes that need them, a resource that isn't
+//    used for a few passes changes state while they run. All of it goes through a ParticleTrackedCommandList.
+//  - Transient resources only live from their first use to their last one in the frame. The ones that never live at
+//    the same time share memory, ParticleTransientLayout says where, and get an aliasing barrier at their first use.
+// The graph only orders the passes inside a stage, the stages run the way ParticleFramePipeline submits them. The
+// lifetimes take the stages in their declared order, so only the stages of one queue may use transient resources.
+
+#include "ParticleResourceTracker.h"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// The lists ParticleFramePipeline submits, each one signals the fence when it's done
+enum class ParticleFrameStage
+{
+    Emission,       // On the compute queue, in the list of the update
+    Update,
+    Render,         // On the graphics queue
+    Count
+};
+
+// D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT, every transient resource starts on it
+const uint64_t ParticleTransientAlignment = 64 * 1024;
+
+// Where the transient resources go in one heap. The ones with a size of zero aren't in it.
+struct ParticleTransientLayout
+{
+    uint64_t nHeapSize = 0;
+    uint64_t nOffsets[(int)ParticleResource::Count] = {};
+    uint64_t nSizes[(int)ParticleResource::Count] = {};        // Rounded up to ParticleTransientAlignment
+
+    bool SharesMemory(ParticleResource first, ParticleResource second) const;
+};
+
+class ParticleFrameGraph
+{
+public:
+    typedef std::function<void(ParticleTrackedCommandList&)> RecordFunction;
+
+    enum class Access
+    {
+        Read,
+        Write,              // Everything the pass reads of it, it wrote itself before
+        ReadWrite,
+        DisjointWrite       // Reads and writes parts no other pass with a DisjointWrite of it touches
+    };
+
+    // Leaves the state alone, the other queue keeps the resource readable. The render reads what the simulation wrote.
+    static const ParticleResourceState AnyState = ParticleResourceState::Count;
+
+    // The uses below belong to the pass. The passes are declared in the order they'd run by hand, stage by stage.
+    // A pass without a record function only changes states.
+    void AddPass(const char* pName, ParticleFrameStage stage, RecordFunction fnRecord);
+    void Use(ParticleResource resource, ParticleResourceState state, Access access);
+    void Read(ParticleResource resource, ParticleResourceState state)          { Use(resource, state, Access::Read); }
+    void Write(ParticleResource resource, ParticleResourceState state)         { Use(resource, state, Access::Write); }
+    void ReadWrite(ParticleResource resource, ParticleResourceState state)     { Use(resource, state, Access::ReadWrite); }
+
+    // Nothing of it is kept between the frames, so its first use has to be a Write
+    void DeclareTransient(ParticleResource resource, uint64_t nSize);
+
+    // Culls, lays out the transient resources unless pLayout did already, and orders the stages.
+    // A layout has to come from a graph with at least the passes of this one, so the lifetimes only get shorter.
+    void Compile(const ParticleTransientLayout* pLayout = nullptr);
+
+    // The passes of the stages from first to last, into one list
+    void Record(ParticleTrackedCommandList& commandList, ParticleFrameStage first, ParticleFrameStage last) const;
+
+    // For the next frame, keeps the memory
+    void Reset();
+
+    uint32_t GetPassCount() const                                   { return (uint32_t)m_passes.size(); }
+    const char* GetPassName(uint32_t nPass) const                   { return m_passes[nPass].pName; }
+    bool IsPassCulled(uint32_t nPass) const                         { return m_passes[nPass].bCulled; }
+    uint32_t GetCulledPassCount() const;
+    const std::vector<uint32_t>& GetOrder(ParticleFrameStage stage) const  { return m_orders[(int)stage]; }
+
+    const ParticleTransientLayout& GetTransientLayout() const       { return m_layout; }
+    uint64_t GetTransientSize() const;                              // Of the used ones without aliasing, rounded up the same way
+
+    // Transient resources that share memory and live at the same time, or aren't in the layout. Has to be zero.
+    uint32_t GetAliasConflictCount() const                          { return m_nAliasConflictCount; }
+
+private:
+    struct ResourceUse
+    {
+        ParticleResource resource;
+        ParticleResourceState state;
+        Access access;
+    };
+
+    struct Pass
+    {
+        const char* pName;
+        ParticleFrameStage stage;
+        RecordFunction fnRecord;
+        uint32_t nFirstUse;
+        uint32_t nUseCount;
+        bool bCulled;
+    };
+
+    // What the passes since the last barrier did to every resource, to find where the next barrier has to go
+    class BarrierState
+    {
+    public:
+        BarrierState();
+
+        // Sets pbTransition if the pass needs a resource in another state than it's in, pbUnorderedAccess if it
+        // touches what an earlier pass touched without a barrier in between. States not known yet need nothing.
+        void GetBarriers(const ParticleFrameGraph& graph, const Pass& pass, bool* pbTransition, bool* pbUnorderedAccess) const;
+
+        // After the barriers GetBarriers asked for
+        void Apply(const ParticleFrameGraph& graph, const Pass& pass, bool bUnorderedAccessBarrier);
+
+    private:
+        ParticleResourceState m_states[(int)ParticleResource::Count];     // Count until a pass needs a state
+        uint8_t m_accesses[(int)ParticleResource::Count];                 // AccessBits since the last barrier
+    };
+
+    const ResourceUse* FindUse(const Pass& pass, ParticleResource resource) const;
+    bool IsTransient(ParticleResource resource) const               { return m_nTransientSizes[(int)resource] != 0; }
+    bool DependsOn(uint32_t nPass, uint32_t nEarlierPass) const;
+
+    void Cull();
+    void FindLifetimes();
+    void LayOutTransients();
+    void CountAliasConflicts();
+    void OrderStage(ParticleFrameStage stage);
+
+    std::vector<Pass> m_passes;
+    std::vector<ResourceUse> m_uses;
+    uint64_t m_nTransientSizes[(int)ParticleResource::Count] = {};
+
+    // The first and the last pass that uses a transient resource, in the declared order. The first one writes it.
+    uint32_t m_nFirstUses[(int)ParticleResource::Count];
+    uint32_t m_nLastUses[(int)ParticleResource::Count];
+
+    ParticleTransientLayout m_layout;
+    std::vector<uint32_t> m_orders[(int)ParticleFrameStage::Count];
+    uint32_t m_nAliasConflictCount = 0;
+};
@@ -0,0 +1,471 @@
+#include "ParticleQuadtree.h"
+#include "ParticleSimulationCPU.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+
+// Below this distance the force stops growing, roughly the size of a particle
+static const float SofteningLength = 0.01f;
+
+// The top levels are split by the calling thread, every node this deep gets its own job. 4^3 = 64 subtrees at most.
+static const uint32_t SubtreeDepth = 3;
+
+// Number of keys a job sorts on its own before the merges
+static const uint32_t SortChunkSize = 16384;
+
+// Deep enough for a traversal that opens four children at every level
+static const uint32_t TraversalStackSize = 4 * ParticleQuadtree::MaxDepth;
+
+// Spreads the lower 16 bits out to the even bits
+static inline uint32_t SpreadBits(uint32_t n)
+{
+    n &= 0x0000ffff;
+    n = (n | (n << 8)) & 0x00ff00ff;
+    n = (n | (n << 4)) & 0x0f0f0f0f;
+    n = (n | (n << 2)) & 0x33333333;
+    n = (n | (n << 1)) & 0x55555555;
+    return n;
+}
+
+float ParticleQuadtree::GetSofteningLength()
+{
+    return SofteningLength;
+}
+
+void ParticleQuadtree::ForEachChunk(uint32_t nCount, uint32_t nChunkSize, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob)
+{
+    if (pJobSystem)
+    {
+        pJobSystem->ParallelFor(nCount, nChunkSize, fnJob);
+        return;
+    }
+
+    for (uint32_t nBegin = 0; nBegin < nCount; nBegin += nChunkSize)
+    {
+        fnJob(nBegin, std::min(nCount, nBegin + nChunkSize), 0);
+    }
+}
+
+void ParticleQuadtree::SortKeys(uint32_t nCount, JobSystem* pJobSystem)
+{
+    ForEachChunk(nCount, SortChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        std::sort(m_keys.begin() + nBegin, m_keys.begin() + nEnd);
+    });
+
+    // The keys are unique, so the merges give the same order as a single sort would
+    for (uint32_t nWidth = SortChunkSize; nWidth < nCount; nWidth *= 2)
+    {
+        uint32_t nPairCount = (nCount + 2 * nWidth - 1) / (2 * nWidth);
+        ForEachChunk(nPairCount, 1, pJobSystem, [&](uint32_t nFirstPair, uint32_t nLastPair, uint32_t)
+        {
+            for (uint32_t iPair = nFirstPair; iPair < nLastPair; iPair++)
+            {
+                uint32_t nBegin = iPair * 2 * nWidth;
+                uint32_t nMiddle = std::min(nBegin + nWidth, nCount);
+                uint32_t nEnd = std::min(nBegin + 2 * nWidth, nCount);
+                std::merge(m_keys.begin() + nBegin, m_keys.begin() + nMiddle, m_keys.begin() + nMiddle, m_keys.begin() + nEnd, m_keysScratch.begin() + nBegin);
+            }
+        });
+        std::swap(m_keys, m_keysScratch);
+    }
+}
+
+void ParticleQuadtree::SplitNode(std::vector<QuadtreeNode>& nodes, uint32_t nNode, uint32_t nDepth) const
+{
+    // Copied, the vector can reallocate below
+    QuadtreeNode node = nodes[nNode];
+    if (node.nEnd - node.nBegin <= LeafSize || nDepth >= MaxDepth)
+    {
+        return;
+    }
+
+    // Every particle of the node has the same digits above this one, so the quadrants are sorted runs
+    uint32_t nShift = 32 + 2 * (MaxDepth - 1 - nDepth);
+    uint32_t nFirstChild = (uint32_t)nodes.size();
+    uint32_t nChildCount = 0;
+    uint32_t nBegin = node.nBegin;
+    for (uint32_t nQuadrant = 0; nQuadrant < 4; nQuadrant++)
+    {
+        uint32_t nEnd = node.nEnd;
+        if (nQuadrant < 3)
+        {
+            nEnd = (uint32_t)(std::partition_point(m_keys.begin() + nBegin, m_keys.begin() + node.nEnd, [&](uint64_t nKey)
+            {
+                return ((nKey >> nShift) & 3) <= nQuadrant;
+            }) - m_keys.begin());
+        }
+
+        if (nEnd > nBegin)
+        {
+            QuadtreeNode child = {};
+            child.fWidth = node.fWidth * 0.5f;
+            child.nBegin = nBegin;
+            child.nEnd = nEnd;
+            nodes.push_back(child);
+            nChildCount++;
+        }
+        nBegin = nEnd;
+    }
+
+    nodes[nNode].nFirstChild = nFirstChild;
+    nodes[nNode].nChildCount = nChildCount;
+}
+
+void ParticleQuadtree::ComputeMass(QuadtreeNode& node, const std::vector<QuadtreeNode>& nodes) const
+{
+    float fMass = 0.0f;
+    float fCenterX = 0.0f;
+    float fCenterY = 0.0f;
+    if (node.nChildCount == 0)
+    {
+        for (uint32_t i = node.nBegin; i < node.nEnd; i++)
+        {
+            fCenterX += m_sortedX[i];
+            fCenterY += m_sortedY[i];
+        }
+        float fCount = (float)(node.nEnd - node.nBegin);
+        fMass = fCount * m_fParticleMass;
+        fCenterX /= fCount;
+        fCenterY /= fCount;
+    }
+    else
+    {
+        for (uint32_t iChild = node.nFirstChild; iChild < node.nFirstChild + node.nChildCount; iChild++)
+        {
+            const QuadtreeNode& child = nodes[iChild];
+            fMass += child.fMass;
+            fCenterX += child.fCenterX * child.fMass;
+            fCenterY += child.fCenterY * child.fMass;
+        }
+        fCenterX /= fMass;
+        fCenterY /= fMass;
+    }
+
+    node.fMass = fMass;
+    node.fCenterX = fCenterX;
+    node.fCenterY = fCenterY;
+}
+
+void ParticleQuadtree::Build(const Float2* pPositions, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    m_nParticleCount = nCount;
+    m_fParticleMass = nCount > 0 ? 1.0f / nCount : 0.0f;
+    m_nodes.clear();
+    if (nCount == 0)
+    {
+        m_nBuildNanoseconds = 0;
+        return;
+    }
+
+    if (m_keys.size() < nCount)
+    {
+        m_keys.resize(nCount);
+        m_keysScratch.resize(nCount);
+        m_sortedX.resize(nCount);
+        m_sortedY.resize(nCount);
+        m_sortedIndices.resize(nCount);
+    }
+
+    // Bounding square of the particles, every chunk finds its own bounds first
+    uint32_t nChunkCount = (nCount + ChunkSize - 1) / ChunkSize;
+    std::vector<float> chunkBounds(nChunkCount * 4);
+    ForEachChunk(nCount, ChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        const Float2& first = pPositions[pIndices[nBegin]];
+        float fMinX = first.x, fMinY = first.y, fMaxX = first.x, fMaxY = first.y;
+        for (uint32_t i = nBegin + 1; i < nEnd; i++)
+        {
+            const Float2& position = pPositions[pIndices[i]];
+            fMinX = std::min(fMinX, position.x);
+            fMinY = std::min(fMinY, position.y);
+            fMaxX = std::max(fMaxX, position.x);
+            fMaxY = std::max(fMaxY, position.y);
+        }
+
+        float* pBounds = &chunkBounds[nBegin / ChunkSize * 4];
+        pBounds[0] = fMinX;
+        pBounds[1] = fMinY;
+        pBounds[2] = fMaxX;
+        pBounds[3] = fMaxY;
+    });
+
+    float fMinX = chunkBounds[0], fMinY = chunkBounds[1], fMaxX = chunkBounds[2], fMaxY = chunkBounds[3];
+    for (uint32_t iChunk = 1; iChunk < nChunkCount; iChunk++)
+    {
+        fMinX = std::min(fMinX, chunkBounds[iChunk * 4 + 0]);
+        fMinY = std::min(fMinY, chunkBounds[iChunk * 4 + 1]);
+        fMaxX = std::max(fMaxX, chunkBounds[iChunk * 4 + 2]);
+        fMaxY = std::max(fMaxY, chunkBounds[iChunk * 4 + 3]);
+    }
+
+    m_fMinX = fMinX;
+    m_fMinY = fMinY;
+    m_fExtent = std::max(fMaxX - fMinX, fMaxY - fMinY);
+    if (m_fExtent <= 0.0f)
+    {
+        m_fExtent = 1.0f;
+    }
+
+    // Morton codes of the particles, the index breaks the ties so the order doesn't depend on the sort
+    const float fScale = (1 << MaxDepth) / m_fExtent;
+    const uint32_t nMaxCoordinate = (1 << MaxDepth) - 1;
+    ForEachChunk(nCount, ChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            uint32_t nParticle = pIndices[i];
+            const Float2& position = pPositions[nParticle];
+            uint32_t nX = std::min((uint32_t)((position.x - m_fMinX) * fScale), nMaxCoordinate);
+            uint32_t nY = std::min((uint32_t)((position.y - m_fMinY) * fScale), nMaxCoordinate);
+            uint32_t nCode = SpreadBits(nX) | (SpreadBits(nY) << 1);
+            m_keys[i] = ((uint64_t)nCode << 32) | nParticle;
+        }
+    });
+
+    SortKeys(nCount, pJobSystem);
+
+    // The traversal reads the positions in tree order, so they get their own copy
+    ForEachChunk(nCount, ChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            uint32_t nParticle = (uint32_t)m_keys[i];
+            m_sortedIndices[i] = nParticle;
+            m_sortedX[i] = pPositions[nParticle].x;
+            m_sortedY[i] = pPositions[nParticle].y;
+        }
+    });
+
+    // The top levels, one level at a time
+    QuadtreeNode root = {};
+    root.fWidth = m_fExtent;
+    root.nBegin = 0;
+    root.nEnd = nCount;
+    m_nodes.push_back(root);
+
+    uint32_t nLevelBegin = 0;
+    uint32_t nLevelEnd = 1;
+    for (uint32_t nDepth = 0; nDepth < SubtreeDepth; nDepth++)
+    {
+        for (uint32_t iNode = nLevelBegin; iNode < nLevelEnd; iNode++)
+        {
+            SplitNode(m_nodes, iNode, nDepth);
+        }
+        nLevelBegin = nLevelEnd;
+        nLevelEnd = (uint32_t)m_nodes.size();
+    }
+
+    // Every node of the last level is the root of a subtree. The subtrees get built into their own vectors
+    // with the root at index 0. Children always come after their parents, so the masses can go backwards.
+    uint32_t nSubtreeCount = nLevelEnd - nLevelBegin;
+    m_subtreeNodes.resize(std::max((uint32_t)m_subtreeNodes.size(), nSubtreeCount));
+    ForEachChunk(nSubtreeCount, 1, pJobSystem, [&](uint32_t nFirstSubtree, uint32_t nLastSubtree, uint32_t)
+    {
+        for (uint32_t iSubtree = nFirstSubtree; iSubtree < nLastSubtree; iSubtree++)
+        {
+            std::vector<QuadtreeNode>& nodes = m_subtreeNodes[iSubtree];
+            nodes.clear();
+            nodes.push_back(m_nodes[nLevelBegin + iSubtree]);
+
+            // Depth first, with a stack of the nodes and their depths
+            std::vector<std::pair<uint32_t, uint32_t>> pendingNodes = { { 0, SubtreeDepth } };
+            while (!pendingNodes.empty())
+            {
+                std::pair<uint32_t, uint32_t> pendingNode = pendingNodes.back();
+                pendingNodes.pop_back();
+                SplitNode(nodes, pendingNode.first, pendingNode.second);
+                for (uint32_t iChild = 0; iChild < nodes[pendingNode.first].nChildCount; iChild++)
+                {
+                    pendingNodes.push_back({ nodes[pendingNode.first].nFirstChild + iChild, pendingNode.second + 1 });
+                }
+            }
+
+            for (uint32_t iNode = (uint32_t)nodes.size(); iNode-- > 0;)
+            {
+                ComputeMass(nodes[iNode], nodes);
+            }
+        }
+    });
+
+    // Stitched together in order. The subtree roots stay where they are, the rest of the nodes move behind the top levels.
+    for (uint32_t iSubtree = 0; iSubtree < nSubtreeCount; iSubtree++)
+    {
+        std::vector<QuadtreeNode>& nodes = m_subtreeNodes[iSubtree];
+        uint32_t nOffset = (uint32_t)m_nodes.size() - 1;
+        for (QuadtreeNode& node : nodes)
+        {
+            if (node.nChildCount > 0)
+            {
+                node.nFirstChild += nOffset;
+            }
+        }
+        m_nodes[nLevelBegin + iSubtree] = nodes[0];
+        m_nodes.insert(m_nodes.end(), nodes.begin() + 1, nodes.end());
+    }
+
+    for (uint32_t iNode = nLevelBegin; iNode-- > 0;)
+    {
+        ComputeMass(m_nodes[iNode], m_nodes);
+    }
+
+    m_nBuildNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void ParticleQuadtree::ApplyGravity(Float2* pVelocities, float fGravity, float fTheta, float fElapsedTime, JobSystem* pJobSystem)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    const float fVelocityScale = fGravity * fElapsedTime;
+    const float fThetaSq = fTheta * fTheta;
+    const float fSofteningSq = SofteningLength * SofteningLength;
+
+    // The particles are walked in tree order, so neighbouring particles open mostly the same nodes
+    ForEachChunk(m_nParticleCount, ChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        uint32_t nodeStack[TraversalStackSize];
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            const float x = m_sortedX[i];
+            const float y = m_sortedY[i];
+            float fAccelerationX = 0.0f;
+            float fAccelerationY = 0.0f;
+
+            uint32_t nStackSize = 0;
+            nodeStack[nStackSize++] = 0;
+            while (nStackSize > 0)
+            {
+                const QuadtreeNode& node = m_nodes[nodeStack[--nStackSize]];
+                if (node.nChildCount == 0)
+                {
+                    // The particle itself is at distance zero and adds nothing
+                    for (uint32_t j = node.nBegin; j < node.nEnd; j++)
+                    {
+                        float fDx = m_sortedX[j] - x;
+                        float fDy = m_sortedY[j] - y;
+                        float fDistanceSq = fDx * fDx + fDy * fDy + fSofteningSq;
+                        float fStrength = m_fParticleMass / (fDistanceSq * std::sqrt(fDistanceSq));
+                        fAccelerationX += fDx * fStrength;
+                        fAccelerationY += fDy * fStrength;
+                    }
+                    continue;
+                }
+
+                float fDx = node.fCenterX - x;
+                float fDy = node.fCenterY - y;
+                float fDistanceSq = fDx * fDx + fDy * fDy;
+                if (node.fWidth * node.fWidth < fThetaSq * fDistanceSq)
+                {
+                    fDistanceSq += fSofteningSq;
+                    float fStrength = node.fMass / (fDistanceSq * std::sqrt(fDistanceSq));
+                    fAccelerationX += fDx * fStrength;
+                    fAccelerationY += fDy * fStrength;
+                    continue;
+                }
+
+                for (uint32_t iChild = node.nFirstChild; iChild < node.nFirstChild + node.nChildCount; iChild++)
+                {
+                    nodeStack[nStackSize++] = iChild;
+                }
+            }
+
+            Float2& velocity = pVelocities[m_sortedIndices[i]];
+            velocity.x += fAccelerationX * fVelocityScale;
+            velocity.y += fAccelerationY * fVelocityScale;
+        }
+    });
+
+    m_nTraversalNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+QuadtreeBenchmarkResult BenchmarkQuadtreeGravity(uint32_t nParticleCount, uint32_t nIterationCount, float fTheta, uint32_t nErrorSampleCount, JobSystem* pJobSystem)
+{
+    // Uniform over a disc, which is a lot less kind to the tree than a uniform square
+    std::mt19937 randomNumberEngine(42);
+    std::uniform_real_distribution<float> unitDistribution(0.0f, 1.0f);
+
+    std::vector<Float2> positions(nParticleCount);
+    std::vector<Float2> velocities(nParticleCount, Float2{ 0.0f, 0.0f });
+    std::vector<uint32_t> indices(nParticleCount);
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        float fRadius = 0.8f * std::sqrt(unitDistribution(randomNumberEngine));
+        float fAngle = 6.2831853f * unitDistribution(randomNumberEngine);
+        positions[i] = { fRadius * std::cos(fAngle), fRadius * std::sin(fAngle) };
+        indices[i] = i;
+    }
+
+    const float fElapsedTime = 1.0f / 60.0f;
+    const float fGravity = 1.0f;
+    ParticleQuadtree quadtree;
+
+    QuadtreeBenchmarkResult result = {};
+    result.nParticleCount = nParticleCount;
+    result.nIterationCount = nIterationCount;
+    result.fTheta = fTheta;
+
+    uint64_t nBuildNanoseconds = 0;
+    uint64_t nTraversalNanoseconds = 0;
+    for (uint32_t iIteration = 0; iIteration < nIterationCount; iIteration++)
+    {
+        quadtree.Build(positions.data(), indices.data(), nParticleCount, pJobSystem);
+        quadtree.ApplyGravity(velocities.data(), fGravity, fTheta, fElapsedTime, pJobSystem);
+        nBuildNanoseconds += quadtree.GetBuildNanoseconds();
+        nTraversalNanoseconds += quadtree.GetTraversalNanoseconds();
+
+        // Not timed, only there so the next build doesn't get the same, already cached layout
+        for (uint32_t i = 0; i < nParticleCount; i++)
+        {
+            positions[i].x += velocities[i].x * fElapsedTime;
+            positions[i].y += velocities[i].y * fElapsedTime;
+        }
+    }
+
+    if (nIterationCount > 0)
+    {
+        result.fBuildMilliseconds = (double)nBuildNanoseconds / nIterationCount / 1000000.0;
+        result.fTraversalMilliseconds = (double)nTraversalNanoseconds / nIterationCount / 1000000.0;
+    }
+
+    // The accelerations of the tree come out of a zero velocity with a unit time step
+    nErrorSampleCount = std::min(nErrorSampleCount, nParticleCount);
+    if (nErrorSampleCount > 0)
+    {
+        std::vector<Float2> accelerations(nParticleCount, Float2{ 0.0f, 0.0f });
+        quadtree.Build(positions.data(), indices.data(), nParticleCount, pJobSystem);
+        quadtree.ApplyGravity(accelerations.data(), fGravity, fTheta, 1.0f, pJobSystem);
+
+        const double fParticleMass = 1.0 / nParticleCount;
+        const double fSofteningSq = (double)SofteningLength * SofteningLength;
+        double fErrorSqSum = 0.0;
+        for (uint32_t iSample = 0; iSample < nErrorSampleCount; iSample++)
+        {
+            uint32_t i = (uint32_t)((uint64_t)iSample * nParticleCount / nErrorSampleCount);
+            double fExactX = 0.0;
+            double fExactY = 0.0;
+            for (uint32_t j = 0; j < nParticleCount; j++)
+            {
+                double fDx = (double)positions[j].x - positions[i].x;
+                double fDy = (double)positions[j].y - positions[i].y;
+                double fDistanceSq = fDx * fDx + fDy * fDy + fSofteningSq;
+                double fStrength = fGravity * fParticleMass / (fDistanceSq * std::sqrt(fDistanceSq));
+                fExactX += fDx * fStrength;
+                fExactY += fDy * fStrength;
+            }
+
+            double fErrorX = accelerations[i].x - fExactX;
+            double fErrorY = accelerations[i].y - fExactY;
+            double fExactSq = fExactX * fExactX + fExactY * fExactY;
+            if (fExactSq > 0.0)
+            {
+                fErrorSqSum += (fErrorX * fErrorX + fErrorY * fErrorY) / fExactSq;
+            }
+        }
+        result.fRelativeError = std::sqrt(fErrorSqSum / nErrorSampleCount);
+    }
+    return result;
+}
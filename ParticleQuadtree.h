@@ -0,0 +1,108 @@
+#pragma once
+
+// Barnes-Hut quadtree for the N-body gravity mode of the CPU simulation, rebuilt from scratch every frame.
+// The tree is linear: the live particles are sorted by the Morton code of their position inside the bounding square,
+// so the particles of every node are one contiguous run of the sorted order and a node only needs to know that run.
+//  - the bounding square of the particles gives the quantization of the codes, 16 bits per axis
+//  - the (code, particle index) keys get sorted, each chunk on its own and then merged pairwise
+//  - the nodes are split top-down on the next two bits of the codes, until at most LeafSize particles are left
+//  - every node stores its mass and center of mass, computed bottom-up
+// The force traversal opens a node when its width is more than fTheta times its distance from the particle,
+// otherwise the whole node acts as a single point mass at its center of mass.
+//
+// The top levels are split on the calling thread, the subtrees below them are built by separate jobs and
+// stitched together in a fixed order. The tree and the forces come out the same no matter how many threads built them.
+
+#include "JobSystem.h"
+
+#include <cstdint>
+#include <vector>
+
+struct Float2;
+
+struct QuadtreeNode
+{
+    float fCenterX;         // Center of mass
+    float fCenterY;
+    float fMass;
+    float fWidth;           // Side length of the node's square
+    uint32_t nFirstChild;   // The children of a node are next to each other
+    uint32_t nChildCount;   // Zero for leaves, only the non-empty quadrants get a node
+    uint32_t nBegin;        // Range of the sorted particles inside the node
+    uint32_t nEnd;
+};
+
+class ParticleQuadtree
+{
+public:
+    // Number of particles a job processes at once, same as ParticleSimulationCPU::ChunkSize
+    static const uint32_t ChunkSize = 4096;
+
+    // Nodes with this many particles or less aren't split any further, their particles are summed up directly
+    static const uint32_t LeafSize = 16;
+
+    // Each Morton code has this many bits per axis, which is also the deepest a node can be
+    static const uint32_t MaxDepth = 16;
+
+    // Every particle weighs 1 / nCount, so the strength of the gravity doesn't depend on the number of particles
+    void Build(const Float2* pPositions, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem);
+
+    // Adds fGravity * dt times the acceleration of every particle of the last Build to its velocity.
+    // Positive gravity pulls the particles together, negative pushes them apart. The force is softened
+    // within GetSofteningLength() so particles right next to each other don't fling each other away.
+    // Every particle only writes its own velocity, so it can run in place.
+    void ApplyGravity(Float2* pVelocities, float fGravity, float fTheta, float fElapsedTime, JobSystem* pJobSystem);
+
+    static float GetSofteningLength();
+
+    const std::vector<QuadtreeNode>& GetNodes() const   { return m_nodes; }
+    uint32_t GetParticleCount() const                   { return m_nParticleCount; }
+
+    // Wall clock time of the last Build and ApplyGravity
+    uint64_t GetBuildNanoseconds() const                { return m_nBuildNanoseconds; }
+    uint64_t GetTraversalNanoseconds() const            { return m_nTraversalNanoseconds; }
+
+private:
+    void ForEachChunk(uint32_t nCount, uint32_t nChunkSize, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob);
+    void SortKeys(uint32_t nCount, JobSystem* pJobSystem);
+
+    // Gives the node its children and recurses into them, the new nodes go to the end of nodes
+    void SplitNode(std::vector<QuadtreeNode>& nodes, uint32_t nNode, uint32_t nDepth) const;
+    void ComputeMass(QuadtreeNode& node, const std::vector<QuadtreeNode>& nodes) const;
+
+    uint32_t m_nParticleCount = 0;
+    float m_fParticleMass = 0.0f;
+    float m_fMinX = 0.0f;
+    float m_fMinY = 0.0f;
+    float m_fExtent = 0.0f;
+
+    // Morton code in the upper half, particle index in the lower half
+    std::vector<uint64_t> m_keys;
+    std::vector<uint64_t> m_keysScratch;
+
+    // The particles in Morton order
+    std::vector<float> m_sortedX;
+    std::vector<float> m_sortedY;
+    std::vector<uint32_t> m_sortedIndices;
+
+    std::vector<QuadtreeNode> m_nodes;
+    std::vector<std::vector<QuadtreeNode>> m_subtreeNodes;
+
+    uint64_t m_nBuildNanoseconds = 0;
+    uint64_t m_nTraversalNanoseconds = 0;
+};
+
+struct QuadtreeBenchmarkResult
+{
+    uint32_t nParticleCount;
+    uint32_t nIterationCount;
+    float fTheta;
+    double fBuildMilliseconds;      // Averages over the iterations
+    double fTraversalMilliseconds;
+    double fRelativeError;          // RMS of |a_tree - a_exact| / |a_exact| over a sample of the particles in the last iteration
+};
+
+// Builds the tree and runs the traversal nIterationCount times over nParticleCount particles in a disc, moving them
+// a little between the iterations like a running simulation would. The exact O(N^2) accelerations are only computed
+// for up to nErrorSampleCount particles, spread evenly over the indices.
+QuadtreeBenchmarkResult BenchmarkQuadtreeGravity(uint32_t nParticleCount, uint32_t nIterationCount, float fTheta, uint32_t nErrorSampleCount, JobSystem* pJobSystem);
@@ -0,0 +1,308 @@
+#include "ParticleRadixSort.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <utility>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PARTICLE_SIMD_X86
+#endif
+
+#ifdef PARTICLE_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// MSVC lets us use any intrinsic in any function, GCC and Clang need to be told per function.
+#if defined(__GNUC__) || defined(__clang__)
+#define PARTICLE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PARTICLE_TARGET(isa)
+#endif
+
+// The bits where the keys in [nBegin, nCount) differ from the first key, and whether they keep on increasing from pKeys[nBegin - 1]
+static void ScanKeysScalar(const uint32_t* pKeys, uint32_t nBegin, uint32_t nCount, uint32_t& nVaryingBits, bool& bSorted)
+{
+    for (uint32_t i = nBegin; i < nCount; i++)
+    {
+        nVaryingBits |= pKeys[i] ^ pKeys[0];
+        bSorted = bSorted && pKeys[i - 1] <= pKeys[i];
+    }
+}
+
+#ifdef PARTICLE_SIMD_X86
+PARTICLE_TARGET("sse4.2")
+static void ScanKeysSSE42(const uint32_t* pKeys, uint32_t nCount, uint32_t& nVaryingBits, bool& bSorted)
+{
+    const __m128i firstKey = _mm_set1_epi32((int)pKeys[0]);
+    __m128i varying = _mm_setzero_si128();
+    __m128i ordered = _mm_set1_epi32(-1);
+
+    // Every key against the one before it, there's no unsigned compare so a <= b is max(a, b) == b
+    uint32_t i = 1;
+    for (; i + 4 <= nCount; i += 4)
+    {
+        __m128i keys = _mm_loadu_si128((const __m128i*)(pKeys + i));
+        __m128i previousKeys = _mm_loadu_si128((const __m128i*)(pKeys + i - 1));
+        varying = _mm_or_si128(varying, _mm_xor_si128(keys, firstKey));
+        ordered = _mm_and_si128(ordered, _mm_cmpeq_epi32(_mm_max_epu32(previousKeys, keys), keys));
+    }
+
+    varying = _mm_or_si128(varying, _mm_shuffle_epi32(varying, _MM_SHUFFLE(1, 0, 3, 2)));
+    varying = _mm_or_si128(varying, _mm_shuffle_epi32(varying, _MM_SHUFFLE(2, 3, 0, 1)));
+    nVaryingBits = (uint32_t)_mm_cvtsi128_si32(varying);
+    bSorted = _mm_movemask_epi8(ordered) == 0xFFFF;
+    ScanKeysScalar(pKeys, i, nCount, nVaryingBits, bSorted);
+}
+
+PARTICLE_TARGET("avx2")
+static void ScanKeysAVX2(const uint32_t* pKeys, uint32_t nCount, uint32_t& nVaryingBits, bool& bSorted)
+{
+    const __m256i firstKey = _mm256_set1_epi32((int)pKeys[0]);
+    __m256i varying = _mm256_setzero_si256();
+    __m256i ordered = _mm256_set1_epi32(-1);
+
+    uint32_t i = 1;
+    for (; i + 8 <= nCount; i += 8)
+    {
+        __m256i keys = _mm256_loadu_si256((const __m256i*)(pKeys + i));
+        __m256i previousKeys = _mm256_loadu_si256((const __m256i*)(pKeys + i - 1));
+        varying = _mm256_or_si256(varying, _mm256_xor_si256(keys, firstKey));
+        ordered = _mm256_and_si256(ordered, _mm256_cmpeq_epi32(_mm256_max_epu32(previousKeys, keys), keys));
+    }
+
+    __m128i varyingHalf = _mm_or_si128(_mm256_castsi256_si128(varying), _mm256_extracti128_si256(varying, 1));
+    varyingHalf = _mm_or_si128(varyingHalf, _mm_shuffle_epi32(varyingHalf, _MM_SHUFFLE(1, 0, 3, 2)));
+    varyingHalf = _mm_or_si128(varyingHalf, _mm_shuffle_epi32(varyingHalf, _MM_SHUFFLE(2, 3, 0, 1)));
+    nVaryingBits = (uint32_t)_mm_cvtsi128_si32(varyingHalf);
+    bSorted = (uint32_t)_mm256_movemask_epi8(ordered) == 0xFFFFFFFFu;
+    ScanKeysScalar(pKeys, i, nCount, nVaryingBits, bSorted);
+}
+#endif
+
+static void ScanKeys(SimdInstructionSet instructionSet, const uint32_t* pKeys, uint32_t nCount, uint32_t& nVaryingBits, bool& bSorted)
+{
+    nVaryingBits = 0;
+    bSorted = true;
+
+    // Nothing in the scan is wider than 8 keys, AVX512 has no lists long enough to pay for itself
+#ifdef PARTICLE_SIMD_X86
+    switch (instructionSet)
+    {
+    case SimdInstructionSet::SSE42:
+        ScanKeysSSE42(pKeys, nCount, nVaryingBits, bSorted);
+        return;
+    case SimdInstructionSet::AVX2:
+    case SimdInstructionSet::AVX512:
+        ScanKeysAVX2(pKeys, nCount, nVaryingBits, bSorted);
+        return;
+    default:
+        break;
+    }
+#else
+    (void)instructionSet;
+#endif
+    ScanKeysScalar(pKeys, 1, nCount, nVaryingBits, bSorted);
+}
+
+void RadixSortKeyValues(SimdInstructionSet instructionSet, uint32_t* pKeys, uint32_t* pValues, uint32_t nCount, uint32_t* pKeyScratch, uint32_t* pValueScratch)
+{
+    if (nCount < 2)
+    {
+        return;
+    }
+
+    uint32_t nVaryingBits;
+    bool bSorted;
+    ScanKeys(instructionSet, pKeys, nCount, nVaryingBits, bSorted);
+    if (bSorted)
+    {
+        return;
+    }
+
+    const uint32_t nDigitBits = nCount <= RadixSortSmallCount ? 4 : 8;
+    const uint32_t nDigitCount = 1u << nDigitBits;
+    const uint32_t nDigitMask = nDigitCount - 1;
+
+    uint32_t* pKeysIn = pKeys;
+    uint32_t* pValuesIn = pValues;
+    uint32_t* pKeysOut = pKeyScratch;
+    uint32_t* pValuesOut = pValueScratch;
+    for (uint32_t nShift = 0; nShift < 32; nShift += nDigitBits)
+    {
+        // Every key has the same digit here, the pass wouldn't move anything
+        if (((nVaryingBits >> nShift) & nDigitMask) == 0)
+        {
+            continue;
+        }
+
+        uint32_t digitStarts[256] = {};
+        for (uint32_t i = 0; i < nCount; i++)
+        {
+            digitStarts[(pKeysIn[i] >> nShift) & nDigitMask]++;
+        }
+
+        uint32_t nOffset = 0;
+        for (uint32_t iDigit = 0; iDigit < nDigitCount; iDigit++)
+        {
+            uint32_t nDigitCountInList = digitStarts[iDigit];
+            digitStarts[iDigit] = nOffset;
+            nOffset += nDigitCountInList;
+        }
+
+        if (pValuesIn)
+        {
+            for (uint32_t i = 0; i < nCount; i++)
+            {
+                uint32_t nPlace = digitStarts[(pKeysIn[i] >> nShift) & nDigitMask]++;
+                pKeysOut[nPlace] = pKeysIn[i];
+                pValuesOut[nPlace] = pValuesIn[i];
+            }
+        }
+        else
+        {
+            for (uint32_t i = 0; i < nCount; i++)
+            {
+                pKeysOut[digitStarts[(pKeysIn[i] >> nShift) & nDigitMask]++] = pKeysIn[i];
+            }
+        }
+
+        std::swap(pKeysIn, pKeysOut);
+        std::swap(pValuesIn, pValuesOut);
+    }
+
+    // An odd number of passes leaves the result in the scratch
+    if (pKeysIn != pKeys)
+    {
+        std::copy(pKeysIn, pKeysIn + nCount, pKeys);
+        if (pValues)
+        {
+            std::copy(pValuesIn, pValuesIn + nCount, pValues);
+        }
+    }
+}
+
+void BitonicSortKeyValues(uint32_t* pKeys, uint32_t* pValues, uint32_t nCount)
+{
+    uint32_t nCountPowerOfTwo = 1;
+    while (nCountPowerOfTwo < nCount)
+    {
+        nCountPowerOfTwo <<= 1;
+    }
+
+    // Every iteration of the innermost loop is a thread of the group, the missing entries at the end count as infinitely big
+    for (uint32_t nMergeSize = 2; nMergeSize <= nCountPowerOfTwo; nMergeSize *= 2)
+    {
+        for (uint32_t nMergeSubSize = nMergeSize >> 1; nMergeSubSize > 0; nMergeSubSize >>= 1)
+        {
+            for (uint32_t iThread = 0; iThread < nCountPowerOfTwo / 2; iThread++)
+            {
+                uint32_t nIndexLow = iThread & (nMergeSubSize - 1);
+                uint32_t nIndexHigh = 2 * (iThread - nIndexLow);
+                uint32_t nIndex = nIndexHigh + nIndexLow;
+                uint32_t nSwapIndex = nMergeSubSize == nMergeSize >> 1 ?
+                    nIndexHigh + (2 * nMergeSubSize - 1) - nIndexLow :
+                    nIndexHigh + nMergeSubSize + nIndexLow;
+
+                if (nSwapIndex < nCount && nIndex < nCount && pKeys[nIndex] > pKeys[nSwapIndex])
+                {
+                    std::swap(pKeys[nIndex], pKeys[nSwapIndex]);
+                    std::swap(pValues[nIndex], pValues[nSwapIndex]);
+                }
+            }
+        }
+    }
+}
+
+TileSortBenchmarkResult BenchmarkTileSort(SimdInstructionSet instructionSet, TileSortKey key, uint32_t nElementCount, uint32_t nListCount)
+{
+    std::mt19937 randomNumberEngine(42);
+    std::uniform_int_distribution<uint32_t> indexDistribution(0, (1u << 20) - 1);
+    std::uniform_real_distribution<float> depthDistribution(0.0f, 1.0f);
+    std::uniform_int_distribution<uint32_t> frameDistribution(0, 600);
+
+    // Every list with the particle indices as the values, like a tile's list
+    const uint32_t nTotalCount = nElementCount * nListCount;
+    std::vector<uint32_t> keys(nTotalCount);
+    std::vector<uint32_t> values(nTotalCount);
+    for (uint32_t i = 0; i < nTotalCount; i++)
+    {
+        values[i] = indexDistribution(randomNumberEngine);
+        switch (key)
+        {
+        case TileSortKey::Depth:
+            keys[i] = FloatToSortKey(depthDistribution(randomNumberEngine));
+            break;
+        case TileSortKey::SpawnTime:
+            keys[i] = FloatToSortKey(frameDistribution(randomNumberEngine) / 60.0f);
+            break;
+        default:
+            keys[i] = values[i];
+            break;
+        }
+    }
+
+    std::vector<uint32_t> sortedKeys(nTotalCount);
+    std::vector<uint32_t> sortedValues(nTotalCount);
+    std::vector<uint32_t> keyScratch(nElementCount);
+    std::vector<uint32_t> valueScratch(nElementCount);
+
+    // Every sort gets a fresh copy of the lists, the copy isn't timed
+    auto fnTimeSort = [&](auto&& fnSort)
+    {
+        sortedKeys = keys;
+        sortedValues = values;
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t iList = 0; iList < nListCount; iList++)
+        {
+            fnSort(sortedKeys.data() + iList * nElementCount, sortedValues.data() + iList * nElementCount);
+        }
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    TileSortBenchmarkResult result = {};
+    result.nElementCount = nElementCount;
+    result.nListCount = nListCount;
+    if (nTotalCount == 0)
+    {
+        return result;
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> pairs(nElementCount);
+    double fStableSortMicroseconds = fnTimeSort([&](uint32_t* pKeys, uint32_t* pValues)
+    {
+        for (uint32_t i = 0; i < nElementCount; i++)
+        {
+            pairs[i] = { pKeys[i], pValues[i] };
+        }
+        std::stable_sort(pairs.begin(), pairs.end(), [](const std::pair<uint32_t, uint32_t>& a, const std::pair<uint32_t, uint32_t>& b)
+        {
+            return a.first < b.first;
+        });
+        for (uint32_t i = 0; i < nElementCount; i++)
+        {
+            pKeys[i] = pairs[i].first;
+            pValues[i] = pairs[i].second;
+        }
+    });
+    std::vector<uint32_t> referenceKeys = sortedKeys;
+    std::vector<uint32_t> referenceValues = sortedValues;
+
+    double fRadixSortMicroseconds = fnTimeSort([&](uint32_t* pKeys, uint32_t* pValues)
+    {
+        RadixSortKeyValues(instructionSet, pKeys, pValues, nElementCount, keyScratch.data(), valueScratch.data());
+    });
+    result.bMatchesStableSort = sortedKeys == referenceKeys && sortedValues == referenceValues;
+
+    double fBitonicSortMicroseconds = fnTimeSort([&](uint32_t* pKeys, uint32_t* pValues)
+    {
+        BitonicSortKeyValues(pKeys, pValues, nElementCount);
+    });
+    result.bBitonicMatchesKeys = sortedKeys == referenceKeys;
+
+    result.fRadixSortMicroseconds = fRadixSortMicroseconds / nListCount;
+    result.fBitonicSortMicroseconds = fBitonicSortMicroseconds / nListCount;
+    result.fStableSortMicroseconds = fStableSortMicroseconds / nListCount;
+    return result;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+// Stable LSD radix sort for the per tile particle lists, the CPU side of GroupRadixSort.hlsli.
+// The lists are short, from a handful to a few thousand entries, and there's one per tile every frame, so:
+//  - the digits are 4 bits up to RadixSortSmallCount entries and 8 bits above, the histograms stay small next to the lists
+//  - a vectorized pass over the keys finds the bits where they differ, the digits all of them agree on are skipped,
+//    and lists that are already in order aren't touched at all
+// The keys are 32 bit unsigned. The particle index is used as is, floats like the depth or the spawn time
+// go through FloatToSortKey first.
+
+#include "ParticleUpdateKernels.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Lists up to this long are sorted with 4 bit digits
+static const uint32_t RadixSortSmallCount = 64;
+
+// Order preserving map of floats to keys, negative values included
+inline uint32_t FloatToSortKey(float fValue)
+{
+    uint32_t nBits;
+    std::memcpy(&nBits, &fValue, sizeof(nBits));
+
+    // The negative floats order backwards, all their bits flip. The positive ones only have to end up above them.
+    return (nBits & 0x80000000u) ? ~nBits : (nBits | 0x80000000u);
+}
+
+// Sorts pKeys[0, nCount) and moves pValues along with them, the entries with equal keys keep their order.
+// Without values only the keys are sorted. The scratch arrays need room for nCount entries, pValueScratch only with values.
+void RadixSortKeyValues(SimdInstructionSet instructionSet, uint32_t* pKeys, uint32_t* pValues, uint32_t nCount, uint32_t* pKeyScratch, uint32_t* pValueScratch);
+
+// The network of BitonicSort in ParticleTile.hlsl on the CPU, only there to compare the radix sort with.
+// Not stable, the values of equal keys can end up in any order.
+void BitonicSortKeyValues(uint32_t* pKeys, uint32_t* pValues, uint32_t nCount);
+
+enum class TileSortKey
+{
+    ParticleIndex,  // What CSTileSort uses, random indices of a big pool
+    Depth,          // Uniform floats in [0, 1)
+    SpawnTime,      // Whole frames over ten seconds, lots of equal keys
+    Count
+};
+
+struct TileSortBenchmarkResult
+{
+    uint32_t nElementCount;
+    uint32_t nListCount;
+    double fRadixSortMicroseconds;      // Per list
+    double fBitonicSortMicroseconds;
+    double fStableSortMicroseconds;     // std::stable_sort of the same pairs
+    bool bMatchesStableSort;            // Same keys and values as std::stable_sort
+    bool bBitonicMatchesKeys;           // Same keys as std::stable_sort, the values can differ
+};
+
+// Sorts nListCount lists of nElementCount pairs with each of the sorts
+TileSortBenchmarkResult BenchmarkTileSort(SimdInstructionSet instructionSet, TileSortKey key, uint32_t nElementCount, uint32_t nListCount);
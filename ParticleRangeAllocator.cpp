@@ -0,0 +1,322 @@
+#include "ParticleRangeAllocator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+ParticleRangeAllocator::ParticleRangeAllocator(uint32_t nCapacity) :
+    m_nCapacity(nCapacity),
+    m_nFreeSize(0)
+{
+    AddFreeRange(0, nCapacity);
+}
+
+uint32_t ParticleRangeAllocator::FindFreeRange(uint32_t nSize) const
+{
+    for (uint32_t iFreeRange = 0; iFreeRange < m_freeRanges.size(); iFreeRange++)
+    {
+        if (m_freeRanges[iFreeRange].nSize >= nSize)
+        {
+            return iFreeRange;
+        }
+    }
+    return (uint32_t)m_freeRanges.size();
+}
+
+void ParticleRangeAllocator::TakeFromFreeRange(uint32_t iFreeRange, uint32_t nBegin, uint32_t nSize)
+{
+    // [nBegin, nBegin + nSize) has to be inside the free range, whatever is left on either side stays free
+    Range freeRange = m_freeRanges[iFreeRange];
+    uint32_t nSizeBefore = nBegin - freeRange.nBegin;
+    uint32_t nSizeAfter = freeRange.nBegin + freeRange.nSize - (nBegin + nSize);
+
+    if (nSizeBefore == 0 && nSizeAfter == 0)
+    {
+        m_freeRanges.erase(m_freeRanges.begin() + iFreeRange);
+    }
+    else if (nSizeBefore == 0)
+    {
+        m_freeRanges[iFreeRange] = Range{ nBegin + nSize, nSizeAfter };
+    }
+    else
+    {
+        m_freeRanges[iFreeRange].nSize = nSizeBefore;
+        if (nSizeAfter != 0)
+        {
+            m_freeRanges.insert(m_freeRanges.begin() + iFreeRange + 1, Range{ nBegin + nSize, nSizeAfter });
+        }
+    }
+    m_nFreeSize -= nSize;
+}
+
+void ParticleRangeAllocator::AddFreeRange(uint32_t nBegin, uint32_t nSize)
+{
+    if (nSize == 0)
+    {
+        return;
+    }
+    m_nFreeSize += nSize;
+
+    auto it = std::lower_bound(m_freeRanges.begin(), m_freeRanges.end(), nBegin, [](const Range& range, uint32_t nValue) { return range.nBegin < nValue; });
+
+    // Merge with the neighbours so the free list never has two ranges next to each other
+    bool bMergeWithPrev = it != m_freeRanges.begin() && (it - 1)->nBegin + (it - 1)->nSize == nBegin;
+    bool bMergeWithNext = it != m_freeRanges.end() && nBegin + nSize == it->nBegin;
+    if (bMergeWithPrev && bMergeWithNext)
+    {
+        (it - 1)->nSize += nSize + it->nSize;
+        m_freeRanges.erase(it);
+    }
+    else if (bMergeWithPrev)
+    {
+        (it - 1)->nSize += nSize;
+    }
+    else if (bMergeWithNext)
+    {
+        it->nBegin = nBegin;
+        it->nSize += nSize;
+    }
+    else
+    {
+        m_freeRanges.insert(it, Range{ nBegin, nSize });
+    }
+}
+
+uint32_t ParticleRangeAllocator::Allocate(uint32_t nSize)
+{
+    if (nSize == 0)
+    {
+        return InvalidHandle;
+    }
+
+    uint32_t iFreeRange = FindFreeRange(nSize);
+    if (iFreeRange == m_freeRanges.size())
+    {
+        return InvalidHandle;
+    }
+
+    Range range{ m_freeRanges[iFreeRange].nBegin, nSize };
+    TakeFromFreeRange(iFreeRange, range.nBegin, nSize);
+
+    uint32_t hRange;
+    if (m_unusedHandles.empty())
+    {
+        hRange = (uint32_t)m_ranges.size();
+        m_ranges.push_back(range);
+    }
+    else
+    {
+        hRange = m_unusedHandles.back();
+        m_unusedHandles.pop_back();
+        m_ranges[hRange] = range;
+    }
+    return hRange;
+}
+
+void ParticleRangeAllocator::Free(uint32_t hRange)
+{
+    if (!IsValid(hRange))
+    {
+        return;
+    }
+
+    AddFreeRange(m_ranges[hRange].nBegin, m_ranges[hRange].nSize);
+    m_ranges[hRange] = Range{ 0, 0 };
+    m_unusedHandles.push_back(hRange);
+}
+
+bool ParticleRangeAllocator::Resize(uint32_t hRange, uint32_t nNewSize, std::vector<Move>& moves)
+{
+    if (!IsValid(hRange) || nNewSize == 0)
+    {
+        return false;
+    }
+
+    Range& range = m_ranges[hRange];
+    if (nNewSize <= range.nSize)
+    {
+        AddFreeRange(range.nBegin + nNewSize, range.nSize - nNewSize);
+        range.nSize = nNewSize;
+        return true;
+    }
+
+    // In place if the free range right after it is big enough
+    uint32_t nEnd = range.nBegin + range.nSize;
+    auto itNext = std::lower_bound(m_freeRanges.begin(), m_freeRanges.end(), nEnd, [](const Range& freeRange, uint32_t nValue) { return freeRange.nBegin < nValue; });
+    uint32_t nGrowth = nNewSize - range.nSize;
+    if (itNext != m_freeRanges.end() && itNext->nBegin == nEnd && itNext->nSize >= nGrowth)
+    {
+        TakeFromFreeRange((uint32_t)(itNext - m_freeRanges.begin()), nEnd, nGrowth);
+        range.nSize = nNewSize;
+        return true;
+    }
+
+    // The range itself doesn't count as free while looking for a new place, so the move never overlaps
+    uint32_t iFreeRange = FindFreeRange(nNewSize);
+    if (iFreeRange == m_freeRanges.size())
+    {
+        return false;
+    }
+
+    Range oldRange = range;
+    range = Range{ m_freeRanges[iFreeRange].nBegin, nNewSize };
+    TakeFromFreeRange(iFreeRange, range.nBegin, nNewSize);
+    AddFreeRange(oldRange.nBegin, oldRange.nSize);
+
+    moves.push_back(Move{ hRange, oldRange.nBegin, range.nBegin, oldRange.nSize });
+    return true;
+}
+
+void ParticleRangeAllocator::Grow(uint32_t nNewCapacity)
+{
+    if (nNewCapacity <= m_nCapacity)
+    {
+        return;
+    }
+
+    uint32_t nOldCapacity = m_nCapacity;
+    m_nCapacity = nNewCapacity;
+    AddFreeRange(nOldCapacity, nNewCapacity - nOldCapacity);
+}
+
+void ParticleRangeAllocator::Defragment(std::vector<Move>& moves)
+{
+    std::vector<uint32_t> handles;
+    GetRangesInAddressOrder(handles);
+
+    uint32_t nOffset = 0;
+    for (uint32_t hRange : handles)
+    {
+        Range& range = m_ranges[hRange];
+        if (range.nBegin != nOffset)
+        {
+            moves.push_back(Move{ hRange, range.nBegin, nOffset, range.nSize });
+            range.nBegin = nOffset;
+        }
+        nOffset += range.nSize;
+    }
+
+    m_freeRanges.clear();
+    m_nFreeSize = 0;
+    AddFreeRange(nOffset, m_nCapacity - nOffset);
+}
+
+uint32_t ParticleRangeAllocator::GetLargestFreeSize() const
+{
+    uint32_t nLargestSize = 0;
+    for (const Range& freeRange : m_freeRanges)
+    {
+        nLargestSize = std::max(nLargestSize, freeRange.nSize);
+    }
+    return nLargestSize;
+}
+
+void ParticleRangeAllocator::GetRangesInAddressOrder(std::vector<uint32_t>& handles) const
+{
+    handles.clear();
+    for (uint32_t hRange = 0; hRange < m_ranges.size(); hRange++)
+    {
+        if (m_ranges[hRange].nSize != 0)
+        {
+            handles.push_back(hRange);
+        }
+    }
+    std::sort(handles.begin(), handles.end(), [&](uint32_t hA, uint32_t hB) { return m_ranges[hA].nBegin < m_ranges[hB].nBegin; });
+}
+
+bool ParticleRangeAllocator::IsConsistent() const
+{
+    std::vector<Range> ranges = m_freeRanges;
+    uint32_t nFreeSize = 0;
+    for (uint32_t iFreeRange = 0; iFreeRange < m_freeRanges.size(); iFreeRange++)
+    {
+        const Range& freeRange = m_freeRanges[iFreeRange];
+        if (freeRange.nSize == 0 || (iFreeRange > 0 && m_freeRanges[iFreeRange - 1].nBegin + m_freeRanges[iFreeRange - 1].nSize >= freeRange.nBegin))
+        {
+            return false;
+        }
+        nFreeSize += freeRange.nSize;
+    }
+    for (const Range& range : m_ranges)
+    {
+        if (range.nSize != 0)
+        {
+            ranges.push_back(range);
+        }
+    }
+
+    std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.nBegin < b.nBegin; });
+    uint64_t nOffset = 0;
+    for (const Range& range : ranges)
+    {
+        if (range.nBegin != nOffset)
+        {
+            return false;
+        }
+        nOffset += range.nSize;
+    }
+    return nOffset == m_nCapacity && nFreeSize == m_nFreeSize;
+}
+
+RangeAllocatorBenchmarkResult BenchmarkRangeAllocator(uint32_t nCapacity, uint32_t nRangeCount, uint32_t nOperationCount)
+{
+    // Sizes like the emitters ask for, small enough that the pool only fills up to about half
+    std::mt19937 randomNumberEngine(42);
+    std::uniform_int_distribution<uint32_t> sizeDistribution(16, std::max(nCapacity / std::max(nRangeCount, 1u), 16u));
+    std::uniform_int_distribution<uint32_t> operationDistribution(0, 1);
+
+    RangeAllocatorBenchmarkResult result = {};
+    result.nCapacity = nCapacity;
+    result.nOperationCount = nOperationCount;
+
+    ParticleRangeAllocator allocator(nCapacity);
+    std::vector<uint32_t> handles(std::max(nRangeCount, 1u));
+    for (uint32_t& hRange : handles)
+    {
+        hRange = allocator.Allocate(sizeDistribution(randomNumberEngine));
+    }
+
+    // The operations are picked up front so only the allocator gets timed
+    struct Operation
+    {
+        uint32_t nType;
+        uint32_t nSlot;
+        uint32_t nSize;
+    };
+    std::vector<Operation> operations(nOperationCount);
+    for (Operation& operation : operations)
+    {
+        operation.nType = operationDistribution(randomNumberEngine);
+        operation.nSlot = (uint32_t)randomNumberEngine();
+        operation.nSize = sizeDistribution(randomNumberEngine);
+    }
+
+    std::vector<ParticleRangeAllocator::Move> moves;
+    auto start = std::chrono::steady_clock::now();
+    for (const Operation& operation : operations)
+    {
+        // Either a range goes and another one of a different size comes, or a range gets resized
+        uint32_t& hRange = handles[operation.nSlot % handles.size()];
+        if (operation.nType == 0 || !allocator.IsValid(hRange))
+        {
+            allocator.Free(hRange);
+            hRange = allocator.Allocate(operation.nSize);
+            result.nFailedCount += hRange == ParticleRangeAllocator::InvalidHandle ? 1 : 0;
+        }
+        else
+        {
+            result.nFailedCount += allocator.Resize(hRange, operation.nSize, moves) ? 0 : 1;
+            moves.clear();
+        }
+    }
+    double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.fMillionOperationsPerSecond = fSeconds > 0.0 ? nOperationCount / fSeconds / 1000000.0 : 0.0;
+    result.nFreeRangeCount = allocator.GetFreeRangeCount();
+    result.bConsistent = allocator.IsConsistent();
+
+    auto defragmentStart = std::chrono::steady_clock::now();
+    allocator.Defragment(moves);
+    result.fDefragmentMicroseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - defragmentStart).count();
+    result.bConsistent = result.bConsistent && allocator.IsConsistent() && allocator.GetFreeRangeCount() <= 1;
+    return result;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+// Hands out contiguous ranges of the particle pool, one per emitter.
+// First fit over a sorted list of free ranges, neighbouring free ranges are merged when a range is freed.
+// Ranges are referred to by handles so they can be moved around by Resize and Defragment.
+// Nothing in here touches particle data, the moves are returned to the caller who has to copy the particles.
+
+#include <cstdint>
+#include <vector>
+
+class ParticleRangeAllocator
+{
+public:
+    static const uint32_t InvalidHandle = 0xffffffff;
+
+    struct Range
+    {
+        uint32_t nBegin;
+        uint32_t nSize;
+    };
+
+    // The particles in [nSrcBegin, nSrcBegin + nSize) have to end up in [nDstBegin, nDstBegin + nSize)
+    struct Move
+    {
+        uint32_t hRange;
+        uint32_t nSrcBegin;
+        uint32_t nDstBegin;
+        uint32_t nSize;
+    };
+
+    explicit ParticleRangeAllocator(uint32_t nCapacity);
+
+    // Returns InvalidHandle if there's no free range big enough. Zero sized ranges aren't allowed.
+    uint32_t Allocate(uint32_t nSize);
+    void Free(uint32_t hRange);
+
+    // Grows or shrinks a range. Grows in place when the space after it is free, otherwise the range moves
+    // to the first free range that fits and the move gets appended to moves. Returns false if it doesn't fit anywhere.
+    bool Resize(uint32_t hRange, uint32_t nNewSize, std::vector<Move>& moves);
+
+    // Adds free space at the end of the pool
+    void Grow(uint32_t nNewCapacity);
+
+    // Slides every range towards the beginning of the pool so all the free space ends up in one range at the end.
+    // The ranges keep their order. The moves are in increasing address order and always go backwards,
+    // so they can be done one after the other in place.
+    void Defragment(std::vector<Move>& moves);
+
+    bool IsValid(uint32_t hRange) const             { return hRange < m_ranges.size() && m_ranges[hRange].nSize != 0; }
+    const Range& GetRange(uint32_t hRange) const    { return m_ranges[hRange]; }
+
+    uint32_t GetCapacity() const                    { return m_nCapacity; }
+    uint32_t GetFreeSize() const                    { return m_nFreeSize; }
+    uint32_t GetLargestFreeSize() const;
+    uint32_t GetFreeRangeCount() const              { return (uint32_t)m_freeRanges.size(); }
+
+    // Handles of the allocated ranges in increasing address order
+    void GetRangesInAddressOrder(std::vector<uint32_t>& handles) const;
+
+    // The ranges and the free ranges cover the pool exactly once, the free ranges are sorted and never next to each other
+    bool IsConsistent() const;
+
+private:
+    // Index of the first free range that is at least nSize long, or m_freeRanges.size()
+    uint32_t FindFreeRange(uint32_t nSize) const;
+    void TakeFromFreeRange(uint32_t iFreeRange, uint32_t nBegin, uint32_t nSize);
+    void AddFreeRange(uint32_t nBegin, uint32_t nSize);
+
+    uint32_t m_nCapacity;
+    uint32_t m_nFreeSize;
+
+    // Indexed by handle, unused handles have a size of zero
+    std::vector<Range> m_ranges;
+    std::vector<uint32_t> m_unusedHandles;
+
+    // Sorted by nBegin, never adjacent to each other
+    std::vector<Range> m_freeRanges;
+};
+
+struct RangeAllocatorBenchmarkResult
+{
+    uint32_t nCapacity;
+    uint32_t nOperationCount;
+    double fMillionOperationsPerSecond; // Allocate, Free and Resize calls
+    double fDefragmentMicroseconds;     // A single Defragment of what's left at the end
+    uint32_t nFreeRangeCount;           // Before the defragment, how fragmented the churn left the pool
+    uint32_t nFailedCount;              // Allocates and resizes that didn't fit
+    bool bConsistent;                   // The ranges and the free ranges tile the pool without overlaps, before and after the defragment
+};
+
+// Fills the pool with nRangeCount ranges of random sizes, then frees, allocates and resizes random ones nOperationCount times
+RangeAllocatorBenchmarkResult BenchmarkRangeAllocator(uint32_t nCapacity, uint32_t nRangeCount, uint32_t nOperationCount);
@@ -0,0 +1,256 @@
+#include "ParticleResourceTracker.h"
+
+#include <algorithm>
+#include <cassert>
+
+ParticleResourceTracker::ParticleResourceTracker()
+{
+    for (int iResource = 0; iResource < (int)ParticleResource::Count; iResource++)
+    {
+        m_states[iResource] = ParticleResourceState::Common;
+        m_splitBefore[iResource] = ParticleResourceState::Common;
+        m_bSplit[iResource] = false;
+    }
+}
+
+void ParticleResourceTracker::SetState(ParticleResource resource, ParticleResourceState state)
+{
+    assert(!m_bSplit[(int)resource]);
+    m_states[(int)resource] = state;
+}
+
+ParticleTrackedCommandList::ParticleTrackedCommandList(ParticleCommandList& commandList, ParticleResourceTracker& tracker) :
+    m_commandList(commandList),
+    m_tracker(tracker)
+{
+}
+
+ParticleTrackedCommandList::~ParticleTrackedCommandList()
+{
+    assert(m_bClosed || (m_pendingBarriers.empty() && m_splitResources.empty()));
+}
+
+ParticleBarrier* ParticleTrackedCommandList::FindPendingTransition(ParticleResource resource)
+{
+    for (ParticleBarrier& barrier : m_pendingBarriers)
+    {
+        if (barrier.type == ParticleBarrier::Type::Transition && barrier.resource == resource && barrier.flags != ParticleBarrierFlags::EndOnly)
+        {
+            return &barrier;
+        }
+    }
+    return nullptr;
+}
+
+// A begin that didn't go out yet has nothing to overlap, it becomes a whole transition
+void ParticleTrackedCommandList::EndSplitTransition(ParticleResource resource)
+{
+    const int nResource = (int)resource;
+    assert(std::find(m_splitResources.begin(), m_splitResources.end(), resource) != m_splitResources.end());
+
+    ParticleBarrier* pPending = FindPendingTransition(resource);
+    if (pPending != nullptr)
+    {
+        pPending->flags = ParticleBarrierFlags::None;
+    }
+    else
+    {
+        m_pendingBarriers.push_back(ParticleBarrier::Transition(resource, m_tracker.m_splitBefore[nResource], m_tracker.m_states[nResource], ParticleBarrierFlags::EndOnly));
+        m_tracker.m_nSplitTransitionCount++;
+    }
+
+    m_tracker.m_bSplit[nResource] = false;
+    m_splitResources.erase(std::find(m_splitResources.begin(), m_splitResources.end(), resource));
+}
+
+void ParticleTrackedCommandList::Transition(ParticleResource resource, ParticleResourceState state)
+{
+    const int nResource = (int)resource;
+    if (m_tracker.m_bSplit[nResource])
+    {
+        EndSplitTransition(resource);
+    }
+
+    ParticleResourceState& current = m_tracker.m_states[nResource];
+    if (current == state)
+    {
+        m_tracker.m_nElidedTransitionCount++;
+        return;
+    }
+
+    // Two transitions of the resource without work in between are one, or none if it goes back
+    ParticleBarrier* pPending = FindPendingTransition(resource);
+    if (pPending == nullptr)
+    {
+        m_pendingBarriers.push_back(ParticleBarrier::Transition(resource, current, state));
+        m_tracker.m_nTransitionCount++;
+    }
+    else if (pPending->before == state)
+    {
+        m_pendingBarriers.erase(m_pendingBarriers.begin() + (pPending - m_pendingBarriers.data()));
+        m_tracker.m_nTransitionCount--;
+        m_tracker.m_nElidedTransitionCount += 2;
+    }
+    else
+    {
+        pPending->after = state;
+        m_tracker.m_nElidedTransitionCount++;
+    }
+    current = state;
+}
+
+void ParticleTrackedCommandList::BeginTransition(ParticleResource resource, ParticleResourceState state)
+{
+    const int nResource = (int)resource;
+    if (m_tracker.m_bSplit[nResource])
+    {
+        EndSplitTransition(resource);
+    }
+
+    // A transition of the same batch has no work to overlap either
+    ParticleResourceState& current = m_tracker.m_states[nResource];
+    if (current == state || FindPendingTransition(resource) != nullptr)
+    {
+        Transition(resource, state);
+        return;
+    }
+
+    m_pendingBarriers.push_back(ParticleBarrier::Transition(resource, current, state, ParticleBarrierFlags::BeginOnly));
+    m_tracker.m_nTransitionCount++;
+    m_tracker.m_splitBefore[nResource] = current;
+    m_tracker.m_bSplit[nResource] = true;
+    m_splitResources.push_back(resource);
+    current = state;
+}
+
+void ParticleTrackedCommandList::UnorderedAccessBarrier(ParticleResource resource)
+{
+    for (const ParticleBarrier& barrier : m_pendingBarriers)
+    {
+        if (barrier.type == ParticleBarrier::Type::UnorderedAccess && (barrier.resource == ParticleResource::Count || barrier.resource == resource))
+        {
+            return;
+        }
+    }
+
+    if (resource == ParticleResource::Count)
+    {
+        m_pendingBarriers.erase(std::remove_if(m_pendingBarriers.begin(), m_pendingBarriers.end(),
+            [](const ParticleBarrier& barrier) { return barrier.type == ParticleBarrier::Type::UnorderedAccess; }), m_pendingBarriers.end());
+    }
+    m_pendingBarriers.push_back(ParticleBarrier::UnorderedAccess(resource));
+}
+
+void ParticleTrackedCommandList::AliasingBarrier(ParticleResource resource)
+{
+    m_pendingBarriers.push_back(ParticleBarrier::Aliasing(resource));
+}
+
+void ParticleTrackedCommandList::FlushBarriers()
+{
+    if (!m_pendingBarriers.empty())
+    {
+        m_commandList.ResourceBarrier(m_pendingBarriers.data(), (uint32_t)m_pendingBarriers.size());
+        m_pendingBarriers.clear();
+    }
+}
+
+void ParticleTrackedCommandList::Close()
+{
+    while (!m_splitResources.empty())
+    {
+        EndSplitTransition(m_splitResources.back());
+    }
+    FlushBarriers();
+    m_bClosed = true;
+}
+
+void ParticleTrackedCommandList::BeginPass(ParticlePass pass, const ParticlePassParams& params)
+{
+    m_commandList.BeginPass(pass, params);
+}
+
+void ParticleTrackedCommandList::Dispatch(uint32_t nGroupCountX, uint32_t nGroupCountY, uint32_t nGroupCountZ)
+{
+    FlushBarriers();
+    m_commandList.Dispatch(nGroupCountX, nGroupCountY, nGroupCountZ);
+}
+
+void ParticleTrackedCommandList::DispatchIndirect(ParticleResource arguments, uint32_t nArgumentOffset)
+{
+    FlushBarriers();
+    m_commandList.DispatchIndirect(arguments, nArgumentOffset);
+}
+
+void ParticleTrackedCommandList::Draw(uint32_t nVertexCount)
+{
+    FlushBarriers();
+    m_commandList.Draw(nVertexCount);
+}
+
+void ParticleTrackedCommandList::DrawIndirect(ParticleResource arguments, uint32_t nArgumentOffset)
+{
+    FlushBarriers();
+    m_commandList.DrawIndirect(arguments, nArgumentOffset);
+}
+
+void ParticleTrackedCommandList::CopyBufferRegion(ParticleResource destination, uint32_t nDestinationOffset, ParticleResource source, uint32_t nSourceOffset, uint32_t nSize)
+{
+    FlushBarriers();
+    m_commandList.CopyBufferRegion(destination, nDestinationOffset, source, nSourceOffset, nSize);
+}
+
+void ParticleTrackedCommandList::CopyResource(ParticleResource destination, ParticleResource source)
+{
+    FlushBarriers();
+    m_commandList.CopyResource(destination, source);
+}
+
+void ParticleTrackedCommandList::ClearUnorderedAccess(ParticleResource resource)
+{
+    FlushBarriers();
+    m_commandList.ClearUnorderedAccess(resource);
+}
+
+void ParticleTrackedCommandList::SetRenderTarget(ParticleResource renderTarget, const float* pClearColor)
+{
+    FlushBarriers();
+    m_commandList.SetRenderTarget(renderTarget, pClearColor);
+}
+
+// The timestamps around a pass have to see the barriers before them, or the wait for the pass isn't in the time
+void ParticleTrackedCommandList::WriteTimestamp(uint32_t nQuery)
+{
+    FlushBarriers();
+    m_commandList.WriteTimestamp(nQuery);
+}
+
+void ParticleTrackedCommandList::ResolveTimestamps(uint32_t nFirstQuery, uint32_t nCount)
+{
+    FlushBarriers();
+    m_commandList.ResolveTimestamps(nFirstQuery, nCount);
+}
+
+void ParticleTrackedCommandList::ResourceBarrier(const ParticleBarrier* pBarriers, uint32_t nCount)
+{
+    for (uint32_t iBarrier = 0; iBarrier < nCount; iBarrier++)
+    {
+        const ParticleBarrier& barrier = pBarriers[iBarrier];
+        if (barrier.type == ParticleBarrier::Type::UnorderedAccess)
+        {
+            UnorderedAccessBarrier(barrier.resource);
+        }
+        else if (barrier.type == ParticleBarrier::Type::Aliasing)
+        {
+            AliasingBarrier(barrier.resource);
+        }
+        else if (barrier.flags == ParticleBarrierFlags::BeginOnly)
+        {
+            BeginTransition(barrier.resource, barrier.after);
+        }
+        else
+        {
+            Transition(barrier.resource, barrier.after);
+        }
+    }
+}
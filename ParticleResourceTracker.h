@@ -0,0 +1,96 @@
+#pragma once
+
+// Transitions without hand written before states. ParticleResourceTracker knows the state every resource is in after
+// the lists recorded so far, ParticleTrackedCommandList records a list against it. Transition only says which state the
+// next dispatch, draw or copy needs: the ones that change nothing are dropped, two of the same resource in a row become
+// one, and the rest wait with the unordered access barriers until that work is recorded and go out in one call.
+// BeginTransition starts a split transition with the next work, the next Transition of the resource ends it, so
+// whatever is recorded in between overlaps it. The ones still open at Close end there, a split never leaves its list.
+//
+// The states follow the lists in the order they're recorded, so every list has to be submitted before the next one is
+// recorded, and a queue has to wait for the other one before it uses what that one transitioned.
+// ParticleFramePipeline does both. Like ParticleDeviceRecording it ignores the decay of the buffers to the common state
+// at the end of every ExecuteCommandLists.
+
+#include "ParticleDevice.h"
+
+#include <cstdint>
+#include <vector>
+
+class ParticleResourceTracker
+{
+public:
+    // Every resource starts out in Common
+    ParticleResourceTracker();
+
+    // For resources created again or used outside the tracked lists
+    void SetState(ParticleResource resource, ParticleResourceState state);
+    ParticleResourceState GetState(ParticleResource resource) const        { return m_states[(int)resource]; }
+
+    // Since the start, a split transition counts once
+    uint32_t GetTransitionCount() const                 { return m_nTransitionCount; }
+    uint32_t GetElidedTransitionCount() const           { return m_nElidedTransitionCount; }
+    uint32_t GetSplitTransitionCount() const            { return m_nSplitTransitionCount; }
+
+private:
+    friend class ParticleTrackedCommandList;
+
+    ParticleResourceState m_states[(int)ParticleResource::Count];          // The target of a split transition already
+    ParticleResourceState m_splitBefore[(int)ParticleResource::Count];     // Where an open split transition started
+    bool m_bSplit[(int)ParticleResource::Count];
+
+    uint32_t m_nTransitionCount = 0;
+    uint32_t m_nElidedTransitionCount = 0;
+    uint32_t m_nSplitTransitionCount = 0;
+};
+
+class ParticleTrackedCommandList : public ParticleCommandList
+{
+public:
+    ParticleTrackedCommandList(ParticleCommandList& commandList, ParticleResourceTracker& tracker);
+    virtual ~ParticleTrackedCommandList();
+
+    // The resource has to be in the state for the next work
+    void Transition(ParticleResource resource, ParticleResourceState state);
+
+    // Begins with the next work, which must not use the resource until the next Transition of it
+    void BeginTransition(ParticleResource resource, ParticleResourceState state);
+
+    // Goes out with the transitions, one on every resource stands for all the others
+    void UnorderedAccessBarrier(ParticleResource resource = ParticleResource::Count);
+
+    // Before the first use of a resource that shares its memory with others
+    void AliasingBarrier(ParticleResource resource);
+
+    // The work below does it on its own
+    void FlushBarriers();
+
+    // Ends the split transitions still open and flushes, before the list is submitted
+    void Close();
+
+    // The work flushes before it's passed on
+    virtual void BeginPass(ParticlePass pass, const ParticlePassParams& params);
+    virtual void Dispatch(uint32_t nGroupCountX, uint32_t nGroupCountY, uint32_t nGroupCountZ);
+    virtual void DispatchIndirect(ParticleResource arguments, uint32_t nArgumentOffset);
+    virtual void Draw(uint32_t nVertexCount);
+    virtual void DrawIndirect(ParticleResource arguments, uint32_t nArgumentOffset);
+    virtual void CopyBufferRegion(ParticleResource destination, uint32_t nDestinationOffset, ParticleResource source, uint32_t nSourceOffset, uint32_t nSize);
+    virtual void CopyResource(ParticleResource destination, ParticleResource source);
+    virtual void ClearUnorderedAccess(ParticleResource resource);
+    virtual void SetRenderTarget(ParticleResource renderTarget, const float* pClearColor);
+    virtual void WriteTimestamp(uint32_t nQuery);
+    virtual void ResolveTimestamps(uint32_t nFirstQuery, uint32_t nCount);
+
+    // Hand written barriers: the before states are ignored, the rest goes through the calls above
+    virtual void ResourceBarrier(const ParticleBarrier* pBarriers, uint32_t nCount);
+
+private:
+    ParticleBarrier* FindPendingTransition(ParticleResource resource);
+    void EndSplitTransition(ParticleResource resource);
+
+    ParticleCommandList& m_commandList;
+    ParticleResourceTracker& m_tracker;
+    std::vector<ParticleBarrier> m_pendingBarriers;
+    std::vector<ParticleResource> m_splitResources;     // Begun in this list and not ended yet
+    bool m_bClosed = false;
+};
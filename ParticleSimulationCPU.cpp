@@ -0,0 +1,1057 @@
+#include "ParticleSimulationCPU.h"
+#include "ParticleRadixSort.h"
+#include "TileConstants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <type_traits>
+
+void ParticleStreams::Resize(uint32_t nParticleCount)
+{
+    Positions.resize(nParticleCount);
+    Scales.resize(nParticleCount);
+    Velocities.resize(nParticleCount);
+    Rotations.resize(nParticleCount);
+    Lifetimes.resize(nParticleCount);
+    Colors.resize(nParticleCount);
+    Densities.resize(nParticleCount);
+    Pressures.resize(nParticleCount);
+}
+
+ParticleSimulationCPU::ParticleSimulationCPU(uint32_t nParticleBufferSize) :
+    m_nParticleBufferSize(nParticleBufferSize),
+    m_nMaxParticleBufferSize(nParticleBufferSize),
+    m_rangeAllocator(nParticleBufferSize),
+    m_instructionSet(GetBestSupportedInstructionSet())
+{
+    m_streams.Resize(m_nParticleBufferSize);
+    m_emittedIndices.resize(m_nParticleBufferSize);
+    m_dyingIndices.resize(m_nParticleBufferSize);
+    m_releasedIndices.resize(m_nParticleBufferSize);
+    m_aliveIndices.resize(m_nParticleBufferSize);
+    m_aliveIndicesScratch.resize(m_nParticleBufferSize);
+
+    // The first allocation always gets handle 0
+    m_rangeAllocator.Allocate(m_nParticleBufferSize);
+    m_emitters.resize(1);
+    m_emitters[DefaultEmitter].pDeadList = std::make_unique<ParticleDeadList>(m_nParticleBufferSize);
+    UpdateEmitterOrder();
+
+    Reset();
+}
+
+void ParticleSimulationCPU::SetInstructionSet(SimdInstructionSet instructionSet)
+{
+    if (IsInstructionSetSupported(instructionSet))
+    {
+        m_instructionSet = instructionSet;
+    }
+}
+
+void ParticleSimulationCPU::SetMaxParticleBufferSize(uint32_t nMaxParticleBufferSize)
+{
+    m_nMaxParticleBufferSize = std::max(nMaxParticleBufferSize, m_nParticleBufferSize);
+}
+
+void ParticleSimulationCPU::Grow(uint32_t nParticleBufferSize)
+{
+    if (nParticleBufferSize <= m_nParticleBufferSize)
+    {
+        return;
+    }
+
+    // The vectors move the live data over in one go, the new slots come out zeroed just like after a Reset
+    m_nParticleBufferSize = nParticleBufferSize;
+    m_nMaxParticleBufferSize = std::max(m_nMaxParticleBufferSize, m_nParticleBufferSize);
+    m_streams.Resize(m_nParticleBufferSize);
+    m_emittedIndices.resize(m_nParticleBufferSize);
+    m_dyingIndices.resize(m_nParticleBufferSize);
+    m_releasedIndices.resize(m_nParticleBufferSize);
+    m_aliveIndices.resize(m_nParticleBufferSize);
+    m_aliveIndicesScratch.resize(m_nParticleBufferSize);
+
+    // The alive list doesn't change, none of the new slots are in use yet
+    m_rangeAllocator.Grow(m_nParticleBufferSize);
+}
+
+bool ParticleSimulationCPU::GrowFreeSize(uint32_t nFreeSize)
+{
+    if (m_rangeAllocator.GetFreeSize() >= nFreeSize)
+    {
+        return true;
+    }
+
+    uint32_t nUsedSize = m_nParticleBufferSize - m_rangeAllocator.GetFreeSize();
+    uint64_t nRequiredSize = (uint64_t)nUsedSize + nFreeSize;
+    if (nRequiredSize > m_nMaxParticleBufferSize)
+    {
+        return false;
+    }
+
+    Grow(ParticleDeadList::GetGrownCapacity(m_nParticleBufferSize, (uint32_t)nRequiredSize, m_nMaxParticleBufferSize));
+    return true;
+}
+
+uint32_t ParticleSimulationCPU::CreateEmitter(const ParticleEmitterParams& params, uint32_t nCapacity)
+{
+    uint32_t nEmitter = m_rangeAllocator.Allocate(nCapacity);
+    if (nEmitter == InvalidEmitter && nCapacity != 0 && GrowFreeSize(nCapacity))
+    {
+        nEmitter = m_rangeAllocator.Allocate(nCapacity);
+        if (nEmitter == InvalidEmitter)
+        {
+            // There's enough free space, it's just in pieces
+            Defragment();
+            nEmitter = m_rangeAllocator.Allocate(nCapacity);
+        }
+    }
+
+    if (nEmitter == InvalidEmitter)
+    {
+        return InvalidEmitter;
+    }
+
+    if (nEmitter >= m_emitters.size())
+    {
+        m_emitters.resize(nEmitter + 1);
+    }
+
+    Emitter& emitter = m_emitters[nEmitter];
+    emitter.Params = params;
+    emitter.pDeadList = std::make_unique<ParticleDeadList>(nCapacity);
+    emitter.nPendingEmitCount = 0;
+
+    UpdateEmitterOrder();
+    return nEmitter;
+}
+
+void ParticleSimulationCPU::DestroyEmitter(uint32_t nEmitter)
+{
+    if (nEmitter == DefaultEmitter || !IsEmitterValid(nEmitter))
+    {
+        return;
+    }
+
+    // The alive list is sorted, so the particles of the emitter are one block in it
+    const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(nEmitter);
+    uint32_t* pAliveBegin = m_aliveIndices.data();
+    uint32_t* pAliveEnd = pAliveBegin + m_nAliveCount;
+    uint32_t* pFirst = std::lower_bound(pAliveBegin, pAliveEnd, range.nBegin);
+    uint32_t* pLast = std::lower_bound(pFirst, pAliveEnd, range.nBegin + range.nSize);
+    std::copy(pLast, pAliveEnd, pFirst);
+    m_nAliveCount -= (uint32_t)(pLast - pFirst);
+
+    // The dense update runs over dead slots too, it relies on them having no lifetime left
+    std::fill(m_streams.Lifetimes.begin() + range.nBegin, m_streams.Lifetimes.begin() + range.nBegin + range.nSize, 0.0f);
+
+    m_rangeAllocator.Free(nEmitter);
+    m_emitters[nEmitter].pDeadList.reset();
+    m_emitters[nEmitter].nPendingEmitCount = 0;
+    UpdateEmitterOrder();
+}
+
+void ParticleSimulationCPU::SetEmitterParams(uint32_t nEmitter, const ParticleEmitterParams& params)
+{
+    if (IsEmitterValid(nEmitter))
+    {
+        m_emitters[nEmitter].Params = params;
+    }
+}
+
+void ParticleSimulationCPU::Emit(uint32_t nEmitter, uint32_t nCount)
+{
+    if (IsEmitterValid(nEmitter))
+    {
+        uint32_t& nPendingEmitCount = m_emitters[nEmitter].nPendingEmitCount;
+        nPendingEmitCount = (uint32_t)std::min<uint64_t>((uint64_t)nPendingEmitCount + nCount, UINT32_MAX);
+    }
+}
+
+bool ParticleSimulationCPU::IsEmitterValid(uint32_t nEmitter) const
+{
+    return nEmitter < m_emitters.size() && m_emitters[nEmitter].pDeadList;
+}
+
+void ParticleSimulationCPU::UpdateEmitterOrder()
+{
+    m_rangeAllocator.GetRangesInAddressOrder(m_emitterOrder);
+}
+
+bool ParticleSimulationCPU::ResizeEmitterRange(uint32_t nEmitter, uint32_t nNewSize)
+{
+    const uint32_t nOldSize = m_rangeAllocator.GetRange(nEmitter).nSize;
+    std::vector<ParticleRangeAllocator::Move> moves;
+
+    // Growing in place is the cheapest, after that moving somewhere else, defragmenting is the last resort.
+    // The pool only grows by as much as it has to for the next attempt to work.
+    bool bResized = m_rangeAllocator.Resize(nEmitter, nNewSize, moves);
+    if (!bResized && GrowFreeSize(nNewSize - nOldSize))
+    {
+        bResized = m_rangeAllocator.Resize(nEmitter, nNewSize, moves);
+        if (!bResized)
+        {
+            Defragment();
+            bResized = m_rangeAllocator.Resize(nEmitter, nNewSize, moves);
+        }
+        if (!bResized && GrowFreeSize(nNewSize))
+        {
+            bResized = m_rangeAllocator.Resize(nEmitter, nNewSize, moves);
+        }
+    }
+
+    if (!bResized)
+    {
+        return false;
+    }
+
+    ApplyMoves(moves);
+    m_emitters[nEmitter].pDeadList->Grow(nNewSize);
+    UpdateEmitterOrder();
+    return true;
+}
+
+void ParticleSimulationCPU::Defragment()
+{
+    std::vector<ParticleRangeAllocator::Move> moves;
+    m_rangeAllocator.Defragment(moves);
+    ApplyMoves(moves);
+    UpdateEmitterOrder();
+}
+
+void ParticleSimulationCPU::ApplyMoves(const std::vector<ParticleRangeAllocator::Move>& moves)
+{
+    if (moves.empty())
+    {
+        return;
+    }
+
+    // The dead lists store indices relative to their range so they don't change, only the particles and the alive list do.
+    // Moves always go to free space or backwards in address order, so copying them forward one after the other is safe.
+    for (const ParticleRangeAllocator::Move& move : moves)
+    {
+        auto fnMoveStream = [&](auto& stream)
+        {
+            std::copy(stream.begin() + move.nSrcBegin, stream.begin() + move.nSrcBegin + move.nSize, stream.begin() + move.nDstBegin);
+        };
+        fnMoveStream(m_streams.Positions);
+        fnMoveStream(m_streams.Scales);
+        fnMoveStream(m_streams.Velocities);
+        fnMoveStream(m_streams.Rotations);
+        fnMoveStream(m_streams.Lifetimes);
+        fnMoveStream(m_streams.Colors);
+        fnMoveStream(m_streams.Densities);
+        fnMoveStream(m_streams.Pressures);
+
+        // Whatever the move left behind is free space now. The dense update runs over dead slots too, it relies on them having no lifetime left.
+        uint32_t nSrcEnd = move.nSrcBegin + move.nSize;
+        uint32_t nVacatedBegin = move.nDstBegin < move.nSrcBegin ? std::max(move.nSrcBegin, move.nDstBegin + move.nSize) : move.nSrcBegin;
+        uint32_t nVacatedEnd = move.nDstBegin < move.nSrcBegin ? nSrcEnd : std::min(nSrcEnd, move.nDstBegin);
+        std::fill(m_streams.Lifetimes.begin() + nVacatedBegin, m_streams.Lifetimes.begin() + nVacatedEnd, 0.0f);
+    }
+
+    // Every live particle is inside exactly one of the source ranges
+    std::vector<ParticleRangeAllocator::Move> movesBySource = moves;
+    std::sort(movesBySource.begin(), movesBySource.end(), [](const ParticleRangeAllocator::Move& a, const ParticleRangeAllocator::Move& b) { return a.nSrcBegin < b.nSrcBegin; });
+
+    ForEachChunk(m_nAliveCount, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            uint32_t nIndex = m_aliveIndices[i];
+            auto it = std::upper_bound(movesBySource.begin(), movesBySource.end(), nIndex, [](uint32_t nValue, const ParticleRangeAllocator::Move& move) { return nValue < move.nSrcBegin; });
+            if (it != movesBySource.begin() && nIndex - (it - 1)->nSrcBegin < (it - 1)->nSize)
+            {
+                m_aliveIndices[i] = nIndex - (it - 1)->nSrcBegin + (it - 1)->nDstBegin;
+            }
+        }
+    });
+
+    // Defragmenting keeps the order, only a range that moved past others breaks it
+    if (!std::is_sorted(m_aliveIndices.begin(), m_aliveIndices.begin() + m_nAliveCount))
+    {
+        std::sort(m_aliveIndices.begin(), m_aliveIndices.begin() + m_nAliveCount);
+    }
+}
+
+void ParticleSimulationCPU::Reset()
+{
+    std::fill(m_streams.Positions.begin(), m_streams.Positions.end(), Float2{ 0.0f, 0.0f });
+    std::fill(m_streams.Scales.begin(), m_streams.Scales.end(), Float2{ 0.0f, 0.0f });
+    std::fill(m_streams.Velocities.begin(), m_streams.Velocities.end(), Float2{ 0.0f, 0.0f });
+    std::fill(m_streams.Rotations.begin(), m_streams.Rotations.end(), 0.0f);
+    std::fill(m_streams.Lifetimes.begin(), m_streams.Lifetimes.end(), 0.0f);
+    std::fill(m_streams.Colors.begin(), m_streams.Colors.end(), Float4{ 0.0f, 0.0f, 0.0f, 0.0f });
+    std::fill(m_streams.Densities.begin(), m_streams.Densities.end(), 0.0f);
+    std::fill(m_streams.Pressures.begin(), m_streams.Pressures.end(), 0.0f);
+
+    for (Emitter& emitter : m_emitters)
+    {
+        if (emitter.pDeadList)
+        {
+            emitter.pDeadList->Reset();
+        }
+        emitter.nPendingEmitCount = 0;
+    }
+    m_nAliveCount = 0;
+    m_nPendingFixedStepEmitCount = 0;
+}
+
+void ParticleSimulationCPU::SpawnGrid(uint32_t nRandomSeed)
+{
+    Reset();
+
+    const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(DefaultEmitter);
+
+    std::mt19937 randomNumberEngine(nRandomSeed);
+    auto fnGetRandomFloatInRange = [&](float from, float to) -> float
+    {
+        float fRnd = std::uniform_real_distribution<float>{}(randomNumberEngine);
+        return fRnd * (to - from) + from;
+    };
+
+    const Float4 colors[] = { { 1, 0, 0, 1 }, { 0, 1, 0, 1 }, { 0, 0, 1, 1 }, { 1, 0, 1, 1 }, { 1, 1, 0, 1 }, { 0, 1, 1, 1 } };
+    const uint32_t nColorCount = sizeof(colors) / sizeof(colors[0]);
+
+    uint32_t nParticlesPerRow = (uint32_t)ceil(sqrt((float)range.nSize));
+    for (uint32_t iParticle = 0; iParticle < range.nSize; iParticle++)
+    {
+        uint32_t i = range.nBegin + iParticle;
+
+        float posX = (float)(iParticle % nParticlesPerRow) / nParticlesPerRow;
+        posX = -1.0f + posX * 2 + 0.2f;
+
+        float posY = (float)(iParticle / nParticlesPerRow) / nParticlesPerRow;
+        posY = 1.0f - posY * 2 - 0.2f;
+
+        m_streams.Positions[i] = { posX, posY };
+        m_streams.Velocities[i] = { 0.01f, 0.0f };
+        m_streams.Scales[i].x = fnGetRandomFloatInRange(0.01f, 0.06f);
+        m_streams.Scales[i].y = fnGetRandomFloatInRange(0.01f, 0.06f);
+#ifdef DISABLE_ROTATION
+        m_streams.Rotations[i] = 0.0f;
+#else
+        m_streams.Rotations[i] = fnGetRandomFloatInRange(-3.14159265f, 3.14159265f);
+#endif
+        m_streams.Lifetimes[i] = 9999999.0f;
+        m_streams.Colors[i] = colors[iParticle % nColorCount];
+    }
+
+    m_emitters[DefaultEmitter].pDeadList->MarkAllUsed();
+    std::iota(m_aliveIndices.begin(), m_aliveIndices.begin() + range.nSize, range.nBegin);
+    m_nAliveCount = range.nSize;
+}
+
+float ParticleSimulationCPU::GetRandomNumber(uint32_t& seed)
+{
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed = seed ^ (seed >> 4);
+    seed *= 0x27d4eb2d;
+    seed = seed ^ (seed >> 15);
+
+    // Generate a random float in [0, 1)...
+    return float(seed) * (1.0f / 4294967296.0f);
+}
+
+void ParticleSimulationCPU::GenerateNewParticle(const ParticleEmitterParams& params, uint32_t rndSeed, uint32_t nParticleIndex)
+{
+    // Every call is sequenced so the random numbers are consumed in the same order as in the shader
+    Float2 velocity;
+    velocity.x = (GetRandomNumber(rndSeed) * 2.0f - 1.0f) * params.m_fSpeed;
+    velocity.y = (GetRandomNumber(rndSeed) * 2.0f - 1.0f) * params.m_fSpeed;
+
+    Float4 color;
+    color.x = GetRandomNumber(rndSeed) * params.m_Color.x;
+    color.y = GetRandomNumber(rndSeed) * params.m_Color.y;
+    color.z = GetRandomNumber(rndSeed) * params.m_Color.z;
+    color.w = params.m_Color.w;
+
+    m_streams.Positions[nParticleIndex] = params.m_Position;
+    m_streams.Lifetimes[nParticleIndex] = params.m_fLifetime;
+    m_streams.Velocities[nParticleIndex] = velocity;
+    m_streams.Colors[nParticleIndex] = color;
+    m_streams.Scales[nParticleIndex] = params.m_Scale;
+#ifdef DISABLE_ROTATION
+    m_streams.Rotations[nParticleIndex] = 0.0f;
+#else
+    m_streams.Rotations[nParticleIndex] = GetRandomNumber(rndSeed);
+#endif
+}
+
+void ParticleSimulationCPU::ForEachChunk(uint32_t nCount, const JobSystem::RangeJob& fnJob)
+{
+    if (m_pJobSystem)
+    {
+        m_pJobSystem->ParallelFor(nCount, ChunkSize, fnJob);
+        return;
+    }
+
+    for (uint32_t nBegin = 0; nBegin < nCount; nBegin += ChunkSize)
+    {
+        fnJob(nBegin, std::min(nCount, nBegin + ChunkSize), 0);
+    }
+}
+
+void ParticleSimulationCPU::Generate(const ParticleFrameConstants& constants)
+{
+    Emit(DefaultEmitter, constants.m_EmitCount);
+
+    // Emitters that run out of slots grow geometrically. Ranges can only move before any slot is handed out.
+    for (uint32_t nEmitter = 0; nEmitter < m_emitters.size(); nEmitter++)
+    {
+        Emitter& emitter = m_emitters[nEmitter];
+        if (!emitter.pDeadList || emitter.nPendingEmitCount <= emitter.pDeadList->GetFreeCount())
+        {
+            continue;
+        }
+
+        uint64_t nRequiredSize = (uint64_t)emitter.pDeadList->GetParticleCount() + emitter.nPendingEmitCount;
+        uint32_t nRangeSize = m_rangeAllocator.GetRange(nEmitter).nSize;
+        uint32_t nNewRangeSize = ParticleDeadList::GetGrownCapacity(nRangeSize, (uint32_t)std::min<uint64_t>(nRequiredSize, UINT32_MAX), m_nMaxParticleBufferSize);
+        if (nNewRangeSize > nRangeSize)
+        {
+            ResizeEmitterRange(nEmitter, nNewRangeSize);
+        }
+    }
+
+    // One batch for every emitter, like the single CSGenerate dispatch. The threads of an emitter start at its
+    // m_emitOffsetPerEmitter and the i-th one gets the slot that the i-th IncrementCounter would have given it.
+    // The ones that don't fit are dropped, same as the InterlockedMin clamp in the shader.
+    const uint32_t nEmitterCount = (uint32_t)m_emitterOrder.size();
+    m_emitOffsetPerEmitter.resize(nEmitterCount);
+    m_reservedOffsetPerEmitter.resize(nEmitterCount);
+
+    uint32_t nRequestedCount = 0;
+    uint32_t nEmitCount = 0;
+    for (uint32_t iEmitter = 0; iEmitter < nEmitterCount; iEmitter++)
+    {
+        uint32_t nEmitter = m_emitterOrder[iEmitter];
+        Emitter& emitter = m_emitters[nEmitter];
+        uint32_t nRangeBegin = m_rangeAllocator.GetRange(nEmitter).nBegin;
+
+        m_emitOffsetPerEmitter[iEmitter] = nRequestedCount;
+        m_reservedOffsetPerEmitter[iEmitter] = nEmitCount;
+
+        uint32_t* pReservedIndices = m_emittedIndices.data() + nEmitCount;
+        uint32_t nReservedCount = emitter.pDeadList->Reserve(emitter.nPendingEmitCount, pReservedIndices);
+        for (uint32_t i = 0; i < nReservedCount; i++)
+        {
+            pReservedIndices[i] += nRangeBegin;
+        }
+
+        nRequestedCount += emitter.nPendingEmitCount;
+        nEmitCount += nReservedCount;
+        emitter.nPendingEmitCount = 0;
+    }
+
+    ForEachChunk(nEmitCount, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        uint32_t iEmitter = (uint32_t)(std::upper_bound(m_reservedOffsetPerEmitter.begin(), m_reservedOffsetPerEmitter.end(), nBegin) - m_reservedOffsetPerEmitter.begin()) - 1;
+        for (uint32_t iEmit = nBegin; iEmit < nEnd; iEmit++)
+        {
+            while (iEmitter + 1 < nEmitterCount && m_reservedOffsetPerEmitter[iEmitter + 1] <= iEmit)
+            {
+                iEmitter++;
+            }
+
+            const Emitter& emitter = m_emitters[m_emitterOrder[iEmitter]];
+            uint32_t nThread = m_emitOffsetPerEmitter[iEmitter] + iEmit - m_reservedOffsetPerEmitter[iEmitter];
+            GenerateNewParticle(emitter.Params, constants.m_nRandomSeed + nThread, m_emittedIndices[iEmit]);
+        }
+    });
+
+    AddToAliveList(m_emittedIndices.data(), nEmitCount);
+}
+
+void ParticleSimulationCPU::AddToAliveList(uint32_t* pIndices, uint32_t nCount)
+{
+    if (nCount == 0)
+    {
+        return;
+    }
+
+    // The dead list hands the slots out in no particular order, but the alive list has to stay sorted
+    // so the update can find the runs of neighbouring particles and the dead list gets refilled in index order.
+    // @Performance: The merge is serial. It's only as long as the alive list on frames that emit something.
+    std::sort(pIndices, pIndices + nCount);
+    uint32_t* pMergedEnd = std::merge(m_aliveIndices.data(), m_aliveIndices.data() + m_nAliveCount, pIndices, pIndices + nCount, m_aliveIndicesScratch.data());
+    m_nAliveCount = (uint32_t)(pMergedEnd - m_aliveIndicesScratch.data());
+    m_aliveIndices.swap(m_aliveIndicesScratch);
+}
+
+void ParticleSimulationCPU::Update(const ParticleFrameConstants& constants)
+{
+    // The fluid, the gravity and the collisions only change the velocities, the integration below moves the particles with them
+    if (constants.m_fFluidStiffness > 0.0f)
+    {
+        m_fluid.Step(m_streams, m_aliveIndices.data(), m_nAliveCount, constants.m_fFluidStiffness, constants.m_fElapsedTime, m_pJobSystem);
+    }
+
+    if (constants.m_fGravity != 0.0f)
+    {
+        m_quadtree.Build(m_streams.Positions.data(), m_aliveIndices.data(), m_nAliveCount, m_pJobSystem);
+        m_quadtree.ApplyGravity(m_streams.Velocities.data(), constants.m_fGravity, m_fGravityTheta, constants.m_fElapsedTime, m_pJobSystem);
+    }
+
+    if (constants.m_fCollisionStiffness > 0.0f)
+    {
+        m_spatialHash.Build(m_streams.Positions.data(), m_streams.Scales.data(), m_aliveIndices.data(), m_nAliveCount, m_pJobSystem);
+        m_spatialHash.Collide(m_streams.Velocities.data(), constants.m_fCollisionStiffness, constants.m_fElapsedTime, m_pJobSystem);
+    }
+
+    // Only the live particles get touched. Dead ones are left alone, the GPU would just copy them through.
+    const uint32_t nChunkCount = (m_nAliveCount + ChunkSize - 1) / ChunkSize;
+    m_dyingCountPerChunk.resize(nChunkCount);
+    m_dyingOffsetPerChunk.resize(nChunkCount);
+    m_aliveOffsetPerChunk.resize(nChunkCount);
+
+    ForEachChunk(m_nAliveCount, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        ParticleUpdateRange range;
+        range.pPositions = m_streams.Positions.data();
+        range.pVelocities = m_streams.Velocities.data();
+        range.pRotations = m_streams.Rotations.data();
+        range.pLifetimes = m_streams.Lifetimes.data();
+        range.nBegin = nBegin;
+        range.nEnd = nEnd;
+
+        m_dyingCountPerChunk[nBegin / ChunkSize] = UpdateParticleList(m_instructionSet, range, m_aliveIndices.data(), constants.m_fElapsedTime, m_dyingIndices.data() + nBegin);
+    });
+
+    // Exclusive prefix sum over the survivor counts gives every chunk its place in the new alive list.
+    // One release for the whole frame as well, every chunk gets its part of the block in chunk order
+    // so the dead list ends up exactly like it would with one thread per particle.
+    uint32_t nDyingCount = 0;
+    uint32_t nSurvivorCount = 0;
+    for (uint32_t iChunk = 0; iChunk < nChunkCount; iChunk++)
+    {
+        uint32_t nChunkParticleCount = std::min(m_nAliveCount, (iChunk + 1) * ChunkSize) - iChunk * ChunkSize;
+        m_dyingOffsetPerChunk[iChunk] = nDyingCount;
+        m_aliveOffsetPerChunk[iChunk] = nSurvivorCount;
+        nSurvivorCount += nChunkParticleCount - m_dyingCountPerChunk[iChunk];
+        nDyingCount += m_dyingCountPerChunk[iChunk];
+    }
+
+    if (nDyingCount == 0)
+    {
+        return;
+    }
+
+    ForEachChunk(m_nAliveCount, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        const uint32_t iChunk = nBegin / ChunkSize;
+        const uint32_t* pChunkDyingIndices = m_dyingIndices.data() + nBegin;
+        const uint32_t nChunkDyingCount = m_dyingCountPerChunk[iChunk];
+        std::copy(pChunkDyingIndices, pChunkDyingIndices + nChunkDyingCount, m_releasedIndices.data() + m_dyingOffsetPerChunk[iChunk]);
+
+        // Both lists are sorted, so the survivors are the blocks between the dying ones
+        const uint32_t* pAlive = m_aliveIndices.data() + nBegin;
+        const uint32_t* pAliveEnd = m_aliveIndices.data() + nEnd;
+        uint32_t* pOut = m_aliveIndicesScratch.data() + m_aliveOffsetPerChunk[iChunk];
+        for (uint32_t iDying = 0; iDying < nChunkDyingCount; iDying++)
+        {
+            const uint32_t* pDying = std::lower_bound(pAlive, pAliveEnd, pChunkDyingIndices[iDying]);
+            pOut = std::copy(pAlive, pDying, pOut);
+            pAlive = pDying + 1;
+        }
+        std::copy(pAlive, pAliveEnd, pOut);
+    });
+
+    m_aliveIndices.swap(m_aliveIndicesScratch);
+    m_nAliveCount = nSurvivorCount;
+
+    ReleaseToEmitters(m_releasedIndices.data(), nDyingCount);
+}
+
+void ParticleSimulationCPU::ReleaseToEmitters(uint32_t* pIndices, uint32_t nCount)
+{
+    // The ranges are sorted just like the indices, so every emitter gets a single block
+    uint32_t* pIndicesEnd = pIndices + nCount;
+    for (uint32_t nEmitter : m_emitterOrder)
+    {
+        if (pIndices == pIndicesEnd)
+        {
+            break;
+        }
+
+        const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(nEmitter);
+        uint32_t* pRangeEnd = std::lower_bound(pIndices, pIndicesEnd, range.nBegin + range.nSize);
+        uint32_t nReleaseCount = (uint32_t)(pRangeEnd - pIndices);
+        if (nReleaseCount == 0)
+        {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < nReleaseCount; i++)
+        {
+            pIndices[i] -= range.nBegin;
+        }
+        m_emitters[nEmitter].pDeadList->Release(nReleaseCount, pIndices);
+        pIndices = pRangeEnd;
+    }
+}
+
+void ParticleSimulationCPU::Simulate(const ParticleFrameConstants& constants)
+{
+    Generate(constants);
+    Update(constants);
+
+    if (m_nReorderInterval > 0 && ++m_nSimulateCountSinceReorder >= m_nReorderInterval)
+    {
+        ReorderParticles();
+        m_nSimulateCountSinceReorder = 0;
+    }
+}
+
+// Spreads the 16 low bits out to the even bits
+static uint32_t SpreadMortonBits(uint32_t nValue)
+{
+    nValue &= 0x0000ffff;
+    nValue = (nValue | (nValue << 8)) & 0x00ff00ff;
+    nValue = (nValue | (nValue << 4)) & 0x0f0f0f0f;
+    nValue = (nValue | (nValue << 2)) & 0x33333333;
+    nValue = (nValue | (nValue << 1)) & 0x55555555;
+    return nValue;
+}
+
+uint32_t ParticleSimulationCPU::GetMortonKey(const Float2& position)
+{
+    // Clip space to [0, 1] from the top left like the tiles, y flips. std::max would let a NaN through to the
+    // conversion, the comparison sends it to zero instead.
+    float fX = (position.x + 1.0f) * 0.5f;
+    float fY = (1.0f - position.y) * 0.5f;
+    fX = fX >= 0.0f ? std::min(fX, 1.0f) : 0.0f;
+    fY = fY >= 0.0f ? std::min(fY, 1.0f) : 0.0f;
+    return SpreadMortonBits((uint32_t)(fX * 65535.0f)) | (SpreadMortonBits((uint32_t)(fY * 65535.0f)) << 1);
+}
+
+void ParticleSimulationCPU::ReorderParticles()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    const uint32_t nAliveCount = m_nAliveCount;
+    m_reorderKeys.resize(nAliveCount);
+    m_reorderSlots.resize(nAliveCount);
+    m_reorderKeyScratch.resize(nAliveCount);
+    m_reorderSlotScratch.resize(nAliveCount);
+
+    ForEachChunk(nAliveCount, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            uint32_t nSlot = m_aliveIndices[i];
+            m_reorderKeys[i] = GetMortonKey(m_streams.Positions[nSlot]);
+            m_reorderSlots[i] = nSlot;
+        }
+    });
+
+    // The alive list is sorted, so the particles of an emitter are one block in it. Every block is sorted on its own
+    // and goes to the front of its range, the new alive list is still sorted.
+    for (uint32_t nEmitter : m_emitterOrder)
+    {
+        const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(nEmitter);
+        uint32_t* pAliveBegin = m_aliveIndices.data();
+        uint32_t* pAliveEnd = pAliveBegin + nAliveCount;
+        uint32_t nFirst = (uint32_t)(std::lower_bound(pAliveBegin, pAliveEnd, range.nBegin) - pAliveBegin);
+        uint32_t nLast = (uint32_t)(std::lower_bound(pAliveBegin + nFirst, pAliveEnd, range.nBegin + range.nSize) - pAliveBegin);
+        uint32_t nCount = nLast - nFirst;
+
+        RadixSortKeyValues(m_instructionSet, m_reorderKeys.data() + nFirst, m_reorderSlots.data() + nFirst, nCount,
+            m_reorderKeyScratch.data(), m_reorderSlotScratch.data());
+        std::iota(m_aliveIndicesScratch.begin() + nFirst, m_aliveIndicesScratch.begin() + nLast, range.nBegin);
+        m_emitters[nEmitter].pDeadList->MarkFirstUsed(nCount);
+    }
+
+    // Gathered in the new order first, the old and the new slots overlap
+    auto fnPermuteStream = [&](auto& stream, auto& gathered)
+    {
+        gathered.resize(nAliveCount);
+        ForEachChunk(nAliveCount, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+        {
+            for (uint32_t i = nBegin; i < nEnd; i++)
+            {
+                gathered[i] = stream[m_reorderSlots[i]];
+            }
+        });
+        ForEachChunk(nAliveCount, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+        {
+            for (uint32_t i = nBegin; i < nEnd; i++)
+            {
+                stream[m_aliveIndicesScratch[i]] = gathered[i];
+            }
+        });
+    };
+    fnPermuteStream(m_streams.Positions, m_reorderFloat2Scratch);
+    fnPermuteStream(m_streams.Scales, m_reorderFloat2Scratch);
+    fnPermuteStream(m_streams.Velocities, m_reorderFloat2Scratch);
+    fnPermuteStream(m_streams.Rotations, m_reorderFloatScratch);
+    fnPermuteStream(m_streams.Lifetimes, m_reorderFloatScratch);
+    fnPermuteStream(m_streams.Colors, m_reorderFloat4Scratch);
+    fnPermuteStream(m_streams.Densities, m_reorderFloatScratch);
+    fnPermuteStream(m_streams.Pressures, m_reorderFloatScratch);
+
+    // The dense update runs over dead slots too, it relies on them having no lifetime left
+    for (uint32_t nEmitter : m_emitterOrder)
+    {
+        const ParticleRangeAllocator::Range& range = m_rangeAllocator.GetRange(nEmitter);
+        uint32_t nCount = m_emitters[nEmitter].pDeadList->GetParticleCount();
+        std::fill(m_streams.Lifetimes.begin() + range.nBegin + nCount, m_streams.Lifetimes.begin() + range.nBegin + range.nSize, 0.0f);
+    }
+
+    m_aliveIndices.swap(m_aliveIndicesScratch);
+
+    m_nReorderNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void ParticleSimulationCPU::SetFixedTimeStep(double fStepSeconds, uint32_t nMaxStepCount)
+{
+    m_nFixedStepTicks = std::max((uint64_t)(fStepSeconds * TicksPerSecond), (uint64_t)1);
+    m_nMaxFixedStepCount = std::max(nMaxStepCount, 1u);
+    m_nLeftOverTicks = 0;
+}
+
+uint32_t ParticleSimulationCPU::SimulateFixedSteps(const ParticleFrameConstants& constants, uint64_t nElapsedTicks)
+{
+    if (std::abs((int64_t)nElapsedTicks - (int64_t)m_nFixedStepTicks) < (int64_t)(TicksPerSecond / 4000))
+    {
+        nElapsedTicks = m_nFixedStepTicks;
+    }
+
+    m_nLeftOverTicks += nElapsedTicks;
+    uint64_t nStepCount = m_nLeftOverTicks / m_nFixedStepTicks;
+    m_nLeftOverTicks -= nStepCount * m_nFixedStepTicks;
+    nStepCount = std::min(nStepCount, (uint64_t)m_nMaxFixedStepCount);
+
+    m_nPendingFixedStepEmitCount = (uint32_t)std::min<uint64_t>((uint64_t)m_nPendingFixedStepEmitCount + constants.m_EmitCount, UINT32_MAX);
+    if (nStepCount == 0)
+    {
+        return 0;
+    }
+
+    ParticleFrameConstants stepConstants = constants;
+    stepConstants.m_fElapsedTime = (float)((double)m_nFixedStepTicks / TicksPerSecond);
+    stepConstants.m_EmitCount = m_nPendingFixedStepEmitCount;
+    m_nPendingFixedStepEmitCount = 0;
+    for (uint64_t iStep = 0; iStep < nStepCount; iStep++)
+    {
+        Simulate(stepConstants);
+        stepConstants.m_EmitCount = 0;
+    }
+    return (uint32_t)nStepCount;
+}
+
+AliveListBenchmarkResult BenchmarkAliveList(SimdInstructionSet instructionSet, uint32_t nParticleBufferSize, float fOccupancy, bool bPacked, uint32_t nFrameCount, JobSystem* pJobSystem)
+{
+    const float fElapsedTime = 1.0f / 60.0f;
+    const uint32_t nAliveCount = std::min((uint32_t)(nParticleBufferSize * fOccupancy), nParticleBufferSize);
+
+    ParticleSimulationCPU simulation(nParticleBufferSize);
+    simulation.SetInstructionSet(instructionSet);
+    simulation.SetJobSystem(pJobSystem);
+    simulation.SpawnGrid(1);
+
+    std::vector<uint32_t> slots(nParticleBufferSize);
+    std::iota(slots.begin(), slots.end(), 0);
+    std::mt19937 randomNumberEngine(42);
+    if (!bPacked)
+    {
+        std::shuffle(slots.begin(), slots.end(), randomNumberEngine);
+    }
+
+    // The first nAliveCount slots live, a fifth of them die somewhere in the frames. The rest die in the first update,
+    // which isn't timed.
+    std::uniform_real_distribution<float> lifetimeDistribution(fElapsedTime, std::max(nFrameCount, 1u) * fElapsedTime);
+    ParticleStreams& streams = simulation.GetStreams();
+    for (uint32_t i = 0; i < nParticleBufferSize; i++)
+    {
+        float& fLifetime = streams.Lifetimes[slots[i]];
+        fLifetime = i >= nAliveCount ? 0.5f * fElapsedTime : (i % 5 == 0 ? lifetimeDistribution(randomNumberEngine) : -1.0f);
+    }
+
+    ParticleFrameConstants constants;
+    constants.m_fElapsedTime = fElapsedTime;
+    simulation.Update(constants);
+
+    // The dense update works on a copy of what it touches, with a dead list of its own
+    ParticleStreams denseStreams;
+    denseStreams.Positions = streams.Positions;
+    denseStreams.Velocities = streams.Velocities;
+    denseStreams.Rotations = streams.Rotations;
+    denseStreams.Lifetimes = streams.Lifetimes;
+    ParticleDeadList denseDeadList(nParticleBufferSize);
+    denseDeadList.MarkFirstUsed(simulation.GetParticleCount());
+    std::vector<uint32_t> denseDeadIndices(nParticleBufferSize);
+
+    AliveListBenchmarkResult result = {};
+    result.nParticleBufferSize = nParticleBufferSize;
+    result.nAliveCount = simulation.GetParticleCount();
+    result.nFrameCount = nFrameCount;
+
+    const uint32_t ChunkSize = ParticleSimulationCPU::ChunkSize;
+    auto updateDense = [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        ParticleUpdateRange range;
+        range.pPositions = denseStreams.Positions.data();
+        range.pVelocities = denseStreams.Velocities.data();
+        range.pRotations = denseStreams.Rotations.data();
+        range.pLifetimes = denseStreams.Lifetimes.data();
+        range.nBegin = nBegin;
+        range.nEnd = nEnd;
+
+        uint32_t nDeadCount = UpdateParticles(instructionSet, range, fElapsedTime, denseDeadIndices.data() + nBegin);
+        denseDeadList.Release(nDeadCount, denseDeadIndices.data() + nBegin);
+    };
+
+    uint64_t nDenseNanoseconds = 0;
+    uint64_t nAliveListNanoseconds = 0;
+    for (uint32_t iFrame = 0; iFrame < nFrameCount; iFrame++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (pJobSystem)
+        {
+            pJobSystem->ParallelFor(nParticleBufferSize, ChunkSize, updateDense);
+        }
+        else
+        {
+            for (uint32_t nBegin = 0; nBegin < nParticleBufferSize; nBegin += ChunkSize)
+            {
+                updateDense(nBegin, std::min(nBegin + ChunkSize, nParticleBufferSize), 0);
+            }
+        }
+        auto denseEnd = std::chrono::steady_clock::now();
+        simulation.Update(constants);
+        auto aliveListEnd = std::chrono::steady_clock::now();
+
+        nDenseNanoseconds += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(denseEnd - start).count();
+        nAliveListNanoseconds += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(aliveListEnd - denseEnd).count();
+    }
+
+    if (nFrameCount > 0)
+    {
+        result.fDenseMicroseconds = (double)nDenseNanoseconds / nFrameCount / 1000.0;
+        result.fAliveListMicroseconds = (double)nAliveListNanoseconds / nFrameCount / 1000.0;
+    }
+
+    const size_t nFloat2Bytes = nParticleBufferSize * sizeof(Float2);
+    const size_t nFloatBytes = nParticleBufferSize * sizeof(float);
+    result.bMatchesDense = denseDeadList.GetParticleCount() == simulation.GetParticleCount() &&
+        std::memcmp(denseStreams.Positions.data(), streams.Positions.data(), nFloat2Bytes) == 0 &&
+        std::memcmp(denseStreams.Velocities.data(), streams.Velocities.data(), nFloat2Bytes) == 0 &&
+        std::memcmp(denseStreams.Rotations.data(), streams.Rotations.data(), nFloatBytes) == 0 &&
+        std::memcmp(denseStreams.Lifetimes.data(), streams.Lifetimes.data(), nFloatBytes) == 0;
+    return result;
+}
+
+// Everything a live particle has but its slot, compared bit for bit
+struct LiveParticleState
+{
+    Float2 Position;
+    Float2 Scale;
+    Float2 Velocity;
+    float fRotation;
+    float fLifetime;
+    Float4 Color;
+};
+
+// Sorted so two pools can be compared whatever slots the particles ended up in.
+// The particles inside excludedRange are left out.
+static void GetLiveParticleStates(const ParticleSimulationCPU& simulation, std::vector<LiveParticleState>& states,
+    ParticleRangeAllocator::Range excludedRange = ParticleRangeAllocator::Range{ 0, 0 })
+{
+    const ParticleStreams& streams = simulation.GetStreams();
+    states.clear();
+    for (uint32_t i = 0; i < simulation.GetAliveCount(); i++)
+    {
+        uint32_t nParticle = simulation.GetAliveIndices()[i];
+        if (nParticle - excludedRange.nBegin < excludedRange.nSize)
+        {
+            continue;
+        }
+
+        LiveParticleState state;
+        state.Position = streams.Positions[nParticle];
+        state.Scale = streams.Scales[nParticle];
+        state.Velocity = streams.Velocities[nParticle];
+        state.fRotation = streams.Rotations[nParticle];
+        state.fLifetime = streams.Lifetimes[nParticle];
+        state.Color = streams.Colors[nParticle];
+        states.push_back(state);
+    }
+
+    std::sort(states.begin(), states.end(), [](const LiveParticleState& a, const LiveParticleState& b) { return std::memcmp(&a, &b, sizeof(LiveParticleState)) < 0; });
+}
+
+static bool SameLiveParticleStates(const std::vector<LiveParticleState>& a, const std::vector<LiveParticleState>& b)
+{
+    return a.size() == b.size() && (a.empty() || std::memcmp(a.data(), b.data(), a.size() * sizeof(LiveParticleState)) == 0);
+}
+
+PoolGrowthValidationResult ValidatePoolGrowth(uint32_t nInitialSize, uint32_t nEmitCount, uint32_t nFrameCount, JobSystem* pJobSystem)
+{
+    const uint32_t nFinalSize = std::max(nEmitCount * nFrameCount, nInitialSize);
+
+    ParticleSimulationCPU simulation(nInitialSize);
+    simulation.SetMaxParticleBufferSize(nFinalSize);
+    simulation.SetJobSystem(pJobSystem);
+    ParticleSimulationCPU reference(nFinalSize);
+    reference.SetJobSystem(pJobSystem);
+
+    PoolGrowthValidationResult result = {};
+    result.nInitialSize = nInitialSize;
+
+    ParticleFrameConstants constants;
+    constants.m_EmitCount = nEmitCount;
+    constants.m_fElapsedTime = 1.0f / 60.0f;
+    std::vector<LiveParticleState> states;
+    std::vector<LiveParticleState> referenceStates;
+    for (uint32_t iFrame = 0; iFrame < nFrameCount; iFrame++)
+    {
+        uint32_t nSizeBefore = simulation.GetParticleBufferSize();
+        constants.m_nRandomSeed = iFrame;
+        simulation.Simulate(constants);
+        reference.Simulate(constants);
+        result.nGrowCount += simulation.GetParticleBufferSize() > nSizeBefore ? 1 : 0;
+
+        GetLiveParticleStates(simulation, states);
+        GetLiveParticleStates(reference, referenceStates);
+        if (!SameLiveParticleStates(states, referenceStates) || !std::is_sorted(simulation.GetAliveIndices(), simulation.GetAliveIndices() + simulation.GetAliveCount()))
+        {
+            result.nMismatchedFrameCount++;
+        }
+    }
+
+    result.nFinalSize = simulation.GetParticleBufferSize();
+    result.bPassed = result.nGrowCount > 0 && result.nMismatchedFrameCount == 0;
+    return result;
+}
+
+static bool CheckEmitterInvariants(const ParticleSimulationCPU& simulation)
+{
+    const ParticleRangeAllocator& rangeAllocator = simulation.GetRangeAllocator();
+    if (!rangeAllocator.IsConsistent() || rangeAllocator.GetCapacity() != simulation.GetParticleBufferSize())
+    {
+        return false;
+    }
+
+    const uint32_t* pAliveBegin = simulation.GetAliveIndices();
+    const uint32_t* pAliveEnd = pAliveBegin + simulation.GetAliveCount();
+    if (std::adjacent_find(pAliveBegin, pAliveEnd, [](uint32_t a, uint32_t b) { return a >= b; }) != pAliveEnd)
+    {
+        return false;
+    }
+
+    // With the alive list sorted, the particles of an emitter are one block of it and the blocks add up to the whole list
+    std::vector<uint32_t> emitters;
+    rangeAllocator.GetRangesInAddressOrder(emitters);
+    uint32_t nParticleCount = 0;
+    for (uint32_t nEmitter : emitters)
+    {
+        const ParticleRangeAllocator::Range& range = simulation.GetEmitterRange(nEmitter);
+        const uint32_t* pFirst = std::lower_bound(pAliveBegin, pAliveEnd, range.nBegin);
+        const uint32_t* pLast = std::lower_bound(pFirst, pAliveEnd, range.nBegin + range.nSize);
+        if (!simulation.IsEmitterValid(nEmitter) || simulation.GetEmitterParticleCount(nEmitter) != (uint32_t)(pLast - pFirst))
+        {
+            return false;
+        }
+        nParticleCount += (uint32_t)(pLast - pFirst);
+    }
+    return nParticleCount == simulation.GetAliveCount() && simulation.GetParticleCount() == simulation.GetAliveCount();
+}
+
+EmitterChurnValidationResult ValidateEmitterChurn(uint32_t nFrameCount, JobSystem* pJobSystem)
+{
+    std::mt19937 randomNumberEngine(7);
+    std::uniform_int_distribution<uint32_t> actionDistribution(0, 9);
+    std::uniform_int_distribution<uint32_t> capacityDistribution(16, 1024);
+    std::uniform_int_distribution<uint32_t> emitCountDistribution(0, 64);
+    std::uniform_real_distribution<float> positionDistribution(-0.8f, 0.8f);
+    std::uniform_real_distribution<float> lifetimeDistribution(0.1f, 1.0f);
+
+    ParticleSimulationCPU simulation(1024);
+    simulation.SetMaxParticleBufferSize(1 << 20);
+    simulation.SetJobSystem(pJobSystem);
+
+    // The default emitter keeps its particles, the others live for up to a second so their slots get reused
+    ParticleEmitterParams defaultParams;
+    defaultParams.m_fLifetime = -1.0f;
+    simulation.SetEmitterParams(ParticleSimulationCPU::DefaultEmitter, defaultParams);
+
+    EmitterChurnValidationResult result = {};
+    std::vector<uint32_t> emitters;
+    std::vector<LiveParticleState> statesBefore;
+    std::vector<LiveParticleState> statesAfter;
+    auto fnCheck = [&](bool bIntact)
+    {
+        result.nInvariantFailureCount += CheckEmitterInvariants(simulation) ? 0 : 1;
+        result.nDamagedStepCount += bIntact ? 0 : 1;
+    };
+
+    ParticleFrameConstants constants;
+    constants.m_fElapsedTime = 1.0f / 60.0f;
+    for (uint32_t iFrame = 0; iFrame < nFrameCount; iFrame++)
+    {
+        uint32_t nAction = actionDistribution(randomNumberEngine);
+        GetLiveParticleStates(simulation, statesBefore);
+        if (nAction < 3)
+        {
+            ParticleEmitterParams params;
+            params.m_Position = { positionDistribution(randomNumberEngine), positionDistribution(randomNumberEngine) };
+            params.m_fLifetime = lifetimeDistribution(randomNumberEngine);
+            if (simulation.CreateEmitter(params, capacityDistribution(randomNumberEngine)) != ParticleSimulationCPU::InvalidEmitter)
+            {
+                result.nCreatedCount++;
+            }
+            GetLiveParticleStates(simulation, statesAfter);
+            fnCheck(SameLiveParticleStates(statesBefore, statesAfter));
+        }
+        else if (nAction < 5)
+        {
+            simulation.GetRangeAllocator().GetRangesInAddressOrder(emitters);
+            uint32_t nEmitter = emitters[randomNumberEngine() % emitters.size()];
+            if (nEmitter != ParticleSimulationCPU::DefaultEmitter)
+            {
+                // Only the particles of the destroyed emitter go
+                ParticleRangeAllocator::Range range = simulation.GetEmitterRange(nEmitter);
+                GetLiveParticleStates(simulation, statesBefore, range);
+                simulation.DestroyEmitter(nEmitter);
+                GetLiveParticleStates(simulation, statesAfter);
+                fnCheck(SameLiveParticleStates(statesBefore, statesAfter));
+                result.nDestroyedCount++;
+            }
+        }
+        else if (nAction == 5)
+        {
+            simulation.Defragment();
+            GetLiveParticleStates(simulation, statesAfter);
+            fnCheck(SameLiveParticleStates(statesBefore, statesAfter));
+            result.nDefragmentCount++;
+        }
+
+        // Every emitter gets some particles, often more than its range has free, so the ranges grow, move and the pool grows
+        simulation.GetRangeAllocator().GetRangesInAddressOrder(emitters);
+        for (uint32_t nEmitter : emitters)
+        {
+            simulation.Emit(nEmitter, emitCountDistribution(randomNumberEngine) / (nEmitter == ParticleSimulationCPU::DefaultEmitter ? 8 : 1));
+        }
+
+        GetLiveParticleStates(simulation, statesBefore);
+        constants.m_nRandomSeed = iFrame;
+        simulation.Generate(constants);
+        GetLiveParticleStates(simulation, statesAfter);
+        fnCheck(std::includes(statesAfter.begin(), statesAfter.end(), statesBefore.begin(), statesBefore.end(),
+            [](const LiveParticleState& a, const LiveParticleState& b) { return std::memcmp(&a, &b, sizeof(LiveParticleState)) < 0; }));
+
+        simulation.Update(constants);
+        fnCheck(true);
+    }
+
+    result.nFinalParticleBufferSize = simulation.GetParticleBufferSize();
+    result.bPassed = result.nInvariantFailureCount == 0 && result.nDamagedStepCount == 0 && result.nCreatedCount > 0 &&
+        result.nDestroyedCount > 0 && result.nFinalParticleBufferSize > 1024;
+    return result;
+}
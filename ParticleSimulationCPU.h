@@ -0,0 +1,343 @@
+#pragma once
+
+// Headless CPU version of the particle simulation in ParticleCompute.hlsl.
+// Everything in here has to stay free of Windows and D3D12 headers so it can be built and profiled
+// on machines that don't have a GPU.
+
+#include "ParticleUpdateKernels.h"
+#include "JobSystem.h"
+#include "ParticleDeadList.h"
+#include "ParticleRangeAllocator.h"
+#include "ParticleSpatialHash.h"
+#include "ParticleQuadtree.h"
+#include "ParticleFluid.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct Float2
+{
+    float x;
+    float y;
+};
+
+struct Float4
+{
+    float x;
+    float y;
+    float z;
+    float w;
+};
+
+// Same layout as the perFrame cbuffer in ParticleCommon.hlsli
+struct ParticleFrameConstants
+{
+    uint32_t m_EmitCount = 0;
+    uint32_t m_nRandomSeed = 0;
+    float m_fElapsedTime = 0.0f;
+    uint32_t m_nEmitterCount = 0;
+    uint32_t m_nRelocationCount = 0;
+    float m_fCollisionStiffness = 0.0f;     // Zero turns the particle-particle collisions off
+    float m_fGravity = 0.0f;                // Zero turns the N-body gravity off, negative pushes the particles apart
+    float m_fFluidStiffness = 0.0f;         // Zero turns the SPH fluid off
+};
+
+// Spawn parameters of an emitter. The defaults give the same particles the single emitter used to.
+struct ParticleEmitterParams
+{
+    Float2 m_Position = { 0.0f, 0.0f };
+    Float2 m_Scale = { 0.01f, 0.01f };
+    Float4 m_Color = { 1.0f, 1.0f, 1.0f, 0.02f };  // The random color is multiplied with rgb, alpha is used as is
+    float m_fSpeed = 1.0f;                          // Both velocity components are random in [-m_fSpeed, m_fSpeed)
+    float m_fLifetime = -1.0f;                      // Negative lives forever
+    float m_padding[2] = {};
+};
+
+// Same layout as EmitterData in ParticleCommon.hlsli. The GPU gets one of these per emitter every frame, sorted by m_nRangeBegin.
+struct ParticleEmitterData
+{
+    ParticleEmitterParams m_Params;
+    uint32_t m_nEmitterIndex;   // Index of the emitter's particle counter
+    uint32_t m_nEmitOffset;     // Exclusive prefix sum of m_nEmitCount, the first emitting thread of this emitter
+    uint32_t m_nEmitCount;
+    uint32_t m_nRangeBegin;
+    uint32_t m_nRangeSize;
+    uint32_t m_padding;
+};
+
+// Same layout as ParticleRelocation in ParticleCommon.hlsli
+struct ParticleRelocationData
+{
+    uint32_t m_nSrcBegin;
+    uint32_t m_nDstBegin;
+    uint32_t m_nSize;
+    uint32_t m_padding;
+};
+
+// One vector per DX12Particles::ParticleBufferTypes entry, followed by the channels only the CPU simulation has
+struct ParticleStreams
+{
+    std::vector<Float2> Positions;
+    std::vector<Float2> Scales;
+    std::vector<Float2> Velocities;
+    std::vector<float>  Rotations;
+    std::vector<float>  Lifetimes;
+    std::vector<Float4> Colors;
+
+    // Written by the SPH fluid every step, see ParticleFluid.h
+    std::vector<float>  Densities;
+    std::vector<float>  Pressures;
+
+    void Resize(uint32_t nParticleCount);
+    uint32_t Size() const { return (uint32_t)Lifetimes.size(); }
+};
+
+class ParticleSimulationCPU
+{
+public:
+    // Number of particles a job processes at once. Small enough that a chunk of every stream fits in L2.
+    static const uint32_t ChunkSize = 4096;
+
+    // Every emitter owns a contiguous range of the pool and has its own dead list for it.
+    // The default emitter starts out with the whole pool and gets the m_EmitCount of the frame constants.
+    static const uint32_t DefaultEmitter = 0;
+    static const uint32_t InvalidEmitter = ParticleRangeAllocator::InvalidHandle;
+
+    explicit ParticleSimulationCPU(uint32_t nParticleBufferSize);
+
+    // Kills every particle and refills the dead lists with all the slots. The emitters stay.
+    void Reset();
+
+    // Fills every slot of the default emitter with a live particle the same way DX12Particles::CreateParticleBuffers does.
+    void SpawnGrid(uint32_t nRandomSeed);
+
+    // Makes room for nCapacity particles somewhere in the pool, defragmenting and growing it if it has to.
+    // Returns InvalidEmitter if the pool can't get big enough.
+    uint32_t CreateEmitter(const ParticleEmitterParams& params, uint32_t nCapacity);
+
+    // Kills the particles of the emitter right away and gives its range back. The default emitter can't be destroyed.
+    void DestroyEmitter(uint32_t nEmitter);
+
+    void SetEmitterParams(uint32_t nEmitter, const ParticleEmitterParams& params);
+    const ParticleEmitterParams& GetEmitterParams(uint32_t nEmitter) const     { return m_emitters[nEmitter].Params; }
+
+    // Queued until the next Generate, which emits for every emitter in one go. The emitter grows if it runs out of slots.
+    void Emit(uint32_t nEmitter, uint32_t nCount);
+
+    bool IsEmitterValid(uint32_t nEmitter) const;
+    uint32_t GetEmitterCount() const                { return (uint32_t)m_emitterOrder.size(); }
+    uint32_t GetEmitterParticleCount(uint32_t nEmitter) const   { return m_emitters[nEmitter].pDeadList->GetParticleCount(); }
+    const ParticleRangeAllocator::Range& GetEmitterRange(uint32_t nEmitter) const   { return m_rangeAllocator.GetRange(nEmitter); }
+    const ParticleRangeAllocator& GetRangeAllocator() const     { return m_rangeAllocator; }
+
+    // Closes the gaps between the emitter ranges, the live particles are moved in bulk.
+    void Defragment();
+
+    // The dead lists hand out the slots in whatever order the particles died, so after a while the particles next to each other
+    // in memory are all over the screen. This sorts the live particles of every emitter along a Z-order curve over the screen
+    // and packs them to the front of its range, so the binning and the rasterization read neighbors from the same cache lines.
+    // The particles keep everything but their slot: every stream, the alive list and the dead lists are permuted.
+    // The draw order follows the slots, so which of two overlapping particles ends up on top can change. The tile lists
+    // come out in Z-order too, and the particles at the front of a tile are all in one corner of it: once most pixels
+    // saturate, the rasterization looks at more particles before it stops, see BenchmarkParticleReorder.
+    void ReorderParticles();
+
+    // Runs ReorderParticles after every nInterval Simulate calls, zero never does. Off by default.
+    void SetReorderInterval(uint32_t nInterval)     { m_nReorderInterval = nInterval; m_nSimulateCountSinceReorder = 0; }
+    uint32_t GetReorderInterval() const             { return m_nReorderInterval; }
+
+    // Wall clock time of the last ReorderParticles
+    uint64_t GetReorderNanoseconds() const          { return m_nReorderNanoseconds; }
+
+    // What ReorderParticles sorts by: 16 bits of x and y each, interleaved, counted from the top left corner of the screen.
+    // Off screen positions are clamped to the edge, NaN counts as the top or the left edge.
+    static uint32_t GetMortonKey(const Float2& position);
+
+    // CPU versions of the compute passes. Simulate runs them in the order the frame graph dispatches them,
+    // followed by ReorderParticles when the reorder interval is up.
+    // Update builds the spatial hash and runs the collisions first if they are turned on in the frame constants,
+    // same for the quadtree and the gravity and for the SPH fluid.
+    void Generate(const ParticleFrameConstants& constants);
+    void Update(const ParticleFrameConstants& constants);
+    void Simulate(const ParticleFrameConstants& constants);
+
+    // Fixed timestep driver for the fluid, which blows up with big or uneven steps. Same tick format and the same rules
+    // as the fixed timestep mode of StepTimer, which can't be used here because of QueryPerformanceCounter:
+    // the elapsed time piles up and one Simulate runs for every whole step in it. A frame within a quarter millisecond
+    // of a step counts as exactly one step. The particles of the frame are emitted by the first step, a frame too short
+    // for a whole step keeps them until the next frame that runs one.
+    // More than nMaxStepCount steps worth of time get dropped instead of making the next frame even slower.
+    static const uint64_t TicksPerSecond = 10000000;
+    void SetFixedTimeStep(double fStepSeconds, uint32_t nMaxStepCount);
+    uint32_t SimulateFixedSteps(const ParticleFrameConstants& constants, uint64_t nElapsedTicks);
+
+    uint32_t GetParticleBufferSize() const          { return m_nParticleBufferSize; }
+
+    // Generate grows the pool geometrically when the dead list runs out of slots, up to this many particles.
+    // Defaults to the initial size, so nothing grows unless it's raised.
+    void SetMaxParticleBufferSize(uint32_t nMaxParticleBufferSize);
+    uint32_t GetMaxParticleBufferSize() const       { return m_nMaxParticleBufferSize; }
+
+    // Makes room for nParticleBufferSize particles. The new slots are free for any emitter to grow into,
+    // the live particles keep their slots and their data. Does nothing if the pool is already that big.
+    void Grow(uint32_t nParticleBufferSize);
+
+    // Number of live particles over every emitter, g_deadList[0] on the GPU.
+    uint32_t GetParticleCount() const               { return m_nAliveCount; }
+
+    // Dead list of the default emitter, the indices are relative to the start of its range.
+    const ParticleDeadList& GetDeadList() const     { return *m_emitters[DefaultEmitter].pDeadList; }
+
+    // Indices of the live particles in increasing order. The update only walks these, so its cost depends
+    // on how many particles are alive and not on the size of the pool. Always GetParticleCount() long.
+    const uint32_t* GetAliveIndices() const         { return m_aliveIndices.data(); }
+    uint32_t GetAliveCount() const                  { return m_nAliveCount; }
+
+    // Defaults to the widest instruction set the machine supports. Every choice gives the same results.
+    void SetInstructionSet(SimdInstructionSet instructionSet);
+    SimdInstructionSet GetInstructionSet() const    { return m_instructionSet; }
+
+    // Without a job system everything runs on the calling thread. The results are the same either way.
+    void SetJobSystem(JobSystem* pJobSystem)        { m_pJobSystem = pJobSystem; }
+
+    // The grid of the last Update that had the collisions turned on
+    const ParticleSpatialHash& GetSpatialHash() const   { return m_spatialHash; }
+
+    // Opening angle of the gravity traversal. Zero sums up every pair exactly, bigger is faster and less accurate.
+    void SetGravityTheta(float fTheta)              { m_fGravityTheta = fTheta; }
+    float GetGravityTheta() const                   { return m_fGravityTheta; }
+    const ParticleQuadtree& GetQuadtree() const     { return m_quadtree; }
+
+    void SetFluidParams(const ParticleFluidParams& params)  { m_fluid.SetParams(params); }
+    const ParticleFluid& GetFluid() const           { return m_fluid; }
+
+    ParticleStreams& GetStreams()                   { return m_streams; }
+    const ParticleStreams& GetStreams() const       { return m_streams; }
+
+    // Same hash the compute shader uses so the CPU and the GPU emit identical particles.
+    static float GetRandomNumber(uint32_t& seed);
+
+private:
+    struct Emitter
+    {
+        ParticleEmitterParams Params;
+        std::unique_ptr<ParticleDeadList> pDeadList;    // Null for unused emitter indices
+        uint32_t nPendingEmitCount = 0;
+    };
+
+    void GenerateNewParticle(const ParticleEmitterParams& params, uint32_t rndSeed, uint32_t nParticleIndex);
+    void ForEachChunk(uint32_t nCount, const JobSystem::RangeJob& fnJob);
+    void AddToAliveList(uint32_t* pIndices, uint32_t nCount);
+
+    // Tries the allocator first, then defragments, then grows the pool geometrically up to the maximum
+    bool ResizeEmitterRange(uint32_t nEmitter, uint32_t nNewSize);
+    bool GrowFreeSize(uint32_t nFreeSize);
+    void ApplyMoves(const std::vector<ParticleRangeAllocator::Move>& moves);
+    void UpdateEmitterOrder();
+
+    // Gives the dying particles back to the dead lists of their emitters. pIndices has to be sorted and gets
+    // overwritten with the indices inside the ranges.
+    void ReleaseToEmitters(uint32_t* pIndices, uint32_t nCount);
+
+    uint32_t m_nParticleBufferSize;
+    uint32_t m_nMaxParticleBufferSize;
+    ParticleStreams m_streams;
+
+    ParticleRangeAllocator m_rangeAllocator;
+    std::vector<Emitter> m_emitters;            // Indexed by the handle of the emitter's range
+    std::vector<uint32_t> m_emitterOrder;       // Live emitters by increasing range start
+
+    std::vector<uint32_t> m_emittedIndices;
+    std::vector<uint32_t> m_emitOffsetPerEmitter;       // Same as EmitterData::nEmitOffset, by m_emitterOrder
+    std::vector<uint32_t> m_reservedOffsetPerEmitter;   // Where the emitter's slots start in m_emittedIndices
+
+    SimdInstructionSet m_instructionSet;
+    JobSystem* m_pJobSystem = nullptr;
+
+    // Every chunk writes the particles that died into its own part of m_dyingIndices,
+    // they only get merged into the dead list once all the chunks are done.
+    std::vector<uint32_t> m_dyingIndices;
+    std::vector<uint32_t> m_releasedIndices;
+    std::vector<uint32_t> m_dyingCountPerChunk;
+    std::vector<uint32_t> m_dyingOffsetPerChunk;
+
+    // The survivors of the update get compacted into m_aliveIndicesScratch with a prefix sum over the
+    // per chunk counts, then the two lists are swapped. The dying indices are placed the same way.
+    std::vector<uint32_t> m_aliveIndices;
+    std::vector<uint32_t> m_aliveIndicesScratch;
+    std::vector<uint32_t> m_aliveOffsetPerChunk;
+    uint32_t m_nAliveCount = 0;
+
+    // ReorderParticles scratch, by alive list index: the keys and the slots sorted by them
+    std::vector<uint32_t> m_reorderKeys;
+    std::vector<uint32_t> m_reorderSlots;
+    std::vector<uint32_t> m_reorderKeyScratch;
+    std::vector<uint32_t> m_reorderSlotScratch;
+    // The streams get gathered in the new order into these first, one per element type
+    std::vector<Float2> m_reorderFloat2Scratch;
+    std::vector<float> m_reorderFloatScratch;
+    std::vector<Float4> m_reorderFloat4Scratch;
+    uint32_t m_nReorderInterval = 0;
+    uint32_t m_nSimulateCountSinceReorder = 0;
+    uint64_t m_nReorderNanoseconds = 0;
+
+    ParticleSpatialHash m_spatialHash;
+    ParticleQuadtree m_quadtree;
+    float m_fGravityTheta = 0.5f;
+    ParticleFluid m_fluid;
+
+    uint64_t m_nFixedStepTicks = TicksPerSecond / 240;
+    uint64_t m_nLeftOverTicks = 0;
+    uint32_t m_nPendingFixedStepEmitCount = 0;  // m_EmitCount of the SimulateFixedSteps calls that didn't run a step
+    uint32_t m_nMaxFixedStepCount = 8;
+};
+
+struct AliveListBenchmarkResult
+{
+    uint32_t nParticleBufferSize;
+    uint32_t nAliveCount;               // Before the first frame
+    uint32_t nFrameCount;
+    double fDenseMicroseconds;          // Per frame, UpdateParticles over every slot and the dead list release
+    double fAliveListMicroseconds;      // Per frame, ParticleSimulationCPU::Update over the alive list
+    bool bMatchesDense;                 // Same streams and the same number of live particles after the last frame
+};
+
+// Fills a pool of nParticleBufferSize slots to fOccupancy and updates it nFrameCount times both ways. The live particles
+// are either packed to the front of the pool, like after ReorderParticles, or spread over it at random, like after a while
+// of the dead list handing out slots. A fifth of them die over the frames, nothing is emitted.
+AliveListBenchmarkResult BenchmarkAliveList(SimdInstructionSet instructionSet, uint32_t nParticleBufferSize, float fOccupancy, bool bPacked, uint32_t nFrameCount, JobSystem* pJobSystem);
+
+struct PoolGrowthValidationResult
+{
+    uint32_t nInitialSize;
+    uint32_t nFinalSize;
+    uint32_t nGrowCount;                // Frames whose Generate grew the pool
+    uint32_t nMismatchedFrameCount;     // Frames whose live particles differ from the ones of the pool that started out big enough
+    bool bPassed;                       // Grew and never differed
+};
+
+// Emits nEmitCount particles a frame into a pool of nInitialSize slots that can grow as far as it needs to, and into one
+// that starts out with room for every frame. Both have to hold the same live particles after every frame,
+// the growing one just has them in other slots.
+PoolGrowthValidationResult ValidatePoolGrowth(uint32_t nInitialSize, uint32_t nEmitCount, uint32_t nFrameCount, JobSystem* pJobSystem);
+
+struct EmitterChurnValidationResult
+{
+    uint32_t nCreatedCount;             // Emitters created, destroyed and Defragment calls over the frames
+    uint32_t nDestroyedCount;
+    uint32_t nDefragmentCount;
+    uint32_t nFinalParticleBufferSize;
+    uint32_t nInvariantFailureCount;    // Steps after which the emitters and the alive list disagree, see ValidateEmitterChurn
+    uint32_t nDamagedStepCount;         // Steps that lost or changed a live particle they shouldn't have touched
+    bool bPassed;
+};
+
+// Creates, destroys, fills and defragments emitters at random for nFrameCount frames, starting from a small pool
+// that has to grow. After every step:
+//  - the allocator's ranges and free ranges tile the pool
+//  - the alive list is sorted and every index in it is inside the range of a live emitter
+//  - the particle count of every emitter is the number of its particles in the alive list
+// CreateEmitter, DestroyEmitter, Defragment and Generate can move particles around but not change them,
+// so the live particles they don't kill or emit have to come out the same.
+EmitterChurnValidationResult ValidateEmitterChurn(uint32_t nFrameCount, JobSystem* pJobSystem);
@@ -0,0 +1,313 @@
+#include "ParticleSpatialHash.h"
+#include "ParticleSimulationCPU.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+ParticleSpatialHash::ParticleSpatialHash(uint32_t nGridDim)
+{
+    SetGridDim(nGridDim);
+}
+
+void ParticleSpatialHash::SetGridDim(uint32_t nGridDim)
+{
+    m_nGridDim = std::max(nGridDim, 1u);
+    m_nCellCount = m_nGridDim * m_nGridDim;
+    m_nParticleCount = 0;
+
+    m_cellCounts.reset(new std::atomic<uint32_t>[m_nCellCount]);
+    for (uint32_t iCell = 0; iCell < m_nCellCount; iCell++)
+    {
+        m_cellCounts[iCell].store(0, std::memory_order_relaxed);
+    }
+    m_cellStarts.assign(m_nCellCount + 1, 0);
+}
+
+void ParticleSpatialHash::ForEachChunk(uint32_t nCount, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob)
+{
+    if (pJobSystem)
+    {
+        pJobSystem->ParallelFor(nCount, ChunkSize, fnJob);
+        return;
+    }
+
+    for (uint32_t nBegin = 0; nBegin < nCount; nBegin += ChunkSize)
+    {
+        fnJob(nBegin, std::min(nCount, nBegin + ChunkSize), 0);
+    }
+}
+
+uint32_t ParticleSpatialHash::GetCellKey(float x, float y) const
+{
+    // Same float math as GetHashCell in ParticleCompute.hlsl
+    const float fHalfGridDim = m_nGridDim * 0.5f;
+    const float fLastCell = m_nGridDim - 1.0f;
+    float fCellX = std::min(std::max((x + 1.0f) * fHalfGridDim, 0.0f), fLastCell);
+    float fCellY = std::min(std::max((y + 1.0f) * fHalfGridDim, 0.0f), fLastCell);
+    return (uint32_t)fCellY * m_nGridDim + (uint32_t)fCellX;
+}
+
+void ParticleSpatialHash::Build(const Float2* pPositions, const Float2* pScales, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    m_nParticleCount = nCount;
+    if (m_particleCells.size() < nCount)
+    {
+        m_particleCells.resize(nCount);
+        m_particleCellOffsets.resize(nCount);
+        m_sortedParticles.resize(nCount);
+    }
+
+    // CSHashCount: the key of every particle and its place in the cell
+    ForEachChunk(nCount, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            const Float2& position = pPositions[pIndices[i]];
+            uint32_t nCell = GetCellKey(position.x, position.y);
+            m_particleCells[i] = nCell;
+            m_particleCellOffsets[i] = m_cellCounts[nCell].fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    // CSHashScan: the counts are cleared for the next build on the way
+    uint32_t nOffset = 0;
+    for (uint32_t iCell = 0; iCell < m_nCellCount; iCell++)
+    {
+        m_cellStarts[iCell] = nOffset;
+        nOffset += m_cellCounts[iCell].exchange(0, std::memory_order_relaxed);
+    }
+    m_cellStarts[m_nCellCount] = nOffset;
+
+    // CSHashScatter. The largest radius is taken here instead of in the count like on the GPU, the reach is only needed by Collide.
+    // The radii aren't negative, so their bits order like the floats.
+    std::atomic<uint32_t> nMaxRadiusBits{ 0 };
+    ForEachChunk(nCount, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        float fChunkMaxRadius = 0.0f;
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            uint32_t nParticle = pIndices[i];
+            const Float2& position = pPositions[nParticle];
+
+            HashedParticle& hashedParticle = m_sortedParticles[m_cellStarts[m_particleCells[i]] + m_particleCellOffsets[i]];
+            hashedParticle.x = position.x;
+            hashedParticle.y = position.y;
+            hashedParticle.fRadius = pScales ? std::max(pScales[nParticle].x, pScales[nParticle].y) : 0.0f;
+            hashedParticle.nIndex = nParticle;
+            fChunkMaxRadius = std::max(fChunkMaxRadius, hashedParticle.fRadius);
+        }
+
+        uint32_t nChunkMaxRadiusBits;
+        memcpy(&nChunkMaxRadiusBits, &fChunkMaxRadius, sizeof(float));
+        uint32_t nCurrentBits = nMaxRadiusBits.load(std::memory_order_relaxed);
+        while (nCurrentBits < nChunkMaxRadiusBits && !nMaxRadiusBits.compare_exchange_weak(nCurrentBits, nChunkMaxRadiusBits, std::memory_order_relaxed))
+        {
+        }
+    });
+
+    // Same float math as CSHashScan
+    float fMaxRadius;
+    uint32_t nFinalMaxRadiusBits = nMaxRadiusBits.load();
+    memcpy(&fMaxRadius, &nFinalMaxRadiusBits, sizeof(float));
+    m_nQueryReach = (uint32_t)std::min(std::max(std::ceil(fMaxRadius * m_nGridDim), 1.0f), (float)m_nGridDim);
+
+    // Undo the order the atomics happened to give. The cells only hold a handful of particles, insertion sort is plenty.
+    ForEachChunk(m_nCellCount, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t iCell = nBegin; iCell < nEnd; iCell++)
+        {
+            HashedParticle* pCellBegin = m_sortedParticles.data() + m_cellStarts[iCell];
+            HashedParticle* pCellEnd = m_sortedParticles.data() + m_cellStarts[iCell + 1];
+            for (HashedParticle* pParticle = pCellBegin + 1; pParticle < pCellEnd; pParticle++)
+            {
+                HashedParticle particle = *pParticle;
+                HashedParticle* pInsert = pParticle;
+                while (pInsert > pCellBegin && (pInsert - 1)->nIndex > particle.nIndex)
+                {
+                    *pInsert = *(pInsert - 1);
+                    pInsert--;
+                }
+                *pInsert = particle;
+            }
+        }
+    });
+
+    m_nBuildNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+uint64_t ParticleSpatialHash::Collide(Float2* pVelocities, float fStiffness, float fElapsedTime, JobSystem* pJobSystem)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    const float fImpulseScale = fStiffness * fElapsedTime;
+    std::atomic<uint64_t> nPairCount{ 0 };
+
+    // CSCollide. The particles are walked in cell order, so neighbouring threads read the same cells.
+    ForEachChunk(m_nParticleCount, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        uint64_t nChunkPairCount = 0;
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            const HashedParticle particle = m_sortedParticles[i];
+            uint32_t nCell = GetCellKey(particle.x, particle.y);
+            uint32_t nCellX = nCell % m_nGridDim;
+            uint32_t nCellY = nCell / m_nGridDim;
+
+            uint32_t nFirstX = nCellX - std::min(nCellX, m_nQueryReach);
+            uint32_t nLastX = std::min(nCellX + m_nQueryReach, m_nGridDim - 1);
+            uint32_t nFirstY = nCellY - std::min(nCellY, m_nQueryReach);
+            uint32_t nLastY = std::min(nCellY + m_nQueryReach, m_nGridDim - 1);
+
+            float fImpulseX = 0.0f;
+            float fImpulseY = 0.0f;
+            for (uint32_t nY = nFirstY; nY <= nLastY; nY++)
+            {
+                // The cells of a row are one contiguous run
+                uint32_t nRowBegin = m_cellStarts[nY * m_nGridDim + nFirstX];
+                uint32_t nRowEnd = m_cellStarts[nY * m_nGridDim + nLastX + 1];
+                for (uint32_t j = nRowBegin; j < nRowEnd; j++)
+                {
+                    const HashedParticle& other = m_sortedParticles[j];
+                    float fDx = particle.x - other.x;
+                    float fDy = particle.y - other.y;
+                    float fDistanceSq = fDx * fDx + fDy * fDy;
+                    float fRadiusSum = particle.fRadius + other.fRadius;
+
+                    // Particles right on top of each other have no direction to push in, that includes the particle itself
+                    if (fDistanceSq < fRadiusSum * fRadiusSum && fDistanceSq > 0.0f)
+                    {
+                        float fDistance = std::sqrt(fDistanceSq);
+                        float fPush = (fRadiusSum - fDistance) / (fRadiusSum * fDistance);
+                        fImpulseX += fDx * fPush;
+                        fImpulseY += fDy * fPush;
+                        nChunkPairCount++;
+                    }
+                }
+            }
+
+            Float2& velocity = pVelocities[particle.nIndex];
+            velocity.x += fImpulseX * fImpulseScale;
+            velocity.y += fImpulseY * fImpulseScale;
+        }
+        nPairCount.fetch_add(nChunkPairCount, std::memory_order_relaxed);
+    });
+
+    m_nQueryNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    return nPairCount.load();
+}
+
+SpatialHashBenchmarkResult BenchmarkSpatialHash(uint32_t nParticleCount, uint32_t nIterationCount, JobSystem* pJobSystem)
+{
+    std::mt19937 randomNumberEngine(42);
+    std::uniform_real_distribution<float> positionDistribution(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> velocityDistribution(-0.5f, 0.5f);
+
+    std::vector<Float2> positions(nParticleCount);
+    std::vector<Float2> scales(nParticleCount, Float2{ 0.01f, 0.01f });
+    std::vector<Float2> velocities(nParticleCount);
+    std::vector<uint32_t> indices(nParticleCount);
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        positions[i] = { positionDistribution(randomNumberEngine), positionDistribution(randomNumberEngine) };
+        velocities[i] = { velocityDistribution(randomNumberEngine), velocityDistribution(randomNumberEngine) };
+        indices[i] = i;
+    }
+
+    const float fElapsedTime = 1.0f / 60.0f;
+    ParticleSpatialHash spatialHash;
+
+    SpatialHashBenchmarkResult result = {};
+    result.nParticleCount = nParticleCount;
+    result.nIterationCount = nIterationCount;
+
+    uint64_t nBuildNanoseconds = 0;
+    uint64_t nQueryNanoseconds = 0;
+    for (uint32_t iIteration = 0; iIteration < nIterationCount; iIteration++)
+    {
+        spatialHash.Build(positions.data(), scales.data(), indices.data(), nParticleCount, pJobSystem);
+        result.nPairCount = spatialHash.Collide(velocities.data(), HASH_COLLISION_STIFFNESS, fElapsedTime, pJobSystem);
+        nBuildNanoseconds += spatialHash.GetBuildNanoseconds();
+        nQueryNanoseconds += spatialHash.GetQueryNanoseconds();
+
+        // Not timed, only there so the next build doesn't get the same, already cached layout
+        for (uint32_t i = 0; i < nParticleCount; i++)
+        {
+            positions[i].x = std::min(std::max(positions[i].x + velocities[i].x * fElapsedTime, -1.0f), 1.0f);
+            positions[i].y = std::min(std::max(positions[i].y + velocities[i].y * fElapsedTime, -1.0f), 1.0f);
+        }
+    }
+
+    if (nIterationCount > 0)
+    {
+        result.fBuildMilliseconds = (double)nBuildNanoseconds / nIterationCount / 1000000.0;
+        result.fQueryMilliseconds = (double)nQueryNanoseconds / nIterationCount / 1000000.0;
+    }
+    return result;
+}
+
+SpatialHashValidationResult ValidateSpatialHash(uint32_t nParticleCount, float fScale, JobSystem* pJobSystem)
+{
+    std::mt19937 randomNumberEngine(7);
+    std::uniform_real_distribution<float> positionDistribution(-1.0f, 1.0f);
+
+    std::vector<Float2> positions(nParticleCount);
+    std::vector<Float2> scales(nParticleCount);
+    std::vector<Float2> velocities(nParticleCount, Float2{ 0.0f, 0.0f });
+    std::vector<uint32_t> indices(nParticleCount);
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        positions[i] = { positionDistribution(randomNumberEngine), positionDistribution(randomNumberEngine) };
+        float fParticleScale = i % 20 == 0 ? fScale * 4.0f : fScale;
+        scales[i] = { fParticleScale, fParticleScale * 0.5f };
+        indices[i] = i;
+    }
+    std::shuffle(indices.begin(), indices.end(), randomNumberEngine);
+
+    const float fElapsedTime = 1.0f / 60.0f;
+    ParticleSpatialHash spatialHash;
+    spatialHash.Build(positions.data(), scales.data(), indices.data(), nParticleCount, pJobSystem);
+
+    SpatialHashValidationResult result = {};
+    result.nQueryReach = spatialHash.GetQueryReach();
+    result.nPairCount = spatialHash.Collide(velocities.data(), HASH_COLLISION_STIFFNESS, fElapsedTime, pJobSystem);
+
+    // Same push as Collide, the sums only differ in their order
+    const float fImpulseScale = HASH_COLLISION_STIFFNESS * fElapsedTime;
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        float fImpulseX = 0.0f;
+        float fImpulseY = 0.0f;
+        float fImpulseLength = 0.0f;
+        for (uint32_t j = 0; j < nParticleCount; j++)
+        {
+            float fDx = positions[i].x - positions[j].x;
+            float fDy = positions[i].y - positions[j].y;
+            float fDistanceSq = fDx * fDx + fDy * fDy;
+            float fRadiusSum = std::max(scales[i].x, scales[i].y) + std::max(scales[j].x, scales[j].y);
+            if (fDistanceSq < fRadiusSum * fRadiusSum && fDistanceSq > 0.0f)
+            {
+                float fDistance = std::sqrt(fDistanceSq);
+                float fPush = (fRadiusSum - fDistance) / (fRadiusSum * fDistance);
+                fImpulseX += fDx * fPush;
+                fImpulseY += fDy * fPush;
+                fImpulseLength += fDistance * fPush;
+                result.nBruteForcePairCount++;
+            }
+        }
+
+        // The rounding of the sums grows with the pushes that went into them
+        float fTolerance = fImpulseLength * fImpulseScale * 1e-5f + 1e-7f;
+        if (std::fabs(velocities[i].x - fImpulseX * fImpulseScale) > fTolerance || std::fabs(velocities[i].y - fImpulseY * fImpulseScale) > fTolerance)
+        {
+            result.nMismatchedVelocityCount++;
+        }
+    }
+
+    result.bPassed = result.nPairCount == result.nBruteForcePairCount && result.nMismatchedVelocityCount == 0;
+    return result;
+}
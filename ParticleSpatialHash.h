@@ -0,0 +1,120 @@
+#pragma once
+
+// Uniform grid spatial hash for the particle-particle collisions, rebuilt from scratch every frame.
+// The CPU side of the CSHash* and CSCollide passes, with the same grid and the same steps:
+//  - every live particle gets the key of its cell and its place in that cell from an atomic counter
+//  - an exclusive prefix sum over the cell counts gives the start of every cell
+//  - the particles are scattered into cell order, along with a copy of their positions and radii
+// The cells of a row are next to each other in the sorted order, so the neighbour query reads one contiguous run
+// per row instead of scattered cells. It reaches as many cells out as the biggest particle of the build needs,
+// 3x3 cells for particles up to half a cell and more for bigger ones.
+//
+// The GPU keeps the order the atomics hand out inside a cell. Here the cells get sorted by particle index
+// afterwards, so the collisions give the same bits no matter how many threads built the grid.
+//
+// The grid always covers [-1, 1] on both axes. The collisions use HASH_GRID_DIM like the GPU does,
+// other users (the SPH neighbour search) pick a grid that gives cells as big as their search radius.
+
+#include "JobSystem.h"
+#include "SpatialHashConstants.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct Float2;
+
+// Same layout as HashedParticle in ParticleCommon.hlsli
+struct HashedParticle
+{
+    float x;
+    float y;
+    float fRadius;
+    uint32_t nIndex;    // Index of the particle in the streams
+};
+
+class ParticleSpatialHash
+{
+public:
+    // Number of particles a job processes at once, same as ParticleSimulationCPU::ChunkSize
+    static const uint32_t ChunkSize = 4096;
+
+    explicit ParticleSpatialHash(uint32_t nGridDim = HASH_GRID_DIM);
+
+    // Drops the current grid, the next Build uses nGridDim x nGridDim cells
+    void SetGridDim(uint32_t nGridDim);
+    uint32_t GetGridDim() const                         { return m_nGridDim; }
+    float GetCellSize() const                           { return 2.0f / m_nGridDim; }
+
+    // Sorts the particles in pIndices[0, nCount) by cell. The radius of a particle is the bigger half extent of its scale,
+    // without scales every radius is zero.
+    // Without a job system everything runs on the calling thread.
+    void Build(const Float2* pPositions, const Float2* pScales, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem);
+
+    // Pushes the overlapping particles of the last Build apart. The push grows linearly with the overlap.
+    // Every particle only writes its own velocity and the positions come from the sorted copies, so it can run in place.
+    // Returns the number of overlapping pairs, both particles of a pair count it.
+    uint64_t Collide(Float2* pVelocities, float fStiffness, float fElapsedTime, JobSystem* pJobSystem);
+
+    // Cells the query of the last Build looks out on every side, the same as HASH_START_QUERY_REACH on the GPU
+    uint32_t GetQueryReach() const                      { return m_nQueryReach; }
+
+    // The cell the position falls in, positions outside the grid go to the closest cell on the border
+    uint32_t GetCellKey(float x, float y) const;
+
+    // Cell count + 1 entries, the particles of cell i are GetSortedParticles()[GetCellStarts()[i], GetCellStarts()[i + 1])
+    const uint32_t* GetCellStarts() const               { return m_cellStarts.data(); }
+    const HashedParticle* GetSortedParticles() const    { return m_sortedParticles.data(); }
+    uint32_t GetParticleCount() const                   { return m_nParticleCount; }
+
+    // Wall clock time of the last Build and Collide
+    uint64_t GetBuildNanoseconds() const                { return m_nBuildNanoseconds; }
+    uint64_t GetQueryNanoseconds() const                { return m_nQueryNanoseconds; }
+
+private:
+    void ForEachChunk(uint32_t nCount, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob);
+
+    uint32_t m_nGridDim = 0;
+    uint32_t m_nCellCount = 0;
+    uint32_t m_nParticleCount = 0;
+    uint32_t m_nQueryReach = 1;
+
+    // Key and place inside the cell of every particle, in the order of the input indices
+    std::vector<uint32_t> m_particleCells;
+    std::vector<uint32_t> m_particleCellOffsets;
+
+    std::unique_ptr<std::atomic<uint32_t>[]> m_cellCounts;
+    std::vector<uint32_t> m_cellStarts;
+    std::vector<HashedParticle> m_sortedParticles;
+
+    uint64_t m_nBuildNanoseconds = 0;
+    uint64_t m_nQueryNanoseconds = 0;
+};
+
+struct SpatialHashBenchmarkResult
+{
+    uint32_t nParticleCount;
+    uint32_t nIterationCount;
+    double fBuildMilliseconds;      // Averages over the iterations
+    double fQueryMilliseconds;
+    uint64_t nPairCount;            // Overlapping pairs found by the last iteration
+};
+
+// Builds the hash and runs the collisions nIterationCount times over nParticleCount particles spread evenly
+// over the grid with the default scale, moving them a little between the iterations like a running simulation would.
+SpatialHashBenchmarkResult BenchmarkSpatialHash(uint32_t nParticleCount, uint32_t nIterationCount, JobSystem* pJobSystem);
+
+struct SpatialHashValidationResult
+{
+    uint32_t nQueryReach;
+    uint64_t nPairCount;                // What Collide returned
+    uint64_t nBruteForcePairCount;      // Overlapping pairs over every pair of particles, both particles count them too
+    uint32_t nMismatchedVelocityCount;  // Particles whose velocity change is off from the brute force one by more than rounding
+    bool bPassed;
+};
+
+// Runs Build and Collide once over nParticleCount particles spread evenly over the grid and checks the pairs and the
+// velocity changes against a test of every pair of particles. The particles have a scale of fScale, every twentieth
+// one four times that, so the query has to reach further than the cells around the small ones.
+SpatialHashValidationResult ValidateSpatialHash(uint32_t nParticleCount, float fScale, JobSystem* pJobSystem);
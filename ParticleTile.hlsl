@@ -1,20 +1,24 @@
 #include "ParticleCommon.hlsli"
 #include "TileConstants.h"
+#include "GroupPrefixSum.hlsli"
 
-[numthreads(1, 1, 1)]
-void CSResetTileOffsetCounter(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
-{
-    g_offsetCounter[0] = 0;
-}
+#define RADIX_SORT_GROUP_SIZE TILE_SORT_GROUP_SIZE
+#define RADIX_SORT_MAX_COUNT MAX_PARTICLE_PER_TILE
+#include "GroupRadixSort.hlsli"
 
 RWTexture2D<float4> g_OutputTexture : register(u5);
 
 
 groupshared uint gs_nParticleCountForCurrentTile;
-groupshared uint gs_nParticleCountTotal;
-groupshared uint gs_nOriginalValue;
 groupshared uint gs_aParticleIndices[MAX_PARTICLE_PER_TILE];
 
+groupshared uint gs_nSpilledTileCount;
+groupshared uint gs_nOverflowEntryCount;
+groupshared uint gs_nLargestTileCount;
+
+groupshared uint gs_nSaturatedPixelCount;
+groupshared uint gs_nBinnedParticleCount;
+
 // For debugging purposes
 void BubbleSort()
 {
@@ -77,264 +81,471 @@ void BitonicSort(in uint localIdxFlattened)
     }
 }
 
-[numthreads(MAX_PARTICLE_PER_TILE / COLLECT_PARTICLE_COUNT_PER_THREAD, 1, 1)]
-void CSCollectParticles(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+// Tile binning, same steps as ParticleTileBinner on the CPU: every particle counts itself into the tiles it covers,
+// a scan over the tile counts gives the start of every tile's list, every particle writes itself into its tiles,
+// and finally every tile sorts its list. The tiles never look at the particles that aren't theirs.
+// The per particle passes run over the alive list of the buffer that gets rasterized.
+
+// Same float math as ParticleTileBinner::GetTileRect. xy is the first tile, zw the last one, both inclusive.
+bool GetParticleTileRect(float2 pos, float2 scale, float rotate, out int4 rect)
+{
+    float rotSin, rotCos;
+    sincos(rotate, rotSin, rotCos);
+    float2 halfSize = float2(abs(rotCos) * scale.x + abs(rotSin) * scale.y, abs(rotSin) * scale.x + abs(rotCos) * scale.y);
+
+    // Clip space to pixels, y flips
+    float2 minPx = float2(pos.x - halfSize.x + 1.0f, 1.0f - pos.y - halfSize.y) * 0.5f * (float2)g_Resolution;
+    float2 maxPx = float2(pos.x + halfSize.x + 1.0f, 1.0f - pos.y + halfSize.y) * 0.5f * (float2)g_Resolution;
+
+    float2 firstTile = floor(minPx / TILE_SIZE_IN_PIXELS);
+    float2 lastTile = ceil(maxPx / TILE_SIZE_IN_PIXELS) - 1.0f;
+    float2 tileCount = float2(TILE_COUNT(g_Resolution.x), TILE_COUNT(g_Resolution.y));
+
+    // Clamped as floats first, far away particles don't fit into an int
+    rect.xy = (int2)max(firstTile, 0.0f);
+    rect.zw = (int2)min(lastTile, tileCount - 1.0f);
+    return all(lastTile >= 0.0f) && all(rect.xy <= rect.zw);
+}
+
+// Same as ParticleTileBinner::OverlapsTile. The tile's axes were taken care of by the rect, only the particle's two are left.
+bool ParticleOverlapsTile(float2 pos, float2 scale, float rotate, int2 tile)
 {
-    // Resetting the counters
-    if (GTid.x == 0)
+#ifdef DISABLE_ROTATION
+    return true;
+#else
+    float2 tileHalfSize = TILE_SIZE_IN_PIXELS / (float2)g_Resolution;
+    float2 tileCenter = float2((tile.x * 2 + 1) * tileHalfSize.x - 1.0f, 1.0f - (tile.y * 2 + 1) * tileHalfSize.y);
+
+    float rotSin, rotCos;
+    sincos(rotate, rotSin, rotCos);
+    float2 delta = tileCenter - pos;
+
+    float2 distance = abs(float2(delta.x * rotCos + delta.y * rotSin, delta.y * rotCos - delta.x * rotSin));
+    float2 reach = scale + float2(tileHalfSize.x * abs(rotCos) + tileHalfSize.y * abs(rotSin), tileHalfSize.x * abs(rotSin) + tileHalfSize.y * abs(rotCos));
+    return all(distance <= reach);
+#endif
+}
+
+[numthreads(TILE_BIN_GROUP_SIZE, 1, 1)]
+void CSTileCount(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    if (DTid.x >= g_aliveListIn[0])
     {
-        gs_nParticleCountForCurrentTile = 0;
-        gs_nParticleCountTotal = g_deadList[0];
+        return;
     }
 
-    GroupMemoryBarrierWithGroupSync();
+    uint nParticle = g_aliveListIn[1 + DTid.x];
+    float2 pos = g_particlePositions[nParticle];
+    float2 scale = g_particleScales[nParticle];
+    float rotate = g_particleRotations[nParticle];
+
+    int4 rect;
+    if (!GetParticleTileRect(pos, scale, rotate, rect))
+    {
+        return;
+    }
 
-    // Culling the particles using the Separating Axis Theorem
-    uint2 tileTopLeftPointPx = uint2(TILE_SIZE_IN_PIXELS.xx) * Gid.xy;
-    uint2 tileBottomRightPointPx = tileTopLeftPointPx + uint2(TILE_SIZE_IN_PIXELS.xx);
-    
-    float2 topLeft = ((float2)tileTopLeftPointPx / g_Resolution) * float2(2, -2) - float2(1, -1);
-    float2 bottomRight = ((float2)tileBottomRightPointPx / g_Resolution) * float2(2, -2) - float2(1, -1);
+    uint nTileCountX = TILE_COUNT(g_Resolution.x);
+    for (int nY = rect.y; nY <= rect.w; nY++)
+    {
+        for (int nX = rect.x; nX <= rect.z; nX++)
+        {
+            if (ParticleOverlapsTile(pos, scale, rotate, int2(nX, nY)))
+            {
+                InterlockedAdd(g_tileParticleCounts[nY * nTileCountX + nX], 1);
+            }
+        }
+    }
+}
 
-	float2 tileCorners[4];
-	tileCorners[0] = topLeft;
-	tileCorners[1] = float2(bottomRight.x, topLeft.y);
-	tileCorners[2] = bottomRight;
-	tileCorners[3] = float2(topLeft.x, bottomRight.y);
+// Dispatched with a single group like CSCompactScanGroups, so it works for any number of tiles.
+// The tiles keep every particle as long as the lists fit into TILE_LIST_CAPACITY, the tiles past it are cut short.
+// The tiles over MAX_PARTICLE_PER_TILE go to the spill list for CSTileSortSpill, and the counters of the frame are written.
+// The tiles left with particles go to the work list in row major order, a second scan gives every thread its place in it,
+// and the dispatch arguments of CSRasterizeParticles are written for it.
+// The counts are cleared so CSTileScatter can count the places in the lists from zero.
+[numthreads(COMPACTION_GROUP_SIZE, 1, 1)]
+void CSTileScan(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    uint nTileCountX = TILE_COUNT(g_Resolution.x);
+    uint nTileCount = nTileCountX * TILE_COUNT(g_Resolution.y);
+    uint nTilesPerThread = (nTileCount + COMPACTION_GROUP_SIZE - 1) / COMPACTION_GROUP_SIZE;
+    uint nFirstTile = min(GI * nTilesPerThread, nTileCount);
+    uint nLastTile = min(nFirstTile + nTilesPerThread, nTileCount);
+    uint nCapacity = TILE_LIST_CAPACITY(nTileCount);
+
+    if (GI == 0)
+    {
+        gs_nSpilledTileCount = 0;
+        gs_nOverflowEntryCount = 0;
+        gs_nLargestTileCount = 0;
+    }
 
-    uint iCorner = 0;
+    uint nCount = 0;
+    for (uint iTile = nFirstTile; iTile < nLastTile; iTile++)
+    {
+        nCount += g_tileParticleCounts[iTile];
+    }
 
-    uint nParticlePerThread = ceil((float)gs_nParticleCountTotal / (MAX_PARTICLE_PER_TILE / COLLECT_PARTICLE_COUNT_PER_THREAD));
+    // The scan syncs the group, the group shared counters are cleared after it
+    uint nOffset = GroupExclusivePrefixSum(nCount, GI);
 
-#ifdef INTERLEAVED_PARTICLE_COLLECTION
-    for (uint iLoop = 0; iLoop < nParticlePerThread; iLoop++)
+    uint nOccupiedCount = 0;
+    uint nOccupiedOffset = nOffset;
+    for (uint iOccupiedTile = nFirstTile; iOccupiedTile < nLastTile; iOccupiedTile++)
     {
-        uint iParticle = GTid.x + iLoop * (MAX_PARTICLE_PER_TILE / COLLECT_PARTICLE_COUNT_PER_THREAD);
-#else
-    // @Performance: Apparently it's a good idea to have the threads work on interleaved data so that cache coherence improves as the warp is lockstepping
-    uint nParticleStartIndex = nParticlePerThread * GTid.x;
-    uint nParticleEndIndex = nParticleStartIndex + nParticlePerThread;
-    nParticleEndIndex = min(nParticleEndIndex, gs_nParticleCountTotal);
-    
-    for (uint iParticle = nParticleStartIndex; iParticle < nParticleEndIndex; iParticle++)
+        uint nTileParticleCount = g_tileParticleCounts[iOccupiedTile];
+        nOccupiedCount += min(nTileParticleCount, nCapacity - min(nOccupiedOffset, nCapacity)) > 0 ? 1 : 0;
+        nOccupiedOffset += nTileParticleCount;
+    }
+    uint nWorkListPlace = GroupExclusivePrefixSum(nOccupiedCount, GI);
+
+    for (uint iOffsetTile = nFirstTile; iOffsetTile < nLastTile; iOffsetTile++)
     {
-#endif
-        PosVelo particle = g_bufPosVelo[iParticle];
-        float2 p = particle.pos.xy;
-
-		float rotate = particle.rotate.x;
-		float rotSin, rotCos;
-		sincos(rotate, rotSin, rotCos);
-
-		// Note the scale parameter means the half size
-		float2 particleTopLeft = p - particle.scale.xy;
-		float2 particleBottomRight = p + particle.scale.xy;
-
-		// Particle corners in cw order
-		float2 particleCorners[4];
-		particleCorners[0] = particleTopLeft;
-		particleCorners[1] = float2(particleBottomRight.x, particleTopLeft.y);
-		particleCorners[2] = particleBottomRight;
-		particleCorners[3] = float2(particleTopLeft.x, particleBottomRight.y);
-
-		for (iCorner = 0; iCorner < 4; iCorner++)
-		{
-			float2 originalPosition = particleCorners[iCorner] - p;
-			particleCorners[iCorner].x = originalPosition.x * rotCos - originalPosition.y * rotSin;
-			particleCorners[iCorner].y = originalPosition.x * rotSin + originalPosition.y * rotCos;
-            particleCorners[iCorner] += p;
-		}
-
-		bool bTileAxisX = false;
-		bool bTileAxisY = false;
-
-		bool bParticleAxisX = false;
-		bool bParticleAxisY = false;
-
-		{
-			// Check with the tile's axis (which is just the xy coordinates)
-			// The y min value is in the bottomRight because it goes from bottom up
-			float2 tilePosMin = float2(topLeft.x, bottomRight.y);
-			float2 tilePosMax = float2(bottomRight.x, topLeft.y);
-
-			float2 particlePosMin = min(min(particleCorners[0], particleCorners[1]), min(particleCorners[2], particleCorners[3]));
-			float2 particlePosMax = max(max(particleCorners[0], particleCorners[1]), max(particleCorners[2], particleCorners[3]));
-
-			bTileAxisX = particlePosMin.x <= tilePosMax.x && tilePosMin.x <= particlePosMax.x;
-			bTileAxisY = particlePosMin.y <= tilePosMax.y && tilePosMin.y <= particlePosMax.y;
-		}
-
-#ifndef DISABLE_ROTATION
-		{
-			// Now check the particle's axises
-
-			// They actually dont have to be normalized
-			// Alternatively we could generate these directly from the rotSin and rotCos
-			float2 normal1 = particleCorners[0] - particleCorners[1];
-			float2 normal2 = particleCorners[1] - particleCorners[2];
-
-			float2 tileCornersProjected[4];
-			for (iCorner = 0; iCorner < 4; iCorner++)
-			{
-				tileCornersProjected[iCorner] = float2(dot(tileCorners[iCorner], normal1), dot(tileCorners[iCorner], normal2));
-			}
-
-			float2 particleCornersProjected[4];
-			for (iCorner = 0; iCorner < 4; iCorner++)
-			{
-				particleCornersProjected[iCorner] = float2(dot(particleCorners[iCorner], normal1), dot(particleCorners[iCorner], normal2));
-			}
-
-			float2 tilePosMin = min(min(tileCornersProjected[0], tileCornersProjected[1]), min(tileCornersProjected[2], tileCornersProjected[3]));
-			float2 tilePosMax = max(max(tileCornersProjected[0], tileCornersProjected[1]), max(tileCornersProjected[2], tileCornersProjected[3]));
-
-			float2 particlePosMin = min(min(particleCornersProjected[0], particleCornersProjected[1]), min(particleCornersProjected[2], particleCornersProjected[3]));
-			float2 particlePosMax = max(max(particleCornersProjected[0], particleCornersProjected[1]), max(particleCornersProjected[2], particleCornersProjected[3]));
-
-			bParticleAxisX = particlePosMin.x <= tilePosMax.x && tilePosMin.x <= particlePosMax.x;
-			bParticleAxisY = particlePosMin.y <= tilePosMax.y && tilePosMin.y <= particlePosMax.y;
-		}
-#else
-        bParticleAxisX = true;
-        bParticleAxisY = true;
-#endif
+        uint nTileParticleCount = g_tileParticleCounts[iOffsetTile];
+        uint nStoredCount = min(nTileParticleCount, nCapacity - min(nOffset, nCapacity));
+        g_offsetPerTiles[uint2(iOffsetTile % nTileCountX, iOffsetTile / nTileCountX)] = uint2(nOffset, nStoredCount);
+        g_tileParticleCounts[iOffsetTile] = 0;
+        nOffset += nTileParticleCount;
 
+        if (nStoredCount > 0)
+        {
+            g_offsetCounter[TILE_WORK_LIST_START + nWorkListPlace] = iOffsetTile;
+            nWorkListPlace++;
+        }
+
+        InterlockedMax(gs_nLargestTileCount, nTileParticleCount);
+        if (nStoredCount > MAX_PARTICLE_PER_TILE)
+        {
+            uint nSpill;
+            InterlockedAdd(gs_nSpilledTileCount, 1, nSpill);
+            InterlockedAdd(gs_nOverflowEntryCount, nStoredCount - MAX_PARTICLE_PER_TILE);
+            g_offsetCounter[TILE_SPILL_LIST_START(nTileCount) + nSpill] = iOffsetTile;
+        }
+    }
+
+    GroupMemoryBarrierWithGroupSync();
+
+    // The last thread ends up with the total
+    if (GI == COMPACTION_GROUP_SIZE - 1)
+    {
+        g_offsetCounter[TILE_COUNTER_LIST_ENTRIES] = min(nOffset, nCapacity);
+        g_offsetCounter[TILE_COUNTER_SPILLED_TILES] = gs_nSpilledTileCount;
+        g_offsetCounter[TILE_COUNTER_OVERFLOW_ENTRIES] = gs_nOverflowEntryCount;
+        g_offsetCounter[TILE_COUNTER_DROPPED_ENTRIES] = nOffset - min(nOffset, nCapacity);
+        g_offsetCounter[TILE_COUNTER_LARGEST_TILE] = gs_nLargestTileCount;
+        g_offsetCounter[TILE_COUNTER_SATURATED_PIXELS] = 0;
+        g_offsetCounter[TILE_COUNTER_BINNED_PARTICLES] = 0;
+        g_offsetCounter[TILE_COUNTER_OCCUPIED_TILES] = nWorkListPlace;
+
+        g_dispatchArgs[DISPATCH_ARGS_TILE_RASTER + 0] = min(nWorkListPlace, TILE_RASTER_DISPATCH_MAX_GROUPS);
+        g_dispatchArgs[DISPATCH_ARGS_TILE_RASTER + 1] = (nWorkListPlace + TILE_RASTER_DISPATCH_MAX_GROUPS - 1) / TILE_RASTER_DISPATCH_MAX_GROUPS;
+        g_dispatchArgs[DISPATCH_ARGS_TILE_RASTER + 2] = 1;
+    }
+}
+
+// Also counts the particles on the screen for the tile size policy, once per group. No thread can leave early for that.
+[numthreads(TILE_BIN_GROUP_SIZE, 1, 1)]
+void CSTileScatter(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    if (GI == 0)
+    {
+        gs_nBinnedParticleCount = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
 
-        if(bTileAxisX && bTileAxisY && bParticleAxisX && bParticleAxisY)
+    if (DTid.x < g_aliveListIn[0])
+    {
+        uint nParticle = g_aliveListIn[1 + DTid.x];
+        float2 pos = g_particlePositions[nParticle];
+        float2 scale = g_particleScales[nParticle];
+        float rotate = g_particleRotations[nParticle];
+
+        int4 rect;
+        if (GetParticleTileRect(pos, scale, rotate, rect))
         {
-            uint nPrevCount;
-            InterlockedAdd(gs_nParticleCountForCurrentTile, 1, nPrevCount);
-            if (nPrevCount > MAX_PARTICLE_PER_TILE)
+            InterlockedAdd(gs_nBinnedParticleCount, 1);
+
+            uint nTileCountX = TILE_COUNT(g_Resolution.x);
+            for (int nY = rect.y; nY <= rect.w; nY++)
             {
-                gs_nParticleCountForCurrentTile = MAX_PARTICLE_PER_TILE;
-                break;
+                for (int nX = rect.x; nX <= rect.z; nX++)
+                {
+                    if (ParticleOverlapsTile(pos, scale, rotate, int2(nX, nY)))
+                    {
+                        uint2 offsetAndCount = g_offsetPerTiles[uint2(nX, nY)];
+                        uint nPlace;
+                        InterlockedAdd(g_tileParticleCounts[nY * nTileCountX + nX], 1, nPlace);
+                        if (nPlace < offsetAndCount.y)
+                        {
+                            g_particleIndicesForTiles[offsetAndCount.x + nPlace] = nParticle;
+                        }
+                    }
+                }
             }
-            gs_aParticleIndices[nPrevCount] = iParticle;
         }
     }
 
     GroupMemoryBarrierWithGroupSync();
+    if (GI == 0 && gs_nBinnedParticleCount > 0)
+    {
+        InterlockedAdd(g_offsetCounter[TILE_COUNTER_BINNED_PARTICLES], gs_nBinnedParticleCount);
+    }
+}
+
+// What the lists of the tiles are sorted by, the rasterizer draws the particles with the bigger keys on top.
+// Any order works as long as it's a uint, like FloatToSortKey of a depth.
+uint GetTileSortKey(uint nParticle)
+{
+    return nParticle;
+}
 
+// One group per tile. Undoes the order the atomics of CSTileScatter happened to give, so the later particles
+// stay on top of the earlier ones, and clears the count of the tile for the next frame.
+[numthreads(TILE_SORT_GROUP_SIZE, 1, 1)]
+void CSTileSort(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    // Cleared before anything else, the tiles past TILE_LIST_CAPACITY still counted their particles in CSTileScatter
     if (GTid.x == 0)
     {
-        if (gs_nParticleCountForCurrentTile)
-        {
-            uint nParticleCountForCurrentTile = gs_nParticleCountForCurrentTile;
-            uint nOriginalValue;
-            InterlockedAdd(g_offsetCounter[0], nParticleCountForCurrentTile, nOriginalValue);
-            g_offsetPerTiles[Gid.xy] = uint2(nOriginalValue, nParticleCountForCurrentTile);
-            gs_nOriginalValue = nOriginalValue;
-        }
-        else
-        {
-            g_offsetPerTiles[Gid.xy] = uint2(0, 0);
-        }
+        g_tileParticleCounts[Gid.y * TILE_COUNT(g_Resolution.x) + Gid.x] = 0;
     }
-    
-    if (gs_nParticleCountForCurrentTile)
+
+    // The spilled tiles are left to CSTileSortSpill
+    uint2 offsetAndCount = g_offsetPerTiles[Gid.xy];
+    if (offsetAndCount.y == 0 || offsetAndCount.y > MAX_PARTICLE_PER_TILE)
     {
-#ifdef DEBUG_SORTING
-        if (GTid.x == 0)
+        return;
+    }
+
+#ifndef TILE_SORT_BITONIC
+    for (uint iKey = GI; iKey < offsetAndCount.y; iKey += TILE_SORT_GROUP_SIZE)
+    {
+        uint nParticle = g_particleIndicesForTiles[offsetAndCount.x + iKey];
+        gs_aRadixKeys[iKey] = GetTileSortKey(nParticle);
+        gs_aRadixValues[iKey] = nParticle;
+    }
+
+    GroupMemoryBarrierWithGroupSync();
+
+    uint nSorted = GroupRadixSort(offsetAndCount.y, GI);
+    for (uint iOut = GI; iOut < offsetAndCount.y; iOut += TILE_SORT_GROUP_SIZE)
+    {
+        g_particleIndicesForTiles[offsetAndCount.x + iOut] = gs_aRadixValues[nSorted + iOut];
+    }
+#else
+    if (GTid.x == 0)
+    {
+        gs_nParticleCountForCurrentTile = offsetAndCount.y;
+    }
+
+    for (uint iElement = 0; iElement < COLLECT_PARTICLE_COUNT_PER_THREAD; iElement++)
+    {
+        uint iParticleIndex = GTid.x * COLLECT_PARTICLE_COUNT_PER_THREAD + iElement;
+        if (iParticleIndex < offsetAndCount.y)
         {
-            BubbleSort();
+            gs_aParticleIndices[iParticleIndex] = g_particleIndicesForTiles[offsetAndCount.x + iParticleIndex];
         }
-        GroupMemoryBarrierWithGroupSync();
+    }
+
+    GroupMemoryBarrierWithGroupSync();
+
+#ifdef DEBUG_SORTING
+    if (GTid.x == 0)
+    {
+        BubbleSort();
+    }
+    GroupMemoryBarrierWithGroupSync();
 #else
-        BitonicSort(GTid.x);
+    BitonicSort(GTid.x);
 #endif
 
-#ifdef INTERLEAVED_PARTICLE_COLLECTION
-        uint nParticleCountForCurrentTile = gs_nParticleCountForCurrentTile;
-        nParticlePerThread = ceil((float)gs_nParticleCountForCurrentTile / (MAX_PARTICLE_PER_TILE / COLLECT_PARTICLE_COUNT_PER_THREAD));
-        for (uint iParticle = 0; iParticle < nParticlePerThread; iParticle++)
+    for (uint iOutElement = 0; iOutElement < COLLECT_PARTICLE_COUNT_PER_THREAD; iOutElement++)
+    {
+        uint iParticleIndex = GTid.x * COLLECT_PARTICLE_COUNT_PER_THREAD + iOutElement;
+        if (iParticleIndex < offsetAndCount.y)
         {
-            uint iParticleIndex = GTid.x + iParticle * (MAX_PARTICLE_PER_TILE / COLLECT_PARTICLE_COUNT_PER_THREAD);
-            if (iParticleIndex < nParticleCountForCurrentTile)
-            {
-                g_particleIndicesForTiles[gs_nOriginalValue + iParticleIndex] = gs_aParticleIndices[iParticleIndex];
-            }
+            g_particleIndicesForTiles[offsetAndCount.x + iParticleIndex] = gs_aParticleIndices[iParticleIndex];
         }
-#else
-        nParticlePerThread = ceil((float)gs_nParticleCountForCurrentTile / (MAX_PARTICLE_PER_TILE / COLLECT_PARTICLE_COUNT_PER_THREAD));
-        nParticleStartIndex = nParticlePerThread * GTid.x;
-        nParticleEndIndex = nParticleStartIndex + nParticlePerThread;
-        nParticleEndIndex = min(nParticleEndIndex, gs_nParticleCountForCurrentTile);
+    }
+#endif
+}
 
-        for (uint iParticle = nParticleStartIndex; iParticle < nParticleEndIndex; iParticle++)
+// The tiles CSTileSort had no room for, sorted in place in g_particleIndicesForTiles with the network of BitonicSort.
+// The number of spilled tiles is only known on the GPU, so TILE_SPILL_GROUP_COUNT groups take them in turns.
+// Every group only touches the lists of its own tiles, so the device memory barriers inside the group are enough.
+[numthreads(TILE_SPILL_SORT_GROUP_SIZE, 1, 1)]
+void CSTileSortSpill(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    uint nTileCountX = TILE_COUNT(g_Resolution.x);
+    uint nTileCount = nTileCountX * TILE_COUNT(g_Resolution.y);
+    uint nSpilledTileCount = g_offsetCounter[TILE_COUNTER_SPILLED_TILES];
+
+    // The waits are required for the flow control, the loops below depend on what was just read
+    DeviceMemoryBarrierWithGroupSync();
+
+    for (uint iSpill = Gid.x; iSpill < nSpilledTileCount; iSpill += TILE_SPILL_GROUP_COUNT)
+    {
+        uint nTile = g_offsetCounter[TILE_SPILL_LIST_START(nTileCount) + iSpill];
+        uint2 offsetAndCount = g_offsetPerTiles[uint2(nTile % nTileCountX, nTile / nTileCountX)];
+        uint numParticles = offsetAndCount.y;
+
+        uint numParticlesPowerOfTwo = 1;
+        while (numParticlesPowerOfTwo < numParticles)
+            numParticlesPowerOfTwo <<= 1;
+
+        DeviceMemoryBarrierWithGroupSync();
+
+        for (uint nMergeSize = 2; nMergeSize <= numParticlesPowerOfTwo; nMergeSize = nMergeSize * 2)
         {
-            g_particleIndicesForTiles[gs_nOriginalValue + iParticle] = gs_aParticleIndices[iParticle];
+            for (uint nMergeSubSize = nMergeSize >> 1; nMergeSubSize > 0; nMergeSubSize = nMergeSubSize >> 1)
+            {
+                for (uint tmp_index = GI; tmp_index < numParticlesPowerOfTwo / 2; tmp_index += TILE_SPILL_SORT_GROUP_SIZE)
+                {
+                    uint index_low = tmp_index & (nMergeSubSize - 1);
+                    uint index_high = 2 * (tmp_index - index_low);
+                    uint index = index_high + index_low;
+
+                    uint nSwapElem = nMergeSubSize == nMergeSize >> 1 ?
+                        index_high + (2 * nMergeSubSize - 1) - index_low :
+                        index_high + nMergeSubSize + index_low;
+
+                    if (nSwapElem < numParticles && index < numParticles)
+                    {
+                        uint nLow = g_particleIndicesForTiles[offsetAndCount.x + index];
+                        uint nHigh = g_particleIndicesForTiles[offsetAndCount.x + nSwapElem];
+                        if (nLow > nHigh)
+                        {
+                            g_particleIndicesForTiles[offsetAndCount.x + index] = nHigh;
+                            g_particleIndicesForTiles[offsetAndCount.x + nSwapElem] = nLow;
+                        }
+                    }
+                }
+                DeviceMemoryBarrierWithGroupSync();
+            }
         }
-#endif
     }
 }
 
-[numthreads(TILE_SIZE_IN_PIXELS, TILE_SIZE_IN_PIXELS, 1)]
-void CSRasterizeParticles(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+// Everything CSRasterizeParticles needs of a particle that doesn't depend on the pixel, done once per particle
+// instead of once per pixel of every tile the particle is in. Same math as SetupQuadPlanes in ParticleTileRasterizer.cpp.
+[numthreads(TILE_BIN_GROUP_SIZE, 1, 1)]
+void CSParticleRasterSetup(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
 {
-    uint nWidth, nHeight;
-    g_OutputTexture.GetDimensions(nWidth, nHeight);
-    if (DTid.x >= nWidth || DTid.y >= nHeight)
+    if (DTid.x >= g_aliveListIn[0])
     {
         return;
     }
 
-    float2 threadPos = ((float2)DTid.xy / g_Resolution) * float2(2, -2) - float2(1, -1);
+    uint nParticle = g_aliveListIn[1 + DTid.x];
+    float2 particlePos = g_particlePositions[nParticle];
+    float2 particleScale = g_particleScales[nParticle];
 
-    uint2 offsetAndCount = g_offsetPerTiles[Gid.xy];
-    float4 color = float4(0, 0, 0, 1);
-    for (int iParticle = offsetAndCount.y - 1; iParticle >= 0; iParticle--)
+    float rotate = g_particleRotations[nParticle];
+    float rotSin, rotCos;
+    sincos(rotate, rotSin, rotCos);
+
+    // Note the scale parameter means the half size
+    float2 particleTopLeft = particlePos - particleScale;
+    float2 particleBottomRight = particlePos + particleScale;
+
+    // Particle corners in cw order
+    float2 particleCorners[4];
+    particleCorners[0] = particleTopLeft;
+    particleCorners[1] = float2(particleBottomRight.x, particleTopLeft.y);
+    particleCorners[2] = particleBottomRight;
+    particleCorners[3] = float2(particleTopLeft.x, particleBottomRight.y);
+
+    for (int iCorner = 0; iCorner < 4; iCorner++)
     {
-        uint particleIndex = g_particleIndicesForTiles[offsetAndCount.x + iParticle];
-       
-        PosVelo particle = g_bufPosVelo[particleIndex];
-        float2 particlePos = particle.pos.xy;
-
-        float rotate = particle.rotate.x;
-        float rotSin, rotCos;
-        sincos(rotate, rotSin, rotCos);
-
-        // Note the scale parameter means the half size
-        float2 particleTopLeft = particlePos - particle.scale.xy;
-        float2 particleBottomRight = particlePos + particle.scale.xy;
-
-        // Particle corners in cw order
-        float2 particleCorners[4];
-        particleCorners[0] = particleTopLeft;
-        particleCorners[1] = float2(particleBottomRight.x, particleTopLeft.y);
-        particleCorners[2] = particleBottomRight;
-        particleCorners[3] = float2(particleTopLeft.x, particleBottomRight.y);
-
-        for (int iCorner = 0; iCorner < 4; iCorner++)
-        {
-            float2 originalPosition = particleCorners[iCorner] - particlePos;
-            particleCorners[iCorner].x = originalPosition.x * rotCos - originalPosition.y * rotSin;
-            particleCorners[iCorner].y = originalPosition.x * rotSin + originalPosition.y * rotCos;
-            particleCorners[iCorner] += particlePos;
-        }
+        float2 originalPosition = particleCorners[iCorner] - particlePos;
+        particleCorners[iCorner].x = originalPosition.x * rotCos - originalPosition.y * rotSin;
+        particleCorners[iCorner].y = originalPosition.x * rotSin + originalPosition.y * rotCos;
+        particleCorners[iCorner] += particlePos;
+    }
+
+    float2 v0 = particleCorners[2] - particleCorners[3];
+    float2 v1 = particleCorners[0] - particleCorners[3];
+
+    float dot00 = dot(v0, v0);
+    float dot01 = dot(v0, v1);
+    float dot11 = dot(v1, v1);
+    float invDenom = 1 / (dot00 * dot11 - dot01 * dot01);
 
-        float2 v0 = particleCorners[2] - particleCorners[3];
-        float2 v1 = particleCorners[0] - particleCorners[3];
+    // u = (dot11 * dot(v0, p - c3) - dot01 * dot(v1, p - c3)) * invDenom is linear in p, and so is v
+    float2 uGradient = (dot11 * v0 - dot01 * v1) * invDenom;
+    float2 vGradient = (dot00 * v1 - dot01 * v0) * invDenom;
+
+    ParticleRasterSetup setup;
+    setup.uPlane = float3(uGradient, -dot(uGradient, particleCorners[3]));
+    setup.vPlane = float3(vGradient, -dot(vGradient, particleCorners[3]));
+    g_particleRasterSetups[nParticle] = setup;
+}
 
-        float2 v2 = threadPos - particleCorners[3];
+// The lists are sorted by particle index and the later particles are drawn over the earlier ones, so going through
+// a list backwards is front to back. Every particle the pixel is in goes under what the pixel has so far,
+// until the pixel is as good as opaque and the particles behind it don't matter anymore.
+// The output has premultiplied alpha. A group is a tile of the work list, the tiles over TILE_RASTER_GROUP_SIZE have
+// every thread shade a few of their pixels. The empty tiles aren't dispatched at all, the output was cleared before.
+[numthreads(TILE_RASTER_GROUP_SIZE, TILE_RASTER_GROUP_SIZE, 1)]
+void CSRasterizeParticles(uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex)
+{
+    if (GI == 0)
+    {
+        gs_nSaturatedPixelCount = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
 
-        // Compute dot products
-        float dot00 = dot(v0, v0);
-        float dot01 = dot(v0, v1);
-        float dot02 = dot(v0, v2);
-        float dot11 = dot(v1, v1);
-        float dot12 = dot(v1, v2);
+    // Only the last row of groups can go past the end of the list. Those groups shade nothing but still get to the barriers.
+    uint nWorkIndex = Gid.y * TILE_RASTER_DISPATCH_MAX_GROUPS + Gid.x;
+    bool bInWorkList = nWorkIndex < g_offsetCounter[TILE_COUNTER_OCCUPIED_TILES];
+    uint nTileCountX = TILE_COUNT(g_Resolution.x);
+    uint nTile = bInWorkList ? g_offsetCounter[TILE_WORK_LIST_START + nWorkIndex] : 0;
+    uint2 tile = uint2(nTile % nTileCountX, nTile / nTileCountX);
+    uint nTilePixelCount = bInWorkList ? TILE_SIZE_IN_PIXELS * TILE_SIZE_IN_PIXELS : 0;
 
-        // Compute barycentric coordinates
-        float invDenom = 1 / (dot00 * dot11 - dot01 * dot01);
-        float u = (dot11 * dot02 - dot01 * dot12) * invDenom;
-        float v = (dot00 * dot12 - dot01 * dot02) * invDenom;
+    uint nWidth, nHeight;
+    g_OutputTexture.GetDimensions(nWidth, nHeight);
+    uint2 offsetAndCount = g_offsetPerTiles[tile];
+    for (uint iTilePixel = GI; iTilePixel < nTilePixelCount; iTilePixel += TILE_RASTER_GROUP_SIZE * TILE_RASTER_GROUP_SIZE)
+    {
+        uint2 pixel = tile * TILE_SIZE_IN_PIXELS + uint2(iTilePixel % TILE_SIZE_IN_PIXELS, iTilePixel / TILE_SIZE_IN_PIXELS);
+        if (pixel.x >= nWidth || pixel.y >= nHeight)
+        {
+            continue;
+        }
 
-        // Check if point is in triangle
-        if ((u >= 0) && (v >= 0) && u <= 1 && v <= 1)
+        float2 threadPos = ((float2)pixel / g_Resolution) * float2(2, -2) - float2(1, -1);
+        float4 color = float4(0, 0, 0, 0);
+        for (int iParticle = offsetAndCount.y - 1; iParticle >= 0; iParticle--)
         {
-            color = float4(u, v, 0.5, 1);
-            break;
+            uint particleIndex = g_particleIndicesForTiles[offsetAndCount.x + iParticle];
+            ParticleRasterSetup setup = g_particleRasterSetups[particleIndex];
+
+            // Barycentric coordinates from the planes of CSParticleRasterSetup
+            float u = setup.uPlane.x * threadPos.x + (setup.uPlane.y * threadPos.y + setup.uPlane.z);
+            float v = setup.vPlane.x * threadPos.x + (setup.vPlane.y * threadPos.y + setup.vPlane.z);
+
+            // Check if point is in triangle
+            if ((u >= 0) && (v >= 0) && u <= 1 && v <= 1)
+            {
+                float4 particleColor = g_particleColors[particleIndex];
+                float weight = (1 - color.a) * particleColor.a;
+                color.rgb += weight * particleColor.rgb;
+                color.a += weight;
+                if (color.a >= TILE_COMPOSITE_OPAQUE_ALPHA)
+                {
+                    InterlockedAdd(gs_nSaturatedPixelCount, 1);
+                    break;
+                }
+            }
         }
+        g_OutputTexture[pixel] = color;
+    }
+
+    GroupMemoryBarrierWithGroupSync();
+    if (GI == 0 && gs_nSaturatedPixelCount > 0)
+    {
+        InterlockedAdd(g_offsetCounter[TILE_COUNTER_SATURATED_PIXELS], gs_nSaturatedPixelCount);
     }
-    g_OutputTexture[DTid.xy] = color;
 }
\ No newline at end of file
@@ -0,0 +1,802 @@
+#include "ParticleTileBinner.h"
+#include "ParticleRadixSort.h"
+#include "ParticleSimulationCPU.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iterator>
+#include <random>
+
+void TileGrid::SetResolution(uint32_t nWidth, uint32_t nHeight, uint32_t nTileSize)
+{
+    m_nWidth = std::max(nWidth, 1u);
+    m_nHeight = std::max(nHeight, 1u);
+    m_nTileSize = std::min(std::max(nTileSize, 1u), (uint32_t)TILE_SIZE_MAX_IN_PIXELS);
+    m_nTileCountX = TILE_COUNT_FOR_SIZE(m_nWidth, m_nTileSize);
+    m_nTileCountY = TILE_COUNT_FOR_SIZE(m_nHeight, m_nTileSize);
+}
+
+bool TileGrid::GetTileRect(const Float2& position, const Float2& scale, float fRotation, TileRect& rect) const
+{
+    // Same float math as GetParticleTileRect in ParticleTile.hlsl
+    float fSin = std::sin(fRotation);
+    float fCos = std::cos(fRotation);
+    float fHalfX = std::abs(fCos) * scale.x + std::abs(fSin) * scale.y;
+    float fHalfY = std::abs(fSin) * scale.x + std::abs(fCos) * scale.y;
+
+    // Clip space to pixels, y flips
+    float fMinX = (position.x - fHalfX + 1.0f) * 0.5f * m_nWidth;
+    float fMaxX = (position.x + fHalfX + 1.0f) * 0.5f * m_nWidth;
+    float fMinY = (1.0f - position.y - fHalfY) * 0.5f * m_nHeight;
+    float fMaxY = (1.0f - position.y + fHalfY) * 0.5f * m_nHeight;
+
+    float fFirstX = std::floor(fMinX / m_nTileSize);
+    float fFirstY = std::floor(fMinY / m_nTileSize);
+    float fLastX = std::ceil(fMaxX / m_nTileSize) - 1.0f;
+    float fLastY = std::ceil(fMaxY / m_nTileSize) - 1.0f;
+
+    // Clamped as floats first, far away particles don't fit into an int
+    rect.nFirstX = (int32_t)std::max(fFirstX, 0.0f);
+    rect.nFirstY = (int32_t)std::max(fFirstY, 0.0f);
+    rect.nLastX = (int32_t)std::min(fLastX, m_nTileCountX - 1.0f);
+    rect.nLastY = (int32_t)std::min(fLastY, m_nTileCountY - 1.0f);
+    return fLastX >= 0.0f && fLastY >= 0.0f && rect.nFirstX <= rect.nLastX && rect.nFirstY <= rect.nLastY;
+}
+
+bool TileGrid::OverlapsTile(const Float2& position, const Float2& scale, float fRotation, uint32_t nTileX, uint32_t nTileY) const
+{
+#ifdef DISABLE_ROTATION
+    (void)position;
+    (void)scale;
+    (void)fRotation;
+    (void)nTileX;
+    (void)nTileY;
+    return true;
+#else
+    // The tile's axes were taken care of by the rect, only the particle's two are left
+    float fTileHalfX = (float)m_nTileSize / m_nWidth;
+    float fTileHalfY = (float)m_nTileSize / m_nHeight;
+    float fTileCenterX = (nTileX * 2 + 1) * fTileHalfX - 1.0f;
+    float fTileCenterY = 1.0f - (nTileY * 2 + 1) * fTileHalfY;
+
+    float fSin = std::sin(fRotation);
+    float fCos = std::cos(fRotation);
+    float fDx = fTileCenterX - position.x;
+    float fDy = fTileCenterY - position.y;
+
+    float fDistanceU = std::abs(fDx * fCos + fDy * fSin);
+    float fDistanceV = std::abs(fDy * fCos - fDx * fSin);
+    float fReachU = scale.x + fTileHalfX * std::abs(fCos) + fTileHalfY * std::abs(fSin);
+    float fReachV = scale.y + fTileHalfX * std::abs(fSin) + fTileHalfY * std::abs(fCos);
+    return fDistanceU <= fReachU && fDistanceV <= fReachV;
+#endif
+}
+
+bool TileGrid::ParticleInTile(const Float2& position, const Float2& scale, float fRotation, uint32_t nTileX, uint32_t nTileY) const
+{
+    TileRect rect;
+    return GetTileRect(position, scale, fRotation, rect) &&
+        (int32_t)nTileX >= rect.nFirstX && (int32_t)nTileX <= rect.nLastX &&
+        (int32_t)nTileY >= rect.nFirstY && (int32_t)nTileY <= rect.nLastY &&
+        OverlapsTile(position, scale, fRotation, nTileX, nTileY);
+}
+
+ParticleTileBinner::ParticleTileBinner(uint32_t nWidth, uint32_t nHeight, uint32_t nTileSize)
+{
+    SetResolution(nWidth, nHeight, nTileSize);
+}
+
+void ParticleTileBinner::SetResolution(uint32_t nWidth, uint32_t nHeight, uint32_t nTileSize)
+{
+    m_grid.SetResolution(nWidth, nHeight, nTileSize);
+    m_nOverlapCount = 0;
+    m_nBinnedParticleCount = 0;
+    m_overflow = {};
+
+    uint32_t nTileCount = GetTileCount();
+    m_tileCounts.reset(new std::atomic<uint32_t>[nTileCount]);
+    for (uint32_t iTile = 0; iTile < nTileCount; iTile++)
+    {
+        m_tileCounts[iTile].store(0, std::memory_order_relaxed);
+    }
+    m_tileRanges.assign(nTileCount, TileParticleRange{ 0, 0 });
+    m_occupiedTiles.clear();
+    m_occupiedTiles.reserve(nTileCount);
+}
+
+void ParticleTileBinner::ForEachChunk(uint32_t nCount, uint32_t nChunkSize, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob)
+{
+    if (pJobSystem)
+    {
+        pJobSystem->ParallelFor(nCount, nChunkSize, fnJob);
+        return;
+    }
+
+    for (uint32_t nBegin = 0; nBegin < nCount; nBegin += nChunkSize)
+    {
+        fnJob(nBegin, std::min(nCount, nBegin + nChunkSize), 0);
+    }
+}
+
+void ParticleTileBinner::Bin(const Float2* pPositions, const Float2* pScales, const float* pRotations, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    if (m_particleRects.size() < nCount)
+    {
+        m_particleRects.resize(nCount);
+    }
+
+    const uint32_t nTileCountX = m_grid.GetTileCountX();
+    const uint32_t nTileCount = GetTileCount();
+    std::atomic<uint32_t> nBinnedParticleCount{ 0 };
+
+    // CSTileCount: the rect of every particle, and the particle counted into every tile of it
+    ForEachChunk(nCount, ChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        uint32_t nChunkBinnedParticleCount = 0;
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            uint32_t nParticle = pIndices[i];
+            float fRotation = pRotations ? pRotations[nParticle] : 0.0f;
+
+            TileRect& rect = m_particleRects[i];
+            if (!m_grid.GetTileRect(pPositions[nParticle], pScales[nParticle], fRotation, rect))
+            {
+                rect = { 0, 0, -1, -1 };
+                continue;
+            }
+            nChunkBinnedParticleCount++;
+
+            for (int32_t nY = rect.nFirstY; nY <= rect.nLastY; nY++)
+            {
+                for (int32_t nX = rect.nFirstX; nX <= rect.nLastX; nX++)
+                {
+                    if (m_grid.OverlapsTile(pPositions[nParticle], pScales[nParticle], fRotation, nX, nY))
+                    {
+                        m_tileCounts[nY * nTileCountX + nX].fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+            }
+        }
+        nBinnedParticleCount.fetch_add(nChunkBinnedParticleCount, std::memory_order_relaxed);
+    });
+    m_nBinnedParticleCount = nBinnedParticleCount.load();
+
+    // CSTileScan: the counts are cleared so the scatter can count the places in the lists from zero.
+    // The lists here are never cut, the overflow is only what the GPU would report for the same particles.
+    // The work list takes the tiles with particles, the GPU also leaves out the ones cut down to nothing.
+    const uint32_t nCapacity = TILE_LIST_CAPACITY(nTileCount);
+    uint32_t nOffset = 0;
+    m_overflow = {};
+    m_occupiedTiles.clear();
+    for (uint32_t iTile = 0; iTile < nTileCount; iTile++)
+    {
+        uint32_t nCountInTile = m_tileCounts[iTile].exchange(0, std::memory_order_relaxed);
+        m_tileRanges[iTile] = { nOffset, nCountInTile };
+        if (nCountInTile > 0)
+        {
+            m_occupiedTiles.push_back(iTile);
+        }
+
+        uint32_t nStoredCount = std::min(nCountInTile, nCapacity - std::min(nOffset, nCapacity));
+        if (nStoredCount > MAX_PARTICLE_PER_TILE)
+        {
+            m_overflow.nSpilledTileCount++;
+            m_overflow.nOverflowEntryCount += nStoredCount - MAX_PARTICLE_PER_TILE;
+        }
+        m_overflow.nLargestTileCount = std::max(m_overflow.nLargestTileCount, nCountInTile);
+        nOffset += nCountInTile;
+    }
+    m_nOverlapCount = nOffset;
+    m_overflow.nDroppedEntryCount = nOffset - std::min(nOffset, nCapacity);
+
+    if (m_particleIndices.size() < m_nOverlapCount)
+    {
+        m_particleIndices.resize(m_nOverlapCount);
+    }
+
+    // CSTileScatter. The rects are reused, the narrow test has to give the same answer as in the count.
+    ForEachChunk(nCount, ChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            uint32_t nParticle = pIndices[i];
+            float fRotation = pRotations ? pRotations[nParticle] : 0.0f;
+            const TileRect& rect = m_particleRects[i];
+            for (int32_t nY = rect.nFirstY; nY <= rect.nLastY; nY++)
+            {
+                for (int32_t nX = rect.nFirstX; nX <= rect.nLastX; nX++)
+                {
+                    if (m_grid.OverlapsTile(pPositions[nParticle], pScales[nParticle], fRotation, nX, nY))
+                    {
+                        uint32_t nTile = nY * nTileCountX + nX;
+                        uint32_t nPlace = m_tileCounts[nTile].fetch_add(1, std::memory_order_relaxed);
+                        m_particleIndices[m_tileRanges[nTile].nOffset + nPlace] = nParticle;
+                    }
+                }
+            }
+        }
+    });
+
+    // CSTileSort: undo the order the atomics happened to give, and clear the counts for the next Bin.
+    // The particle indices are their own keys, every worker has its own scratch for the radix sort.
+    m_sortScratch.resize(pJobSystem ? pJobSystem->GetWorkerCount() : 1);
+    ForEachChunk(nTileCount, TileChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t nWorkerIndex)
+    {
+        std::vector<uint32_t>& sortScratch = m_sortScratch[nWorkerIndex];
+        for (uint32_t iTile = nBegin; iTile < nEnd; iTile++)
+        {
+            const TileParticleRange& range = m_tileRanges[iTile];
+            if (sortScratch.size() < range.nCount)
+            {
+                sortScratch.resize(range.nCount);
+            }
+            RadixSortKeyValues(m_instructionSet, m_particleIndices.data() + range.nOffset, nullptr, range.nCount, sortScratch.data(), nullptr);
+            m_tileCounts[iTile].store(0, std::memory_order_relaxed);
+        }
+    });
+
+    m_nBinNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void ParticleTileBinner::BinBruteForce(const Float2* pPositions, const Float2* pScales, const float* pRotations, const uint32_t* pIndices, uint32_t nCount)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // The particles come in index order, so the lists come out sorted without any extra work
+    std::vector<uint32_t> sortedIndices(pIndices, pIndices + nCount);
+    std::sort(sortedIndices.begin(), sortedIndices.end());
+
+    m_nBinnedParticleCount = 0;
+    for (uint32_t nParticle : sortedIndices)
+    {
+        TileRect rect;
+        float fRotation = pRotations ? pRotations[nParticle] : 0.0f;
+        m_nBinnedParticleCount += m_grid.GetTileRect(pPositions[nParticle], pScales[nParticle], fRotation, rect) ? 1 : 0;
+    }
+
+    m_particleIndices.clear();
+    m_occupiedTiles.clear();
+    for (uint32_t nTileY = 0; nTileY < GetTileCountY(); nTileY++)
+    {
+        for (uint32_t nTileX = 0; nTileX < GetTileCountX(); nTileX++)
+        {
+            TileParticleRange& range = m_tileRanges[nTileY * GetTileCountX() + nTileX];
+            range.nOffset = (uint32_t)m_particleIndices.size();
+            for (uint32_t nParticle : sortedIndices)
+            {
+                float fRotation = pRotations ? pRotations[nParticle] : 0.0f;
+                if (m_grid.ParticleInTile(pPositions[nParticle], pScales[nParticle], fRotation, nTileX, nTileY))
+                {
+                    m_particleIndices.push_back(nParticle);
+                }
+            }
+            range.nCount = (uint32_t)m_particleIndices.size() - range.nOffset;
+            if (range.nCount > 0)
+            {
+                m_occupiedTiles.push_back(nTileY * GetTileCountX() + nTileX);
+            }
+        }
+    }
+    m_nOverlapCount = (uint32_t)m_particleIndices.size();
+
+    m_nBinNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+TileOccupancy ParticleTileBinner::GetOccupancy() const
+{
+    TileOccupancy occupancy;
+    occupancy.nTileSize = GetTileSize();
+    occupancy.nTileCount = GetTileCount();
+    occupancy.nBinnedParticleCount = m_nBinnedParticleCount;
+    occupancy.nEntryCount = m_nOverlapCount;
+    occupancy.nLargestTileCount = m_overflow.nLargestTileCount;
+    return occupancy;
+}
+
+ParticleHierarchicalTileBinner::ParticleHierarchicalTileBinner(uint32_t nWidth, uint32_t nHeight)
+{
+    SetResolution(nWidth, nHeight);
+}
+
+void ParticleHierarchicalTileBinner::SetResolution(uint32_t nWidth, uint32_t nHeight)
+{
+    m_grid.SetResolution(nWidth, nHeight);
+    m_nBinCountX = (m_grid.GetTileCountX() + BinSizeInTiles - 1) / BinSizeInTiles;
+    m_nBinCountY = (m_grid.GetTileCountY() + BinSizeInTiles - 1) / BinSizeInTiles;
+    m_nBigParticleCount = 0;
+    m_nTileOverlapCount = 0;
+
+    // Small and big counts of every bin
+    uint32_t nBinListCount = GetBinCount() * 2;
+    m_binCounts.reset(new std::atomic<uint32_t>[nBinListCount]);
+    for (uint32_t iList = 0; iList < nBinListCount; iList++)
+    {
+        m_binCounts[iList].store(0, std::memory_order_relaxed);
+    }
+    m_binStarts.assign(nBinListCount + 1, 0);
+
+    m_bins.clear();
+    m_bins.resize(GetBinCount());
+    for (CoarseBin& bin : m_bins)
+    {
+        bin.tileStarts.assign(BinSizeInTiles * BinSizeInTiles + 1, 0);
+    }
+}
+
+void ParticleHierarchicalTileBinner::ForEachChunk(uint32_t nCount, uint32_t nChunkSize, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob)
+{
+    if (pJobSystem)
+    {
+        pJobSystem->ParallelFor(nCount, nChunkSize, fnJob);
+        return;
+    }
+
+    for (uint32_t nBegin = 0; nBegin < nCount; nBegin += nChunkSize)
+    {
+        fnJob(nBegin, std::min(nCount, nBegin + nChunkSize), 0);
+    }
+}
+
+void ParticleHierarchicalTileBinner::Bin(const Float2* pPositions, const Float2* pScales, const float* pRotations, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    if (m_particleRects.size() < nCount)
+    {
+        m_particleRects.resize(nCount);
+    }
+
+    const uint32_t nBinCount = GetBinCount();
+    const uint32_t nBinCountX = m_nBinCountX;
+    std::atomic<uint32_t> nBigParticleCount{ 0 };
+
+    // Visits the list of every bin the particle's rect touches, the big particles have their own lists after the small ones
+    auto fnForEachBinList = [&](const TileRect& rect, auto&& fnVisit)
+    {
+        uint32_t nTileCount = (rect.nLastX - rect.nFirstX + 1) * (rect.nLastY - rect.nFirstY + 1);
+        uint32_t nListOffset = nTileCount > BigParticleTileCount ? nBinCount : 0;
+        for (int32_t nBinY = rect.nFirstY / (int32_t)BinSizeInTiles; nBinY <= rect.nLastY / (int32_t)BinSizeInTiles; nBinY++)
+        {
+            for (int32_t nBinX = rect.nFirstX / (int32_t)BinSizeInTiles; nBinX <= rect.nLastX / (int32_t)BinSizeInTiles; nBinX++)
+            {
+                fnVisit(nListOffset + nBinY * nBinCountX + nBinX);
+            }
+        }
+        return nListOffset != 0;
+    };
+
+    // Count the particles into the bins
+    ForEachChunk(nCount, ChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        uint32_t nChunkBigParticleCount = 0;
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            uint32_t nParticle = pIndices[i];
+            float fRotation = pRotations ? pRotations[nParticle] : 0.0f;
+
+            TileRect& rect = m_particleRects[i];
+            if (!m_grid.GetTileRect(pPositions[nParticle], pScales[nParticle], fRotation, rect))
+            {
+                rect = { 0, 0, -1, -1 };
+                continue;
+            }
+
+            bool bBig = fnForEachBinList(rect, [&](uint32_t nList)
+            {
+                m_binCounts[nList].fetch_add(1, std::memory_order_relaxed);
+            });
+            nChunkBigParticleCount += bBig ? 1 : 0;
+        }
+        nBigParticleCount.fetch_add(nChunkBigParticleCount, std::memory_order_relaxed);
+    });
+    m_nBigParticleCount = nBigParticleCount.load();
+
+    // Scan, the counts are cleared so the scatter can count the places in the lists from zero
+    uint32_t nOffset = 0;
+    for (uint32_t iList = 0; iList < nBinCount * 2; iList++)
+    {
+        m_binStarts[iList] = nOffset;
+        nOffset += m_binCounts[iList].exchange(0, std::memory_order_relaxed);
+    }
+    m_binStarts[nBinCount * 2] = nOffset;
+
+    if (m_binEntries.size() < nOffset)
+    {
+        m_binEntries.resize(nOffset);
+    }
+
+    // Scatter into the bins
+    ForEachChunk(nCount, ChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            const TileRect& rect = m_particleRects[i];
+            if (rect.nFirstX > rect.nLastX)
+            {
+                continue;
+            }
+
+            uint64_t nEntry = (uint64_t)pIndices[i] << 32 | i;
+            fnForEachBinList(rect, [&](uint32_t nList)
+            {
+                uint32_t nPlace = m_binCounts[nList].fetch_add(1, std::memory_order_relaxed);
+                m_binEntries[m_binStarts[nList] + nPlace] = nEntry;
+            });
+        }
+    });
+
+    // Every bin sorts its lists and splits its small particles into its tiles. Empty bins are done right away.
+    ForEachChunk(nBinCount, 1, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t iBin = nBegin; iBin < nEnd; iBin++)
+        {
+            RefineBin(iBin, pPositions, pScales, pRotations);
+        }
+    });
+
+    m_nTileOverlapCount = 0;
+    for (const CoarseBin& bin : m_bins)
+    {
+        m_nTileOverlapCount += bin.tileStarts.back();
+    }
+
+    m_nBinNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void ParticleHierarchicalTileBinner::RefineBin(uint32_t nBin, const Float2* pPositions, const Float2* pScales, const float* pRotations)
+{
+    const uint32_t nBinCount = GetBinCount();
+    const uint32_t nLocalTileCount = BinSizeInTiles * BinSizeInTiles;
+    CoarseBin& bin = m_bins[nBin];
+
+    m_binCounts[nBin].store(0, std::memory_order_relaxed);
+    m_binCounts[nBinCount + nBin].store(0, std::memory_order_relaxed);
+
+    // The entries sort by particle index, which the tile lists inherit below
+    uint64_t* pSmallBegin = m_binEntries.data() + m_binStarts[nBin];
+    uint64_t* pSmallEnd = m_binEntries.data() + m_binStarts[nBin + 1];
+    uint64_t* pBigBegin = m_binEntries.data() + m_binStarts[nBinCount + nBin];
+    uint64_t* pBigEnd = m_binEntries.data() + m_binStarts[nBinCount + nBin + 1];
+    std::sort(pSmallBegin, pSmallEnd);
+    std::sort(pBigBegin, pBigEnd);
+
+    bin.bigParticles.resize(pBigEnd - pBigBegin);
+    for (uint64_t* pEntry = pBigBegin; pEntry < pBigEnd; pEntry++)
+    {
+        bin.bigParticles[pEntry - pBigBegin] = (uint32_t)(*pEntry >> 32);
+    }
+
+    std::fill(bin.tileStarts.begin(), bin.tileStarts.end(), 0);
+    bin.tileEntries.clear();
+    if (pSmallBegin == pSmallEnd)
+    {
+        bin.particleIndices.clear();
+        return;
+    }
+
+    const int32_t nBinFirstX = (int32_t)((nBin % m_nBinCountX) * BinSizeInTiles);
+    const int32_t nBinFirstY = (int32_t)((nBin / m_nBinCountX) * BinSizeInTiles);
+    const int32_t nBinLastX = std::min(nBinFirstX + (int32_t)BinSizeInTiles, (int32_t)m_grid.GetTileCountX()) - 1;
+    const int32_t nBinLastY = std::min(nBinFirstY + (int32_t)BinSizeInTiles, (int32_t)m_grid.GetTileCountY()) - 1;
+
+    // The tiles of every small particle inside the bin, in particle order
+    for (uint64_t* pEntry = pSmallBegin; pEntry < pSmallEnd; pEntry++)
+    {
+        uint32_t nParticle = (uint32_t)(*pEntry >> 32);
+        const TileRect& rect = m_particleRects[(uint32_t)*pEntry];
+        float fRotation = pRotations ? pRotations[nParticle] : 0.0f;
+        for (int32_t nY = std::max(rect.nFirstY, nBinFirstY); nY <= std::min(rect.nLastY, nBinLastY); nY++)
+        {
+            for (int32_t nX = std::max(rect.nFirstX, nBinFirstX); nX <= std::min(rect.nLastX, nBinLastX); nX++)
+            {
+                if (m_grid.OverlapsTile(pPositions[nParticle], pScales[nParticle], fRotation, nX, nY))
+                {
+                    uint64_t nLocalTile = (nY - nBinFirstY) * BinSizeInTiles + (nX - nBinFirstX);
+                    bin.tileEntries.push_back(nLocalTile << 32 | nParticle);
+                    bin.tileStarts[nLocalTile + 1]++;
+                }
+            }
+        }
+    }
+
+    // Counting sort by tile. It's stable, so every tile's list stays in particle order.
+    for (uint32_t iTile = 0; iTile < nLocalTileCount; iTile++)
+    {
+        bin.tileStarts[iTile + 1] += bin.tileStarts[iTile];
+    }
+
+    uint32_t tilePlaces[BinSizeInTiles * BinSizeInTiles];
+    std::copy(bin.tileStarts.begin(), bin.tileStarts.end() - 1, tilePlaces);
+    bin.particleIndices.resize(bin.tileEntries.size());
+    for (uint64_t nEntry : bin.tileEntries)
+    {
+        bin.particleIndices[tilePlaces[nEntry >> 32]++] = (uint32_t)nEntry;
+    }
+}
+
+const uint32_t* ParticleHierarchicalTileBinner::GetTileParticles(uint32_t nTileX, uint32_t nTileY, uint32_t& nCount) const
+{
+    const CoarseBin& bin = m_bins[(nTileY / BinSizeInTiles) * m_nBinCountX + nTileX / BinSizeInTiles];
+    uint32_t nLocalTile = (nTileY % BinSizeInTiles) * BinSizeInTiles + nTileX % BinSizeInTiles;
+    nCount = bin.tileStarts[nLocalTile + 1] - bin.tileStarts[nLocalTile];
+    return bin.particleIndices.data() + bin.tileStarts[nLocalTile];
+}
+
+const uint32_t* ParticleHierarchicalTileBinner::GetBigParticles(uint32_t nBinX, uint32_t nBinY, uint32_t& nCount) const
+{
+    const CoarseBin& bin = m_bins[nBinY * m_nBinCountX + nBinX];
+    nCount = (uint32_t)bin.bigParticles.size();
+    return bin.bigParticles.data();
+}
+
+// The positions go a bit past the screen, so some particles are clipped
+void CreateTileBinningScene(TileBinningScene scene, uint32_t nWidth, uint32_t nHeight, std::mt19937& randomNumberEngine,
+    std::vector<Float2>& positions, std::vector<Float2>& scales, std::vector<Float2>& velocities, std::vector<float>& rotations)
+{
+    std::uniform_real_distribution<float> positionDistribution(-1.1f, 1.1f);
+    std::uniform_real_distribution<float> velocityDistribution(-0.5f, 0.5f);
+    std::uniform_real_distribution<float> rotationDistribution(0.0f, 6.2831853f);
+
+    // Mostly small particles with the odd one that covers a few tiles
+    const float fTileSize = 2.0f * TILE_SIZE_IN_PIXELS / std::max(nWidth, nHeight);
+    std::exponential_distribution<float> scaleDistribution(1.0f / (0.25f * fTileSize));
+    std::uniform_real_distribution<float> bigScaleDistribution(2.0f * fTileSize, 8.0f * fTileSize);
+
+    // The cluster is a few tiles wide, a bit off center so it straddles bins
+    std::normal_distribution<float> clusterDistribution(0.0f, 2.0f * fTileSize);
+    const Float2 clusterCenter = { 0.2f, -0.1f };
+
+    // The tile in the middle of the screen, in clip space
+    const Float2 tileHalfSize = { (float)TILE_SIZE_IN_PIXELS / nWidth, (float)TILE_SIZE_IN_PIXELS / nHeight };
+    const Float2 tileCenter = { (TILE_COUNT(nWidth) / 2 * 2 + 1) * tileHalfSize.x - 1.0f, 1.0f - (TILE_COUNT(nHeight) / 2 * 2 + 1) * tileHalfSize.y };
+    std::uniform_real_distribution<float> inTileDistribution(-0.4f, 0.4f);
+
+    for (uint32_t i = 0; i < (uint32_t)positions.size(); i++)
+    {
+        positions[i] = { positionDistribution(randomNumberEngine), positionDistribution(randomNumberEngine) };
+        scales[i] = { scaleDistribution(randomNumberEngine), scaleDistribution(randomNumberEngine) };
+        velocities[i] = { velocityDistribution(randomNumberEngine), velocityDistribution(randomNumberEngine) };
+        rotations[i] = rotationDistribution(randomNumberEngine);
+
+        if (scene == TileBinningScene::BigParticles && i % 10 == 0)
+        {
+            scales[i] = { bigScaleDistribution(randomNumberEngine), bigScaleDistribution(randomNumberEngine) };
+        }
+        else if (scene == TileBinningScene::DenseCluster && i % 10 != 0)
+        {
+            positions[i] = { clusterCenter.x + clusterDistribution(randomNumberEngine), clusterCenter.y + clusterDistribution(randomNumberEngine) };
+            velocities[i] = { velocities[i].x * 0.1f, velocities[i].y * 0.1f };
+        }
+        else if (scene == TileBinningScene::SingleTile)
+        {
+            // Standing still, small enough to stay inside the tile however they are turned
+            positions[i] = { tileCenter.x + inTileDistribution(randomNumberEngine) * tileHalfSize.x, tileCenter.y + inTileDistribution(randomNumberEngine) * tileHalfSize.y };
+            scales[i] = { 0.1f * std::min(tileHalfSize.x, tileHalfSize.y), 0.1f * std::min(tileHalfSize.x, tileHalfSize.y) };
+            velocities[i] = { 0.0f, 0.0f };
+        }
+        else if (scene == TileBinningScene::ScreenCovering)
+        {
+            positions[i] = { positions[i].x * 0.1f, positions[i].y * 0.1f };
+            scales[i] = { 1.5f, 1.5f };
+            velocities[i] = { 0.0f, 0.0f };
+        }
+    }
+}
+
+// Compares the lists of both binners with the brute force ones tile by tile. The big particles of the hierarchical
+// binner's bins that really touch the tile go in between its small ones.
+static void CompareWithBruteForce(const ParticleTileBinner& reference, const ParticleTileBinner& binner, const ParticleHierarchicalTileBinner& hierarchicalBinner,
+    const Float2* pPositions, const Float2* pScales, const float* pRotations, uint32_t& nMismatchedTileCount, uint32_t& nHierarchicalMismatchedTileCount)
+{
+    nMismatchedTileCount = 0;
+    nHierarchicalMismatchedTileCount = 0;
+
+    const TileGrid& grid = reference.GetGrid();
+    std::vector<uint32_t> bigParticles;
+    std::vector<uint32_t> tileParticles;
+    for (uint32_t nTileY = 0; nTileY < grid.GetTileCountY(); nTileY++)
+    {
+        for (uint32_t nTileX = 0; nTileX < grid.GetTileCountX(); nTileX++)
+        {
+            const TileParticleRange& referenceRange = reference.GetTileRanges()[nTileY * grid.GetTileCountX() + nTileX];
+            const uint32_t* pReferenceBegin = reference.GetParticleIndices() + referenceRange.nOffset;
+            const uint32_t* pReferenceEnd = pReferenceBegin + referenceRange.nCount;
+
+            const TileParticleRange& range = binner.GetTileRanges()[nTileY * grid.GetTileCountX() + nTileX];
+            if (range.nCount != referenceRange.nCount || !std::equal(pReferenceBegin, pReferenceEnd, binner.GetParticleIndices() + range.nOffset))
+            {
+                nMismatchedTileCount++;
+            }
+
+            uint32_t nBigCount;
+            const uint32_t* pBigParticles = hierarchicalBinner.GetBigParticles(nTileX / ParticleHierarchicalTileBinner::BinSizeInTiles, nTileY / ParticleHierarchicalTileBinner::BinSizeInTiles, nBigCount);
+            bigParticles.clear();
+            for (uint32_t iBig = 0; iBig < nBigCount; iBig++)
+            {
+                uint32_t nParticle = pBigParticles[iBig];
+                if (grid.ParticleInTile(pPositions[nParticle], pScales[nParticle], pRotations[nParticle], nTileX, nTileY))
+                {
+                    bigParticles.push_back(nParticle);
+                }
+            }
+
+            uint32_t nSmallCount;
+            const uint32_t* pSmallParticles = hierarchicalBinner.GetTileParticles(nTileX, nTileY, nSmallCount);
+            tileParticles.clear();
+            std::merge(pSmallParticles, pSmallParticles + nSmallCount, bigParticles.begin(), bigParticles.end(), std::back_inserter(tileParticles));
+            if (tileParticles.size() != referenceRange.nCount || !std::equal(pReferenceBegin, pReferenceEnd, tileParticles.begin()))
+            {
+                nHierarchicalMismatchedTileCount++;
+            }
+        }
+    }
+}
+
+static bool OccupiedTilesMatch(const ParticleTileBinner& reference, const ParticleTileBinner& binner)
+{
+    return reference.GetOverlapCount() == binner.GetOverlapCount() &&
+        reference.GetOccupiedTileCount() == binner.GetOccupiedTileCount() &&
+        std::equal(reference.GetOccupiedTiles(), reference.GetOccupiedTiles() + reference.GetOccupiedTileCount(), binner.GetOccupiedTiles());
+}
+
+TileBinningBenchmarkResult BenchmarkTileBinning(TileBinningScene scene, uint32_t nParticleCount, uint32_t nIterationCount, uint32_t nWidth, uint32_t nHeight, JobSystem* pJobSystem)
+{
+    std::mt19937 randomNumberEngine(42);
+
+    std::vector<Float2> positions(nParticleCount);
+    std::vector<Float2> scales(nParticleCount);
+    std::vector<Float2> velocities(nParticleCount);
+    std::vector<float> rotations(nParticleCount);
+    std::vector<uint32_t> indices(nParticleCount);
+    CreateTileBinningScene(scene, nWidth, nHeight, randomNumberEngine, positions, scales, velocities, rotations);
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        indices[i] = i;
+    }
+
+    // Shuffled like an alive list after a while, the lists still have to come out in index order
+    std::shuffle(indices.begin(), indices.end(), randomNumberEngine);
+
+    const float fElapsedTime = 1.0f / 60.0f;
+    ParticleTileBinner binner(nWidth, nHeight);
+    ParticleHierarchicalTileBinner hierarchicalBinner(nWidth, nHeight);
+
+    uint64_t nBinNanoseconds = 0;
+    uint64_t nHierarchicalBinNanoseconds = 0;
+    for (uint32_t iIteration = 0; iIteration < nIterationCount; iIteration++)
+    {
+        for (uint32_t i = 0; i < nParticleCount; i++)
+        {
+            positions[i].x += velocities[i].x * fElapsedTime;
+            positions[i].y += velocities[i].y * fElapsedTime;
+        }
+
+        binner.Bin(positions.data(), scales.data(), rotations.data(), indices.data(), nParticleCount, pJobSystem);
+        nBinNanoseconds += binner.GetBinNanoseconds();
+
+        hierarchicalBinner.Bin(positions.data(), scales.data(), rotations.data(), indices.data(), nParticleCount, pJobSystem);
+        nHierarchicalBinNanoseconds += hierarchicalBinner.GetBinNanoseconds();
+    }
+
+    TileBinningBenchmarkResult result = {};
+    result.nParticleCount = nParticleCount;
+    result.nIterationCount = nIterationCount;
+    result.nTileCount = binner.GetTileCount();
+    result.nOccupiedTileCount = binner.GetOccupiedTileCount();
+    if (nIterationCount == 0)
+    {
+        return result;
+    }
+
+    result.fBinMilliseconds = nBinNanoseconds / 1e6 / nIterationCount;
+    result.overflow = binner.GetOverflow();
+    result.fHierarchicalBinMilliseconds = nHierarchicalBinNanoseconds / 1e6 / nIterationCount;
+    if (nParticleCount > 0)
+    {
+        uint32_t nBigEntryCount = 0;
+        for (uint32_t nBinY = 0; nBinY < hierarchicalBinner.GetBinCountY(); nBinY++)
+        {
+            for (uint32_t nBinX = 0; nBinX < hierarchicalBinner.GetBinCountX(); nBinX++)
+            {
+                uint32_t nBigCount;
+                hierarchicalBinner.GetBigParticles(nBinX, nBinY, nBigCount);
+                nBigEntryCount += nBigCount;
+            }
+        }
+        result.fOverlapsPerParticle = (double)binner.GetOverlapCount() / nParticleCount;
+        result.fHierarchicalOverlapsPerParticle = (double)(hierarchicalBinner.GetTileOverlapCount() + nBigEntryCount) / nParticleCount;
+    }
+
+    ParticleTileBinner reference(nWidth, nHeight);
+    reference.BinBruteForce(positions.data(), scales.data(), rotations.data(), indices.data(), nParticleCount);
+    result.fBruteForceMilliseconds = reference.GetBinNanoseconds() / 1e6;
+
+    uint32_t nMismatchedTileCount;
+    uint32_t nHierarchicalMismatchedTileCount;
+    CompareWithBruteForce(reference, binner, hierarchicalBinner, positions.data(), scales.data(), rotations.data(), nMismatchedTileCount, nHierarchicalMismatchedTileCount);
+    result.bMatchesBruteForce = OccupiedTilesMatch(reference, binner) && nMismatchedTileCount == 0;
+    result.bHierarchicalMatchesBruteForce = nHierarchicalMismatchedTileCount == 0;
+    return result;
+}
+
+TileBinningValidationResult ValidateTileBinning(TileBinningScene scene, uint32_t nParticleCount, uint32_t nWidth, uint32_t nHeight, JobSystem* pJobSystem)
+{
+    std::mt19937 randomNumberEngine(7);
+
+    std::vector<Float2> positions(nParticleCount);
+    std::vector<Float2> scales(nParticleCount);
+    std::vector<Float2> velocities(nParticleCount);
+    std::vector<float> rotations(nParticleCount);
+    std::vector<uint32_t> indices(nParticleCount);
+    CreateTileBinningScene(scene, nWidth, nHeight, randomNumberEngine, positions, scales, velocities, rotations);
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        indices[i] = i;
+    }
+    std::shuffle(indices.begin(), indices.end(), randomNumberEngine);
+
+    ParticleTileBinner binner(nWidth, nHeight);
+    ParticleHierarchicalTileBinner hierarchicalBinner(nWidth, nHeight);
+    ParticleTileBinner reference(nWidth, nHeight);
+    binner.Bin(positions.data(), scales.data(), rotations.data(), indices.data(), nParticleCount, pJobSystem);
+    hierarchicalBinner.Bin(positions.data(), scales.data(), rotations.data(), indices.data(), nParticleCount, pJobSystem);
+    reference.BinBruteForce(positions.data(), scales.data(), rotations.data(), indices.data(), nParticleCount);
+
+    TileBinningValidationResult result = {};
+    result.overflow = binner.GetOverflow();
+    result.bOccupiedTilesMatch = OccupiedTilesMatch(reference, binner);
+    CompareWithBruteForce(reference, binner, hierarchicalBinner, positions.data(), scales.data(), rotations.data(), result.nMismatchedTileCount, result.nHierarchicalMismatchedTileCount);
+
+    // The counters CSTileScan writes, from the brute force lists. The tiles past TILE_LIST_CAPACITY are cut short
+    // and only the part that's left spills.
+    const uint32_t nTileCount = reference.GetTileCount();
+    const uint32_t nCapacity = TILE_LIST_CAPACITY(nTileCount);
+    TileListOverflow expectedOverflow = {};
+    std::vector<uint32_t> spilledTiles;
+    uint32_t nOffset = 0;
+    for (uint32_t iTile = 0; iTile < nTileCount; iTile++)
+    {
+        uint32_t nCountInTile = reference.GetTileRanges()[iTile].nCount;
+        uint32_t nStoredCount = std::min(nCountInTile, nCapacity - std::min(nOffset, nCapacity));
+        if (nStoredCount > MAX_PARTICLE_PER_TILE)
+        {
+            expectedOverflow.nSpilledTileCount++;
+            expectedOverflow.nOverflowEntryCount += nStoredCount - MAX_PARTICLE_PER_TILE;
+            spilledTiles.push_back(iTile);
+        }
+        expectedOverflow.nLargestTileCount = std::max(expectedOverflow.nLargestTileCount, nCountInTile);
+        nOffset += nCountInTile;
+    }
+    expectedOverflow.nDroppedEntryCount = nOffset - std::min(nOffset, nCapacity);
+    result.bOverflowMatches = expectedOverflow.nSpilledTileCount == result.overflow.nSpilledTileCount &&
+        expectedOverflow.nOverflowEntryCount == result.overflow.nOverflowEntryCount &&
+        expectedOverflow.nDroppedEntryCount == result.overflow.nDroppedEntryCount &&
+        expectedOverflow.nLargestTileCount == result.overflow.nLargestTileCount;
+
+    // CSTileSortSpill gets the spilled lists in whatever order the atomics of CSTileScatter gave them. Its network is the
+    // one of BitonicSortKeyValues with the particle indices as the keys, it has to give the brute force order.
+    // A cut tile keeps the entries that came first on the GPU, here it's the start of the brute force list.
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> values;
+    for (uint32_t nTile : spilledTiles)
+    {
+        const TileParticleRange& range = reference.GetTileRanges()[nTile];
+        const uint32_t* pReference = reference.GetParticleIndices() + range.nOffset;
+        uint32_t nStoredCount = std::min(range.nCount, nCapacity - std::min(range.nOffset, nCapacity));
+        keys.assign(pReference, pReference + nStoredCount);
+        std::shuffle(keys.begin(), keys.end(), randomNumberEngine);
+        values = keys;
+        BitonicSortKeyValues(keys.data(), values.data(), nStoredCount);
+        if (!std::equal(keys.begin(), keys.end(), pReference))
+        {
+            result.nSpillSortMismatchCount++;
+        }
+    }
+
+    result.bPassed = result.bOccupiedTilesMatch && result.nMismatchedTileCount == 0 && result.nHierarchicalMismatchedTileCount == 0 &&
+        result.bOverflowMatches && result.nSpillSortMismatchCount == 0;
+    return result;
+}
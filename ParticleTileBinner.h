@@ -0,0 +1,277 @@
+#pragma once
+
+// Screen tile binning for the tiled rasterization, the CPU side of the CSTile* passes in ParticleTile.hlsl.
+// Every particle finds the tiles it covers itself, instead of every tile looking at every particle:
+//  - every live particle counts itself into the tiles its bounding box covers
+//  - an exclusive prefix sum over the tile counts gives the start of every tile's list
+//  - every particle writes its index into the lists of its tiles
+//  - the lists get radix sorted by particle index, so later particles end up on top like with the primitive draw
+// The scan also makes the work list of the rasterization, the tiles that got any particles.
+// That's O(particles + overlaps) work, where the per tile scan of CSCollectParticles was O(tiles * particles).
+//
+// ParticleHierarchicalTileBinner does the same in two levels: the particles go into coarse bins of
+// BinSizeInTiles x BinSizeInTiles tiles first, then every non-empty bin is split into its tiles on its own.
+// Particles that cover a lot of tiles stay in the bins, so they don't end up in hundreds of tile lists.
+//
+// The tiles are TILE_SIZE_IN_PIXELS unless the binner is given another size, the last row and column can be partial.
+// The particles are in clip space, [-1, 1] on both axes with y pointing up, the tiles start at the top left corner of the screen.
+// A tile gets every particle whose bounding box is inside or touches it from the inside: a box that ends exactly on the
+// boundary between two tiles only goes to the tile it covers. Without DISABLE_ROTATION the particles that only
+// cover a tile with a corner of their bounding box are dropped with the separating axis test on their own axes.
+
+#include "JobSystem.h"
+#include "ParticleTileSizePolicy.h"
+#include "ParticleUpdateKernels.h"
+#include "TileConstants.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+struct Float2;
+
+// Same layout as the texels of g_offsetPerTiles
+struct TileParticleRange
+{
+    uint32_t nOffset;   // Into GetParticleIndices()
+    uint32_t nCount;
+};
+
+// The tiles [nFirstX, nLastX] x [nFirstY, nLastY] a particle's bounding box covers
+struct TileRect
+{
+    int32_t nFirstX;
+    int32_t nFirstY;
+    int32_t nLastX;
+    int32_t nLastY;
+};
+
+// What the TILE_COUNTER_* counters of CSTileScan would say about the same lists
+struct TileListOverflow
+{
+    uint32_t nSpilledTileCount;     // Tiles over MAX_PARTICLE_PER_TILE that CSTileSortSpill has to sort
+    uint32_t nOverflowEntryCount;   // Their entries over MAX_PARTICLE_PER_TILE
+    uint32_t nDroppedEntryCount;    // Entries past TILE_LIST_CAPACITY, the only ones the GPU loses
+    uint32_t nLargestTileCount;
+};
+
+// The tiles of a screen and the tests that decide which tiles a particle goes to, shared by the binners
+class TileGrid
+{
+public:
+    // Up to TILE_SIZE_MAX_IN_PIXELS
+    void SetResolution(uint32_t nWidth, uint32_t nHeight, uint32_t nTileSize = TILE_SIZE_IN_PIXELS);
+    uint32_t GetWidth() const                               { return m_nWidth; }
+    uint32_t GetHeight() const                              { return m_nHeight; }
+    uint32_t GetTileSize() const                            { return m_nTileSize; }
+    uint32_t GetTileCountX() const                          { return m_nTileCountX; }
+    uint32_t GetTileCountY() const                          { return m_nTileCountY; }
+    uint32_t GetTileCount() const                           { return m_nTileCountX * m_nTileCountY; }
+
+    // False if the particle is completely off screen
+    bool GetTileRect(const Float2& position, const Float2& scale, float fRotation, TileRect& rect) const;
+
+    // The narrow test for a tile inside the rect of the particle, always true with DISABLE_ROTATION
+    bool OverlapsTile(const Float2& position, const Float2& scale, float fRotation, uint32_t nTileX, uint32_t nTileY) const;
+
+    // Both of the above, the same answer the binners give
+    bool ParticleInTile(const Float2& position, const Float2& scale, float fRotation, uint32_t nTileX, uint32_t nTileY) const;
+
+private:
+    uint32_t m_nWidth = 0;
+    uint32_t m_nHeight = 0;
+    uint32_t m_nTileSize = TILE_SIZE_IN_PIXELS;
+    uint32_t m_nTileCountX = 0;
+    uint32_t m_nTileCountY = 0;
+};
+
+class ParticleTileBinner
+{
+public:
+    // Number of particles a job processes at once, same as ParticleSimulationCPU::ChunkSize
+    static const uint32_t ChunkSize = 4096;
+
+    // Number of tiles a job sorts at once
+    static const uint32_t TileChunkSize = 16;
+
+    ParticleTileBinner(uint32_t nWidth, uint32_t nHeight, uint32_t nTileSize = TILE_SIZE_IN_PIXELS);
+
+    // Drops the current lists, the next Bin covers a screen of nWidth x nHeight pixels with tiles of nTileSize
+    void SetResolution(uint32_t nWidth, uint32_t nHeight, uint32_t nTileSize = TILE_SIZE_IN_PIXELS);
+    void SetTileSize(uint32_t nTileSize)                    { SetResolution(m_grid.GetWidth(), m_grid.GetHeight(), nTileSize); }
+    const TileGrid& GetGrid() const                         { return m_grid; }
+    uint32_t GetTileSize() const                            { return m_grid.GetTileSize(); }
+    uint32_t GetTileCountX() const                          { return m_grid.GetTileCountX(); }
+    uint32_t GetTileCountY() const                          { return m_grid.GetTileCountY(); }
+    uint32_t GetTileCount() const                           { return m_grid.GetTileCount(); }
+
+    // Bins the particles in pIndices[0, nCount). The scales are half sizes like everywhere else.
+    // Without rotations every particle is axis aligned. Without a job system everything runs on the calling thread.
+    void Bin(const Float2* pPositions, const Float2* pScales, const float* pRotations, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem);
+
+    // Same lists the slow way: every tile goes through all the particles, like CSCollectParticles used to.
+    // Only there to check the binners against.
+    void BinBruteForce(const Float2* pPositions, const Float2* pScales, const float* pRotations, const uint32_t* pIndices, uint32_t nCount);
+
+    // Row major, GetTileRanges()[nTileY * GetTileCountX() + nTileX]. Unlike on the GPU there's no
+    // TILE_LIST_CAPACITY limit, the lists hold every particle.
+    const TileParticleRange* GetTileRanges() const          { return m_tileRanges.data(); }
+    const uint32_t* GetParticleIndices() const              { return m_particleIndices.data(); }
+    uint32_t GetOverlapCount() const                        { return m_nOverlapCount; }
+
+    // The row major indices of the tiles with particles, in order. Same as the work list of CSTileScan,
+    // the rasterization only shades these and clears the others.
+    const uint32_t* GetOccupiedTiles() const                { return m_occupiedTiles.data(); }
+    uint32_t GetOccupiedTileCount() const                   { return (uint32_t)m_occupiedTiles.size(); }
+
+    // Of the last Bin
+    const TileListOverflow& GetOverflow() const             { return m_overflow; }
+    uint32_t GetBinnedParticleCount() const                 { return m_nBinnedParticleCount; }
+
+    // The last Bin's lists for ParticleTileSizePolicy, the same the GPU reads back from its counters
+    TileOccupancy GetOccupancy() const;
+
+    // Wall clock time of the last Bin or BinBruteForce
+    uint64_t GetBinNanoseconds() const                      { return m_nBinNanoseconds; }
+
+private:
+    void ForEachChunk(uint32_t nCount, uint32_t nChunkSize, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob);
+
+    TileGrid m_grid;
+    uint32_t m_nOverlapCount = 0;
+    uint32_t m_nBinnedParticleCount = 0;
+    TileListOverflow m_overflow = {};
+    SimdInstructionSet m_instructionSet = GetBestSupportedInstructionSet();
+
+    // Bounding box of every particle in tiles, in the order of the input indices
+    std::vector<TileRect> m_particleRects;
+
+    std::unique_ptr<std::atomic<uint32_t>[]> m_tileCounts;
+    std::vector<TileParticleRange> m_tileRanges;
+    std::vector<uint32_t> m_particleIndices;
+    std::vector<uint32_t> m_occupiedTiles;
+    std::vector<std::vector<uint32_t>> m_sortScratch;   // By worker
+
+    uint64_t m_nBinNanoseconds = 0;
+};
+
+class ParticleHierarchicalTileBinner
+{
+public:
+    // Number of particles a job processes at once, same as ParticleSimulationCPU::ChunkSize
+    static const uint32_t ChunkSize = 4096;
+
+    // 256 pixel bins with the 32 pixel tiles
+    static const uint32_t BinSizeInTiles = 8;
+
+    // Particles whose bounding box covers more tiles than this are big, they only go into the bins
+    static const uint32_t BigParticleTileCount = 16;
+
+    ParticleHierarchicalTileBinner(uint32_t nWidth, uint32_t nHeight);
+
+    // Drops the current lists, the next Bin covers a screen of nWidth x nHeight pixels
+    void SetResolution(uint32_t nWidth, uint32_t nHeight);
+    const TileGrid& GetGrid() const                         { return m_grid; }
+    uint32_t GetBinCountX() const                           { return m_nBinCountX; }
+    uint32_t GetBinCountY() const                           { return m_nBinCountY; }
+    uint32_t GetBinCount() const                            { return m_nBinCountX * m_nBinCountY; }
+
+    // Same inputs as ParticleTileBinner::Bin
+    void Bin(const Float2* pPositions, const Float2* pScales, const float* pRotations, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem);
+
+    // The particles of the tile that aren't big, sorted by index
+    const uint32_t* GetTileParticles(uint32_t nTileX, uint32_t nTileY, uint32_t& nCount) const;
+
+    // The big particles touching the bin, sorted by index. A big particle doesn't have to cover every tile of its bins,
+    // whoever uses the list still has to test it against the tile.
+    const uint32_t* GetBigParticles(uint32_t nBinX, uint32_t nBinY, uint32_t& nCount) const;
+
+    // Number of particles that were big in the last Bin, and the number of tile list entries the small ones made
+    uint32_t GetBigParticleCount() const                    { return m_nBigParticleCount; }
+    uint32_t GetTileOverlapCount() const                    { return m_nTileOverlapCount; }
+
+    // Wall clock time of the last Bin
+    uint64_t GetBinNanoseconds() const                      { return m_nBinNanoseconds; }
+
+private:
+    // Everything of a bin is only touched by the job that refines it
+    struct CoarseBin
+    {
+        std::vector<uint32_t> tileStarts;       // BinSizeInTiles^2 + 1, local row major tiles
+        std::vector<uint32_t> particleIndices;  // The small particles' tile lists
+        std::vector<uint32_t> bigParticles;
+        std::vector<uint64_t> tileEntries;      // Scratch, local tile in the upper half and particle index in the lower
+    };
+
+    void ForEachChunk(uint32_t nCount, uint32_t nChunkSize, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob);
+    void RefineBin(uint32_t nBin, const Float2* pPositions, const Float2* pScales, const float* pRotations);
+
+    TileGrid m_grid;
+    uint32_t m_nBinCountX = 0;
+    uint32_t m_nBinCountY = 0;
+    uint32_t m_nBigParticleCount = 0;
+    uint32_t m_nTileOverlapCount = 0;
+
+    // Bounding box of every particle in tiles, in the order of the input indices
+    std::vector<TileRect> m_particleRects;
+
+    // The small particles of all the bins first, then the big ones
+    std::unique_ptr<std::atomic<uint32_t>[]> m_binCounts;
+    std::vector<uint32_t> m_binStarts;
+    std::vector<uint64_t> m_binEntries;     // Particle index in the upper half, place in the input indices in the lower
+
+    std::vector<CoarseBin> m_bins;
+
+    uint64_t m_nBinNanoseconds = 0;
+};
+
+enum class TileBinningScene
+{
+    Uniform,        // Mostly small particles all over the screen, the odd one covers a few tiles
+    BigParticles,   // The same with every tenth particle covering a big part of the screen
+    DenseCluster,   // Most of the particles in a small blob, way over MAX_PARTICLE_PER_TILE in its tiles
+    SingleTile,     // Every particle inside the same TILE_SIZE_IN_PIXELS tile
+    ScreenCovering, // Every particle covers the whole screen, more than TILE_LIST_CAPACITY with over MAX_PARTICLE_PER_TILE of them
+    Count
+};
+
+struct TileBinningBenchmarkResult
+{
+    uint32_t nParticleCount;
+    uint32_t nIterationCount;
+    uint32_t nTileCount;
+    uint32_t nOccupiedTileCount;            // Tiles with particles in the last iteration
+    double fBinMilliseconds;                // Averages over the iterations
+    double fHierarchicalBinMilliseconds;
+    double fBruteForceMilliseconds;         // A single BinBruteForce over the last iteration's particles
+    double fOverlapsPerParticle;            // Tile list entries of the flat binner
+    double fHierarchicalOverlapsPerParticle;// Tile and bin list entries of the hierarchical one
+    bool bMatchesBruteForce;                // Same lists, in the same order, and the same occupied tiles as BinBruteForce
+    bool bHierarchicalMatchesBruteForce;    // Same, with the big particles of the bins tested against the tile and merged in
+    TileListOverflow overflow;              // Of the last iteration, what the GPU would have spilled and dropped
+};
+
+// Fills the streams with the particles of the scene, sized by TILE_SIZE_IN_PIXELS tiles. The velocities are in clip space per second.
+void CreateTileBinningScene(TileBinningScene scene, uint32_t nWidth, uint32_t nHeight, std::mt19937& randomNumberEngine,
+    std::vector<Float2>& positions, std::vector<Float2>& scales, std::vector<Float2>& velocities, std::vector<float>& rotations);
+
+// Bins nParticleCount particles of the scene with both binners nIterationCount times, moving them a little between
+// the iterations like a running simulation would. The lists of the last iteration are checked against the brute force ones.
+TileBinningBenchmarkResult BenchmarkTileBinning(TileBinningScene scene, uint32_t nParticleCount, uint32_t nIterationCount, uint32_t nWidth, uint32_t nHeight, JobSystem* pJobSystem);
+
+struct TileBinningValidationResult
+{
+    uint32_t nMismatchedTileCount;              // Tiles whose list differs from BinBruteForce's
+    uint32_t nHierarchicalMismatchedTileCount;  // Same for the hierarchical binner, with the big particles merged in
+    bool bOccupiedTilesMatch;
+    bool bOverflowMatches;                      // GetOverflow against the counters CSTileScan writes for the brute force lists
+    uint32_t nSpillSortMismatchCount;           // Spilled tiles the network of CSTileSortSpill doesn't put in the brute force order
+    TileListOverflow overflow;
+    bool bPassed;
+};
+
+// Bins the scene once with both binners and checks everything against BinBruteForce, including what the GPU
+// does with the tiles over MAX_PARTICLE_PER_TILE. Meant for the scenes that spill, like SingleTile and DenseCluster.
+TileBinningValidationResult ValidateTileBinning(TileBinningScene scene, uint32_t nParticleCount, uint32_t nWidth, uint32_t nHeight, JobSystem* pJobSystem);
@@ -0,0 +1,1039 @@
+#include "ParticleTileRasterizer.h"
+#include "ParticleSimulationCPU.h"
+#include "ParticleTileBinner.h"
+#include "TileConstants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+
+// The results have to match the scalar path bit for bit, so the compiler must not fuse the multiply and the add.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PARTICLE_SIMD_X86
+#endif
+
+#ifdef PARTICLE_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// MSVC lets us use any intrinsic in any function, GCC and Clang need to be told per function.
+#if defined(__GNUC__) || defined(__clang__)
+#define PARTICLE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PARTICLE_TARGET(isa)
+#endif
+
+typedef ParticleTileRasterizer::QuadSetup QuadSetup;
+typedef ParticleTileRasterizer::QuadPlanes QuadPlanes;
+
+// Same steps as CSParticleRasterSetup, the particle is rotated around its center and the coordinates start from corner 3
+static QuadSetup SetupQuad(const Float2& position, const Float2& scale, float fRotation)
+{
+    float fSin = std::sin(fRotation);
+    float fCos = std::cos(fRotation);
+
+    // Note the scale means the half size
+    Float2 corners[4] =
+    {
+        { position.x - scale.x, position.y - scale.y },
+        { position.x + scale.x, position.y - scale.y },
+        { position.x + scale.x, position.y + scale.y },
+        { position.x - scale.x, position.y + scale.y },
+    };
+    for (Float2& corner : corners)
+    {
+        float fOffsetX = corner.x - position.x;
+        float fOffsetY = corner.y - position.y;
+        corner.x = fOffsetX * fCos - fOffsetY * fSin + position.x;
+        corner.y = fOffsetX * fSin + fOffsetY * fCos + position.y;
+    }
+
+    QuadSetup quad;
+    quad.fCornerX = corners[3].x;
+    quad.fCornerY = corners[3].y;
+    quad.fV0X = corners[2].x - corners[3].x;
+    quad.fV0Y = corners[2].y - corners[3].y;
+    quad.fV1X = corners[0].x - corners[3].x;
+    quad.fV1Y = corners[0].y - corners[3].y;
+    quad.fDot00 = quad.fV0X * quad.fV0X + quad.fV0Y * quad.fV0Y;
+    quad.fDot01 = quad.fV0X * quad.fV1X + quad.fV0Y * quad.fV1Y;
+    quad.fDot11 = quad.fV1X * quad.fV1X + quad.fV1Y * quad.fV1Y;
+    quad.fInvDenom = 1.0f / (quad.fDot00 * quad.fDot11 - quad.fDot01 * quad.fDot01);
+    return quad;
+}
+
+// u = (dot11 * dot(v0, p - c3) - dot01 * dot(v1, p - c3)) * invDenom is linear in p, and so is v
+static QuadPlanes SetupQuadPlanes(const Float2& position, const Float2& scale, float fRotation)
+{
+    QuadSetup quad = SetupQuad(position, scale, fRotation);
+
+    QuadPlanes planes;
+    planes.fUX = (quad.fDot11 * quad.fV0X - quad.fDot01 * quad.fV1X) * quad.fInvDenom;
+    planes.fUY = (quad.fDot11 * quad.fV0Y - quad.fDot01 * quad.fV1Y) * quad.fInvDenom;
+    planes.fUW = -(planes.fUX * quad.fCornerX + planes.fUY * quad.fCornerY);
+    planes.fVX = (quad.fDot00 * quad.fV1X - quad.fDot01 * quad.fV0X) * quad.fInvDenom;
+    planes.fVY = (quad.fDot00 * quad.fV1Y - quad.fDot01 * quad.fV0Y) * quad.fInvDenom;
+    planes.fVW = -(planes.fVX * quad.fCornerX + planes.fVY * quad.fCornerY);
+    return planes;
+}
+
+// What the row functions shade, a row of a tile
+struct TileRow
+{
+    const float* pPixelX;   // TILE_SIZE_MAX_IN_PIXELS of them
+    uint32_t nPixelCount;   // The pixels on the screen, the rest of the row isn't shaded
+    float fPixelY;
+    float fOpaqueAlpha;
+    uint32_t* pColors;
+    ParticleTileRasterizer::CompositeStats* pStats;
+};
+
+static inline bool IsInQuad(float u, float v)
+{
+    return u >= 0.0f && v >= 0.0f && u <= 1.0f && v <= 1.0f;
+}
+
+// Puts the quad's color under the pixel's, true once the pixel is opaque enough to stop
+static inline bool CompositeUnder(Float4& color, const Float4& quadColor, uint32_t nQuadsLeft, const TileRow& row)
+{
+    float fWeight = (1.0f - color.w) * quadColor.w;
+    color.x += fWeight * quadColor.x;
+    color.y += fWeight * quadColor.y;
+    color.z += fWeight * quadColor.z;
+    color.w += fWeight;
+    if (color.w < row.fOpaqueAlpha)
+    {
+        return false;
+    }
+
+    row.pStats->nSaturatedPixelCount++;
+    row.pStats->nSkippedQuadCount += nQuadsLeft;
+    return true;
+}
+
+static inline void CountSaturated(uint32_t nLaneBits, uint32_t nQuadsLeft, const TileRow& row)
+{
+    uint32_t nLaneCount = 0;
+    for (; nLaneBits; nLaneBits &= nLaneBits - 1)
+    {
+        nLaneCount++;
+    }
+    row.pStats->nSaturatedPixelCount += nLaneCount;
+    row.pStats->nSkippedQuadCount += (uint64_t)nLaneCount * nQuadsLeft;
+}
+
+// UNORM conversion of the render target, the premultiplied colors stay in [0, 1] unless a particle's color is over one
+static inline uint32_t ToUNorm(float fValue)
+{
+    return (uint32_t)((fValue < 1.0f ? fValue : 1.0f) * 255.0f + 0.5f);
+}
+
+static inline uint32_t PackColor(const Float4& color)
+{
+    return ToUNorm(color.x) | (ToUNorm(color.y) << 8) | (ToUNorm(color.z) << 16) | (ToUNorm(color.w) << 24);
+}
+
+// Reference implementations, this is what CSRasterizeParticles does for a single thread.
+// The particles are gone through from the last one, front to back.
+static void ShadeRowBarycentricScalar(const QuadSetup* pQuads, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    for (uint32_t iPixel = 0; iPixel < row.nPixelCount; iPixel++)
+    {
+        Float4 color = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (uint32_t iQuad = nQuadCount; iQuad-- > 0;)
+        {
+            const QuadSetup& quad = pQuads[iQuad];
+            float fV2X = row.pPixelX[iPixel] - quad.fCornerX;
+            float fV2Y = row.fPixelY - quad.fCornerY;
+            float fDot02 = quad.fV0X * fV2X + quad.fV0Y * fV2Y;
+            float fDot12 = quad.fV1X * fV2X + quad.fV1Y * fV2Y;
+            float u = (quad.fDot11 * fDot02 - quad.fDot01 * fDot12) * quad.fInvDenom;
+            float v = (quad.fDot00 * fDot12 - quad.fDot01 * fDot02) * quad.fInvDenom;
+            if (IsInQuad(u, v) && CompositeUnder(color, pQuadColors[iQuad], iQuad, row))
+            {
+                break;
+            }
+        }
+        row.pColors[iPixel] = PackColor(color);
+    }
+}
+
+static void ShadeRowPlanesScalar(const QuadPlanes* pPlanes, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    for (uint32_t iPixel = 0; iPixel < row.nPixelCount; iPixel++)
+    {
+        Float4 color = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (uint32_t iQuad = nQuadCount; iQuad-- > 0;)
+        {
+            const QuadPlanes& planes = pPlanes[iQuad];
+            float u = planes.fUX * row.pPixelX[iPixel] + (planes.fUY * row.fPixelY + planes.fUW);
+            float v = planes.fVX * row.pPixelX[iPixel] + (planes.fVY * row.fPixelY + planes.fVW);
+            if (IsInQuad(u, v) && CompositeUnder(color, pQuadColors[iQuad], iQuad, row))
+            {
+                break;
+            }
+        }
+        row.pColors[iPixel] = PackColor(color);
+    }
+}
+
+#ifdef PARTICLE_SIMD_X86
+// The pending lanes that are in the quad put its color under theirs. The ones that got opaque enough stop pending.
+// True once no lane is pending anymore.
+PARTICLE_TARGET("sse4.2")
+static inline bool CompositeUnderSSE42(__m128 u, __m128 v, const Float4& quadColor, uint32_t nQuadsLeft, const TileRow& row, __m128& pending, __m128 (&color)[4])
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)), _mm_and_ps(_mm_cmple_ps(u, one), _mm_cmple_ps(v, one)));
+    inside = _mm_and_ps(inside, pending);
+    if (_mm_movemask_ps(inside) == 0)
+    {
+        return false;
+    }
+
+    __m128 weight = _mm_and_ps(_mm_mul_ps(_mm_sub_ps(one, color[3]), _mm_set1_ps(quadColor.w)), inside);
+    color[0] = _mm_add_ps(color[0], _mm_mul_ps(weight, _mm_set1_ps(quadColor.x)));
+    color[1] = _mm_add_ps(color[1], _mm_mul_ps(weight, _mm_set1_ps(quadColor.y)));
+    color[2] = _mm_add_ps(color[2], _mm_mul_ps(weight, _mm_set1_ps(quadColor.z)));
+    color[3] = _mm_add_ps(color[3], weight);
+
+    __m128 saturated = _mm_and_ps(_mm_cmpge_ps(color[3], _mm_set1_ps(row.fOpaqueAlpha)), inside);
+    int nSaturated = _mm_movemask_ps(saturated);
+    if (nSaturated == 0)
+    {
+        return false;
+    }
+
+    CountSaturated((uint32_t)nSaturated, nQuadsLeft, row);
+    pending = _mm_andnot_ps(saturated, pending);
+    return _mm_movemask_ps(pending) == 0;
+}
+
+PARTICLE_TARGET("sse4.2")
+static inline __m128i PackColorsSSE42(const __m128 (&color)[4])
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 colorScale = _mm_set1_ps(255.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    __m128i red = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(color[0], one), colorScale), half));
+    __m128i green = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(color[1], one), colorScale), half));
+    __m128i blue = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(color[2], one), colorScale), half));
+    __m128i alpha = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(color[3], one), colorScale), half));
+    return _mm_or_si128(_mm_or_si128(red, _mm_slli_epi32(green, 8)), _mm_or_si128(_mm_slli_epi32(blue, 16), _mm_slli_epi32(alpha, 24)));
+}
+
+// The lanes of the pixels on the screen
+PARTICLE_TARGET("sse4.2")
+static inline __m128 OnScreenLanesSSE42(uint32_t nPixel, uint32_t nPixelCount)
+{
+    __m128i pixels = _mm_add_epi32(_mm_set1_epi32((int)nPixel), _mm_setr_epi32(0, 1, 2, 3));
+    return _mm_castsi128_ps(_mm_cmplt_epi32(pixels, _mm_set1_epi32((int)nPixelCount)));
+}
+
+PARTICLE_TARGET("sse4.2")
+static void ShadeRowBarycentricSSE42(const QuadSetup* pQuads, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    const __m128 y = _mm_set1_ps(row.fPixelY);
+    for (uint32_t iPixel = 0; iPixel < row.nPixelCount; iPixel += 4)
+    {
+        const __m128 x = _mm_loadu_ps(row.pPixelX + iPixel);
+        __m128 color[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+        __m128 pending = OnScreenLanesSSE42(iPixel, row.nPixelCount);
+
+        // Until every pixel of the four is opaque enough
+        for (uint32_t iQuad = nQuadCount; iQuad-- > 0;)
+        {
+            const QuadSetup& quad = pQuads[iQuad];
+            __m128 v2x = _mm_sub_ps(x, _mm_set1_ps(quad.fCornerX));
+            __m128 v2y = _mm_sub_ps(y, _mm_set1_ps(quad.fCornerY));
+            __m128 dot02 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(quad.fV0X), v2x), _mm_mul_ps(_mm_set1_ps(quad.fV0Y), v2y));
+            __m128 dot12 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(quad.fV1X), v2x), _mm_mul_ps(_mm_set1_ps(quad.fV1Y), v2y));
+            __m128 u = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(quad.fDot11), dot02), _mm_mul_ps(_mm_set1_ps(quad.fDot01), dot12)), _mm_set1_ps(quad.fInvDenom));
+            __m128 v = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(quad.fDot00), dot12), _mm_mul_ps(_mm_set1_ps(quad.fDot01), dot02)), _mm_set1_ps(quad.fInvDenom));
+            if (CompositeUnderSSE42(u, v, pQuadColors[iQuad], iQuad, row, pending, color))
+            {
+                break;
+            }
+        }
+        _mm_storeu_si128((__m128i*)(row.pColors + iPixel), PackColorsSSE42(color));
+    }
+}
+
+PARTICLE_TARGET("sse4.2")
+static void ShadeRowPlanesSSE42(const QuadPlanes* pPlanes, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    for (uint32_t iPixel = 0; iPixel < row.nPixelCount; iPixel += 4)
+    {
+        const __m128 x = _mm_loadu_ps(row.pPixelX + iPixel);
+        __m128 color[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+        __m128 pending = OnScreenLanesSSE42(iPixel, row.nPixelCount);
+
+        for (uint32_t iQuad = nQuadCount; iQuad-- > 0;)
+        {
+            const QuadPlanes& planes = pPlanes[iQuad];
+            __m128 u = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes.fUX), x), _mm_set1_ps(planes.fUY * row.fPixelY + planes.fUW));
+            __m128 v = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes.fVX), x), _mm_set1_ps(planes.fVY * row.fPixelY + planes.fVW));
+            if (CompositeUnderSSE42(u, v, pQuadColors[iQuad], iQuad, row, pending, color))
+            {
+                break;
+            }
+        }
+        _mm_storeu_si128((__m128i*)(row.pColors + iPixel), PackColorsSSE42(color));
+    }
+}
+
+PARTICLE_TARGET("avx2")
+static inline bool CompositeUnderAVX2(__m256 u, __m256 v, const Float4& quadColor, uint32_t nQuadsLeft, const TileRow& row, __m256& pending, __m256 (&color)[4])
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ)),
+        _mm256_and_ps(_mm256_cmp_ps(u, one, _CMP_LE_OQ), _mm256_cmp_ps(v, one, _CMP_LE_OQ)));
+    inside = _mm256_and_ps(inside, pending);
+    if (_mm256_movemask_ps(inside) == 0)
+    {
+        return false;
+    }
+
+    __m256 weight = _mm256_and_ps(_mm256_mul_ps(_mm256_sub_ps(one, color[3]), _mm256_set1_ps(quadColor.w)), inside);
+    color[0] = _mm256_add_ps(color[0], _mm256_mul_ps(weight, _mm256_set1_ps(quadColor.x)));
+    color[1] = _mm256_add_ps(color[1], _mm256_mul_ps(weight, _mm256_set1_ps(quadColor.y)));
+    color[2] = _mm256_add_ps(color[2], _mm256_mul_ps(weight, _mm256_set1_ps(quadColor.z)));
+    color[3] = _mm256_add_ps(color[3], weight);
+
+    __m256 saturated = _mm256_and_ps(_mm256_cmp_ps(color[3], _mm256_set1_ps(row.fOpaqueAlpha), _CMP_GE_OQ), inside);
+    int nSaturated = _mm256_movemask_ps(saturated);
+    if (nSaturated == 0)
+    {
+        return false;
+    }
+
+    CountSaturated((uint32_t)nSaturated, nQuadsLeft, row);
+    pending = _mm256_andnot_ps(saturated, pending);
+    return _mm256_movemask_ps(pending) == 0;
+}
+
+PARTICLE_TARGET("avx2")
+static inline __m256i PackColorsAVX2(const __m256 (&color)[4])
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 colorScale = _mm256_set1_ps(255.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    __m256i red = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_min_ps(color[0], one), colorScale), half));
+    __m256i green = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_min_ps(color[1], one), colorScale), half));
+    __m256i blue = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_min_ps(color[2], one), colorScale), half));
+    __m256i alpha = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_min_ps(color[3], one), colorScale), half));
+    return _mm256_or_si256(_mm256_or_si256(red, _mm256_slli_epi32(green, 8)), _mm256_or_si256(_mm256_slli_epi32(blue, 16), _mm256_slli_epi32(alpha, 24)));
+}
+
+PARTICLE_TARGET("avx2")
+static inline __m256 OnScreenLanesAVX2(uint32_t nPixel, uint32_t nPixelCount)
+{
+    __m256i pixels = _mm256_add_epi32(_mm256_set1_epi32((int)nPixel), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32((int)nPixelCount), pixels));
+}
+
+PARTICLE_TARGET("avx2")
+static void ShadeRowBarycentricAVX2(const QuadSetup* pQuads, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    const __m256 y = _mm256_set1_ps(row.fPixelY);
+    for (uint32_t iPixel = 0; iPixel < row.nPixelCount; iPixel += 8)
+    {
+        const __m256 x = _mm256_loadu_ps(row.pPixelX + iPixel);
+        __m256 color[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+        __m256 pending = OnScreenLanesAVX2(iPixel, row.nPixelCount);
+
+        for (uint32_t iQuad = nQuadCount; iQuad-- > 0;)
+        {
+            const QuadSetup& quad = pQuads[iQuad];
+            __m256 v2x = _mm256_sub_ps(x, _mm256_set1_ps(quad.fCornerX));
+            __m256 v2y = _mm256_sub_ps(y, _mm256_set1_ps(quad.fCornerY));
+            __m256 dot02 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(quad.fV0X), v2x), _mm256_mul_ps(_mm256_set1_ps(quad.fV0Y), v2y));
+            __m256 dot12 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(quad.fV1X), v2x), _mm256_mul_ps(_mm256_set1_ps(quad.fV1Y), v2y));
+            __m256 u = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(quad.fDot11), dot02), _mm256_mul_ps(_mm256_set1_ps(quad.fDot01), dot12)), _mm256_set1_ps(quad.fInvDenom));
+            __m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(quad.fDot00), dot12), _mm256_mul_ps(_mm256_set1_ps(quad.fDot01), dot02)), _mm256_set1_ps(quad.fInvDenom));
+            if (CompositeUnderAVX2(u, v, pQuadColors[iQuad], iQuad, row, pending, color))
+            {
+                break;
+            }
+        }
+        _mm256_storeu_si256((__m256i*)(row.pColors + iPixel), PackColorsAVX2(color));
+    }
+}
+
+PARTICLE_TARGET("avx2")
+static void ShadeRowPlanesAVX2(const QuadPlanes* pPlanes, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    for (uint32_t iPixel = 0; iPixel < row.nPixelCount; iPixel += 8)
+    {
+        const __m256 x = _mm256_loadu_ps(row.pPixelX + iPixel);
+        __m256 color[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+        __m256 pending = OnScreenLanesAVX2(iPixel, row.nPixelCount);
+
+        for (uint32_t iQuad = nQuadCount; iQuad-- > 0;)
+        {
+            const QuadPlanes& planes = pPlanes[iQuad];
+            __m256 u = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(planes.fUX), x), _mm256_set1_ps(planes.fUY * row.fPixelY + planes.fUW));
+            __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(planes.fVX), x), _mm256_set1_ps(planes.fVY * row.fPixelY + planes.fVW));
+            if (CompositeUnderAVX2(u, v, pQuadColors[iQuad], iQuad, row, pending, color))
+            {
+                break;
+            }
+        }
+        _mm256_storeu_si256((__m256i*)(row.pColors + iPixel), PackColorsAVX2(color));
+    }
+}
+
+PARTICLE_TARGET("avx512f")
+static inline bool CompositeUnderAVX512(__m512 u, __m512 v, const Float4& quadColor, uint32_t nQuadsLeft, const TileRow& row, __mmask16& pending, __m512 (&color)[4])
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.0f);
+    __mmask16 inside = _mm512_mask_cmp_ps_mask(pending, u, zero, _CMP_GE_OQ);
+    inside = _mm512_mask_cmp_ps_mask(inside, v, zero, _CMP_GE_OQ);
+    inside = _mm512_mask_cmp_ps_mask(inside, u, one, _CMP_LE_OQ);
+    inside = _mm512_mask_cmp_ps_mask(inside, v, one, _CMP_LE_OQ);
+    if (inside == 0)
+    {
+        return false;
+    }
+
+    __m512 weight = _mm512_maskz_mul_ps(inside, _mm512_sub_ps(one, color[3]), _mm512_set1_ps(quadColor.w));
+    color[0] = _mm512_add_ps(color[0], _mm512_mul_ps(weight, _mm512_set1_ps(quadColor.x)));
+    color[1] = _mm512_add_ps(color[1], _mm512_mul_ps(weight, _mm512_set1_ps(quadColor.y)));
+    color[2] = _mm512_add_ps(color[2], _mm512_mul_ps(weight, _mm512_set1_ps(quadColor.z)));
+    color[3] = _mm512_add_ps(color[3], weight);
+
+    __mmask16 saturated = _mm512_mask_cmp_ps_mask(inside, color[3], _mm512_set1_ps(row.fOpaqueAlpha), _CMP_GE_OQ);
+    if (saturated == 0)
+    {
+        return false;
+    }
+
+    CountSaturated(saturated, nQuadsLeft, row);
+    pending = (__mmask16)(pending & ~saturated);
+    return pending == 0;
+}
+
+PARTICLE_TARGET("avx512f")
+static inline __m512i PackColorsAVX512(const __m512 (&color)[4])
+{
+    // The zero masked forms with every lane on are the same instructions. The plain ones of GCC pass an uninitialized
+    // vector as the source of the masked off lanes, which -Wmaybe-uninitialized reports.
+    const __mmask16 all = 0xFFFF;
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 colorScale = _mm512_set1_ps(255.0f);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    __m512i red = _mm512_maskz_cvttps_epi32(all, _mm512_add_ps(_mm512_mul_ps(_mm512_maskz_min_ps(all, color[0], one), colorScale), half));
+    __m512i green = _mm512_maskz_cvttps_epi32(all, _mm512_add_ps(_mm512_mul_ps(_mm512_maskz_min_ps(all, color[1], one), colorScale), half));
+    __m512i blue = _mm512_maskz_cvttps_epi32(all, _mm512_add_ps(_mm512_mul_ps(_mm512_maskz_min_ps(all, color[2], one), colorScale), half));
+    __m512i alpha = _mm512_maskz_cvttps_epi32(all, _mm512_add_ps(_mm512_mul_ps(_mm512_maskz_min_ps(all, color[3], one), colorScale), half));
+    return _mm512_or_si512(_mm512_or_si512(red, _mm512_maskz_slli_epi32(all, green, 8)), _mm512_or_si512(_mm512_maskz_slli_epi32(all, blue, 16), _mm512_maskz_slli_epi32(all, alpha, 24)));
+}
+
+static inline __mmask16 OnScreenLanesAVX512(uint32_t nPixel, uint32_t nPixelCount)
+{
+    return nPixelCount - nPixel >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (nPixelCount - nPixel)) - 1);
+}
+
+PARTICLE_TARGET("avx512f")
+static void ShadeRowBarycentricAVX512(const QuadSetup* pQuads, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    const __m512 y = _mm512_set1_ps(row.fPixelY);
+    for (uint32_t iPixel = 0; iPixel < row.nPixelCount; iPixel += 16)
+    {
+        const __m512 x = _mm512_loadu_ps(row.pPixelX + iPixel);
+        __m512 color[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+        __mmask16 pending = OnScreenLanesAVX512(iPixel, row.nPixelCount);
+
+        for (uint32_t iQuad = nQuadCount; iQuad-- > 0;)
+        {
+            const QuadSetup& quad = pQuads[iQuad];
+            __m512 v2x = _mm512_sub_ps(x, _mm512_set1_ps(quad.fCornerX));
+            __m512 v2y = _mm512_sub_ps(y, _mm512_set1_ps(quad.fCornerY));
+            __m512 dot02 = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(quad.fV0X), v2x), _mm512_mul_ps(_mm512_set1_ps(quad.fV0Y), v2y));
+            __m512 dot12 = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(quad.fV1X), v2x), _mm512_mul_ps(_mm512_set1_ps(quad.fV1Y), v2y));
+            __m512 u = _mm512_mul_ps(_mm512_sub_ps(_mm512_mul_ps(_mm512_set1_ps(quad.fDot11), dot02), _mm512_mul_ps(_mm512_set1_ps(quad.fDot01), dot12)), _mm512_set1_ps(quad.fInvDenom));
+            __m512 v = _mm512_mul_ps(_mm512_sub_ps(_mm512_mul_ps(_mm512_set1_ps(quad.fDot00), dot12), _mm512_mul_ps(_mm512_set1_ps(quad.fDot01), dot02)), _mm512_set1_ps(quad.fInvDenom));
+            if (CompositeUnderAVX512(u, v, pQuadColors[iQuad], iQuad, row, pending, color))
+            {
+                break;
+            }
+        }
+        _mm512_storeu_si512(row.pColors + iPixel, PackColorsAVX512(color));
+    }
+}
+
+PARTICLE_TARGET("avx512f")
+static void ShadeRowPlanesAVX512(const QuadPlanes* pPlanes, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    for (uint32_t iPixel = 0; iPixel < row.nPixelCount; iPixel += 16)
+    {
+        const __m512 x = _mm512_loadu_ps(row.pPixelX + iPixel);
+        __m512 color[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+        __mmask16 pending = OnScreenLanesAVX512(iPixel, row.nPixelCount);
+
+        for (uint32_t iQuad = nQuadCount; iQuad-- > 0;)
+        {
+            const QuadPlanes& planes = pPlanes[iQuad];
+            __m512 u = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(planes.fUX), x), _mm512_set1_ps(planes.fUY * row.fPixelY + planes.fUW));
+            __m512 v = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(planes.fVX), x), _mm512_set1_ps(planes.fVY * row.fPixelY + planes.fVW));
+            if (CompositeUnderAVX512(u, v, pQuadColors[iQuad], iQuad, row, pending, color))
+            {
+                break;
+            }
+        }
+        _mm512_storeu_si512(row.pColors + iPixel, PackColorsAVX512(color));
+    }
+}
+#endif // PARTICLE_SIMD_X86
+
+static void ShadeRowBarycentric(SimdInstructionSet instructionSet, const QuadSetup* pQuads, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    switch (instructionSet)
+    {
+#ifdef PARTICLE_SIMD_X86
+    case SimdInstructionSet::SSE42:
+        ShadeRowBarycentricSSE42(pQuads, pQuadColors, nQuadCount, row);
+        return;
+    case SimdInstructionSet::AVX2:
+        ShadeRowBarycentricAVX2(pQuads, pQuadColors, nQuadCount, row);
+        return;
+    case SimdInstructionSet::AVX512:
+        ShadeRowBarycentricAVX512(pQuads, pQuadColors, nQuadCount, row);
+        return;
+#endif
+    default:
+        ShadeRowBarycentricScalar(pQuads, pQuadColors, nQuadCount, row);
+        return;
+    }
+}
+
+static void ShadeRowPlanes(SimdInstructionSet instructionSet, const QuadPlanes* pPlanes, const Float4* pQuadColors, uint32_t nQuadCount, const TileRow& row)
+{
+    switch (instructionSet)
+    {
+#ifdef PARTICLE_SIMD_X86
+    case SimdInstructionSet::SSE42:
+        ShadeRowPlanesSSE42(pPlanes, pQuadColors, nQuadCount, row);
+        return;
+    case SimdInstructionSet::AVX2:
+        ShadeRowPlanesAVX2(pPlanes, pQuadColors, nQuadCount, row);
+        return;
+    case SimdInstructionSet::AVX512:
+        ShadeRowPlanesAVX512(pPlanes, pQuadColors, nQuadCount, row);
+        return;
+#endif
+    default:
+        ShadeRowPlanesScalar(pPlanes, pQuadColors, nQuadCount, row);
+        return;
+    }
+}
+
+ParticleTileRasterizer::ParticleTileRasterizer() :
+    m_instructionSet(GetBestSupportedInstructionSet()),
+    m_fOpaqueAlpha(TILE_COMPOSITE_OPAQUE_ALPHA)
+{
+}
+
+void ParticleTileRasterizer::SetInstructionSet(SimdInstructionSet instructionSet)
+{
+    m_instructionSet = IsInstructionSetSupported(instructionSet) ? instructionSet : SimdInstructionSet::Scalar;
+}
+
+void ParticleTileRasterizer::ForEachChunk(uint32_t nCount, uint32_t nChunkSize, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob)
+{
+    if (pJobSystem)
+    {
+        pJobSystem->ParallelFor(nCount, nChunkSize, fnJob);
+        return;
+    }
+
+    for (uint32_t nBegin = 0; nBegin < nCount; nBegin += nChunkSize)
+    {
+        fnJob(nBegin, std::min(nCount, nBegin + nChunkSize), 0);
+    }
+}
+
+void ParticleTileRasterizer::SetupParticles(const Float2* pPositions, const Float2* pScales, const float* pRotations, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem)
+{
+    // Indexed like the particle streams, so the tile lists can look their particles up directly
+    uint32_t nIndexCount = nCount ? *std::max_element(pIndices, pIndices + nCount) + 1 : 0;
+    if (m_particlePlanes.size() < nIndexCount)
+    {
+        m_particlePlanes.resize(nIndexCount);
+    }
+
+    ForEachChunk(nCount, ChunkSize, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t)
+    {
+        for (uint32_t i = nBegin; i < nEnd; i++)
+        {
+            uint32_t nParticle = pIndices[i];
+            m_particlePlanes[nParticle] = SetupQuadPlanes(pPositions[nParticle], pScales[nParticle], pRotations ? pRotations[nParticle] : 0.0f);
+        }
+    });
+}
+
+void ParticleTileRasterizer::ShadeTile(const ParticleTileBinner& binner, uint32_t nTile, const Float2* pPositions, const Float2* pScales, const float* pRotations, const Float4* pColors, uint32_t nWorkerIndex)
+{
+    const TileParticleRange& range = binner.GetTileRanges()[nTile];
+    const uint32_t* pParticles = binner.GetParticleIndices() + range.nOffset;
+
+    std::vector<QuadSetup>& quads = m_workerQuads[nWorkerIndex];
+    std::vector<QuadPlanes>& planes = m_workerPlanes[nWorkerIndex];
+    std::vector<Float4>& colors = m_workerColors[nWorkerIndex];
+    colors.resize(range.nCount);
+    for (uint32_t i = 0; i < range.nCount; i++)
+    {
+        colors[i] = pColors[pParticles[i]];
+    }
+
+    if (m_rasterSetup == RasterSetup::PerParticle)
+    {
+        planes.resize(range.nCount);
+        for (uint32_t i = 0; i < range.nCount; i++)
+        {
+            planes[i] = m_particlePlanes[pParticles[i]];
+        }
+    }
+    else
+    {
+        quads.resize(range.nCount);
+        for (uint32_t i = 0; i < range.nCount; i++)
+        {
+            uint32_t nParticle = pParticles[i];
+            quads[i] = SetupQuad(pPositions[nParticle], pScales[nParticle], pRotations ? pRotations[nParticle] : 0.0f);
+        }
+    }
+
+    const uint32_t nTileSize = binner.GetTileSize();
+    const uint32_t nFirstX = (nTile % binner.GetTileCountX()) * nTileSize;
+    const uint32_t nFirstY = (nTile / binner.GetTileCountX()) * nTileSize;
+    const uint32_t nPixelCountX = std::min(m_nWidth - nFirstX, nTileSize);
+    const uint32_t nPixelCountY = std::min(m_nHeight - nFirstY, nTileSize);
+
+    // Pixel to clip space like the shader. The SIMD paths load whole lanes, past the edge of the tile and the screen too.
+    float pixelX[TILE_SIZE_MAX_IN_PIXELS];
+    for (uint32_t iPixel = 0; iPixel < TILE_SIZE_MAX_IN_PIXELS; iPixel++)
+    {
+        pixelX[iPixel] = ((float)(nFirstX + iPixel) / (float)m_nWidth) * 2.0f - 1.0f;
+    }
+
+    CompositeStats& stats = m_workerStats[nWorkerIndex];
+    uint32_t rowColors[TILE_SIZE_MAX_IN_PIXELS];
+
+    TileRow row;
+    row.pPixelX = pixelX;
+    row.nPixelCount = nPixelCountX;
+    row.fOpaqueAlpha = m_fOpaqueAlpha;
+    row.pColors = rowColors;
+    row.pStats = &stats;
+    for (uint32_t iRow = 0; iRow < nPixelCountY; iRow++)
+    {
+        row.fPixelY = ((float)(nFirstY + iRow) / (float)m_nHeight) * -2.0f + 1.0f;
+        if (m_rasterSetup == RasterSetup::PerParticle)
+        {
+            ShadeRowPlanes(m_instructionSet, planes.data(), colors.data(), range.nCount, row);
+        }
+        else
+        {
+            ShadeRowBarycentric(m_instructionSet, quads.data(), colors.data(), range.nCount, row);
+        }
+        std::copy(rowColors, rowColors + nPixelCountX, m_pixels.data() + (size_t)(nFirstY + iRow) * m_nWidth + nFirstX);
+    }
+
+    stats.nListedQuadCount += (uint64_t)nPixelCountX * nPixelCountY * range.nCount;
+}
+
+void ParticleTileRasterizer::Rasterize(const ParticleTileBinner& binner, const Float2* pPositions, const Float2* pScales, const float* pRotations, const Float4* pColors, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    m_nWidth = binner.GetGrid().GetWidth();
+    m_nHeight = binner.GetGrid().GetHeight();
+    m_pixels.resize((size_t)m_nWidth * m_nHeight);
+    m_workerQuads.resize(pJobSystem ? pJobSystem->GetWorkerCount() : 1);
+    m_workerPlanes.resize(m_workerQuads.size());
+    m_workerColors.resize(m_workerQuads.size());
+    m_workerStats.assign(m_workerQuads.size(), CompositeStats());
+
+    m_nSetupNanoseconds = 0;
+    if (m_rasterSetup == RasterSetup::PerParticle)
+    {
+        SetupParticles(pPositions, pScales, pRotations, pIndices, nCount, pJobSystem);
+        m_nSetupNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+    }
+
+    // A tile of the work list is a job, they take long enough for the stealing to even out the busy and the quiet ones.
+    // The empty tiles only get the clear.
+    std::fill(m_pixels.begin(), m_pixels.end(), 0u);
+    const uint32_t* pOccupiedTiles = binner.GetOccupiedTiles();
+    ForEachChunk(binner.GetOccupiedTileCount(), 1, pJobSystem, [&](uint32_t nBegin, uint32_t nEnd, uint32_t nWorkerIndex)
+    {
+        for (uint32_t iWork = nBegin; iWork < nEnd; iWork++)
+        {
+            ShadeTile(binner, pOccupiedTiles[iWork], pPositions, pScales, pRotations, pColors, nWorkerIndex);
+        }
+    });
+
+    m_nShadeNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    m_compositeStats = CompositeStats();
+    m_compositeStats.nPixelCount = (uint64_t)m_nWidth * m_nHeight;
+    for (const CompositeStats& stats : m_workerStats)
+    {
+        m_compositeStats.nSaturatedPixelCount += stats.nSaturatedPixelCount;
+        m_compositeStats.nListedQuadCount += stats.nListedQuadCount;
+        m_compositeStats.nSkippedQuadCount += stats.nSkippedQuadCount;
+    }
+}
+
+bool ParticleTileRasterizer::WritePPM(const char* pFileName) const
+{
+    std::ofstream file(pFileName, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    file << "P6\n" << m_nWidth << " " << m_nHeight << "\n255\n";
+
+    std::vector<uint8_t> row(m_nWidth * 3);
+    const uint8_t* pPixels = GetPixels();
+    for (uint32_t nY = 0; nY < m_nHeight; nY++)
+    {
+        for (uint32_t nX = 0; nX < m_nWidth; nX++)
+        {
+            const uint8_t* pPixel = pPixels + ((size_t)nY * m_nWidth + nX) * 4;
+            row[nX * 3 + 0] = pPixel[0];
+            row[nX * 3 + 1] = pPixel[1];
+            row[nX * 3 + 2] = pPixel[2];
+        }
+        file.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+    return (bool)file;
+}
+
+TileRasterBenchmarkResult BenchmarkTileRasterization(SimdInstructionSet instructionSet, uint32_t nParticleCount, uint32_t nIterationCount, uint32_t nWidth, uint32_t nHeight, float fAlpha, JobSystem* pJobSystem, const char* pPPMFileName)
+{
+    std::mt19937 randomNumberEngine(42);
+    std::uniform_real_distribution<float> positionDistribution(-1.1f, 1.1f);
+    std::uniform_real_distribution<float> velocityDistribution(-0.5f, 0.5f);
+    std::uniform_real_distribution<float> rotationDistribution(0.0f, 6.2831853f);
+    std::uniform_real_distribution<float> colorDistribution(0.2f, 1.0f);
+
+    // Between a quarter and two tiles wide, so most pixels have a few particles to go through
+    const float fTileSize = 2.0f * TILE_SIZE_IN_PIXELS / std::max(nWidth, nHeight);
+    std::uniform_real_distribution<float> scaleDistribution(0.125f * fTileSize, fTileSize);
+
+    std::vector<Float2> positions(nParticleCount);
+    std::vector<Float2> scales(nParticleCount);
+    std::vector<Float2> velocities(nParticleCount);
+    std::vector<float> rotations(nParticleCount);
+    std::vector<Float4> colors(nParticleCount);
+    std::vector<uint32_t> indices(nParticleCount);
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        positions[i] = { positionDistribution(randomNumberEngine), positionDistribution(randomNumberEngine) };
+        scales[i] = { scaleDistribution(randomNumberEngine), scaleDistribution(randomNumberEngine) };
+        velocities[i] = { velocityDistribution(randomNumberEngine), velocityDistribution(randomNumberEngine) };
+        rotations[i] = rotationDistribution(randomNumberEngine);
+        colors[i] = { colorDistribution(randomNumberEngine), colorDistribution(randomNumberEngine), colorDistribution(randomNumberEngine), fAlpha };
+        indices[i] = i;
+    }
+
+    const float fElapsedTime = 1.0f / 60.0f;
+    ParticleTileBinner binner(nWidth, nHeight);
+    ParticleTileRasterizer rasterizer;
+    rasterizer.SetInstructionSet(instructionSet);
+    ParticleTileRasterizer perTileRasterizer;
+    perTileRasterizer.SetInstructionSet(instructionSet);
+    perTileRasterizer.SetRasterSetup(RasterSetup::PerTile);
+    ParticleTileRasterizer noEarlyOutRasterizer;
+    noEarlyOutRasterizer.SetInstructionSet(instructionSet);
+    noEarlyOutRasterizer.SetOpaqueAlpha(2.0f);
+
+    uint64_t nBinNanoseconds = 0;
+    uint64_t nSetupNanoseconds = 0;
+    uint64_t nShadeNanoseconds = 0;
+    uint64_t nPerTileShadeNanoseconds = 0;
+    uint64_t nNoEarlyOutShadeNanoseconds = 0;
+    ParticleTileRasterizer::CompositeStats stats = {};
+    for (uint32_t iIteration = 0; iIteration < nIterationCount; iIteration++)
+    {
+        for (uint32_t i = 0; i < nParticleCount; i++)
+        {
+            positions[i].x += velocities[i].x * fElapsedTime;
+            positions[i].y += velocities[i].y * fElapsedTime;
+        }
+
+        binner.Bin(positions.data(), scales.data(), rotations.data(), indices.data(), nParticleCount, pJobSystem);
+        nBinNanoseconds += binner.GetBinNanoseconds();
+
+        rasterizer.Rasterize(binner, positions.data(), scales.data(), rotations.data(), colors.data(), indices.data(), nParticleCount, pJobSystem);
+        nSetupNanoseconds += rasterizer.GetSetupNanoseconds();
+        nShadeNanoseconds += rasterizer.GetShadeNanoseconds();
+        stats.nPixelCount += rasterizer.GetCompositeStats().nPixelCount;
+        stats.nSaturatedPixelCount += rasterizer.GetCompositeStats().nSaturatedPixelCount;
+        stats.nListedQuadCount += rasterizer.GetCompositeStats().nListedQuadCount;
+        stats.nSkippedQuadCount += rasterizer.GetCompositeStats().nSkippedQuadCount;
+
+        perTileRasterizer.Rasterize(binner, positions.data(), scales.data(), rotations.data(), colors.data(), indices.data(), nParticleCount, pJobSystem);
+        nPerTileShadeNanoseconds += perTileRasterizer.GetShadeNanoseconds();
+
+        noEarlyOutRasterizer.Rasterize(binner, positions.data(), scales.data(), rotations.data(), colors.data(), indices.data(), nParticleCount, pJobSystem);
+        nNoEarlyOutShadeNanoseconds += noEarlyOutRasterizer.GetShadeNanoseconds();
+    }
+
+    TileRasterBenchmarkResult result = {};
+    result.nParticleCount = nParticleCount;
+    result.nIterationCount = nIterationCount;
+    result.nTileCount = binner.GetTileCount();
+    if (nIterationCount == 0)
+    {
+        return result;
+    }
+
+    result.fBinMilliseconds = nBinNanoseconds / 1e6 / nIterationCount;
+    result.fSetupMilliseconds = nSetupNanoseconds / 1e6 / nIterationCount;
+    result.fShadeMilliseconds = nShadeNanoseconds / 1e6 / nIterationCount;
+    result.fPerTileShadeMilliseconds = nPerTileShadeNanoseconds / 1e6 / nIterationCount;
+    result.fNoEarlyOutShadeMilliseconds = nNoEarlyOutShadeNanoseconds / 1e6 / nIterationCount;
+    result.fSaturatedPixelRate = stats.nPixelCount ? (double)stats.nSaturatedPixelCount / stats.nPixelCount : 0.0;
+    result.fSkippedQuadRate = stats.nListedQuadCount ? (double)stats.nSkippedQuadCount / stats.nListedQuadCount : 0.0;
+
+    // The two setups only differ in the rounding, so at most a few pixels on the edges of the quads should change
+    const uint32_t* pPixels = reinterpret_cast<const uint32_t*>(rasterizer.GetPixels());
+    const uint32_t* pPerTilePixels = reinterpret_cast<const uint32_t*>(perTileRasterizer.GetPixels());
+    for (uint32_t iPixel = 0; iPixel < nWidth * nHeight; iPixel++)
+    {
+        result.nCoveredPixelCount += pPixels[iPixel] != 0 ? 1 : 0;
+        result.nPerTileDifferenceCount += pPixels[iPixel] != pPerTilePixels[iPixel] ? 1 : 0;
+    }
+
+    ParticleTileRasterizer reference;
+    reference.SetInstructionSet(SimdInstructionSet::Scalar);
+    reference.Rasterize(binner, positions.data(), scales.data(), rotations.data(), colors.data(), indices.data(), nParticleCount, pJobSystem);
+    result.fScalarShadeMilliseconds = (reference.GetSetupNanoseconds() + reference.GetShadeNanoseconds()) / 1e6;
+    result.bMatchesScalar = std::equal(pPixels, pPixels + nWidth * nHeight, reinterpret_cast<const uint32_t*>(reference.GetPixels())) &&
+        reference.GetCompositeStats().nSaturatedPixelCount == rasterizer.GetCompositeStats().nSaturatedPixelCount &&
+        reference.GetCompositeStats().nSkippedQuadCount == rasterizer.GetCompositeStats().nSkippedQuadCount;
+
+    if (pPPMFileName)
+    {
+        auto start = std::chrono::steady_clock::now();
+        rasterizer.WritePPM(pPPMFileName);
+        result.fWriteMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    return result;
+}
+
+TileSizeBenchmarkResult BenchmarkTileSizes(TileBinningScene scene, SimdInstructionSet instructionSet, uint32_t nParticleCount, uint32_t nFrameCount, uint32_t nWidth, uint32_t nHeight, float fAlpha, JobSystem* pJobSystem)
+{
+    std::mt19937 randomNumberEngine(42);
+    std::uniform_real_distribution<float> colorDistribution(0.2f, 1.0f);
+
+    std::vector<Float2> startPositions(nParticleCount);
+    std::vector<Float2> scales(nParticleCount);
+    std::vector<Float2> velocities(nParticleCount);
+    std::vector<float> rotations(nParticleCount);
+    std::vector<Float4> colors(nParticleCount);
+    std::vector<uint32_t> indices(nParticleCount);
+    CreateTileBinningScene(scene, nWidth, nHeight, randomNumberEngine, startPositions, scales, velocities, rotations);
+    for (uint32_t i = 0; i < nParticleCount; i++)
+    {
+        colors[i] = { colorDistribution(randomNumberEngine), colorDistribution(randomNumberEngine), colorDistribution(randomNumberEngine), fAlpha };
+        indices[i] = i;
+    }
+    std::shuffle(indices.begin(), indices.end(), randomNumberEngine);
+
+    const float fElapsedTime = 1.0f / 60.0f;
+    std::vector<Float2> positions;
+    ParticleTileBinner binner(nWidth, nHeight);
+    ParticleTileRasterizer rasterizer;
+    rasterizer.SetInstructionSet(instructionSet);
+
+    // The same frames with every tile size, and then with the policy picking it. The policy starts out
+    // on the default size like the GPU does.
+    TileSizeBenchmarkResult result = {};
+    result.nParticleCount = nParticleCount;
+    result.nFrameCount = nFrameCount;
+    result.bImagesMatch = true;
+    TileOccupancy defaultOccupancy = {};
+    std::vector<uint32_t> firstImage;
+    for (uint32_t iRun = 0; iRun <= TILE_SIZE_OPTION_COUNT; iRun++)
+    {
+        const bool bAdaptive = iRun == TILE_SIZE_OPTION_COUNT;
+        ParticleTileSizePolicy policy(ParticleTileSizePolicy::CpuCosts);
+        binner.SetTileSize(bAdaptive ? policy.GetTileSize() : ParticleTileSizePolicy::GetTileSizeFromIndex(iRun));
+        positions = startPositions;
+
+        uint64_t nFrameNanoseconds = 0;
+        for (uint32_t iFrame = 0; iFrame < nFrameCount; iFrame++)
+        {
+            for (uint32_t i = 0; i < nParticleCount; i++)
+            {
+                positions[i].x += velocities[i].x * fElapsedTime;
+                positions[i].y += velocities[i].y * fElapsedTime;
+            }
+
+            binner.Bin(positions.data(), scales.data(), rotations.data(), indices.data(), nParticleCount, pJobSystem);
+            rasterizer.Rasterize(binner, positions.data(), scales.data(), rotations.data(), colors.data(), indices.data(), nParticleCount, pJobSystem);
+            nFrameNanoseconds += binner.GetBinNanoseconds() + rasterizer.GetSetupNanoseconds() + rasterizer.GetShadeNanoseconds();
+
+            if (bAdaptive && policy.Update(binner.GetOccupancy()) != binner.GetTileSize())
+            {
+                binner.SetTileSize(policy.GetTileSize());
+                result.nSwitchCount++;
+            }
+        }
+
+        double fMilliseconds = nFrameCount ? nFrameNanoseconds / 1e6 / nFrameCount : 0.0;
+        if (bAdaptive)
+        {
+            result.fAdaptiveMilliseconds = fMilliseconds;
+            result.nFinalTileSize = policy.GetTileSize();
+            continue;
+        }
+
+        result.fFixedMilliseconds[iRun] = fMilliseconds;
+        if (iRun == 0 || fMilliseconds < result.fFixedMilliseconds[ParticleTileSizePolicy::GetTileSizeIndex(result.nFastestTileSize)])
+        {
+            result.nFastestTileSize = binner.GetTileSize();
+        }
+        if (binner.GetTileSize() == TILE_SIZE_IN_PIXELS)
+        {
+            defaultOccupancy = binner.GetOccupancy();
+        }
+
+        // The tiles only decide which particles a pixel looks at, never the order, so the images come out the same
+        const uint32_t* pPixels = reinterpret_cast<const uint32_t*>(rasterizer.GetPixels());
+        if (iRun == 0)
+        {
+            firstImage.assign(pPixels, pPixels + nWidth * nHeight);
+        }
+        else
+        {
+            result.bImagesMatch = result.bImagesMatch && std::equal(firstImage.begin(), firstImage.end(), pPixels);
+        }
+    }
+
+    // What the policy makes of the last frame with the default size
+    ParticleTileSizePolicy policy(ParticleTileSizePolicy::CpuCosts);
+    for (uint32_t iSize = 0; iSize < TILE_SIZE_OPTION_COUNT; iSize++)
+    {
+        result.fEstimatedCost[iSize] = policy.EstimateCost(defaultOccupancy, ParticleTileSizePolicy::GetTileSizeFromIndex(iSize));
+    }
+    result.nChosenTileSize = policy.ChooseTileSize(defaultOccupancy);
+    return result;
+}
+
+ParticleReorderBenchmarkResult BenchmarkParticleReorder(SimdInstructionSet instructionSet, uint32_t nParticleCount, uint32_t nFrameCount, uint32_t nReorderInterval, uint32_t nWidth, uint32_t nHeight, float fAlpha, JobSystem* pJobSystem)
+{
+    // Everything lives for two seconds, so the fountain is full after that
+    const float fElapsedTime = 1.0f / 60.0f;
+    const float fLifetime = 2.0f;
+    const uint32_t nFillFrameCount = (uint32_t)(fLifetime / fElapsedTime) + 1;
+
+    ParticleEmitterParams params;
+    params.m_Position = { 0.0f, 0.0f };
+    params.m_Scale = { 0.01f, 0.01f };
+    params.m_Color = { 1.0f, 1.0f, 1.0f, fAlpha };
+    params.m_fSpeed = 0.5f;
+    params.m_fLifetime = fLifetime;
+
+    ParticleSimulationCPU simulation(nParticleCount);
+    ParticleSimulationCPU reorderedSimulation(nParticleCount);
+    ParticleSimulationCPU* pSimulations[2] = { &simulation, &reorderedSimulation };
+    for (ParticleSimulationCPU* pSimulation : pSimulations)
+    {
+        pSimulation->SetInstructionSet(instructionSet);
+        pSimulation->SetJobSystem(pJobSystem);
+        pSimulation->SetEmitterParams(ParticleSimulationCPU::DefaultEmitter, params);
+    }
+    reorderedSimulation.SetReorderInterval(nReorderInterval);
+
+    ParticleTileBinner binner(nWidth, nHeight);
+    ParticleTileRasterizer rasterizer;
+    rasterizer.SetInstructionSet(instructionSet);
+
+    ParticleReorderBenchmarkResult result = {};
+    result.nFrameCount = nFrameCount;
+    result.bSameParticles = true;
+
+    ParticleFrameConstants constants;
+    constants.m_EmitCount = nParticleCount / nFillFrameCount;
+    constants.m_fElapsedTime = fElapsedTime;
+
+    uint64_t nBinNanoseconds[2] = {};
+    uint64_t nRasterNanoseconds[2] = {};
+    uint64_t nListedQuadCount[2] = {};
+    uint64_t nSkippedQuadCount[2] = {};
+    uint64_t nReorderNanoseconds = 0;
+    for (uint32_t iFrame = 0; iFrame < nFillFrameCount + nFrameCount; iFrame++)
+    {
+        constants.m_nRandomSeed = iFrame;
+        uint32_t nOverlapCount[2];
+        for (uint32_t iSimulation = 0; iSimulation < 2; iSimulation++)
+        {
+            ParticleSimulationCPU& current = *pSimulations[iSimulation];
+            current.Simulate(constants);
+            if (iFrame < nFillFrameCount)
+            {
+                continue;
+            }
+
+            // Simulate reorders on every nReorderInterval-th call
+            if (&current == &reorderedSimulation && nReorderInterval > 0 && (iFrame + 1) % nReorderInterval == 0)
+            {
+                nReorderNanoseconds += current.GetReorderNanoseconds();
+                result.nReorderCount++;
+            }
+
+            const ParticleStreams& streams = current.GetStreams();
+            binner.Bin(streams.Positions.data(), streams.Scales.data(), streams.Rotations.data(), current.GetAliveIndices(), current.GetAliveCount(), pJobSystem);
+            rasterizer.Rasterize(binner, streams.Positions.data(), streams.Scales.data(), streams.Rotations.data(), streams.Colors.data(), current.GetAliveIndices(), current.GetAliveCount(), pJobSystem);
+            nBinNanoseconds[iSimulation] += binner.GetBinNanoseconds();
+            nRasterNanoseconds[iSimulation] += rasterizer.GetSetupNanoseconds() + rasterizer.GetShadeNanoseconds();
+            nOverlapCount[iSimulation] = binner.GetOverlapCount();
+            nListedQuadCount[iSimulation] += rasterizer.GetCompositeStats().nListedQuadCount;
+            nSkippedQuadCount[iSimulation] += rasterizer.GetCompositeStats().nSkippedQuadCount;
+        }
+
+        if (iFrame >= nFillFrameCount)
+        {
+            result.bSameParticles = result.bSameParticles && simulation.GetAliveCount() == reorderedSimulation.GetAliveCount() &&
+                nOverlapCount[0] == nOverlapCount[1];
+        }
+    }
+
+    result.nParticleCount = simulation.GetAliveCount();
+    if (nFrameCount > 0)
+    {
+        result.fBinMilliseconds = nBinNanoseconds[0] / 1e6 / nFrameCount;
+        result.fRasterMilliseconds = nRasterNanoseconds[0] / 1e6 / nFrameCount;
+        result.fReorderedBinMilliseconds = nBinNanoseconds[1] / 1e6 / nFrameCount;
+        result.fReorderedRasterMilliseconds = nRasterNanoseconds[1] / 1e6 / nFrameCount;
+    }
+    if (nListedQuadCount[0] > 0)
+    {
+        result.fSkippedQuadRate = (double)nSkippedQuadCount[0] / nListedQuadCount[0];
+        result.fReorderedSkippedQuadRate = (double)nSkippedQuadCount[1] / nListedQuadCount[1];
+    }
+    if (result.nReorderCount > 0)
+    {
+        result.fReorderMilliseconds = nReorderNanoseconds / 1e6 / result.nReorderCount;
+    }
+    return result;
+}
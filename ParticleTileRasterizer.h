@@ -0,0 +1,193 @@
+#pragma once
+
+// Software version of CSRasterizeParticles, for machines without a GPU and as the reference image of the tiled path.
+// It shades the tile lists of a ParticleTileBinner: every pixel goes through the particles of its tile front to back,
+// from the last one to the first, and composites the colors of the ones it's inside of under what it has so far.
+// A pixel stops once its alpha reaches the opaque alpha, the particles behind that wouldn't show anyway.
+// The quads are set up before the tiles are shaded, like CSParticleRasterSetup does on the GPU: the barycentric coordinates
+// are linear in the pixel position, so every particle gets the plane equations of u and v once and a pixel only costs
+// two multiply-adds per particle. A tile is a job, every row of the tile is shaded 4, 8 or 16 pixels at a time
+// depending on the instruction set. Every path gives the same bits as the scalar one.
+// Only the tiles of the binner's work list are shaded, the image is cleared once before them like the GPU output.
+//
+// The image is RGBA8 with premultiplied alpha, so the color is the particles over black. Nothing covered is all zero.
+
+#include "JobSystem.h"
+#include "ParticleTileBinner.h"
+#include "ParticleUpdateKernels.h"
+#include "TileConstants.h"
+
+#include <cstdint>
+#include <vector>
+
+struct Float2;
+struct Float4;
+
+// Where the work that doesn't depend on the pixel is done
+enum class RasterSetup
+{
+    PerTile,        // Once per tile the particle is in, and the pixels compute the barycentric coordinates from the dot products
+    PerParticle,    // Once per particle into plane equations, the default
+};
+
+class ParticleTileRasterizer
+{
+public:
+    // Number of particles a job sets up at once, same as ParticleTileBinner::ChunkSize
+    static const uint32_t ChunkSize = 4096;
+
+    ParticleTileRasterizer();
+
+    void SetInstructionSet(SimdInstructionSet instructionSet);
+    SimdInstructionSet GetInstructionSet() const        { return m_instructionSet; }
+
+    void SetRasterSetup(RasterSetup setup)              { m_rasterSetup = setup; }
+    RasterSetup GetRasterSetup() const                  { return m_rasterSetup; }
+
+    // The alpha a pixel stops compositing at, TILE_COMPOSITE_OPAQUE_ALPHA by default. Over one never stops early.
+    void SetOpaqueAlpha(float fAlpha)                   { m_fOpaqueAlpha = fAlpha; }
+    float GetOpaqueAlpha() const                        { return m_fOpaqueAlpha; }
+
+    // Shades the occupied tiles of the binner's last Bin and clears the rest, the image takes the binner's resolution.
+    // The particle streams and the indices have to be the ones the binner was given.
+    void Rasterize(const ParticleTileBinner& binner, const Float2* pPositions, const Float2* pScales, const float* pRotations, const Float4* pColors, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem);
+
+    // Rows from the top, four bytes per pixel in RGBA order
+    const uint8_t* GetPixels() const                    { return reinterpret_cast<const uint8_t*>(m_pixels.data()); }
+    uint32_t GetWidth() const                           { return m_nWidth; }
+    uint32_t GetHeight() const                          { return m_nHeight; }
+
+    // Binary PPM, the alpha is left out. False if the file can't be written.
+    bool WritePPM(const char* pFileName) const;
+
+    // Counted over the pixels on the screen
+    struct CompositeStats
+    {
+        uint64_t nPixelCount;
+        uint64_t nSaturatedPixelCount;  // Pixels that reached the opaque alpha and stopped early
+        uint64_t nListedQuadCount;      // Particles of the tile lists, summed over the pixels
+        uint64_t nSkippedQuadCount;     // The ones the saturated pixels didn't have to look at
+    };
+    const CompositeStats& GetCompositeStats() const     { return m_compositeStats; }
+
+    // Wall clock times of the last Rasterize, the setup is zero with RasterSetup::PerTile
+    uint64_t GetSetupNanoseconds() const                { return m_nSetupNanoseconds; }
+    uint64_t GetShadeNanoseconds() const                { return m_nShadeNanoseconds; }
+
+    // Same layout as ParticleRasterSetup in ParticleCommon.hlsli, u = fUX * x + (fUY * y + fUW) and the same for v
+    struct QuadPlanes
+    {
+        float fUX;
+        float fUY;
+        float fUW;
+        float fVX;
+        float fVY;
+        float fVW;
+    };
+
+    // What the per tile setup keeps of a particle, the corner and the dot products of the barycentric coordinates
+    struct QuadSetup
+    {
+        float fCornerX;     // The corner the barycentric coordinates start from
+        float fCornerY;
+        float fV0X;
+        float fV0Y;
+        float fV1X;
+        float fV1Y;
+        float fDot00;
+        float fDot01;
+        float fDot11;
+        float fInvDenom;
+    };
+
+private:
+    void ForEachChunk(uint32_t nCount, uint32_t nChunkSize, JobSystem* pJobSystem, const JobSystem::RangeJob& fnJob);
+    void SetupParticles(const Float2* pPositions, const Float2* pScales, const float* pRotations, const uint32_t* pIndices, uint32_t nCount, JobSystem* pJobSystem);
+    void ShadeTile(const ParticleTileBinner& binner, uint32_t nTile, const Float2* pPositions, const Float2* pScales, const float* pRotations, const Float4* pColors, uint32_t nWorkerIndex);
+
+    SimdInstructionSet m_instructionSet;
+    RasterSetup m_rasterSetup = RasterSetup::PerParticle;
+    float m_fOpaqueAlpha;
+    uint32_t m_nWidth = 0;
+    uint32_t m_nHeight = 0;
+
+    // One packed RGBA8 per pixel
+    std::vector<uint32_t> m_pixels;
+
+    // By particle index, only the particles of the last Rasterize are up to date
+    std::vector<QuadPlanes> m_particlePlanes;
+
+    // The quads of the tile a worker is shading and their colors, by worker. Copied together so the rows read them in order.
+    std::vector<std::vector<QuadSetup>> m_workerQuads;
+    std::vector<std::vector<QuadPlanes>> m_workerPlanes;
+    std::vector<std::vector<Float4>> m_workerColors;
+
+    // Summed into m_compositeStats at the end of Rasterize
+    std::vector<CompositeStats> m_workerStats;
+    CompositeStats m_compositeStats = {};
+
+    uint64_t m_nSetupNanoseconds = 0;
+    uint64_t m_nShadeNanoseconds = 0;
+};
+
+struct TileRasterBenchmarkResult
+{
+    uint32_t nParticleCount;
+    uint32_t nIterationCount;
+    uint32_t nTileCount;
+    double fBinMilliseconds;            // Averages over the iterations
+    double fSetupMilliseconds;          // RasterSetup::PerParticle
+    double fShadeMilliseconds;
+    double fPerTileShadeMilliseconds;   // RasterSetup::PerTile, its setup included
+    double fNoEarlyOutShadeMilliseconds; // RasterSetup::PerParticle compositing every particle of every pixel
+    double fScalarShadeMilliseconds;    // A single scalar Rasterize of the last iteration's lists, setup included
+    double fWriteMilliseconds;          // Of the PPM, zero without a file name
+    uint32_t nCoveredPixelCount;        // Pixels some particle covers in the last image
+    uint32_t nPerTileDifferenceCount;   // Pixels of the last image the two setups round differently
+    double fSaturatedPixelRate;         // Share of the pixels that stopped early, over all the iterations
+    double fSkippedQuadRate;            // Share of the listed particles the pixels didn't have to look at
+    bool bMatchesScalar;                // The last image is the same as the scalar one, bit for bit
+};
+
+// Bins and rasterizes nParticleCount particles of random colors with fAlpha nIterationCount times, moving them a little
+// between the iterations, with both setups and without the early out. The last image is written to pPPMFileName unless it's null.
+TileRasterBenchmarkResult BenchmarkTileRasterization(SimdInstructionSet instructionSet, uint32_t nParticleCount, uint32_t nIterationCount, uint32_t nWidth, uint32_t nHeight, float fAlpha, JobSystem* pJobSystem, const char* pPPMFileName);
+
+struct TileSizeBenchmarkResult
+{
+    uint32_t nParticleCount;
+    uint32_t nFrameCount;
+    double fFixedMilliseconds[TILE_SIZE_OPTION_COUNT];  // Bin, setup and shade per frame with every tile size, smallest first
+    double fAdaptiveMilliseconds;                       // With ParticleTileSizePolicy switching the size
+    double fEstimatedCost[TILE_SIZE_OPTION_COUNT];      // The policy's estimates for every size from the last default size frame
+    uint32_t nFastestTileSize;                          // Of the fixed sizes
+    uint32_t nChosenTileSize;                           // ChooseTileSize of the last default size frame
+    uint32_t nFinalTileSize;                            // Where the policy ended up
+    uint32_t nSwitchCount;
+    bool bImagesMatch;                                  // The last image is the same with every fixed size
+};
+
+// Bins and rasterizes nFrameCount frames of the scene with every tile size, and once more with the policy choosing it
+// from the lists of the frame before. Every run starts from the same particles, colored randomly with fAlpha.
+TileSizeBenchmarkResult BenchmarkTileSizes(TileBinningScene scene, SimdInstructionSet instructionSet, uint32_t nParticleCount, uint32_t nFrameCount, uint32_t nWidth, uint32_t nHeight, float fAlpha, JobSystem* pJobSystem);
+
+struct ParticleReorderBenchmarkResult
+{
+    uint32_t nParticleCount;                // Alive in the last frame
+    uint32_t nFrameCount;
+    uint32_t nReorderCount;
+    double fBinMilliseconds;                // Per frame, with the slots in the order the dead list handed them out
+    double fRasterMilliseconds;             // Setup and shade
+    double fReorderedBinMilliseconds;       // The same frames with ParticleSimulationCPU::ReorderParticles
+    double fReorderedRasterMilliseconds;
+    double fReorderMilliseconds;            // Per ReorderParticles
+    double fSkippedQuadRate;                // Share of the listed particles the saturated pixels didn't have to look at
+    double fReorderedSkippedQuadRate;
+    bool bSameParticles;                    // Both had the same number of particles and tile list entries every frame
+};
+
+// Runs two simulations of a fountain side by side until they're full of nParticleCount particles, one of them reordered every
+// nReorderInterval frames, then bins and rasterizes both for nFrameCount frames. The particles emitted in the same frame
+// fly off in every direction and die together, so the slots handed out by the dead list end up scattered over the screen.
+// The particles have fAlpha, with a high one the lost early outs can cost more than the reorder saves.
+ParticleReorderBenchmarkResult BenchmarkParticleReorder(SimdInstructionSet instructionSet, uint32_t nParticleCount, uint32_t nFrameCount, uint32_t nReorderInterval, uint32_t nWidth, uint32_t nHeight, float fAlpha, JobSystem* pJobSystem);
@@ -0,0 +1,138 @@
+#include "ParticleTileSizePolicy.h"
+
+#include <algorithm>
+#include <cmath>
+
+// A list entry costs two atomics, a scattered write and the sort on the GPU. Every tile is a group of CSTileSort and of
+// CSRasterizeParticles and a few loads in CSTileScan.
+const TileSizeCosts ParticleTileSizePolicy::GpuCosts = { 64.0f, 1024.0f, 64.0f };
+
+// Fitted to the frame times of BenchmarkTileSizes over the scenes, a list entry costs as much as thousands of SIMD pixel
+// tests there: the binner's atomics and sort, and gathering the planes and colors of every tile. Nothing spills.
+const TileSizeCosts ParticleTileSizePolicy::CpuCosts = { 3000.0f, 8000.0f, 0.0f };
+
+const float ParticleTileSizePolicy::MinimumGain = 0.1f;
+
+// The lists of the frame as they would come out with another tile size
+struct TileOccupancyEstimate
+{
+    double fTileCount;
+    double fEntryCount;
+    double fLargestTileCount;
+    double fShadeCount;     // Pixel tests
+};
+
+static TileOccupancyEstimate EstimateOccupancy(const TileOccupancy& occupancy, uint32_t nTileSize)
+{
+    const double fSizeRatio = (double)occupancy.nTileSize / nTileSize;
+
+    TileOccupancyEstimate estimate = {};
+    estimate.fTileCount = occupancy.nTileCount * fSizeRatio * fSizeRatio;
+    if (occupancy.nBinnedParticleCount == 0)
+    {
+        return estimate;
+    }
+
+    // A particle covers (w / size + 1)^2 tiles on average, that's the mean width in pixels
+    double fEntriesPerParticle = std::max((double)occupancy.nEntryCount / occupancy.nBinnedParticleCount, 1.0);
+    double fWidth = (std::sqrt(fEntriesPerParticle) - 1.0) * occupancy.nTileSize;
+
+    double fTilesPerParticle = fWidth / nTileSize + 1.0;
+    double fLargestTileScale = (fWidth + nTileSize) / (fWidth + occupancy.nTileSize);
+    estimate.fEntryCount = occupancy.nBinnedParticleCount * fTilesPerParticle * fTilesPerParticle;
+    estimate.fLargestTileCount = occupancy.nLargestTileCount * fLargestTileScale * fLargestTileScale;
+    estimate.fShadeCount = estimate.fEntryCount * nTileSize * nTileSize;
+    return estimate;
+}
+
+static bool WouldDropEntries(const TileOccupancyEstimate& estimate)
+{
+    return estimate.fEntryCount > estimate.fTileCount * MAX_PARTICLE_PER_TILE;
+}
+
+ParticleTileSizePolicy::ParticleTileSizePolicy(const TileSizeCosts& costs, uint32_t nTileSize)
+    : m_costs(costs)
+{
+    Reset(nTileSize);
+}
+
+void ParticleTileSizePolicy::Reset(uint32_t nTileSize)
+{
+    m_nTileSize = GetTileSizeFromIndex(GetTileSizeIndex(nTileSize));
+    m_nCandidateTileSize = m_nTileSize;
+    m_nCandidateFrameCount = 0;
+}
+
+uint32_t ParticleTileSizePolicy::GetTileSizeIndex(uint32_t nTileSize)
+{
+    uint32_t nIndex = 0;
+    while (nIndex + 1 < TILE_SIZE_OPTION_COUNT && GetTileSizeFromIndex(nIndex) < nTileSize)
+    {
+        nIndex++;
+    }
+    return nIndex;
+}
+
+double ParticleTileSizePolicy::EstimateCost(const TileOccupancy& occupancy, uint32_t nTileSize) const
+{
+    TileOccupancyEstimate estimate = EstimateOccupancy(occupancy, nTileSize);
+    double fCost = estimate.fShadeCount + estimate.fEntryCount * m_costs.fEntryCost + estimate.fTileCount * m_costs.fTileCost;
+    if (estimate.fLargestTileCount > MAX_PARTICLE_PER_TILE)
+    {
+        fCost += estimate.fLargestTileCount * m_costs.fSpillEntryCost;
+    }
+    return fCost;
+}
+
+uint32_t ParticleTileSizePolicy::ChooseTileSize(const TileOccupancy& occupancy) const
+{
+    uint32_t nBestTileSize = 0;
+    double fBestCost = 0.0;
+    bool bBestDrops = true;
+    for (uint32_t iSize = 0; iSize < TILE_SIZE_OPTION_COUNT; iSize++)
+    {
+        uint32_t nTileSize = GetTileSizeFromIndex(iSize);
+        bool bDrops = WouldDropEntries(EstimateOccupancy(occupancy, nTileSize));
+        double fCost = EstimateCost(occupancy, nTileSize);
+        if (nBestTileSize == 0 || (bBestDrops && !bDrops) || (bBestDrops == bDrops && fCost < fBestCost))
+        {
+            nBestTileSize = nTileSize;
+            fBestCost = fCost;
+            bBestDrops = bDrops;
+        }
+    }
+    return nBestTileSize;
+}
+
+uint32_t ParticleTileSizePolicy::Update(const TileOccupancy& occupancy)
+{
+    // Lists of a size that was already left behind, from a frame that was still in flight
+    if (occupancy.nTileSize != m_nTileSize)
+    {
+        return m_nTileSize;
+    }
+
+    // Dropping entries is worse than any cost, a size that doesn't always wins
+    uint32_t nBestTileSize = ChooseTileSize(occupancy);
+    bool bDrops = WouldDropEntries(EstimateOccupancy(occupancy, m_nTileSize));
+    bool bBetter = nBestTileSize != m_nTileSize &&
+        ((bDrops && !WouldDropEntries(EstimateOccupancy(occupancy, nBestTileSize))) ||
+         EstimateCost(occupancy, nBestTileSize) < (1.0 - MinimumGain) * EstimateCost(occupancy, m_nTileSize));
+    if (!bBetter)
+    {
+        m_nCandidateFrameCount = 0;
+        return m_nTileSize;
+    }
+
+    if (nBestTileSize != m_nCandidateTileSize)
+    {
+        m_nCandidateTileSize = nBestTileSize;
+        m_nCandidateFrameCount = 0;
+    }
+    if (++m_nCandidateFrameCount >= SwitchFrameCount)
+    {
+        m_nTileSize = nBestTileSize;
+        m_nCandidateFrameCount = 0;
+    }
+    return m_nTileSize;
+}
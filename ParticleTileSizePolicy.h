@@ -0,0 +1,71 @@
+#pragma once
+
+// Picks the tile size of the next frame from the tile lists of the last one, for the GPU passes and ParticleTileBinner alike.
+// Small tiles keep the lists of the pixels short, big ones keep the number of lists and of list entries down, and which one
+// wins depends on how big and how dense the particles are. All the policy looks at is what the TILE_COUNTER_* counters say:
+// the number of particles on the screen and of entries in the lists give the mean particle size in tiles, and from that the
+// entries, the fullest tile and the work of every other tile size are estimated:
+//  - a particle w pixels wide covers about (w / size + 1)^2 tiles
+//  - the fullest tile gets the particles within (w + size) / 2 of its center, so it grows with (w + size)^2
+//  - the pixels go through (w + size)^2 particles for every particle, on top of that every entry costs something to bin,
+//    sort and load, and so does every tile
+// Sizes whose fullest tile would spill pay for it, sizes that would drop entries are only taken if they all do.
+// The costs differ a lot between the GPU and ParticleTileRasterizer, so each has its own.
+// A new size has to win SwitchFrameCount frames in a row by MinimumGain before it's taken, every switch rebuilds
+// the binning resources.
+
+#include "TileConstants.h"
+
+#include <cstdint>
+
+// The tile lists of a frame
+struct TileOccupancy
+{
+    uint32_t nTileSize;             // The lists were binned with
+    uint32_t nTileCount;
+    uint32_t nBinnedParticleCount;  // Particles on the screen, TILE_COUNTER_BINNED_PARTICLES
+    uint32_t nEntryCount;           // In all the lists, the dropped ones included
+    uint32_t nLargestTileCount;     // TILE_COUNTER_LARGEST_TILE
+};
+
+// Relative to testing a pixel against a particle
+struct TileSizeCosts
+{
+    float fEntryCost;       // Binning, sorting and loading a list entry
+    float fTileCost;        // A tile in every per tile pass, empty or not
+    float fSpillEntryCost;  // On top of the entry cost for the entries of a spilled tile
+};
+
+class ParticleTileSizePolicy
+{
+public:
+    static const TileSizeCosts GpuCosts;
+    static const TileSizeCosts CpuCosts;        // Measured with ParticleTileBinner and ParticleTileRasterizer, BenchmarkTileSizes
+
+    static const uint32_t SwitchFrameCount = 8;
+    static const float MinimumGain;             // Share of the estimated cost the new size has to save
+
+    explicit ParticleTileSizePolicy(const TileSizeCosts& costs = GpuCosts, uint32_t nTileSize = TILE_SIZE_IN_PIXELS);
+
+    // Forgets the frames seen so far
+    void Reset(uint32_t nTileSize);
+
+    // Takes the lists of a frame, returns the tile size of the next one
+    uint32_t Update(const TileOccupancy& occupancy);
+    uint32_t GetTileSize() const                        { return m_nTileSize; }
+
+    // The estimated cost of binning and shading the frame with nTileSize tiles, in pixel tests
+    double EstimateCost(const TileOccupancy& occupancy, uint32_t nTileSize) const;
+
+    // The cheapest size for the frame, without the hysteresis of Update
+    uint32_t ChooseTileSize(const TileOccupancy& occupancy) const;
+
+    static uint32_t GetTileSizeIndex(uint32_t nTileSize);
+    static uint32_t GetTileSizeFromIndex(uint32_t nIndex) { return TILE_SIZE_MIN_IN_PIXELS << nIndex; }
+
+private:
+    TileSizeCosts m_costs;
+    uint32_t m_nTileSize;
+    uint32_t m_nCandidateTileSize;
+    uint32_t m_nCandidateFrameCount = 0;
+};
@@ -0,0 +1,476 @@
+#include "ParticleUpdateKernels.h"
+#include "ParticleSimulationCPU.h"
+#include "TileConstants.h"
+
+#include <algorithm>
+
+// The results have to match the scalar path bit for bit, so the compiler must not fuse the multiply and the add.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PARTICLE_SIMD_X86
+#endif
+
+#ifdef PARTICLE_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets us use any intrinsic in any function, GCC and Clang need to be told per function.
+#if defined(__GNUC__) || defined(__clang__)
+#define PARTICLE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PARTICLE_TARGET(isa)
+#endif
+
+static inline uint32_t CountTrailingZeros(uint32_t nValue)
+{
+#ifdef _MSC_VER
+    unsigned long nIndex;
+    _BitScanForward(&nIndex, nValue);
+    return (uint32_t)nIndex;
+#else
+    return (uint32_t)__builtin_ctz(nValue);
+#endif
+}
+
+static inline uint32_t AppendDeadIndices(uint32_t nDeadMask, uint32_t nFirstIndex, uint32_t* pDeadIndices)
+{
+    uint32_t nDeadCount = 0;
+    while (nDeadMask)
+    {
+        pDeadIndices[nDeadCount++] = nFirstIndex + CountTrailingZeros(nDeadMask);
+        nDeadMask &= nDeadMask - 1;
+    }
+    return nDeadCount;
+}
+
+// Reference implementation, this is what CSUpdate does for a single thread.
+static uint32_t UpdateParticlesScalar(const ParticleUpdateRange& range, uint32_t nBegin, float fElapsedTime, uint32_t* pDeadIndices)
+{
+    uint32_t nDeadCount = 0;
+    for (uint32_t i = nBegin; i < range.nEnd; i++)
+    {
+        float timeLeft = range.pLifetimes[i];
+        if (timeLeft == 0.0f)
+        {
+            continue;
+        }
+
+        // Negative time means it lives forever
+        if (timeLeft > 0.0f)
+        {
+            timeLeft -= fElapsedTime;
+            timeLeft = std::max(0.0f, timeLeft);
+        }
+
+        Float2 pos = range.pPositions[i];
+        Float2 velocity = range.pVelocities[i];
+
+        pos.x += velocity.x * fElapsedTime;
+        pos.y += velocity.y * fElapsedTime;
+#ifndef DISABLE_ROTATION
+        range.pRotations[i] += fElapsedTime * 0.5f;
+#endif
+
+        if (pos.x < -1)
+        {
+            pos.x = -1;
+            velocity.x *= -1;
+        }
+        else if (pos.x > 1)
+        {
+            pos.x = 1;
+            velocity.x *= -1;
+        }
+
+        if (pos.y < -1)
+        {
+            pos.y = -1;
+            velocity.y *= -1;
+        }
+        else if (pos.y > 1)
+        {
+            pos.y = 1;
+            velocity.y *= -1;
+        }
+
+        if (timeLeft == 0.0f)
+        {
+            pDeadIndices[nDeadCount++] = i;
+        }
+
+        range.pPositions[i] = pos;
+        range.pVelocities[i] = velocity;
+        range.pLifetimes[i] = timeLeft;
+    }
+    return nDeadCount;
+}
+
+#ifdef PARTICLE_SIMD_X86
+
+// The position and velocity streams are interleaved xy pairs. The x and y components bounce independently,
+// so they can be treated as one flat float array where every particle takes up two lanes.
+
+PARTICLE_TARGET("sse4.2")
+static inline void IntegrateSSE42(float* pPos, float* pVel, __m128 alive, __m128 dt)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 minusOne = _mm_set1_ps(-1.0f);
+
+    __m128 pos = _mm_loadu_ps(pPos);
+    __m128 vel = _mm_loadu_ps(pVel);
+
+    __m128 newPos = _mm_add_ps(pos, _mm_mul_ps(vel, dt));
+    __m128 below = _mm_cmplt_ps(newPos, minusOne);
+    __m128 above = _mm_cmpgt_ps(newPos, one);
+    newPos = _mm_blendv_ps(newPos, minusOne, below);
+    newPos = _mm_blendv_ps(newPos, one, above);
+    __m128 newVel = _mm_blendv_ps(vel, _mm_mul_ps(vel, minusOne), _mm_or_ps(below, above));
+
+    _mm_storeu_ps(pPos, _mm_blendv_ps(pos, newPos, alive));
+    _mm_storeu_ps(pVel, _mm_blendv_ps(vel, newVel, alive));
+}
+
+PARTICLE_TARGET("sse4.2")
+static uint32_t UpdateParticlesSSE42(const ParticleUpdateRange& range, float fElapsedTime, uint32_t* pDeadIndices)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 dt = _mm_set1_ps(fElapsedTime);
+#ifndef DISABLE_ROTATION
+    const __m128 rotationDelta = _mm_set1_ps(fElapsedTime * 0.5f);
+#endif
+
+    float* pPositions = &range.pPositions[0].x;
+    float* pVelocities = &range.pVelocities[0].x;
+
+    uint32_t nDeadCount = 0;
+    uint32_t i = range.nBegin;
+    for (; i + 4 <= range.nEnd; i += 4)
+    {
+        __m128 timeLeft = _mm_loadu_ps(range.pLifetimes + i);
+        __m128 alive = _mm_cmpneq_ps(timeLeft, zero);
+        if (_mm_movemask_ps(alive) == 0)
+        {
+            continue;
+        }
+
+        // Negative time means it lives forever, dead particles have zero so they are left alone as well
+        __m128 ticking = _mm_cmpgt_ps(timeLeft, zero);
+        __m128 newTimeLeft = _mm_max_ps(_mm_sub_ps(timeLeft, dt), zero);
+        newTimeLeft = _mm_blendv_ps(timeLeft, newTimeLeft, ticking);
+        _mm_storeu_ps(range.pLifetimes + i, newTimeLeft);
+
+        IntegrateSSE42(pPositions + 2 * i, pVelocities + 2 * i, _mm_unpacklo_ps(alive, alive), dt);
+        IntegrateSSE42(pPositions + 2 * i + 4, pVelocities + 2 * i + 4, _mm_unpackhi_ps(alive, alive), dt);
+
+#ifndef DISABLE_ROTATION
+        __m128 rotation = _mm_loadu_ps(range.pRotations + i);
+        _mm_storeu_ps(range.pRotations + i, _mm_blendv_ps(rotation, _mm_add_ps(rotation, rotationDelta), alive));
+#endif
+
+        uint32_t nDeadMask = (uint32_t)_mm_movemask_ps(_mm_and_ps(ticking, _mm_cmpeq_ps(newTimeLeft, zero)));
+        nDeadCount += AppendDeadIndices(nDeadMask, i, pDeadIndices + nDeadCount);
+    }
+
+    return nDeadCount + UpdateParticlesScalar(range, i, fElapsedTime, pDeadIndices + nDeadCount);
+}
+
+PARTICLE_TARGET("avx2")
+static inline void IntegrateAVX2(float* pPos, float* pVel, __m256 alive, __m256 dt)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 minusOne = _mm256_set1_ps(-1.0f);
+
+    __m256 pos = _mm256_loadu_ps(pPos);
+    __m256 vel = _mm256_loadu_ps(pVel);
+
+    __m256 newPos = _mm256_add_ps(pos, _mm256_mul_ps(vel, dt));
+    __m256 below = _mm256_cmp_ps(newPos, minusOne, _CMP_LT_OS);
+    __m256 above = _mm256_cmp_ps(newPos, one, _CMP_GT_OS);
+    newPos = _mm256_blendv_ps(newPos, minusOne, below);
+    newPos = _mm256_blendv_ps(newPos, one, above);
+    __m256 newVel = _mm256_blendv_ps(vel, _mm256_mul_ps(vel, minusOne), _mm256_or_ps(below, above));
+
+    _mm256_storeu_ps(pPos, _mm256_blendv_ps(pos, newPos, alive));
+    _mm256_storeu_ps(pVel, _mm256_blendv_ps(vel, newVel, alive));
+}
+
+PARTICLE_TARGET("avx2")
+static uint32_t UpdateParticlesAVX2(const ParticleUpdateRange& range, float fElapsedTime, uint32_t* pDeadIndices)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 dt = _mm256_set1_ps(fElapsedTime);
+#ifndef DISABLE_ROTATION
+    const __m256 rotationDelta = _mm256_set1_ps(fElapsedTime * 0.5f);
+#endif
+    // Duplicates the per particle mask for the x and y lanes
+    const __m256i expandLow = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i expandHigh = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+
+    float* pPositions = &range.pPositions[0].x;
+    float* pVelocities = &range.pVelocities[0].x;
+
+    uint32_t nDeadCount = 0;
+    uint32_t i = range.nBegin;
+    for (; i + 8 <= range.nEnd; i += 8)
+    {
+        __m256 timeLeft = _mm256_loadu_ps(range.pLifetimes + i);
+        __m256 alive = _mm256_cmp_ps(timeLeft, zero, _CMP_NEQ_UQ);
+        if (_mm256_movemask_ps(alive) == 0)
+        {
+            continue;
+        }
+
+        __m256 ticking = _mm256_cmp_ps(timeLeft, zero, _CMP_GT_OQ);
+        __m256 newTimeLeft = _mm256_max_ps(_mm256_sub_ps(timeLeft, dt), zero);
+        newTimeLeft = _mm256_blendv_ps(timeLeft, newTimeLeft, ticking);
+        _mm256_storeu_ps(range.pLifetimes + i, newTimeLeft);
+
+        IntegrateAVX2(pPositions + 2 * i, pVelocities + 2 * i, _mm256_permutevar8x32_ps(alive, expandLow), dt);
+        IntegrateAVX2(pPositions + 2 * i + 8, pVelocities + 2 * i + 8, _mm256_permutevar8x32_ps(alive, expandHigh), dt);
+
+#ifndef DISABLE_ROTATION
+        __m256 rotation = _mm256_loadu_ps(range.pRotations + i);
+        _mm256_storeu_ps(range.pRotations + i, _mm256_blendv_ps(rotation, _mm256_add_ps(rotation, rotationDelta), alive));
+#endif
+
+        uint32_t nDeadMask = (uint32_t)_mm256_movemask_ps(_mm256_and_ps(ticking, _mm256_cmp_ps(newTimeLeft, zero, _CMP_EQ_OQ)));
+        nDeadCount += AppendDeadIndices(nDeadMask, i, pDeadIndices + nDeadCount);
+    }
+
+    return nDeadCount + UpdateParticlesScalar(range, i, fElapsedTime, pDeadIndices + nDeadCount);
+}
+
+// Turns an 8 bit per particle mask into a 16 bit per component mask
+static inline __mmask16 ExpandParticleMask(uint32_t nMask)
+{
+    nMask &= 0xFF;
+    nMask = (nMask | (nMask << 4)) & 0x0F0F;
+    nMask = (nMask | (nMask << 2)) & 0x3333;
+    nMask = (nMask | (nMask << 1)) & 0x5555;
+    return (__mmask16)(nMask | (nMask << 1));
+}
+
+PARTICLE_TARGET("avx512f")
+static inline void IntegrateAVX512(float* pPos, float* pVel, __mmask16 alive, __m512 dt)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 minusOne = _mm512_set1_ps(-1.0f);
+
+    __m512 pos = _mm512_loadu_ps(pPos);
+    __m512 vel = _mm512_loadu_ps(pVel);
+
+    __m512 newPos = _mm512_add_ps(pos, _mm512_mul_ps(vel, dt));
+    __mmask16 below = _mm512_cmp_ps_mask(newPos, minusOne, _CMP_LT_OS);
+    __mmask16 above = _mm512_cmp_ps_mask(newPos, one, _CMP_GT_OS);
+    newPos = _mm512_mask_blend_ps(below, newPos, minusOne);
+    newPos = _mm512_mask_blend_ps(above, newPos, one);
+    __m512 newVel = _mm512_mask_mul_ps(vel, (__mmask16)(below | above), vel, minusOne);
+
+    _mm512_mask_storeu_ps(pPos, alive, newPos);
+    _mm512_mask_storeu_ps(pVel, alive, newVel);
+}
+
+PARTICLE_TARGET("avx512f")
+static uint32_t UpdateParticlesAVX512(const ParticleUpdateRange& range, float fElapsedTime, uint32_t* pDeadIndices)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 dt = _mm512_set1_ps(fElapsedTime);
+#ifndef DISABLE_ROTATION
+    const __m512 rotationDelta = _mm512_set1_ps(fElapsedTime * 0.5f);
+#endif
+
+    float* pPositions = &range.pPositions[0].x;
+    float* pVelocities = &range.pVelocities[0].x;
+
+    uint32_t nDeadCount = 0;
+    uint32_t i = range.nBegin;
+    for (; i + 16 <= range.nEnd; i += 16)
+    {
+        __m512 timeLeft = _mm512_loadu_ps(range.pLifetimes + i);
+        __mmask16 alive = _mm512_cmp_ps_mask(timeLeft, zero, _CMP_NEQ_UQ);
+        if (alive == 0)
+        {
+            continue;
+        }
+
+        __mmask16 ticking = _mm512_cmp_ps_mask(timeLeft, zero, _CMP_GT_OQ);
+        __m512 newTimeLeft = _mm512_mask_max_ps(timeLeft, ticking, _mm512_sub_ps(timeLeft, dt), zero);
+        _mm512_storeu_ps(range.pLifetimes + i, newTimeLeft);
+
+        IntegrateAVX512(pPositions + 2 * i, pVelocities + 2 * i, ExpandParticleMask(alive), dt);
+        IntegrateAVX512(pPositions + 2 * i + 16, pVelocities + 2 * i + 16, ExpandParticleMask(alive >> 8), dt);
+
+#ifndef DISABLE_ROTATION
+        __m512 rotation = _mm512_loadu_ps(range.pRotations + i);
+        _mm512_mask_storeu_ps(range.pRotations + i, alive, _mm512_add_ps(rotation, rotationDelta));
+#endif
+
+        uint32_t nDeadMask = _mm512_mask_cmp_ps_mask(ticking, newTimeLeft, zero, _CMP_EQ_OQ);
+        nDeadCount += AppendDeadIndices(nDeadMask, i, pDeadIndices + nDeadCount);
+    }
+
+    return nDeadCount + UpdateParticlesScalar(range, i, fElapsedTime, pDeadIndices + nDeadCount);
+}
+
+#endif // PARTICLE_SIMD_X86
+
+bool IsInstructionSetSupported(SimdInstructionSet instructionSet)
+{
+    if (instructionSet == SimdInstructionSet::Scalar)
+    {
+        return true;
+    }
+
+#if !defined(PARTICLE_SIMD_X86)
+    return false;
+#elif defined(_MSC_VER)
+    int cpuInfo[4];
+    __cpuid(cpuInfo, 1);
+    bool bSSE42 = (cpuInfo[2] & (1 << 20)) != 0;
+    bool bOSXSave = (cpuInfo[2] & (1 << 27)) != 0;
+    bool bAVX = (cpuInfo[2] & (1 << 28)) != 0;
+
+    // The OS has to save the ymm and zmm registers on a context switch for us to be able to use them
+    unsigned long long nEnabledStates = bOSXSave ? _xgetbv(0) : 0;
+    bool bYmmEnabled = (nEnabledStates & 0x06) == 0x06;
+    bool bZmmEnabled = (nEnabledStates & 0xE6) == 0xE6;
+
+    __cpuidex(cpuInfo, 7, 0);
+    bool bAVX2 = (cpuInfo[1] & (1 << 5)) != 0;
+    bool bAVX512F = (cpuInfo[1] & (1 << 16)) != 0;
+
+    switch (instructionSet)
+    {
+    case SimdInstructionSet::SSE42:
+        return bSSE42;
+    case SimdInstructionSet::AVX2:
+        return bAVX && bAVX2 && bYmmEnabled;
+    case SimdInstructionSet::AVX512:
+        return bAVX512F && bZmmEnabled;
+    default:
+        return false;
+    }
+#else
+    // These already check whether the OS saves the wide registers
+    switch (instructionSet)
+    {
+    case SimdInstructionSet::SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case SimdInstructionSet::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case SimdInstructionSet::AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return false;
+    }
+#endif
+}
+
+SimdInstructionSet GetBestSupportedInstructionSet()
+{
+    static const SimdInstructionSet bestInstructionSet = []()
+    {
+        for (int i = (int)SimdInstructionSet::Count - 1; i > 0; i--)
+        {
+            if (IsInstructionSetSupported((SimdInstructionSet)i))
+            {
+                return (SimdInstructionSet)i;
+            }
+        }
+        return SimdInstructionSet::Scalar;
+    }();
+
+    return bestInstructionSet;
+}
+
+const char* GetInstructionSetName(SimdInstructionSet instructionSet)
+{
+    switch (instructionSet)
+    {
+    case SimdInstructionSet::Scalar:
+        return "Scalar";
+    case SimdInstructionSet::SSE42:
+        return "SSE4.2";
+    case SimdInstructionSet::AVX2:
+        return "AVX2";
+    case SimdInstructionSet::AVX512:
+        return "AVX-512";
+    default:
+        return "Unknown";
+    }
+}
+
+uint32_t UpdateParticles(SimdInstructionSet instructionSet, const ParticleUpdateRange& range, float fElapsedTime, uint32_t* pDeadIndices)
+{
+    if (range.nBegin >= range.nEnd)
+    {
+        return 0;
+    }
+
+    switch (instructionSet)
+    {
+#ifdef PARTICLE_SIMD_X86
+    case SimdInstructionSet::SSE42:
+        return UpdateParticlesSSE42(range, fElapsedTime, pDeadIndices);
+    case SimdInstructionSet::AVX2:
+        return UpdateParticlesAVX2(range, fElapsedTime, pDeadIndices);
+    case SimdInstructionSet::AVX512:
+        return UpdateParticlesAVX512(range, fElapsedTime, pDeadIndices);
+#endif
+    default:
+        return UpdateParticlesScalar(range, range.nBegin, fElapsedTime, pDeadIndices);
+    }
+}
+
+uint32_t UpdateParticleList(SimdInstructionSet instructionSet, const ParticleUpdateRange& range, const uint32_t* pIndices, float fElapsedTime, uint32_t* pDeadIndices)
+{
+    // The list is checked a window at a time. Where the live particles are packed tightly enough it's cheaper to
+    // run the vectorized path over every slot between them (it skips the dead ones anyway) than to jump around.
+    const uint32_t nWindowSize = 64;
+    const uint32_t nMaxSlotsPerParticle = 8;
+
+    ParticleUpdateRange subRange = range;
+    uint32_t nDeadCount = 0;
+    uint32_t iEntry = range.nBegin;
+    while (iEntry < range.nEnd)
+    {
+        uint32_t nSpanEnd = iEntry;
+        while (nSpanEnd < range.nEnd)
+        {
+            uint32_t nWindowEnd = std::min(range.nEnd, nSpanEnd + nWindowSize);
+            uint32_t nWindowStartSlot = pIndices[nSpanEnd == iEntry ? nSpanEnd : nSpanEnd - 1];
+            if (pIndices[nWindowEnd - 1] - nWindowStartSlot >= (nWindowEnd - nSpanEnd) * nMaxSlotsPerParticle)
+            {
+                break;
+            }
+            nSpanEnd = nWindowEnd;
+        }
+
+        if (nSpanEnd > iEntry)
+        {
+            subRange.nBegin = pIndices[iEntry];
+            subRange.nEnd = pIndices[nSpanEnd - 1] + 1;
+            nDeadCount += UpdateParticles(instructionSet, subRange, fElapsedTime, pDeadIndices + nDeadCount);
+            iEntry = nSpanEnd;
+        }
+        else
+        {
+            uint32_t nWindowEnd = std::min(range.nEnd, iEntry + nWindowSize);
+            for (; iEntry < nWindowEnd; iEntry++)
+            {
+                subRange.nEnd = pIndices[iEntry] + 1;
+                nDeadCount += UpdateParticlesScalar(subRange, pIndices[iEntry], fElapsedTime, pDeadIndices + nDeadCount);
+            }
+        }
+    }
+    return nDeadCount;
+}
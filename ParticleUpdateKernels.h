@@ -0,0 +1,42 @@
+#pragma once
+
+// Vectorized versions of the integration part of CSUpdate.
+// Every path has to give the exact same bits as the scalar one, so there is no FMA and the
+// bounce is done with the same compare and multiply-by-minus-one as the shader.
+
+#include <cstdint>
+
+struct Float2;
+
+enum class SimdInstructionSet
+{
+    Scalar,
+    SSE42,
+    AVX2,
+    AVX512,
+    Count
+};
+
+// The widest instruction set that both the CPU and the OS support.
+SimdInstructionSet GetBestSupportedInstructionSet();
+bool IsInstructionSetSupported(SimdInstructionSet instructionSet);
+const char* GetInstructionSetName(SimdInstructionSet instructionSet);
+
+struct ParticleUpdateRange
+{
+    Float2* pPositions;
+    Float2* pVelocities;
+    float*  pRotations;
+    float*  pLifetimes;
+    uint32_t nBegin;
+    uint32_t nEnd;
+};
+
+// Integrates the particles in [nBegin, nEnd) in place.
+// The indices of the particles that died this frame go to pDeadIndices in increasing order,
+// it needs room for nEnd - nBegin entries. Returns the number of dead indices written.
+uint32_t UpdateParticles(SimdInstructionSet instructionSet, const ParticleUpdateRange& range, float fElapsedTime, uint32_t* pDeadIndices);
+
+// Same as UpdateParticles, but only for the particles in pIndices[nBegin, nEnd). The indices have to be increasing.
+// Runs of neighbouring indices go through the vectorized path, the scattered ones are done one by one.
+uint32_t UpdateParticleList(SimdInstructionSet instructionSet, const ParticleUpdateRange& range, const uint32_t* pIndices, float fElapsedTime, uint32_t* pDeadIndices);
@@ -0,0 +1,23 @@
+#ifdef SPATIAL_HASH_CONSTANTS_HEADER_GUARD
+#else
+#define SPATIAL_HASH_CONSTANTS_HEADER_GUARD
+
+// Uniform grid over the [-1, 1] square the particles bounce around in
+#define HASH_GRID_DIM 512
+#define HASH_CELL_COUNT (HASH_GRID_DIM * HASH_GRID_DIM)
+#define HASH_CELL_SIZE (2.0f / HASH_GRID_DIM)
+
+// The particles can be bigger than the cells. The collision query looks ceil(largest radius * HASH_GRID_DIM) cells out on
+// every side, at least one, which covers twice the largest radius of the frame: as far as an overlapping neighbour can be.
+
+// After the cell counts, the bits of the largest radius, cleared by CSHashScan like the counts
+#define HASH_COUNTER_MAX_RADIUS HASH_CELL_COUNT
+#define HASH_COUNTER_COUNT (HASH_CELL_COUNT + 1)
+
+// After the starts of the cells and their end, the query reach CSHashScan works out for CSCollide
+#define HASH_START_QUERY_REACH (HASH_CELL_COUNT + 1)
+#define HASH_START_COUNT (HASH_CELL_COUNT + 2)
+
+#define HASH_COLLISION_STIFFNESS 2.0f   // Velocity change per second of two particles on top of each other
+
+#endif
\ No newline at end of file
@@ -2,12 +2,70 @@
 #else
 #define TILE_CONSTANTS_HEADER_GUARD
 
+// The tile size can change at runtime between the powers of two from TILE_SIZE_MIN_IN_PIXELS to TILE_SIZE_MAX_IN_PIXELS.
+// ParticleTile.hlsl is compiled once per size with TILE_SIZE_IN_PIXELS defined, everything else gets the default.
+#define TILE_SIZE_MIN_IN_PIXELS 8
+#define TILE_SIZE_MAX_IN_PIXELS 64
+#define TILE_SIZE_OPTION_COUNT 4
+#ifndef TILE_SIZE_IN_PIXELS
 #define TILE_SIZE_IN_PIXELS 32
+#endif
 #define MAX_PARTICLE_PER_TILE 1024
 #define COLLECT_PARTICLE_COUNT_PER_THREAD 1 // Should be a divisor of MAX_PARTICLE_PER_TILE
 
+// Number of tiles along a side of nPixels, the last one can be partial
+#define TILE_COUNT_FOR_SIZE(nPixels, nTileSize) (((nPixels) + (nTileSize) - 1) / (nTileSize))
+#define TILE_COUNT(nPixels) TILE_COUNT_FOR_SIZE(nPixels, TILE_SIZE_IN_PIXELS)
+
+// Threads along a side of a CSRasterizeParticles group. A group can't have more than 1024, the bigger tiles
+// have every thread shade a few pixels.
+#if TILE_SIZE_IN_PIXELS > 32
+#define TILE_RASTER_GROUP_SIZE 32
+#else
+#define TILE_RASTER_GROUP_SIZE TILE_SIZE_IN_PIXELS
+#endif
+
+#define TILE_BIN_GROUP_SIZE 256     // Threads of the per particle binning passes
+
+// The tile lists of a frame share room for MAX_PARTICLE_PER_TILE particles per tile. A tile can take more than that
+// as long as the others leave room for it, but then it doesn't fit into the group shared memory of CSTileSort
+// and it spills: CSTileSortSpill sorts it in the list itself.
+#define TILE_LIST_CAPACITY(nTileCount) ((nTileCount) * MAX_PARTICLE_PER_TILE)
+#define TILE_SPILL_GROUP_COUNT 64           // Groups of CSTileSortSpill, they take the spilled tiles in turns
+#define TILE_SPILL_SORT_GROUP_SIZE 1024
+
+// The counters at the start of g_offsetCounter, CSTileScan writes them every frame. The work list and the spilled tiles follow them.
+// CSTileScan only clears TILE_COUNTER_SATURATED_PIXELS and TILE_COUNTER_BINNED_PARTICLES, the passes after it count them up.
+#define TILE_COUNTER_LIST_ENTRIES 0         // Entries in the tile lists
+#define TILE_COUNTER_SPILLED_TILES 1        // Tiles over MAX_PARTICLE_PER_TILE
+#define TILE_COUNTER_OVERFLOW_ENTRIES 2     // Their entries over MAX_PARTICLE_PER_TILE, the ones that used to be dropped
+#define TILE_COUNTER_DROPPED_ENTRIES 3      // Entries past TILE_LIST_CAPACITY, these are still dropped
+#define TILE_COUNTER_LARGEST_TILE 4         // Particle count of the fullest tile, dropped entries included
+#define TILE_COUNTER_SATURATED_PIXELS 5     // Pixels that reached TILE_COMPOSITE_OPAQUE_ALPHA and skipped the particles behind
+#define TILE_COUNTER_BINNED_PARTICLES 6     // Particles on the screen, counted by CSTileScatter
+#define TILE_COUNTER_OCCUPIED_TILES 7       // Tiles with particles in their lists, the length of the work list
+#define TILE_COUNTER_COUNT 8
+
+// The work list has the row major indices of the tiles with particles, in order. CSRasterizeParticles is dispatched indirectly
+// with a group per entry and the empty tiles are cleared all at once before it. The spilled tiles come after the work list.
+#define TILE_WORK_LIST_START TILE_COUNTER_COUNT
+#define TILE_SPILL_LIST_START(nTileCount) (TILE_WORK_LIST_START + (nTileCount))
+#define TILE_COUNTER_REGION_SIZE(nTileCount) (TILE_SPILL_LIST_START(nTileCount) + (nTileCount))
+#define TILE_RASTER_DISPATCH_MAX_GROUPS 65535   // Along x, D3D12_CS_DISPATCH_MAX_THREAD_GROUPS_PER_DIMENSION. Longer lists wrap into rows.
+
+// The rasterization composites front to back, a pixel stops looking at its particles once its alpha gets here
+#define TILE_COMPOSITE_OPAQUE_ALPHA 0.99f
+
+// CSTileSort uses the radix sort of GroupRadixSort.hlsli, this switches back to the bitonic network.
+// DEBUG_SORTING only works with the bitonic one.
+//#define TILE_SORT_BITONIC
+#ifdef TILE_SORT_BITONIC
+#define TILE_SORT_GROUP_SIZE (MAX_PARTICLE_PER_TILE / COLLECT_PARTICLE_COUNT_PER_THREAD)
+#else
+#define TILE_SORT_GROUP_SIZE 128
+#endif
+
 #define DISABLE_ROTATION
 //#define DEBUG_SORTING
-#define INTERLEAVED_PARTICLE_COLLECTION
 
 #endif
\ No newline at end of file